@@ -0,0 +1,493 @@
+﻿#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+
+#include "polygonum/renderer.hpp"
+#include "polygonum/toolkit.hpp"
+
+/*
+	Benchmark: Renders a test scene in headless mode (offscreen images, no window), so it runs without display (CI, software Vulkan drivers like lavapipe or SwiftShader).
+	After loading the scene and some warm-up frames, it renders a fixed number of frames and reports (JSON) frame time percentiles, frame pacing jitter, draw commands, device memory allocations, and the profiler's zones.
+
+	Scenes (similar to example_1..3, but built in code, so they only need the mesh of example_3):
+		- triangle: Textured triangle over a textured background (NDC).
+		- cubes: Instanced cubes (SSBO with a model matrix per instance) and a camera (global UBO).
+		- rocks: Like cubes, but using the rock mesh of example_3 (see --resources).
+
+	Usage: benchmark [--scene triangle|cubes|rocks] [--frames 500] [--warmup 50] [--instances 1000] [--width 960] [--height 540]
+	                 [--output results.json] [--trace trace.json] [--image frame.ppm] [--resources ../../../projects/] [--pipelined 0|1]
+	With --pipelined 1, the update runs one frame ahead of the render thread (Renderer::setPipelined()), and --image is ignored.
+*/
+
+// Globals ----------
+
+struct Options
+{
+	std::string scene = "cubes";
+	size_t frames = 500;			//!< Measured frames
+	size_t warmup = 50;				//!< Frames rendered (after loading the scene) before measuring
+	size_t instances = 1000;		//!< Instances (cubes, rocks)
+	int width = 1920 / 2;
+	int height = 1080 / 2;
+	std::string output;				//!< JSON file (stdout if empty)
+	std::string trace;				//!< Chrome trace file (optional)
+	std::string image;				//!< PPM file of the last frame (optional)
+	std::string resources = "../../../projects/";   //!< Folder containing example_3/resources
+	bool pipelined = false;			//!< Renderer::setPipelined()
+};
+
+struct Results
+{
+	std::vector<double> frameTimes;	//!< ms
+	size_t drawCommands = 0;
+	size_t models = 0;
+	int memAllocObjects = 0;
+	MemoryStats memory{};
+	std::vector<uint8_t> pixels;	//!< Last frame (BGRA)
+	double loadingTime = 0;			//!< s
+};
+
+Options opt;
+Results results;
+
+key64 instanced = 0;				//!< Cubes or rocks
+BindingBuffer* globalUbo = nullptr;	//!< View, Proj
+bool loaded = false;
+size_t warmupFrames = 0;
+double currentTime = 0;
+
+// Prototypes ----------
+
+void update(Renderer& rend);		// Callback called for each frame: waits for the scene, updates it, and takes measures.
+bool parseArguments(int argc, char* argv[]);
+
+void createTriangleScene(Renderer& rend);
+void createInstancedScene(Renderer& rend, const char* name, VertexType vertexType, VertexesLoader* loader, unsigned uvLocation);
+void updateInstancedScene(Renderer& rend);
+void createPostprocessing(Renderer& rend);
+
+std::shared_ptr<Texture> getCheckerboard(const std::string& id, unsigned size, unsigned squares);
+double getPercentile(const std::vector<double>& sorted, double percentile);
+void writeResults(Renderer& rend, std::ostream& os);
+bool writePPM(const std::string& fileName, const std::vector<uint8_t>& bgra, uint32_t width, uint32_t height);
+
+// Definitions ----------
+
+int main(int argc, char* argv[])
+{
+	if (!parseArguments(argc, argv)) return 1;
+
+	try
+	{
+		Renderer renderer(update, opt.width, opt.height, true);
+		renderer.setMaxFPS(0);   // Uncapped
+		renderer.setPipelined(opt.pipelined);
+
+		if (opt.scene == "triangle")
+			createTriangleScene(renderer);
+		else if (opt.scene == "cubes")
+			createInstancedScene(renderer, "cubes", VertexType({ vaPos, vaNorm, vaTan, vaUv }), VL_fromBuffer::factory(v_cube.data(), 11 * sizeof(float), 4 * 6, i_cube, {}), 3);
+		else if (opt.scene == "rocks")
+			createInstancedScene(renderer, "rocks", VertexType({ vaPos, vaNorm, vaUv }), VL_fromFile::factory(opt.resources + "example_3/resources/meshes/rock.obj"), 2);
+		else
+		{
+			std::cerr << "Unknown scene: " << opt.scene << std::endl;
+			return 1;
+		}
+		createPostprocessing(renderer);
+
+		renderer.renderLoop();   // Returns when update() closes the "window"
+
+		if (opt.output.empty())
+			writeResults(renderer, std::cout);
+		else
+		{
+			std::ofstream file(opt.output);
+			if (!file.is_open()) throw std::runtime_error("Cannot open file " + opt.output);
+			writeResults(renderer, file);
+		}
+
+		if (opt.trace.size() && !renderer.exportProfile(opt.trace))
+			std::cerr << "Cannot write trace: " << opt.trace << std::endl;
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
+
+bool parseArguments(int argc, char* argv[])
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--help" || i + 1 == argc)
+		{
+			std::cerr << "Usage: benchmark [--scene triangle|cubes|rocks] [--frames N] [--warmup N] [--instances N] [--width W] [--height H] [--output file.json] [--trace file.json] [--image file.ppm] [--resources folder/] [--pipelined 0|1]" << std::endl;
+			return false;
+		}
+
+		std::string value = argv[++i];
+		if (arg == "--scene") opt.scene = value;
+		else if (arg == "--frames") opt.frames = std::max(std::stoul(value), 1ul);
+		else if (arg == "--warmup") opt.warmup = std::stoul(value);
+		else if (arg == "--instances") opt.instances = std::max(std::stoul(value), 1ul);
+		else if (arg == "--width") opt.width = std::stoi(value);
+		else if (arg == "--height") opt.height = std::stoi(value);
+		else if (arg == "--output") opt.output = value;
+		else if (arg == "--trace") opt.trace = value;
+		else if (arg == "--image") opt.image = value;
+		else if (arg == "--resources") opt.resources = value;
+		else if (arg == "--pipelined") opt.pipelined = std::stoi(value) != 0;
+		else
+		{
+			std::cerr << "Unknown argument: " << arg << std::endl;
+			return false;
+		}
+	}
+
+	if (opt.pipelined && opt.image.size())
+	{
+		std::cerr << "--image is ignored in pipelined mode (the last frame may still be rendering)" << std::endl;
+		opt.image.clear();
+	}
+
+	return true;
+}
+
+void update(Renderer& rend)
+{
+	currentTime += rend.getDeltaTime();
+
+	// Wait for the scene to be loaded
+	if (!loaded)
+	{
+		if (rend.getLoadingTasks()) return;
+		loaded = true;
+		results.loadingTime = currentTime;
+	}
+
+	if (instanced) updateInstancedScene(rend);
+
+	// Warm-up (pipelines, caches, command buffers recorded for each frame)
+	if (warmupFrames < opt.warmup)
+	{
+		warmupFrames++;
+		return;
+	}
+
+	// Measure
+	results.frameTimes.push_back(rend.getDeltaTime() * 1000);
+
+	if (results.frameTimes.size() == opt.frames)
+	{
+		results.drawCommands = rend.getCommandsCount();
+		results.models = rend.getModelsCount();
+		results.memAllocObjects = rend.getMemAllocObjects();
+		results.memory = rend.getMemoryStats();
+
+		if (opt.image.size())
+		{
+			rend.readImage(results.pixels);
+			VkExtent2D extent = rend.getImageExtent();
+			if (!writePPM(opt.image, results.pixels, extent.width, extent.height))
+				std::cerr << "Cannot write image: " << opt.image << std::endl;
+		}
+
+		rend.getIO().setWindowShouldClose(true);
+	}
+}
+
+void createTriangleScene(Renderer& rend)
+{
+	std::string vertShader =
+		"#version 450\n"
+		"#pragma shader_stage(vertex)\n"
+		"layout(location = 0) in vec3 inPos;\n"
+		"layout(location = 1) in vec2 inUV;\n"
+		"layout(location = 0) out vec2 outUV;\n"
+		"void main() { gl_Position = vec4(inPos, 1.0); outUV = inUV; }\n";
+
+	std::string fragShader =
+		"#version 450\n"
+		"#pragma shader_stage(fragment)\n"
+		"layout(set = 0, binding = 0) uniform sampler2D texSampler[1];\n"
+		"layout(location = 0) in vec2 inUV;\n"
+		"layout(location = 0) out vec4 outColor;\n"
+		"void main() { outColor = texture(texSampler[0], inUV); }\n";
+
+	std::vector<float> v_triangle = {		// Vulkan NDCs (Vulkan Normalized Device Coordinates)
+		-0.5f, 0.5f, 0.0f,   0.0f, 0.0f,
+		 0.5f, 0.5f, 0.0f,   1.0f, 0.0f,
+		 0.0f,-0.5f, 0.0f,   0.5f, 1.0f };
+	std::vector<uint16_t> i_triangle = { 0, 1, 2 };
+
+	std::vector<float> v_background = {
+		-1.f, 1.f, 0.1f,   0.f, 0.f,
+		 1.f, 1.f, 0.1f,   1.f, 0.f,
+		 1.f,-1.f, 0.1f,   1.f, 1.f,
+		-1.f,-1.f, 0.1f,   0.f, 1.f };
+	std::vector<uint16_t> i_background = { 0, 1, 2,  0, 2, 3 };
+
+	VertexType vertexType({ vaPos, vaUv });
+
+	ModelDataInfo modelInfo;
+	modelInfo.name = "triangle";
+	modelInfo.numInstances = 1;
+	modelInfo.maxNumInstances = 1;
+	modelInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	modelInfo.vertexType = vertexType;
+	modelInfo.vertexesLoader = VL_fromBuffer::factory(v_triangle.data(), vertexType.vertexSize, 3, i_triangle, {});
+	modelInfo.shadersInfo = { SL_fromBuffer::factory("benchTexVert", vertShader), SL_fromBuffer::factory("benchTexFrag", fragShader) };
+	modelInfo.bindSets = { BindingSet() };
+	modelInfo.bindSets[0].fsTextures = { { getCheckerboard("benchChecker8", 256, 8) } };
+	modelInfo.transparency = false;
+	modelInfo.renderPassIndex = 2;
+	modelInfo.subpassIndex = 0;
+	modelInfo.cullMode = VK_CULL_MODE_NONE;
+
+	rend.newModel(modelInfo);
+
+	modelInfo.name = "background";
+	modelInfo.vertexesLoader = VL_fromBuffer::factory(v_background.data(), vertexType.vertexSize, 4, i_background, {});
+	modelInfo.shadersInfo = { SL_fromBuffer::factory("benchTexVert", vertShader), SL_fromBuffer::factory("benchTexFrag", fragShader) };
+	modelInfo.bindSets[0].fsTextures = { { getCheckerboard("benchChecker32", 256, 32) } };
+
+	rend.newModel(modelInfo);
+}
+
+void createInstancedScene(Renderer& rend, const char* name, VertexType vertexType, VertexesLoader* loader, unsigned uvLocation)
+{
+	rend.addGlobalUbo(BindingBuffer(ubo, 1, 1, 2 * sizes::mat4));   // View, Proj
+	globalUbo = &rend.globalBuffers[0];
+
+	std::string vertShader =
+		"#version 450\n"
+		"#pragma shader_stage(vertex)\n"
+		"layout(set = 0, binding = 0) uniform globalUbo { mat4 view; mat4 proj; } gUbo;\n"
+		"layout(set = 0, binding = 1) readonly buffer instanceData { mat4 model[]; } instances;\n"
+		"layout(location = 0) in vec3 inPos;\n"
+		"layout(location = 1) in vec3 inNormal;\n"
+		"layout(location = " + std::to_string(uvLocation) + ") in vec2 inUV;\n"
+		"layout(location = 0) out vec2 outUV;\n"
+		"layout(location = 1) out vec3 outNormal;\n"
+		"void main()\n"
+		"{\n"
+		"	mat4 model = instances.model[gl_InstanceIndex];\n"
+		"	gl_Position = gUbo.proj * gUbo.view * model * vec4(inPos, 1.0);\n"
+		"	outUV = inUV;\n"
+		"	outNormal = mat3(model) * inNormal;\n"
+		"}\n";
+
+	std::string fragShader =
+		"#version 450\n"
+		"#pragma shader_stage(fragment)\n"
+		"layout(set = 0, binding = 2) uniform sampler2D texSampler[1];\n"
+		"layout(location = 0) in vec2 inUV;\n"
+		"layout(location = 1) in vec3 inNormal;\n"
+		"layout(location = 0) out vec4 outColor;\n"
+		"void main()\n"
+		"{\n"
+		"	float diffuse = max(dot(normalize(inNormal), normalize(vec3(1, 2, 3))), 0.0);\n"
+		"	outColor = vec4(texture(texSampler[0], inUV).rgb * (0.2 + 0.8 * diffuse), 1.0);\n"
+		"}\n";
+
+	ModelDataInfo modelInfo;
+	modelInfo.name = name;
+	modelInfo.numInstances = opt.instances;
+	modelInfo.maxNumInstances = opt.instances;
+	modelInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	modelInfo.vertexType = vertexType;
+	modelInfo.vertexesLoader = loader;
+	modelInfo.shadersInfo = { SL_fromBuffer::factory(std::string(name) + "Vert", vertShader), SL_fromBuffer::factory(std::string(name) + "Frag", fragShader) };
+	modelInfo.bindSets = { BindingSet() };
+	modelInfo.bindSets[0].vsGlobal = { globalUbo };
+	modelInfo.bindSets[0].vsLocal = { BindingBuffer(ssbo, 1, 1, opt.instances * sizes::mat4) };   // Model matrices
+	modelInfo.bindSets[0].fsTextures = { { getCheckerboard("benchChecker4", 256, 4) } };
+	modelInfo.transparency = false;
+	modelInfo.renderPassIndex = 2;
+	modelInfo.subpassIndex = 0;
+	modelInfo.cullMode = VK_CULL_MODE_NONE;
+
+	instanced = rend.newModel(modelInfo);
+}
+
+void updateInstancedScene(Renderer& rend)
+{
+	// Camera
+	size_t side = static_cast<size_t>(std::ceil(std::cbrt(static_cast<double>(opt.instances))));   // Instances in a cube grid
+	float distance = 4.f * side;
+	glm::vec3 camPos(distance * std::cos(currentTime * 0.2), distance * std::sin(currentTime * 0.2), distance * 0.6f);
+
+	glm::mat4 view = glm::lookAt(camPos, glm::vec3(0, 0, 0), glm::vec3(0, 0, 1));
+	glm::mat4 proj = glm::perspective(glm::radians(45.f), opt.width / (float)opt.height, 0.1f, 10.f * distance);
+	proj[1][1] *= -1;   // GLM was designed for OpenGL, where the Y coordinate of the clip coordinates is inverted
+
+	uint8_t* dest = globalUbo->getDescriptor(0);
+	memcpy(dest, &view, sizes::mat4);
+	memcpy(dest + sizes::mat4, &proj, sizes::mat4);
+
+	// Instances (rewritten each frame, like animated objects)
+	ModelData* model = rend.getModel(instanced);
+	if (!model || !model->ready) return;
+
+	dest = model->bindSets[0].vsLocal[0].getDescriptor(0);
+	float offset = 2.f * (side - 1);
+	glm::mat4 modelMatrix;
+
+	for (size_t i = 0; i < opt.instances; i++)
+	{
+		glm::vec3 position(4.f * (i % side) - offset, 4.f * ((i / side) % side) - offset, 4.f * (i / (side * side)) - offset);
+		modelMatrix = glm::translate(glm::mat4(1.f), position);
+		modelMatrix = glm::rotate(modelMatrix, static_cast<float>(currentTime) + i, glm::vec3(0, 0, 1));
+		memcpy(dest + i * sizes::mat4, &modelMatrix, sizes::mat4);
+	}
+}
+
+void createPostprocessing(Renderer& rend)
+{
+	std::vector<float> v_quad;
+	std::vector<uint16_t> i_quad;
+	getScreenQuad(v_quad, i_quad);
+
+	std::string vertShader =
+		"#version 450\n"
+		"#pragma shader_stage(vertex)\n"
+		"layout(location = 0) in vec3 inPos;\n"
+		"layout(location = 1) in vec2 inUVs;\n"
+		"layout(location = 0) out vec2 outUVs;\n"
+		"void main() { gl_Position = vec4(inPos, 1.0); outUVs = inUVs; }\n";
+
+	std::string fragShader =
+		"#version 450\n"
+		"#pragma shader_stage(fragment)\n"
+		"layout(set = 0, binding = 0) uniform sampler2D inputAttachments[2];\n"
+		"layout(location = 0) in vec2 inUVs;\n"
+		"layout(location = 0) out vec4 outColor;\n"
+		"void main() { outColor = vec4(texture(inputAttachments[0], inUVs).rgb, 1.0); }\n";
+
+	VertexType vertexType({ vaPos, vaUv });
+
+	ModelDataInfo modelInfo;
+	modelInfo.name = "postprocessingPass";
+	modelInfo.numInstances = 1;
+	modelInfo.maxNumInstances = 1;
+	modelInfo.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	modelInfo.vertexType = vertexType;
+	modelInfo.vertexesLoader = VL_fromBuffer::factory(v_quad.data(), vertexType.vertexSize, 4, i_quad, {});
+	modelInfo.shadersInfo = { SL_fromBuffer::factory("benchPostVert", vertShader), SL_fromBuffer::factory("benchPostFrag", fragShader) };
+	modelInfo.transparency = false;
+	modelInfo.renderPassIndex = 3;
+	modelInfo.subpassIndex = 0;
+
+	rend.newModel(modelInfo);
+}
+
+std::shared_ptr<Texture> getCheckerboard(const std::string& id, unsigned size, unsigned squares)
+{
+	std::vector<unsigned char> pixels(size * size * 4);
+	unsigned squareSize = std::max(size / squares, 1u);
+
+	for (unsigned y = 0; y < size; y++)
+		for (unsigned x = 0; x < size; x++)
+		{
+			unsigned char value = ((x / squareSize + y / squareSize) % 2) ? 230 : 40;
+			unsigned char* pixel = &pixels[(y * size + x) * 4];
+			pixel[0] = value;
+			pixel[1] = value;
+			pixel[2] = value;
+			pixel[3] = 255;
+		}
+
+	return Tex_fromBuffer::factory(id, pixels.data(), size, size);
+}
+
+double getPercentile(const std::vector<double>& sorted, double percentile)
+{
+	if (sorted.empty()) return 0;
+	size_t rank = static_cast<size_t>(std::ceil(percentile / 100 * sorted.size()));   // Nearest-rank method
+	return sorted[std::min(std::max(rank, size_t(1)), sorted.size()) - 1];
+}
+
+void writeResults(Renderer& rend, std::ostream& os)
+{
+	std::vector<double> sorted = results.frameTimes;
+	std::sort(sorted.begin(), sorted.end());
+
+	double total = 0;
+	for (double time : sorted) total += time;
+	double avg = sorted.size() ? total / sorted.size() : 0;
+
+	VkExtent2D extent = rend.getImageExtent();
+	PacingStats pacing = rend.getPacingStats(sorted.size());
+
+	os << "{\n"
+		<< "  \"scene\": \"" << opt.scene << "\",\n"
+		<< "  \"pipelined\": " << (opt.pipelined ? "true" : "false") << ",\n"
+		<< "  \"width\": " << extent.width << ",\n"
+		<< "  \"height\": " << extent.height << ",\n"
+		<< "  \"instances\": " << (instanced ? opt.instances : 1) << ",\n"
+		<< "  \"frames\": " << sorted.size() << ",\n"
+		<< "  \"warmupFrames\": " << warmupFrames << ",\n"
+		<< "  \"loadingTime\": " << results.loadingTime << ",\n"
+		<< "  \"frameTime\": { "
+		<< "\"min\": " << (sorted.size() ? sorted.front() : 0)
+		<< ", \"avg\": " << avg
+		<< ", \"p50\": " << getPercentile(sorted, 50)
+		<< ", \"p90\": " << getPercentile(sorted, 90)
+		<< ", \"p99\": " << getPercentile(sorted, 99)
+		<< ", \"max\": " << (sorted.size() ? sorted.back() : 0) << " },\n"
+		<< "  \"fps\": " << (avg > 0 ? 1000 / avg : 0) << ",\n"
+		<< "  \"pacing\": { "
+		<< "\"avg\": " << pacing.avg
+		<< ", \"jitter\": " << pacing.jitter
+		<< ", \"p99\": " << pacing.p99
+		<< ", \"max\": " << pacing.max
+		<< ", \"lateFrames\": " << pacing.lateFrames << " },\n"
+		<< "  \"drawCommands\": " << results.drawCommands << ",\n"
+		<< "  \"models\": " << results.models << ",\n"
+		<< "  \"memory\": { "
+		<< "\"allocObjects\": " << results.memAllocObjects
+		<< ", \"blocks\": " << results.memory.blocks
+		<< ", \"allocations\": " << results.memory.allocations
+		<< ", \"blockBytes\": " << results.memory.blockBytes
+		<< ", \"usedBytes\": " << results.memory.usedBytes << " },\n"
+		<< "  \"zones\": {";
+
+	const char* zones[] = { "Frame", "waitFrame", "acquire", "waitImage", "waitFPS", "userUpdate", "updateUBOs", "recordCommands", "submit", "present", "GPU render pass 0", "GPU render pass 1", "GPU render pass 2", "GPU render pass 3" };
+	bool first = true;
+	for (const char* zone : zones)
+	{
+		ProfileStats stats = rend.getProfileStats(zone, sorted.size());
+		if (!stats.count) continue;
+
+		os << (first ? "\n" : ",\n")
+			<< "    \"" << zone << "\": { \"min\": " << stats.min << ", \"avg\": " << stats.avg << ", \"p99\": " << stats.p99 << ", \"max\": " << stats.max << ", \"count\": " << stats.count << " }";
+		first = false;
+	}
+
+	os << "\n  }\n}" << std::endl;
+}
+
+bool writePPM(const std::string& fileName, const std::vector<uint8_t>& bgra, uint32_t width, uint32_t height)
+{
+	std::ofstream file(fileName, std::ios::binary);
+	if (!file.is_open()) return false;
+
+	file << "P6\n" << width << " " << height << "\n255\n";
+
+	std::vector<uint8_t> rgb(size_t(width) * height * 3);
+	for (size_t i = 0; i < size_t(width) * height; i++)
+	{
+		rgb[i * 3 + 0] = bgra[i * 4 + 2];
+		rgb[i * 3 + 1] = bgra[i * 4 + 1];
+		rgb[i * 3 + 2] = bgra[i * 4 + 0];
+	}
+
+	file.write(reinterpret_cast<const char*>(rgb.data()), rgb.size());
+	return file.good();
+}
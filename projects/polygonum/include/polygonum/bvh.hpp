@@ -0,0 +1,106 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <functional>
+
+#include "polygonum/toolkit.hpp"
+
+/*
+	Spatial index (Bounding Volume Hierarchy) over the AABBs of models and instances, for frustum culling, picking (ray casts) and proximity queries (sphere overlap) in logarithmic time instead of looping over ModelsManager::data.
+	Usage:
+		- Insert the world space AABB of each model/instance (BVH::insert()) and keep the returned proxy.
+		- When an object moves, update its AABB (BVH::update()). Ancestors are refitted (no restructuring).
+		- Once per frame (after the updates), call BVH::optimize(). It rebuilds the tree (SAH) if refits and insertions degraded it.
+		- Query it (BVH::queryFrustum(), BVH::rayCast(), BVH::querySphere()).
+*/
+
+// Prototypes ----------
+
+struct BVHItem;
+struct BVHHit;
+class BVH;
+
+// Definitions ----------
+
+/// Object stored in a BVH leaf.
+struct BVHItem
+{
+	key64 model;   //!< Key of the model in ModelsManager::data.
+	uint32_t instance;   //!< Instance of the model.
+};
+
+/// Result of a ray cast.
+struct BVHHit
+{
+	BVHItem item;
+	uint32_t proxy;
+	float distance;   //!< Distance along the ray (in units of the ray direction's length).
+};
+
+/**
+	@brief Dynamic AABB tree (binary). Each leaf stores an object (BVHItem) and its AABB; internal nodes store the union of their children.
+
+	Leaves are inserted incrementally where they least increase the surface area (SAH: Surface Area Heuristic) and their AABBs are enlarged by a margin, so small movements don't modify the tree.
+	Tree quality (SAH cost: sum of the surface areas of the internal nodes divided by the root's surface area) is tracked in each change. When it gets worse than rebuildThreshold times its value after the last rebuild, optimize() rebuilds the tree top-down with binned SAH. Proxies (leaf indices) stay valid across rebuilds.
+	Not thread-safe, but queries (const) can run concurrently if the tree is not modified.
+*/
+class BVH
+{
+	struct Node
+	{
+		glm::vec3 min, max;   //!< AABB (enlarged by "margin" in leaves).
+		int32_t parent;   //!< -1 if root.
+		int32_t left, right;   //!< Children. -1 if leaf.
+		BVHItem item;   //!< Leaves only.
+		bool free;   //!< In free list.
+
+		bool isLeaf() const { return left < 0; }
+	};
+
+	std::vector<Node> nodes;
+	std::vector<int32_t> freeNodes;
+	int32_t root;
+	size_t numLeaves;
+
+	float internalArea;   //!< Sum of the surface areas of the internal nodes (updated in each change).
+	float builtCost;   //!< SAH cost after the last rebuild (or when optimize() was first called with 3+ objects, if never rebuilt). -1 if not set yet.
+
+	int32_t allocateNode();
+	void freeNode(int32_t node);
+	void insertLeaf(int32_t leaf);
+	void removeLeaf(int32_t leaf);
+	void refit(int32_t node);   //!< Recompute the AABBs of a node and its ancestors (stops when an AABB doesn't change).
+	void setBounds(int32_t node, const glm::vec3& min, const glm::vec3& max);   //!< Set the AABB of a node (updates internalArea).
+	int32_t build(int32_t* leaves, size_t count);   //!< Top-down binned SAH build. Returns the subtree's root.
+
+public:
+	BVH(float margin = 0.1f);
+
+	float margin;   //!< Distance added to each side of the leaves' AABBs.
+	float rebuildThreshold = 1.5f;   //!< optimize() rebuilds the tree when its SAH cost is greater than this times the cost after the last rebuild.
+	static constexpr uint32_t numBins = 16;   //!< Bins per axis in SAH builds.
+
+	uint32_t insert(const AABB& aabb, key64 model, uint32_t instance = 0);   //!< Add an object. Returns its proxy.
+	void remove(uint32_t proxy);
+	bool update(uint32_t proxy, const AABB& aabb);   //!< Set the new AABB of an object. Returns true if the tree was modified (the new AABB wasn't contained in the enlarged one).
+	bool optimize();   //!< Rebuild the tree if degraded. Returns true if rebuilt. Call it once per frame after updating.
+	void rebuild();   //!< Rebuild the whole tree (binned SAH).
+	void clear();
+
+	const BVHItem& getItem(uint32_t proxy) const;
+	AABB getBounds(uint32_t proxy) const;   //!< Enlarged AABB of an object.
+	size_t size() const;   //!< Number of objects.
+	float getCost() const;   //!< Current SAH cost.
+
+	size_t queryFrustum(const Frustum& frustum, std::vector<BVHItem>& result) const;   //!< Append the objects inside or intersecting the frustum. Returns the number appended.
+	size_t querySphere(const Sphere& sphere, std::vector<BVHItem>& result) const;   //!< Append the objects overlapping the sphere. Returns the number appended.
+	size_t queryAABB(const AABB& aabb, std::vector<BVHItem>& result) const;   //!< Append the objects overlapping the AABB. Returns the number appended.
+
+	/**
+		Find the closest object hit by a ray (nearest children are visited first, and subtrees farther than the closest hit are skipped). Returns false if nothing is hit.
+		If "test" is provided, it's called for each leaf hit: It returns false if the object is actually missed, or true and sets its exact distance (received as the distance to the leaf's AABB). Otherwise, the distance to the leaf's enlarged AABB is used.
+	*/
+	bool rayCast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, BVHHit& hit, const std::function<bool(const BVHItem&, float&)>& test = nullptr) const;
+};
+
+#endif
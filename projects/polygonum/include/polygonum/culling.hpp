@@ -0,0 +1,100 @@
+#ifndef CULLING_HPP
+#define CULLING_HPP
+
+#include "polygonum/shader.hpp"
+#include "polygonum/toolkit.hpp"
+
+/*
+	GPU frustum culling of instances (opt-in: ModelDataInfo::gpuCulling). Useful for models with many instances (forests, grass...):
+		- The bounding sphere of each instance is stored in an SSBO (InstanceCulling::setBounds()).
+		- Before the render passes, a compute pass tests them against the frustum planes (CullingManager::setFrustum()), writes the indices of the visible instances in a vertex buffer, and fills the indirect draw commands with the visible count.
+		- The model is drawn with vkCmdDrawIndexedIndirectCount (or vkCmdDrawIndexedIndirect if not supported).
+	The vertex shader gets the index of its instance in an instance-rate attribute (uint) placed right after the vertex attributes (location = number of vertex attributes). Use it instead of gl_InstanceIndex.
+	Command buffers don't have to be re-recorded when the camera moves or bounds change (the frustum and bounds are copied to GPU memory each frame).
+*/
+
+// Prototypes ----------
+
+class CullingManager;
+class InstanceCulling;
+
+// Definitions ----------
+
+/**
+	@brief Compute pipeline for frustum culling (shared by all culled models) and current frustum.
+
+	Created the first time a culled model is constructed. Thread-safe.
+*/
+class CullingManager
+{
+	VulkanCore& c;
+	std::shared_ptr<Shader> shader;
+	std::mutex mutCulling;
+
+	Frustum frustum;   //!< Default: Planes that don't cull anything.
+	Frustum frameFrustum;   //!< Frustum of the frame being rendered (copied from "frustum" by the render loop, or from a FramePacket in pipelined mode).
+
+	friend InstanceCulling;
+
+public:
+	CullingManager(VulkanCore& core);
+
+	static const char* shaderCode;   //!< GLSL of the culling compute shader.
+	const uint32_t workgroupSize = 64;
+
+	VkDescriptorSetLayout descriptorSetLayout;   //!< Bounds (+ frustum planes), visible instances, indirect commands.
+	VkPipelineLayout pipelineLayout;
+	VkPipeline pipeline;
+
+	void create(PointersManager<std::string, Shader>& loadedShaders);   //!< Create the compute pipeline (if not created yet).
+	void destroy();   //!< Destroy the compute pipeline. Call it before destroying the logical device.
+
+	void setFrustum(const Frustum& frustum);   //!< Frustum used for culling (copied to GPU memory each frame). Call it in the user update callback.
+	const Frustum& getFrustum() const;
+	void setFrameFrustum(const Frustum& frustum);   //!< Used by the render loop.
+};
+
+/**
+	@brief GPU culling data of a model: bounds of its instances, visible instances, and indirect draw commands (one set of buffers per swapchain image).
+
+	Indexed meshes only. Each meshlet (or the whole mesh) gets one indirect command.
+*/
+class InstanceCulling
+{
+	CullingManager& manager;
+	Renderer* r;
+	uint32_t capacity;   //!< Max. number of instances.
+
+	BindingBuffer bounds;   //!< Frustum planes (6 vec4: normal, distance) followed by the bounding sphere of each instance (vec4: center, radius). Host visible.
+	std::vector<VkBuffer> visibleBuffers;   //!< [sc.img] Indices of the visible instances (written by the compute pass, read as instance-rate vertex attribute).
+	std::vector<Allocation> visibleMemories;
+	std::vector<VkBuffer> indirectBuffers;   //!< [sc.img] Header (draw count, visible count, 2 x padding) followed by the VkDrawIndexedIndirectCommand of each meshlet.
+	std::vector<Allocation> indirectMemories;
+	VkDescriptorPool descriptorPool;
+	std::vector<VkDescriptorSet> descriptorSets;   //!< [sc.img]
+	std::vector<VkDrawIndexedIndirectCommand> commands;   //!< Draw commands (instanceCount is written by the compute pass).
+
+public:
+	InstanceCulling(CullingManager& manager, uint32_t maxInstances);
+	~InstanceCulling();
+
+	static constexpr VkDeviceSize headerSize = 4 * sizeof(uint32_t);   //!< Bytes before the commands in the indirect buffers.
+	static constexpr uint32_t planesSize = 6 * sizeof(glm::vec4);   //!< Bytes before the bounding spheres in the bounds buffer.
+
+	void setBounds(uint32_t instance, const Sphere& sphere);   //!< Bounding sphere (world space) of an instance.
+	void setBounds(uint32_t firstInstance, uint32_t count, const glm::vec4* spheres);   //!< Bounding spheres (xyz: center, w: radius) of a range of instances.
+	uint32_t getCapacity() const;
+	BindingBuffer& getBounds();   //!< Used by the render loop for publishing the modified bounds.
+
+	void createResources(Renderer* renderer, const VertexData& vert);   //!< Create buffers and descriptor sets (one per swapchain image), and upload the draw commands.
+	void destroyResources();
+	void updateMemory(uint32_t imageIndex);   //!< Copy frustum and modified bounds to the memory of a swapchain image.
+
+	VkBuffer getVisibleBuffer(size_t imageIndex) const;
+	void recordDraw(VkCommandBuffer commandBuffer, size_t imageIndex) const;   //!< Record the indirect draw (inside the render pass). Visible instances must be bound as vertex buffer 1.
+
+	/// Record the compute pass for these models (outside any render pass), including the barriers that make its results visible to the indirect draws. Each pair contains a model's culling data and its number of instances.
+	static void recordCulling(VkCommandBuffer commandBuffer, size_t imageIndex, const std::vector<std::pair<InstanceCulling*, uint32_t>>& models);
+};
+
+#endif
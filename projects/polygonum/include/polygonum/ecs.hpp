@@ -3,20 +3,82 @@
 
 #include <unordered_map>
 #include <typeindex>
-
+#include <map>
+#include <deque>
+#include <vector>
+#include <array>
+#include <tuple>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <algorithm>
+#include <type_traits>
+#include <new>
+#include <atomic>
+#include <thread>
+
+#include "polygonum/jobs.hpp"
+
+/*
+    Components are stored by archetype (set of component types). Each archetype stores the components of its entities in packed arrays (one per component type), so systems iterate contiguous memory:
+        - Queries (EntitiesManager::query<T...>()) are cached, and keep the list of archetypes containing all the T types. New archetypes are added to existing queries when created.
+        - Query::forEach() and Query::forEachChunk() iterate the arrays without hash lookups, virtual calls or allocations.
+        - Adding/removing a component moves the entity to another archetype (cached in the archetype graph: addEdges, removeEdges).
+    Don't add/remove entities or components while iterating a query (arrays may be reallocated or reordered).
+
+    Systems declare the component types they read and write (System::read<T...>(), System::write<T...>()). EntitiesManager::update() runs systems that don't conflict concurrently on a JobPool:
+        - A system depends on every previous system (insertion order) that writes a type it reads or writes, or reads a type it writes.
+        - Systems that don't declare their types are exclusive (they depend on all previous systems and all next systems depend on them).
+        - Inside a system, Query::parallelForEach() splits the entities in chunks processed in parallel.
+    Systems running concurrently must not add/remove entities or components directly. They record these changes in EntitiesManager::getCommands() (EntityCommandBuffer), which is played back after all the systems have finished.
+*/
 
 // Prototypes ----------
 
 class Entity;
 struct Component;
+struct ComponentInfo;
+class ComponentRegistry;
+class Archetype;
+class QueryBase;
+template<typename... T> class Query;
+class EntityCommandBuffer;
 class System;
 class EntitiesManager;
 class MainEntityFactory;
 
+using ComponentType = uint32_t;   //!< Dense id of a component type (assigned at first use).
+using EntityId = uint64_t;   //!< Generational handle: index of the entity's record (low 32 bits) and generation of the record (high 32 bits). 0 is never a valid entity.
+
 
 // Class definitions ----------
 
-/// It stores state data (fields) and have no behavior (no methods).
+/// Type-erased operations of a component type (used by the archetype arrays).
+struct ComponentInfo
+{
+    ComponentType type;
+    size_t size;
+    size_t alignment;
+    void (*moveConstruct)(void* dst, void* src);   //!< Construct a component at "dst" by moving it from "src".
+    void (*destroy)(void* ptr);   //!< Call the destructor.
+    const char* name;
+};
+
+/// Assigns ids to component types and stores their ComponentInfo. Thread-safe.
+class ComponentRegistry
+{
+    static std::deque<ComponentInfo>& getInfos();   //!< Deque: references are not invalidated when types are registered.
+    static std::mutex& getMutex();
+    static const ComponentInfo& registerType(ComponentInfo info);
+
+public:
+    template<typename T> static const ComponentInfo& get();   //!< Register the type at first call.
+    static const ComponentInfo& get(ComponentType type);
+};
+
+template<typename T> ComponentType getComponentType() { return ComponentRegistry::get<T>().type; }
+
+/// It stores state data (fields) and have no behavior (no methods). Deriving from it is optional: any movable type can be a component.
 struct Component
 {
     Component();
@@ -25,19 +87,20 @@ struct Component
     std::type_index typeIndex;
 };
 
-/// An ID associated with a set of components.
+/// Set of components used for creating an entity (EntitiesManager::addEntity()). Components are moved into their archetype's arrays when the entity is added.
 class Entity
 {
     Entity(std::string name);
 
-    std::unordered_map<std::type_index, std::unique_ptr<Component>> components;
+    std::vector<std::pair<const ComponentInfo*, std::unique_ptr<void, void(*)(void*)>>> components;
+
+    friend EntitiesManager;
 
 public:
     ~Entity();
 
     static Entity* newEntity(std::string name);
     template <typename T, typename... Args> void addComponent(Args&&... args);
-    template <typename T, typename K, typename... Args> void addComponent(Args&&... args);
     template<typename T> T* getComponent();
     void printInfo();
 
@@ -45,6 +108,161 @@ public:
     const std::string name;
 };
 
+/**
+    @brief Entities with the same set of component types. Stores one packed array per component type (columns) and the id of the entity in each row.
+
+    Rows are kept packed: Removing a row moves the last one into it.
+*/
+class Archetype
+{
+    struct Column
+    {
+        const ComponentInfo* info;
+        uint8_t* data;
+
+        void* get(size_t row) const { return data + row * info->size; }
+    };
+
+    size_t capacity;   //!< Rows allocated in each column.
+
+    void reserve(size_t newCapacity);
+
+public:
+    Archetype(const std::vector<ComponentType>& types);
+    ~Archetype();
+    Archetype(const Archetype&) = delete;
+    Archetype& operator=(const Archetype&) = delete;
+
+    const std::vector<ComponentType> types;   //!< Sorted.
+    std::vector<Column> columns;   //!< One per type (same order).
+    std::vector<EntityId> entities;   //!< Entity of each row.
+
+    std::unordered_map<ComponentType, Archetype*> addEdges;   //!< Archetype with one more type.
+    std::unordered_map<ComponentType, Archetype*> removeEdges;   //!< Archetype with one less type.
+
+    size_t size() const;   //!< Number of entities.
+    int findColumn(ComponentType type) const;   //!< Index of the column of a type, or -1.
+    template<typename T> T* getArray(size_t column) { return static_cast<T*>((void*)columns[column].data); }
+
+    size_t addRow(EntityId entity);   //!< Add a row (components not constructed yet). Returns the row.
+    EntityId removeRow(size_t row);   //!< Destroy the components of a row and move the last row into it. Returns the entity moved (0 if none).
+};
+
+/// Interface used by EntitiesManager for adding new archetypes to the cached queries.
+class QueryBase
+{
+public:
+    virtual ~QueryBase() { }
+    virtual void addArchetype(Archetype* archetype) = 0;
+};
+
+/**
+    @brief Cached list of the archetypes containing all the T types (and the column of each type in them).
+
+    Get it with EntitiesManager::query<T...>(). The callback receives the components of each entity (and, optionally, its id first):
+        query.forEach([](Position& p, Velocity& v) { p.pos += v.vel; });
+        query.forEach([](EntityId entity, Position& p) { ... });
+        query.forEachChunk([](size_t count, const EntityId* entities, Position* p, Velocity* v) { for (size_t i = 0; i < count; i++) ... });
+*/
+template<typename... T>
+class Query : public QueryBase
+{
+    struct Match
+    {
+        Archetype* archetype;
+        std::array<uint32_t, sizeof...(T)> columns;
+    };
+
+    std::vector<Match> matches;
+
+    template<typename F, size_t... I> static void iterate(F& function, const Match& match, size_t begin, size_t end, std::index_sequence<I...>);
+    template<typename F, size_t... I> static void iterateChunk(F& function, const Match& match, size_t begin, size_t end, std::index_sequence<I...>);
+
+public:
+    void addArchetype(Archetype* archetype) override;
+
+    template<typename F> void forEach(F&& function);   //!< Call function(T&...) or function(EntityId entity, T&...) for each entity.
+    template<typename F> void forEachChunk(F&& function);   //!< Call function(size_t count, const EntityId* entities, T*...) for each archetype (packed arrays).
+    template<typename F> void parallelForEach(JobPool& pool, F&& function, size_t chunkSize = 1024);   //!< Like forEach(), but chunks of up to chunkSize entities are processed in parallel. "function" must be thread-safe.
+    template<typename F> void parallelForEachChunk(JobPool& pool, F&& function, size_t chunkSize = 1024);   //!< Like forEachChunk(), but with chunks of up to chunkSize entities processed in parallel.
+    size_t size() const;   //!< Number of entities.
+};
+
+/**
+    @brief Deferred structural changes (create/destroy entities, add/remove components). Recorded from any thread and played back later in bulk (EntitiesManager::playback()).
+
+    Each recording thread gets its own stream, so recording doesn't lock. Components are constructed in pooled memory blocks that are reused after each playback (no allocation per component).
+    The commands of a thread are played back in recording order. Streams of different threads are played back one after another. Don't record while playing back.
+*/
+class EntityCommandBuffer
+{
+    enum class CommandType { create, destroy, add, remove };
+
+    /// Sorted component types of an entity created with create<T...>(), and column of each T (in argument order) in its archetype.
+    struct CreateLayout
+    {
+        std::vector<ComponentType> types;
+        std::vector<uint32_t> columns;
+    };
+
+    struct ComponentData
+    {
+        const ComponentInfo* info;
+        void* data;   //!< Component constructed in the stream's memory blocks.
+    };
+
+    struct Command
+    {
+        CommandType type;
+        EntityId entity;   //!< destroy, add, remove
+        const CreateLayout* layout;   //!< create
+        size_t firstComponent;   //!< create, add: first component in Stream::components.
+        ComponentType componentType;   //!< remove
+        std::string name;   //!< create
+    };
+
+    /// Commands recorded by one thread, and the memory of their components.
+    struct Stream
+    {
+        std::vector<Command> commands;
+        std::vector<ComponentData> components;
+        std::vector<uint8_t*> blocks;   //!< Memory blocks (blockSize bytes each). Kept after playback.
+        std::vector<std::pair<uint8_t*, size_t>> bigAllocations;   //!< <memory, alignment> of components that don't fit the blocks. Freed after playback.
+        size_t currentBlock = 0;
+        size_t offset = 0;   //!< Bytes used in the current block.
+
+        ~Stream();
+        void* allocate(size_t size, size_t alignment);
+        void clear();   //!< Destroy the components and reuse the memory.
+    };
+
+    std::vector<std::unique_ptr<Stream>> streams;
+    std::unordered_map<std::thread::id, Stream*> threadStreams;
+    std::mutex mutStreams;   //!< for streams and threadStreams
+    const uint64_t id;   //!< Unique id of this buffer (validates the stream cached by each thread).
+
+    Stream& getStream();   //!< Stream of the calling thread.
+    template<typename... T> static const CreateLayout& getLayout();
+    template<typename T, typename... Args> static void construct(Stream& stream, Args&&... args);   //!< Construct a component in the stream.
+
+    friend EntitiesManager;
+
+public:
+    EntityCommandBuffer();
+    ~EntityCommandBuffer();
+    EntityCommandBuffer(const EntityCommandBuffer&) = delete;
+    EntityCommandBuffer& operator=(const EntityCommandBuffer&) = delete;
+
+    static constexpr size_t blockSize = 64 * 1024;
+    static constexpr size_t blockAlignment = 64;
+
+    template<typename... T> void create(const std::string& name, T&&... components);   //!< Create an entity with these components (of different types). Example: create("bullet", Position{ pos }, Velocity{ vel }).
+    void destroy(EntityId entityId);
+    template<typename T, typename... Args> void add(EntityId entityId, Args&&... args);   //!< Add (or replace) a component.
+    template<typename T> void remove(EntityId entityId);
+    void clear();   //!< Discard the recorded commands.
+    size_t size();   //!< Number of commands recorded.
+};
 
 /// It has behavior (methods) and have no state data (no fields). To each system corresponds a set of components. The systems iterate through their components performing operations (behavior) on their state.
 class System
@@ -56,39 +274,100 @@ public:
     EntitiesManager* em;
     std::type_index typeIndex;
 
+    std::vector<ComponentType> reads;   //!< Component types read (declared with read<T...>()).
+    std::vector<ComponentType> writes;   //!< Component types written (declared with write<T...>()).
+    bool declared;   //!< Types declared. If false, the system runs alone (exclusive).
+
     virtual void update(float timeStep) = 0;
+
+    template<typename... T> void read();   //!< Declare component types read by update() (call it in the constructor). read<>() declares that no types are read.
+    template<typename... T> void write();   //!< Declare component types written by update() (call it in the constructor).
+    bool conflicts(const System& other) const;   //!< True if both systems can't run concurrently.
 };
 
 /// Acts as a "database", where you look up entities and get their list of components.
 class EntitiesManager
 {
-    uint32_t getNewId();
-    uint32_t lowestUnassignedId = 1;
-
-    std::unordered_map<uint32_t, std::unique_ptr<Entity>> entities;
+    /// Location of an entity's components. Records are reused: The generation is incremented each time its entity is removed, so old handles become invalid.
+    struct EntityRecord
+    {
+        Archetype* archetype = nullptr;   //!< nullptr if not in use.
+        size_t row = 0;
+        uint32_t generation = 0;
+        std::string name;
+    };
+
+    std::vector<EntityRecord> records;   //!< Indexed by entity index. Record 0 is never used.
+    std::vector<uint32_t> freeRecords;   //!< Indices of the unused records (LIFO).
+    size_t numEntities;
+
+    EntityId getNewId();   //!< O(1). Returns 0 if no indices are available.
+    EntityRecord* getRecord(EntityId entityId);   //!< Record of a valid entity, or nullptr.
     std::vector<std::unique_ptr<System>> systems;
 
+    std::map<std::vector<ComponentType>, std::unique_ptr<Archetype>> archetypes;   //!< Key: sorted component types.
+    std::unordered_map<std::type_index, std::unique_ptr<QueryBase>> queries;   //!< Key: Query<T...> type.
+    std::mutex mutQueries;   //!< for queries (systems may get queries concurrently)
+
+    std::unique_ptr<JobPool> jobs;   //!< Created at first use.
+    unsigned numThreads;
+
+    /// Dependency graph of the systems (rebuilt when systems are added).
+    struct SystemNode
+    {
+        std::vector<size_t> dependents;   //!< Systems that wait for this one.
+        size_t numDependencies;   //!< Systems this one waits for.
+    };
+
+    std::vector<SystemNode> graph;
+    std::vector<std::atomic<size_t>> remainingDependencies;   //!< Per system, during update().
+    bool graphOutdated;
+    void buildGraph();
+
+    Archetype* getArchetype(const std::vector<ComponentType>& types);   //!< Find or create the archetype for these (sorted) types.
+    Archetype* getArchetypeWith(Archetype* archetype, ComponentType type);   //!< Archetype with one more type.
+    Archetype* getArchetypeWithout(Archetype* archetype, ComponentType type);   //!< Archetype with one less type.
+    size_t moveEntity(EntityId entityId, EntityRecord& record, Archetype* destination);   //!< Move the shared components to another archetype. Returns the new row (components not in the source are not constructed).
+    EntityId createEntity(Archetype* archetype, const std::string& name, size_t& row);   //!< New entity in an archetype (components not constructed yet). Returns 0 if no ids are available.
+    void moveComponent(EntityId entityId, const ComponentInfo& info, void* component);   //!< Add (or replace) a component by moving it.
+    void removeComponent(EntityId entityId, ComponentType type);
+
+    EntityCommandBuffer commands;
+
 public:
     EntitiesManager();
     ~EntitiesManager();
 
-    void update(float timeStep);
+    void update(float timeStep);   //!< Run all systems (non-conflicting systems run concurrently).
     void printInfo();
 
-    uint32_t addEntity(Entity* entity);   //!< Add new entity by defining its components.
+    void setThreads(unsigned numThreads);   //!< Threads running systems, including the calling thread (0: hardware concurrency; 1: systems run serially). Default: 0.
+    JobPool& getJobPool();   //!< Pool used for running systems (for Query::parallelForEach()).
+    EntityCommandBuffer& getCommands();   //!< Deferred changes played back at the end of update(). Thread-safe.
+    void playback(EntityCommandBuffer& buffer);   //!< Apply the commands of a buffer and clear it.
+
+    EntityId addEntity(Entity* entity);   //!< Add new entity by defining its components. Takes ownership of "entity" (deleted after moving its components).
     template<typename T, typename... Args> void addSystem(Args&&... args);   //!< Add new system
 
-    template<typename T> std::vector<uint32_t> getEntities();               //!< Get set of entities containing component of type X.
-    template<typename T, typename Q> std::vector<uint32_t> getEntities();   //!< Get set of entities containing component of type X and type Y.
-    template<typename T> T* getComponent(uint32_t entityId);   //!< Get a certain component from an entity.
-    std::string getName(uint32_t entityId);
+    template<typename... T> Query<T...>& query();   //!< Get the cached query of the entities containing all the T types.
+    template<typename T> std::vector<EntityId> getEntities();               //!< Get set of entities containing component of type X.
+    template<typename T, typename Q> std::vector<EntityId> getEntities();   //!< Get set of entities containing component of type X and type Y.
+    template<typename T> T* getComponent(EntityId entityId);   //!< Get a certain component from an entity.
+    template<typename T, typename... Args> T* addComponent(EntityId entityId, Args&&... args);   //!< Add (or replace) a component. Moves the entity to another archetype.
+    template<typename T> void removeComponent(EntityId entityId);   //!< Moves the entity to another archetype.
+    std::string getName(EntityId entityId);   //!< Empty if the entity is not valid.
+
+    void removeEntity(EntityId entityId);   //!< O(1). Invalidates its handle (the index may be reused by a new entity, but with another generation).
+    bool isValid(EntityId entityId);   //!< True if the entity exists (hasn't been removed).
+    size_t getNumEntities() const;
 
-    void removeEntity(uint32_t entityId);
+    static uint32_t getIndex(EntityId entityId) { return static_cast<uint32_t>(entityId); }
+    static uint32_t getGeneration(EntityId entityId) { return static_cast<uint32_t>(entityId >> 32); }
 
     // Useful ids. Feel free to define new ones here.
-    uint32_t singletonId;   // Id of the entity containing all the singleton components (implementation dependent)
-    uint32_t planetId;
-    uint32_t seaId;
+    EntityId singletonId;   // Id of the entity containing all the singleton components (implementation dependent)
+    EntityId planetId;
+    EntityId seaId;
 };
 
 
@@ -108,23 +387,161 @@ public:
 
 // Templates definitions ----------
 
-template <typename T, typename... Args>
-void Entity::addComponent(Args&&... args)
+template<typename T>
+const ComponentInfo& ComponentRegistry::get()
 {
-    components[std::type_index(typeid(T))] = std::make_unique<T>(std::forward<Args>(args)...);
+    static const ComponentInfo& info = registerType(ComponentInfo{
+        0,
+        sizeof(T),
+        alignof(T),
+        [](void* dst, void* src) { new (dst) T(std::move(*static_cast<T*>(src))); },
+        [](void* ptr) { static_cast<T*>(ptr)->~T(); },
+        typeid(T).name() });
+
+    return info;
 }
 
-template <typename T, typename K, typename... Args>
+template <typename T, typename... Args>
 void Entity::addComponent(Args&&... args)
 {
-    components[std::type_index(typeid(T))] = std::unique_ptr<T>((T*) new K(std::forward<Args>(args)...));
+    std::unique_ptr<void, void(*)(void*)> component(new T(std::forward<Args>(args)...), [](void* ptr) { delete static_cast<T*>(ptr); });
+    const ComponentInfo* info = &ComponentRegistry::get<T>();
+
+    for (auto& pair : components)
+        if (pair.first == info)
+        {
+            pair.second = std::move(component);
+            return;
+        }
+
+    components.push_back({ info, std::move(component) });
 }
 
 template<typename T>
 T* Entity::getComponent()
 {
-    auto it = components.find(std::type_index(typeid(T)));
-    return it != components.end() ? static_cast<T*>(it->second.get()) : nullptr;
+    const ComponentInfo* info = &ComponentRegistry::get<T>();
+
+    for (auto& pair : components)
+        if (pair.first == info)
+            return static_cast<T*>(pair.second.get());
+
+    return nullptr;
+}
+
+template<typename... T>
+void Query<T...>::addArchetype(Archetype* archetype)
+{
+    Match match;
+    match.archetype = archetype;
+
+    std::array<ComponentType, sizeof...(T)> types = { getComponentType<T>()... };
+    for (size_t i = 0; i < types.size(); i++)
+    {
+        int column = archetype->findColumn(types[i]);
+        if (column < 0) return;
+        match.columns[i] = column;
+    }
+
+    matches.push_back(match);
+}
+
+template<typename... T>
+template<typename F, size_t... I>
+void Query<T...>::iterate(F& function, const Match& match, size_t begin, size_t end, std::index_sequence<I...>)
+{
+    std::tuple<T*...> arrays(match.archetype->template getArray<T>(match.columns[I])...);
+    const EntityId* entities = match.archetype->entities.data();
+
+    for (size_t row = begin; row < end; row++)
+    {
+        if constexpr (std::is_invocable_v<F&, EntityId, T&...>)
+            function(entities[row], std::get<I>(arrays)[row]...);
+        else
+            function(std::get<I>(arrays)[row]...);
+    }
+}
+
+template<typename... T>
+template<typename F, size_t... I>
+void Query<T...>::iterateChunk(F& function, const Match& match, size_t begin, size_t end, std::index_sequence<I...>)
+{
+    function(end - begin, match.archetype->entities.data() + begin, (match.archetype->template getArray<T>(match.columns[I]) + begin)...);
+}
+
+template<typename... T>
+template<typename F>
+void Query<T...>::forEach(F&& function)
+{
+    for (const Match& match : matches)
+        iterate(function, match, 0, match.archetype->size(), std::index_sequence_for<T...>{});
+}
+
+template<typename... T>
+template<typename F>
+void Query<T...>::forEachChunk(F&& function)
+{
+    for (const Match& match : matches)
+        if (match.archetype->size())
+            iterateChunk(function, match, 0, match.archetype->size(), std::index_sequence_for<T...>{});
+}
+
+template<typename... T>
+template<typename F>
+void Query<T...>::parallelForEach(JobPool& pool, F&& function, size_t chunkSize)
+{
+    std::atomic<size_t> counter(0);
+
+    for (const Match& match : matches)
+        for (size_t begin = 0; begin < match.archetype->size(); begin += chunkSize)
+        {
+            size_t end = std::min(begin + chunkSize, match.archetype->size());
+            pool.submit([&function, &match, begin, end] { iterate(function, match, begin, end, std::index_sequence_for<T...>{}); }, counter);
+        }
+
+    pool.wait(counter);
+}
+
+template<typename... T>
+template<typename F>
+void Query<T...>::parallelForEachChunk(JobPool& pool, F&& function, size_t chunkSize)
+{
+    std::atomic<size_t> counter(0);
+
+    for (const Match& match : matches)
+        for (size_t begin = 0; begin < match.archetype->size(); begin += chunkSize)
+        {
+            size_t end = std::min(begin + chunkSize, match.archetype->size());
+            pool.submit([&function, &match, begin, end] { iterateChunk(function, match, begin, end, std::index_sequence_for<T...>{}); }, counter);
+        }
+
+    pool.wait(counter);
+}
+
+template<typename... T>
+size_t Query<T...>::size() const
+{
+    size_t count = 0;
+    for (const Match& match : matches)
+        count += match.archetype->size();
+
+    return count;
+}
+
+template<typename... T>
+void System::read()
+{
+    declared = true;
+    std::initializer_list<ComponentType> types = { getComponentType<T>()... };
+    reads.insert(reads.end(), types.begin(), types.end());
+}
+
+template<typename... T>
+void System::write()
+{
+    declared = true;
+    std::initializer_list<ComponentType> types = { getComponentType<T>()... };
+    writes.insert(writes.end(), types.begin(), types.end());
 }
 
 template<typename T, typename... Args>
@@ -133,42 +550,148 @@ void EntitiesManager::addSystem(Args&&... args)
     #ifdef DEBUG_ECS
         std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
     #endif
-    
+
     std::unique_ptr<T> systemPtr = std::make_unique<T>(std::forward<Args>(args)...);
     systemPtr->em = this;
     systemPtr->typeIndex = typeid(T);
     systems.push_back(std::move(systemPtr));
+    graphOutdated = true;
+}
+
+template<typename... T>
+Query<T...>& EntitiesManager::query()
+{
+    const std::lock_guard<std::mutex> lock(mutQueries);
+    std::unique_ptr<QueryBase>& query = queries[std::type_index(typeid(Query<T...>))];
+
+    if (!query)
+    {
+        query = std::make_unique<Query<T...>>();
+        for (auto& pair : archetypes)
+            query->addArchetype(pair.second.get());
+    }
+
+    return *static_cast<Query<T...>*>(query.get());
 }
 
 template<typename T>
-std::vector<uint32_t> EntitiesManager::getEntities()
+std::vector<EntityId> EntitiesManager::getEntities()
 {
-    std::vector<uint32_t> result;
+    std::vector<EntityId> result;
 
-    for (auto& it : entities)
-        if (getComponent<T>(it.first))
-            result.push_back(it.first);
+    query<T>().forEachChunk([&result](size_t count, const EntityId* entities, T*) { result.insert(result.end(), entities, entities + count); });
 
     return result;
 }
 
 template<typename T, typename Q>
-std::vector<uint32_t> EntitiesManager::getEntities()
+std::vector<EntityId> EntitiesManager::getEntities()
 {
-    std::vector<uint32_t> result;
+    std::vector<EntityId> result;
 
-    for (auto& it : entities)
-        if (getComponent<T>(it.first) && getComponent<Q>(it.first))
-            result.push_back(it.first);
+    query<T, Q>().forEachChunk([&result](size_t count, const EntityId* entities, T*, Q*) { result.insert(result.end(), entities, entities + count); });
 
     return result;
 }
 
+inline EntitiesManager::EntityRecord* EntitiesManager::getRecord(EntityId entityId)
+{
+    uint32_t index = getIndex(entityId);
+    if (index >= records.size()) return nullptr;
+
+    EntityRecord& record = records[index];
+    return (record.archetype && record.generation == getGeneration(entityId)) ? &record : nullptr;
+}
+
+template<typename T>
+T* EntitiesManager::getComponent(EntityId entityId)
+{
+    EntityRecord* record = getRecord(entityId);
+    if (!record) return nullptr;   // Removed entity (stale handle)
+
+    int column = record->archetype->findColumn(getComponentType<T>());
+    return column >= 0 ? record->archetype->template getArray<T>(column) + record->row : nullptr;
+}
+
+template<typename T, typename... Args>
+T* EntitiesManager::addComponent(EntityId entityId, Args&&... args)
+{
+    EntityRecord* found = getRecord(entityId);
+    if (!found) return nullptr;
+
+    EntityRecord& record = *found;
+    ComponentType type = getComponentType<T>();
+
+    int column = record.archetype->findColumn(type);
+    if (column >= 0)   // Already there: Replace it.
+    {
+        T* component = record.archetype->template getArray<T>(column) + record.row;
+        *component = T(std::forward<Args>(args)...);
+        return component;
+    }
+
+    Archetype* destination = getArchetypeWith(record.archetype, type);
+    size_t row = moveEntity(entityId, record, destination);
+    return new (destination->columns[destination->findColumn(type)].get(row)) T(std::forward<Args>(args)...);
+}
+
+template<typename T>
+void EntitiesManager::removeComponent(EntityId entityId)
+{
+    EntityRecord* record = getRecord(entityId);
+    if (!record) return;
+
+    removeComponent(entityId, getComponentType<T>());
+}
+
+template<typename... T>
+const EntityCommandBuffer::CreateLayout& EntityCommandBuffer::getLayout()
+{
+    static const CreateLayout layout = []
+    {
+        CreateLayout result;
+        std::vector<ComponentType> types = { getComponentType<T>()... };
+        result.types = types;
+        std::sort(result.types.begin(), result.types.end());
+
+        for (ComponentType type : types)
+            result.columns.push_back(static_cast<uint32_t>(std::lower_bound(result.types.begin(), result.types.end(), type) - result.types.begin()));
+
+        return result;
+    }();
+
+    return layout;
+}
+
+template<typename T, typename... Args>
+void EntityCommandBuffer::construct(Stream& stream, Args&&... args)
+{
+    void* data = stream.allocate(sizeof(T), alignof(T));
+    new (data) T(std::forward<Args>(args)...);
+    stream.components.push_back(ComponentData{ &ComponentRegistry::get<T>(), data });
+}
+
+template<typename... T>
+void EntityCommandBuffer::create(const std::string& name, T&&... components)
+{
+    Stream& stream = getStream();
+    stream.commands.push_back(Command{ CommandType::create, 0, &getLayout<std::decay_t<T>...>(), stream.components.size(), 0, name });
+    (construct<std::decay_t<T>>(stream, std::forward<T>(components)), ...);
+}
+
+template<typename T, typename... Args>
+void EntityCommandBuffer::add(EntityId entityId, Args&&... args)
+{
+    Stream& stream = getStream();
+    stream.commands.push_back(Command{ CommandType::add, entityId, nullptr, stream.components.size(), 0, {} });
+    construct<T>(stream, std::forward<Args>(args)...);
+}
+
 template<typename T>
-T* EntitiesManager::getComponent(uint32_t entityId)
+void EntityCommandBuffer::remove(EntityId entityId)
 {
-    auto it = entities.find(entityId);
-    return it != entities.end() ? entities[entityId]->getComponent<T>() : nullptr;
+    Stream& stream = getStream();
+    stream.commands.push_back(Command{ CommandType::remove, entityId, nullptr, 0, getComponentType<T>(), {} });
 }
 
-#endif
\ No newline at end of file
+#endif
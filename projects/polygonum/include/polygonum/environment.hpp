@@ -6,12 +6,17 @@
 #include <queue>
 #include <cstdint>
 #include <thread>
+#include <atomic>
 //#include <cstdlib>			// EXIT_SUCCESS, EXIT_FAILURE
 //#include <cstdint>			// UINT32_MAX
 //#include <algorithm>			// std::min / std::max
 
 #include "polygonum/toolkit.hpp"
 #include "polygonum/input.hpp"
+#include "polygonum/memory.hpp"
+#include "polygonum/profiler.hpp"
+#include "polygonum/pacer.hpp"
+#include "polygonum/jobs.hpp"
 
 
 // Forward declarations ----------
@@ -55,6 +60,7 @@ struct QueueFamilyIndices
 {
 	std::optional<uint32_t> graphicsFamily;		///< Queue family capable of computer graphics.
 	std::optional<uint32_t> presentFamily;		///< Queue family capable of presenting to our window surface.
+	std::optional<uint32_t> transferFamily;		///< [Optional] Queue family capable of transfers but not graphics (dedicated transfer/DMA engine). Used for uploading resources concurrently with rendering.
 	bool isComplete();							///< Checks whether all members have value.
 };
 
@@ -71,7 +77,7 @@ struct SwapChainSupportDetails
 class Image
 {
 public:
-	Image(VulkanCore* core = nullptr, VkImage image = nullptr, VkDeviceMemory memory = nullptr, VkImageView view = nullptr, VkSampler sampler = nullptr);
+	Image(VulkanCore* core = nullptr, VkImage image = nullptr, Allocation memory = Allocation(), VkImageView view = nullptr, VkSampler sampler = nullptr);
 
 	void destroy();
 
@@ -79,7 +85,7 @@ public:
 	void createSampler(VkSamplerCreateInfo& samplerInfo);
 	
 	VkImage			image;		//!< Image object
-	VkDeviceMemory	memory;		//!< Device memory object
+	Allocation		memory;		//!< Device memory (range of a memory block)
 	VkImageView		view;		//!< References a part of the image to be used (subset of its pixels). Required for being able to access it (images are accessed through image views rather than directly).
 	VkSampler		sampler;	//!< Sampler object (it applies filtering and transformations to an image). It is a distinct object that provides an interface to extract colors from an image. It can be applied to any image you want(1D, 2D or 3D).
 
@@ -87,7 +93,7 @@ private:
 	VulkanCore* c;
 };
 
-/// Creates swap-chain and its images.
+/// Creates swap-chain and its images. In headless mode (VulkanCore::headless), there's no swap chain: the final images are offscreen images that can be read back (see Renderer::readImage()).
 class SwapChain
 {
 public:
@@ -98,18 +104,24 @@ public:
 	size_t numImages();
 	static SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device, VkSurfaceKHR surface);
 
-	VkSwapchainKHR								swapChain;		//!< Swap chain object.
+	VkSwapchainKHR								swapChain;		//!< Swap chain object (VK_NULL_HANDLE in headless mode).
 	std::vector<VkImage>						images;			//!< List. Opaque handle to an image object.
 	std::vector<VkImageView>					views;			//!< List. Opaque handle to an image view object. It allows to use VkImage in the render pipeline. It's a view into an image; it describes how to access the image and which part of the image to access.
+	std::vector<Allocation>						memories;		//!< List. Memory of the offscreen images (headless mode only; swap chain images belong to the swap chain).
 
 	VkFormat									imageFormat;	//!< VK_FORMAT_B8G8R8A8_SRGB
 	VkExtent2D									extent;
+	VkImageLayout								finalLayout;	//!< Layout of the images after the last render pass: VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, or VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL in headless mode (ready for being read back).
+	LatencyTarget								latencyTarget;	//!< Used for choosing the present mode when creating the swap chain (default: ltLow).
+	VkPresentModeKHR							presentMode;	//!< Present mode of the current swap chain.
 
 private:
 	VulkanCore& c;
 
+	void createOffscreenImages();   //!< Headless mode: create images like the swap chain ones (same format, and window size).
+
 	VkSurfaceFormatKHR chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& availableFormats);
-	VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes);
+	VkPresentModeKHR chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes);   //!< From latencyTarget (see FramePacer::choosePresentMode()).
 	VkExtent2D chooseSwapExtent(IOmanager& io, const VkSurfaceCapabilitiesKHR& capabilities);
 
 	const uint32_t additionalSwapChainImages;
@@ -142,11 +154,14 @@ struct DeviceData
 	VkSampleCountFlags framebufferDepthSampleCounts;	//!< Useful for getting max. number of MSAA
 	VkDeviceSize minUniformBufferOffsetAlignment;		//!< Useful for aligning dynamic descriptor sets (usually == 32 or 256)
 	VkDeviceSize minStorageBufferOffsetAlignment;
+	uint32_t maxDrawIndirectCount;						//!< Max. drawCount of vkCmdDrawIndexedIndirect (1 if multiDrawIndirect is not supported)
 
 	// Features (redundant)
 	VkBool32 samplerAnisotropy;							//!< Does physical device supports Anisotropic Filtering (AF)?
 	VkBool32 largePoints;
 	VkBool32 wideLines;
+	VkBool32 multiDrawIndirect;							//!< Can a vkCmdDrawIndexedIndirect call issue many draws? (used for drawing meshlets)
+	VkBool32 drawIndirectCount;							//!< Is vkCmdDrawIndexedIndirectCount supported? (Vulkan 1.2; used by GPU culling)
 
 	// Others
 	VkFormat depthFormat;
@@ -181,26 +196,29 @@ private:
 class Extensions
 {
 public:
-	std::vector<const char*> getRequiredExtensions_device();   //!< Required device extensions. Used for creating logical device. Swap chain: Queue of images that are waiting to be presented to the screen. Our application will acquire such an image to draw to it, and then return it to the queue. Its general purpose is to synchronize the presentation of images with the refresh rate of the screen.
-	bool checkDeviceExtensionSupport(VkPhysicalDevice device);   // Check if device extensions are supported. Used for evaluating device. 
+	std::vector<const char*> getRequiredExtensions_device(bool swapChain = true);   //!< Required device extensions (no swap chain in headless mode). Used for creating logical device. Swap chain: Queue of images that are waiting to be presented to the screen. Our application will acquire such an image to draw to it, and then return it to the queue. Its general purpose is to synchronize the presentation of images with the refresh rate of the screen.
+	bool checkDeviceExtensionSupport(VkPhysicalDevice device, bool swapChain = true);   // Check if device extensions are supported. Used for evaluating device. 
 
-	std::vector<const char*> getRequiredExtensions_glfw_valLayers();   // Required GLFW (and Validation layers) extensions. Used for creating Vulkan instance. 
+	std::vector<const char*> getRequiredExtensions_glfw_valLayers(bool window = true);   // Required GLFW (and Validation layers) extensions. Used for creating Vulkan instance. No GLFW extensions in headless mode.
 	bool checkExtensionSupport(const char* const* requiredExtensions, uint32_t reqExtCount);   // Check if extensions (for GLFW and Validation layers) are supported. For creating Vulkan instance. 
 };
 
-/// Builds and keeps core elements: Instance, Surface, Physical device, Logical device, Queues.
+/// Builds and keeps core elements: Instance, Surface, Physical device, Logical device, Queues. In headless mode, there's no window nor surface (useful for rendering without display, like in CI or with a software Vulkan driver).
 class VulkanCore
 {
 public:
-	VulkanCore(int width, int height);
+	VulkanCore(int width, int height, bool headless = false);
+
+	const bool headless;							//!< No window, surface, nor swap chain. The present queue is the graphics queue.
 
 	const bool add_MSAA = false;					//!< Shader MSAA (MultiSample AntiAliasing). 
 	const bool add_SS   = false;					//!< Sample shading. This can solve some problems from shader MSAA (example: only smoothens out edges of geometry but not the interior filling) (https://www.khronos.org/registry/vulkan/specs/1.0/html/vkspec.html#primsrast-sampleshading).
+	const bool useTransferQueue = true;			//!< Use a dedicated transfer queue family (if available) for uploading resources (see Uploader). Otherwise, uploads are submitted to the graphics queue.
 
 	IOmanager io;
 
 	VkInstance					instance;			//!< Opaque handle to an instance object. There is no global state in Vulkan and all per-application state is stored here.
-	VkSurfaceKHR				surface;			//!< Opaque handle to a surface object (abstract type of surface to present rendered images to)
+	VkSurfaceKHR				surface;			//!< Opaque handle to a surface object (abstract type of surface to present rendered images to). VK_NULL_HANDLE in headless mode.
 
 	VkPhysicalDevice			physicalDevice;		//!< Opaque handle to a physical device object.
 	VkDevice					device;				//!< Opaque handle to a logical device object.
@@ -209,17 +227,19 @@ public:
 
 	VkQueue						graphicsQueue;		//!< Opaque handle to a queue object (computer graphics).
 	VkQueue						presentQueue;		//!< Opaque handle to a queue object (presentation to window surface).
+	VkQueue						transferQueue;		//!< Opaque handle to a queue object (dedicated transfer queue). VK_NULL_HANDLE if there's no dedicated transfer family (or useTransferQueue == false). Only used by Uploader.
 
-	int memAllocObjects;							//!< Number of memory allocated objects (must be <= maxMemoryAllocationCount). Incremented each vkAllocateMemory call; decremented each vkFreeMemory call. Increments when creating an image or buffer; decrements when destroyed.
+	int memAllocObjects;							//!< Number of memory allocated objects (must be <= maxMemoryAllocationCount). Incremented each vkAllocateMemory call; decremented each vkFreeMemory call. Since buffers and images are sub-allocated (see allocator), it counts memory blocks.
+	MemoryAllocator allocator;						//!< Sub-allocates memory for buffers and images from big memory blocks.
 
 	void queueWaitIdle(VkQueue queue, std::mutex* waitMutex);
 	QueueFamilyIndices findQueueFamilies(VkPhysicalDevice device);
 	void destroy();
 
-	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory);   //!< Creates a Vulkan buffer (VkBuffer and VkDeviceMemory).Used as friend in modelData, UBO and Texture.
-	void destroyBuffer(VkDevice device, VkBuffer buffer, VkDeviceMemory memory);
+	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, Allocation& bufferMemory);   //!< Creates a Vulkan buffer (VkBuffer and its memory, taken from the allocator). If memory is host visible, it's already mapped (Allocation::mapped). Used as friend in modelData, UBO and Texture.
+	void destroyBuffer(VkDevice device, VkBuffer buffer, Allocation& memory);
 
-	void createImage(VkImage& destImage, VkDeviceMemory& destMemory, uint32_t width, uint32_t height, uint32_t mipLevels, VkSampleCountFlagBits numSamples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties);
+	void createImage(VkImage& destImage, Allocation& destMemory, uint32_t width, uint32_t height, uint32_t mipLevels, VkSampleCountFlagBits numSamples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties);
 	void createImageView(VkImageView& destImageView, VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32_t mipLevels);
 	void createSampler(VkSampler& destSampler, VkSamplerCreateInfo& samplerInfo);
 	void destroyImage(Image* image);
@@ -285,8 +305,8 @@ public:
 	std::vector<std::mutex> mutCommandPool;   //!< [frame]. Prevents a command pool from being used in 2 threads simultaneously (vkFreeCommandBuffers, vkAllocateCommandBuffers).
 	std::vector<std::mutex> mutFrame;   //!< [frame]. Prevents 2 threads from drawing (acquire-update-submit-present) for the same frame.
 
-	bool updateCommandBuffer;
 	size_t commandsCount;				//!< Number of drawing commands sent to the command buffer. For debugging purposes.
+	GpuTimestamps timestamps;			//!< GPU zones (culling and render passes) of each frame. Collected by Renderer::drawFrame() into its profiler.
 
 	/*
 		@brief Allocates command buffers and record drawing commands in them.
@@ -309,18 +329,29 @@ public:
 			<li>https://www.reddit.com/r/vulkan/comments/hhoktq/rendering_multiple_objects/ </li>
 		</ul>
 	*/
-	void updateCommandBuffers(ModelsManager& models, std::shared_ptr<RenderPipeline> renderPipeline, size_t swapChainImagesCount, size_t frameIndex);
+	void updateCommandBuffers(ModelsManager& models, std::shared_ptr<RenderPipeline> renderPipeline, size_t swapChainImagesCount, size_t frameIndex);   //!< Caller must hold the models mutex (LoadingWorker::mutModels) while the loading thread is running.
+	size_t flagUpdate();   //!< Mark the command buffers of all frames as outdated (model constructed/deleted, number of instances changed, swapchain recreated...). Each frame re-records them the next time it's drawn. Returns the number of this update (see isRetired()). Thread-safe.
+	bool isOutdated(size_t frameIndex);   //!< True if the command buffers of this frame must be re-recorded before being submitted again.
+	bool isRetired(size_t update);   //!< True if every frame re-recorded its command buffers after this update (flagUpdate()) and its last submission finished, so resources removed before the update are no longer used by the GPU. Call it from the thread that records and submits frames.
+	void setRecordingThreads(unsigned numThreads);   //!< Threads used by updateCommandBuffers(). If > 1, the models of each subpass are split into chunks that are recorded in parallel into secondary command buffers (one command pool per thread and frame), which are then executed from the primary ones. If 1 (default), draw commands are recorded inline in the primary command buffers.
 	void createCommandPool(size_t numFrames);   //!< Commands in Vulkan (drawing, memory transfers, etc.) are not executed directly using function calls, you have to record all of the operations you want to perform in command buffer objects. After setting up the drawing commands, just tell Vulkan to execute them in the main loop.
 	void createCommandBuffers(size_t numSwapChainImages, size_t numFrames);
 	uint32_t getNextFrame();   //!< Increment currentFrame by one, but loop around when reaching "maxFramesInFlight".
 	size_t numFrames();
 
-	// Single time commands
+	// Single time commands (each one is submitted in its own command buffer and waited for)
 	void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels);
 	void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
 	void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height);
+	void copyImageToBuffer(VkImage image, VkImageLayout layout, VkBuffer buffer, uint32_t width, uint32_t height);   //!< Copy a color image (rendered, in "layout") into a buffer (tightly packed).
 	void generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels);
 
+	// Record the same commands in a command buffer that is being recorded (used by Uploader for batching transfers)
+	void transitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels);
+	void copyBuffer(VkCommandBuffer commandBuffer, VkBuffer srcBuffer, VkDeviceSize srcOffset, VkBuffer dstBuffer, VkDeviceSize dstOffset, VkDeviceSize size);
+	void copyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer buffer, VkDeviceSize bufferOffset, VkImage image, uint32_t width, uint32_t height);
+	void generateMipmaps(VkCommandBuffer commandBuffer, VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels);
+
 	// Cleanup
 	void freeCommandBuffers();
 	void destroyCommandPool();
@@ -334,6 +365,33 @@ private:
 	const size_t maxFramesInFlight;
 	std::mutex mutGetNextFrame;
 
+	std::atomic<size_t> updatesCount;   //!< Incremented each time command buffers become outdated (see flagUpdate()).
+	std::vector<size_t> recordedUpdates;   //!< [frame]. Value of updatesCount when commandBuffers[frame] were recorded for the last time.
+
+	/// Chunk of models of a subpass, recorded in a secondary command buffer.
+	struct RecordingTask
+	{
+		size_t image, renderPass, subpass;
+		size_t begin, end;   //!< Range of keys in ModelsManager::keys[renderPass][subpass]
+		size_t commandsCount;
+	};
+
+	unsigned recordingThreads;   //!< Threads used for recording command buffers. If > 1, secondary command buffers are used.
+	std::unique_ptr<JobPool> recordingPool;   //!< Persistent recording workers (recordingThreads - 1). Created by the recording thread when recordingThreads changes.
+	const size_t minKeysPerTask = 64;   //!< Minimum number of models per secondary command buffer (avoids many tiny command buffers).
+	std::vector<std::vector<VkCommandPool>> secondaryPools;   //!< [frame][thread]. Pools for secondary command buffers. Each recording thread uses its own.
+	std::vector<std::vector<std::vector<VkCommandBuffer>>> secondaryCommandBuffers;   //!< [frame][thread][CB]. Allocated from secondaryPools. Reused after resetting the pools.
+
+	std::vector<VkBuffer> indirectBuffers;   //!< [frame]. Host visible buffer with the VkDrawIndexedIndirectCommand of the meshlets of each model (all of them are drawn with one vkCmdDrawIndexedIndirect).
+	std::vector<Allocation> indirectMemory;   //!< [frame]. Persistently mapped.
+	std::vector<uint32_t> indirectCapacity;   //!< [frame]. Max. number of commands in indirectBuffers[frame].
+	std::vector<std::atomic<uint32_t>> indirectCount;   //!< [frame]. Commands written in indirectBuffers[frame] (recording threads reserve ranges with fetch_add).
+
+	void reserveIndirectCommands(ModelsManager& models, size_t numCommandBuffers, size_t frameIndex);   //!< Make sure indirectBuffers[frame] fits the meshlets of all models for all the command buffers of the frame, and reset indirectCount[frame].
+	void destroyIndirectBuffers();
+	size_t recordModels(VkCommandBuffer commandBuffer, ModelsManager& models, const std::vector<key64>& keys, size_t begin, size_t end, size_t imageIndex, size_t frameIndex, VkExtent2D extent);   //!< Record draw commands for keys[begin, end), with viewport and scissor covering "extent" (render area). Consecutive models skip the bindings (pipeline, vertex/index buffers) they share with the previous one. Returns number of draw commands.
+	void recordSecondaryCommandBuffers(ModelsManager& models, std::shared_ptr<RenderPipeline> renderPipeline, size_t swapChainImagesCount, size_t frameIndex, std::vector<RecordingTask>& tasks, std::vector<VkCommandBuffer>& secondaries);   //!< Split keys into tasks and record them in parallel. Tasks are sorted by swapchain image, render pass, and subpass.
+
 	void createSynchronizers(size_t numSwapchainImages, size_t numFrames);   //!< Create semaphores and fences for synchronizing the events occuring in each frame (drawFrame()).
 	VkCommandBuffer	beginSingleTimeCommands(uint32_t frameIndex);
 	void endSingleTimeCommands(uint32_t frameIndex, VkCommandBuffer commandBuffer);// <<< commandBuffer as argument?
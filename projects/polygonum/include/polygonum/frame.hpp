@@ -0,0 +1,82 @@
+#ifndef FRAME_HPP
+#define FRAME_HPP
+
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+#include "polygonum/ubo.hpp"
+#include "polygonum/toolkit.hpp"
+
+/*
+	Pipelined frames (Renderer::setPipelined()):
+		- The main thread runs the simulation (events, timer, user update) one frame ahead of the render thread. At the end of each update, it captures what the render thread needs in a FramePacket: the modified bytes of each buffer (BindingBuffer::takeModified()), the instance counts set with Renderer::setInstances(), and the culling frustum.
+		- The render thread takes the packet, applies it (buffers' frame data, instance counts, frustum), and then only uploads, records (if outdated) and submits. It never reads data that the user update is writing.
+		- Packets are recycled (FramePipeline keeps depth + 1 of them), so no memory is allocated per frame once their vectors have grown.
+*/
+
+// Prototypes ----------
+
+struct FramePacket;
+class FramePipeline;
+
+// Definitions ----------
+
+/// Immutable (once published) data of a frame, produced by the user update and consumed by the render thread.
+struct FramePacket
+{
+	/// Modified range of a buffer. Its bytes are stored in FramePacket::data.
+	struct BufferUpdate
+	{
+		key64 model;			//!< Owner of the buffer (0: global buffer). The update is dropped if the model was deleted.
+		BindingBuffer* buffer;
+		uint32_t offset;		//!< First byte modified.
+		uint32_t bytes;			//!< Bytes modified.
+		uint32_t size;			//!< BindingBuffer::getSize()
+		size_t dataOffset;		//!< Position of the bytes in FramePacket::data.
+	};
+
+	std::vector<BufferUpdate> buffers;
+	std::vector<uint8_t> data;								//!< Bytes of all buffer updates.
+	std::vector<std::pair<key64, uint32_t>> instances;		//!< Instance counts set with Renderer::setInstances() (in order).
+	Frustum frustum;										//!< Culling frustum (CullingManager::setFrustum()).
+
+	void clear();   //!< Keeps the capacity of the vectors.
+	void addBuffer(key64 model, BindingBuffer& buffer);   //!< Capture the modified range of a buffer (if any).
+};
+
+/**
+	@brief Queue of frame packets between one producer (user update) and one consumer (render thread). Thread-safe.
+
+	The producer can be up to "depth" frames ahead of the consumer. beginPacket() blocks (up to a timeout) while all packets are in use, and acquire() blocks until a packet is published. stop() unblocks both.
+*/
+class FramePipeline
+{
+	std::vector<FramePacket> packets;
+	std::vector<FramePacket*> freePackets;		//!< Packets ready to be filled.
+	std::vector<FramePacket*> readyPackets;		//!< Published packets (oldest first).
+	FramePacket* writing;						//!< Packet being filled by the producer.
+	FramePacket* reading;						//!< Packet being applied by the consumer.
+
+	std::mutex mutPackets;
+	std::condition_variable condPackets;		//!< Notified when a packet is published or released, or the pipeline stops.
+	bool stopped;
+
+public:
+	FramePipeline(size_t depth = 1);
+
+	// Producer
+	FramePacket* beginPacket(std::chrono::milliseconds timeout);	//!< Get an empty packet. Waits while all of them are in use. nullptr if stopped or timed out.
+	void publish();					//!< Make the packet from beginPacket() available to the consumer.
+
+	// Consumer
+	FramePacket* acquire();			//!< Get the oldest published packet. Waits until there's one. nullptr if stopped.
+	void release();					//!< Return the packet from acquire() to the producer.
+
+	void stop();					//!< Wake up and stop the producer and the consumer.
+	void reset();					//!< Drop all packets and restart. Call it while neither producer nor consumer use the pipeline.
+	bool isStopped();
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef GEOMETRY_HPP
+#define GEOMETRY_HPP
+
+#include <map>
+
+#include "polygonum/uploader.hpp"
+#include "polygonum/vertex.hpp"
+
+/*
+	Small meshes (props, vegetation...) can share big vertex and index buffers (opt-in: ModelDataInfo::useGeometryArena):
+		- Fewer buffers and allocations (one pair of buffers per page instead of one pair per model).
+		- Consecutive draws of models in the same page don't rebind vertex and index buffers.
+	Each mesh gets a range of vertices and indices of a page, and is drawn with firstIndex and vertexOffset (indices are relative to the mesh).
+	Freed ranges are not reused (and empty pages not destroyed) until no frame in flight or cached command buffer can use them (see releasePending()).
+*/
+
+// Prototypes ----------
+
+class GeometryArena;
+
+// Definitions ----------
+
+/**
+	@brief Stores the vertices and indices of many meshes in shared vertex and index buffers.
+
+	There are pages (pair of vertex and index buffers) for each vertex size. Each page keeps a list of free ranges of vertices and indices (first fit, coalesced when freed).
+	Meshes bigger than a page get a dedicated page. Indices are stored as uint32. Thread-safe.
+*/
+class GeometryArena
+{
+	/// Pair of vertex and index buffers shared by many meshes with the same vertex size.
+	struct Page
+	{
+		uint32_t vertexSize;
+		uint32_t vertexCapacity;
+		uint32_t indexCapacity;
+
+		VkBuffer vertexBuffer;
+		Allocation vertexMemory;
+		VkBuffer indexBuffer;
+		Allocation indexMemory;
+
+		std::map<uint32_t, uint32_t> freeVertices;   //!< <first, count> of each free range of vertices, sorted by first vertex.
+		std::map<uint32_t, uint32_t> freeIndices;   //!< <first, count> of each free range of indices, sorted by first index.
+		size_t meshes;   //!< Number of meshes stored (including the freed ones that are still pending).
+	};
+
+	/// Ranges of a freed mesh, waiting for the GPU to stop using them.
+	struct PendingFree
+	{
+		size_t update;   //!< Commander::flagUpdate() done when it was freed.
+		uint32_t page;
+		uint32_t firstVertex, vertexCount;
+		uint32_t firstIndex, indexCount;
+	};
+
+	VulkanCore& c;
+	Commander& commander;
+	Uploader& uploader;
+	std::vector<Page> pages;   //!< Pages are never erased (VertexData::arenaPage is an index), but empty pages release their buffers.
+	std::vector<PendingFree> pendingFrees;   //!< Freed meshes (oldest first).
+	std::mutex mutArena;
+
+	bool allocateRange(std::map<uint32_t, uint32_t>& freeRanges, uint32_t count, uint32_t& first);
+	void freeRange(std::map<uint32_t, uint32_t>& freeRanges, uint32_t first, uint32_t count);
+	uint32_t createPage(uint32_t vertexSize, uint32_t minVertices, uint32_t minIndices);   //!< Returns index of the page.
+	void destroyPage(Page& page);
+	void releaseMesh(const PendingFree& mesh);   //!< Give back the ranges of a mesh, and release its page if empty.
+
+public:
+	GeometryArena(VulkanCore& core, Commander& commander, Uploader& uploader);
+
+	const uint32_t verticesPerPage = 1024 * 1024;	//!< Vertex capacity of each page (the buffer size depends on the vertex size).
+	const uint32_t indicesPerPage = 3 * 1024 * 1024;	//!< Index capacity of each page (12 MB).
+
+	void allocate(const VertexSet& vertices, const std::vector<uint32_t>& indices, VertexData& result);   //!< Upload a mesh into a page and fill "result" (buffers, firstVertex, firstIndex, arenaPage...).
+	void free(VertexData& data);   //!< Give back the ranges of a mesh. They're reused once releasePending() finds that no frame uses them. Thread-safe.
+	void releasePending(bool all = false);   //!< Reuse the ranges of freed meshes that no frame uses anymore (all of them if "all", e.g., when the device is idle). Call it from the render loop.
+	void destroy();   //!< Destroy all pages. Call it before destroying the logical device.
+};
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef INPUT_HPP
 #define INPUT_HPP
 
+#include <atomic>
+
 #include "polygonum/commons.hpp"
 
 
@@ -9,18 +11,23 @@
 	This holds input callbacks and serves as windowUserPointer (pointer accessible from callbacks). 
 	Each window has a windowUserPointer, which can be used for any purpose, and GLFW will not modify 
 	it throughout the life-time of the window.
+	In headless mode, no window is created (GLFW is not initialized): the framebuffer size is the one passed to the constructor, no key or button is ever pressed, and the window only closes with setWindowShouldClose().
+	GLFW functions must be called from the main thread. getFramebufferSize(), getWindowShouldClose() and framebufferResized can also be used by the render thread (pipelined mode).
 */
 class IOmanager
 {
 	void initWindow(int width, int height);
 	void setCallbacks();
 	float YscrollOffset = 0;     //!< Set in a callback (windowUserPointer)
+	std::atomic<int> width, height;		//!< Framebuffer size (updated by framebufferResizeCallback)
+	std::atomic<bool> shouldClose;		//!< Headless mode
 
 public:
-	IOmanager(int width, int height);
+	IOmanager(int width, int height, bool headless = false);
 	~IOmanager();
 
-	GLFWwindow* window;				//!< Opaque window object.
+	GLFWwindow* window;				//!< Opaque window object (nullptr in headless mode).
+	bool isHeadless() const;
 
 	// Output (window)
 	void createWindowSurface(VkInstance instance, VkAllocationCallbacks* allocator, VkSurfaceKHR* surface);
@@ -44,7 +51,7 @@ public:
 	float getYscrollOffset();			//!< Get YscrollOffset value and reset it (set to 0).
 	static void mouseScroll_callback(GLFWwindow* window, double xoffset, double yoffset);	//!< Callback for mouse scroll (called when mouse is scrolled).
 	static void framebufferResizeCallback(GLFWwindow* window, int width, int height);		//!< Callback for window resizing (called when window is resized).
-	bool framebufferResized = false;	//!< Many drivers/platforms trigger VK_ERROR_OUT_OF_DATE_KHR after window resize, but it's not guaranteed. This variable handles resizes explicitly.
+	std::atomic<bool> framebufferResized{ false };	//!< Many drivers/platforms trigger VK_ERROR_OUT_OF_DATE_KHR after window resize, but it's not guaranteed. This variable handles resizes explicitly.
 };
 
 #endif
\ No newline at end of file
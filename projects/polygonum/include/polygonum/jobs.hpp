@@ -0,0 +1,68 @@
+#ifndef JOBS_HPP
+#define JOBS_HPP
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <exception>
+
+/*
+	Work-stealing thread pool for CPU jobs (ECS systems, parallel loops...):
+		- Each worker has its own queue. It runs the newest job of its queue (LIFO: hot cache), or steals the oldest job of another queue when empty.
+		- Jobs are grouped by counters (incremented when submitted, decremented when finished). wait() runs pending jobs while the counter is not zero, so jobs can submit and wait for other jobs without blocking workers. When there are none left to run, it sleeps until a job finishes.
+*/
+
+// Prototypes ----------
+
+class JobPool;
+
+// Definitions ----------
+
+/// Pool of worker threads with one job queue each (work stealing). Thread-safe.
+class JobPool
+{
+	struct Job
+	{
+		std::function<void()> function;
+		std::atomic<size_t>* counter;
+	};
+
+	/// Jobs submitted by one thread. The owner pops from the back; other threads steal from the front.
+	struct Queue
+	{
+		std::deque<Job> jobs;
+		std::mutex mutQueue;
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues;   //!< One per worker, plus one (the last) for jobs submitted by other threads.
+	std::vector<std::thread> threads;
+	std::atomic<size_t> pendingJobs;   //!< Jobs in the queues (not running).
+
+	std::mutex mutSleep;
+	std::condition_variable condJobs;   //!< Notified when a job is submitted or the pool stops.
+	std::condition_variable condDone;   //!< Notified when a job finishes (wakes up wait()).
+	bool stop;
+
+	std::exception_ptr exception;   //!< First exception thrown by a job (rethrown by wait()).
+	std::mutex mutException;
+
+	size_t getQueueIndex() const;   //!< Queue of the calling thread.
+	bool runJob(size_t queueIndex);   //!< Run a job from this queue, or steal one. Returns false if there were no jobs.
+	void worker(size_t queueIndex);
+
+public:
+	JobPool(unsigned numThreads = 0);   //!< Threads running jobs, including the one that waits (0: hardware concurrency). Creates numThreads - 1 workers.
+	~JobPool();
+
+	void submit(std::function<void()> job, std::atomic<size_t>& counter);   //!< Queue a job. "counter" is incremented now and decremented when the job finishes.
+	void wait(std::atomic<size_t>& counter);   //!< Run jobs until "counter" is zero. Rethrows the exception thrown by a job, if any.
+	void parallelFor(size_t count, size_t grainSize, const std::function<void(size_t begin, size_t end)>& function);   //!< Split [0, count) in ranges of up to grainSize elements, run them in parallel, and wait for them.
+	unsigned getNumThreads() const;   //!< Number of workers.
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+#include <map>
+#include <mutex>
+
+#include "polygonum/commons.hpp"
+
+/*
+	Device memory is allocated in big blocks (VkDeviceMemory) that are split among buffers and images:
+		- The number of vkAllocateMemory calls is limited (maxMemoryAllocationCount, usually 4096).
+		- Each vkAllocateMemory call is slow, which penalizes streaming resources.
+*/
+
+// Forward declarations ----------
+
+class VulkanCore;
+
+// Prototypes ----------
+
+struct Allocation;
+struct MemoryStats;
+class MemoryAllocator;
+
+// Definitions ----------
+
+/// Range of a memory block (VkDeviceMemory) assigned to a buffer or an image. Get it from MemoryAllocator.
+struct Allocation
+{
+	Allocation();
+
+	VkDeviceMemory	memory;		//!< Memory block (shared with other allocations). Resources are bound to it at "offset".
+	VkDeviceSize	offset;		//!< Offset (bytes) of this allocation in the memory block.
+	VkDeviceSize	size;		//!< Size (bytes) of this allocation.
+	uint8_t*		mapped;		//!< Host pointer to this allocation. Only for host-visible memory (these blocks are persistently mapped); otherwise, nullptr.
+	uint32_t		poolIndex;	//!< Pool the memory block belongs to. Used by MemoryAllocator.
+
+	bool isValid() const;
+};
+
+/// Memory usage statistics of a MemoryAllocator. Useful for checking fragmentation.
+struct MemoryStats
+{
+	MemoryStats();
+
+	size_t blocks;					//!< Number of memory blocks (VkDeviceMemory).
+	size_t allocations;				//!< Number of live allocations.
+	VkDeviceSize blockBytes;		//!< Bytes allocated from the device (sum of all blocks).
+	VkDeviceSize usedBytes;			//!< Bytes used by allocations.
+	size_t freeRanges;				//!< Number of free ranges (more ranges means more fragmentation).
+	VkDeviceSize largestFreeRange;	//!< Bytes of the largest free range.
+
+	float fragmentation() const;	//!< 0 if all the free memory of each block is contiguous, close to 1 if it's split into many small ranges (1 - largestFreeRange / freeBytes).
+	void print() const;
+};
+
+/**
+	@brief Sub-allocates buffers and images from big device memory blocks.
+
+	There is one pool of blocks per memory type and resource kind (buffers and linear images, or optimal images). Both kinds are kept apart so bufferImageGranularity doesn't need to be considered.
+	Each block keeps a list of free ranges. Allocations take the first free range that fits (taking alignment into account), and freed ranges are coalesced with their neighbours.
+	Resources bigger than the block size get a dedicated block. Blocks of host-visible memory types are mapped once and kept mapped (even if the resource didn't ask for host-visible memory, since the pool is shared). Thread-safe.
+*/
+class MemoryAllocator
+{
+	/// Memory block (VkDeviceMemory) split into allocations.
+	struct Block
+	{
+		VkDeviceMemory memory;
+		VkDeviceSize size;
+		uint8_t* mapped;									//!< Host pointer to the whole block (if it's host visible).
+		std::map<VkDeviceSize, VkDeviceSize> freeRanges;	//!< <offset, size> of each free range, sorted by offset.
+		size_t allocations;									//!< Number of live allocations in this block.
+		bool dedicated;										//!< Block created for a single resource bigger than the block size.
+	};
+
+	VulkanCore& c;
+	std::vector<std::vector<Block>> pools;		//!< [memoryType * 2 + (linear ? 1 : 0)][block]
+	VkPhysicalDeviceMemoryProperties memProperties;	//!< Property flags of each memory type (read on the first block creation).
+	std::mutex mutAlloc;
+
+	bool allocateFromBlock(Block& block, VkDeviceSize size, VkDeviceSize alignment, Allocation& result);
+	void freeBlock(Block& block);
+
+public:
+	MemoryAllocator(VulkanCore& core);
+
+	const VkDeviceSize deviceBlockSize = 64 * 1024 * 1024;	//!< Size of device-local blocks (64 MB).
+	const VkDeviceSize hostBlockSize = 16 * 1024 * 1024;	//!< Size of host-visible blocks (16 MB).
+
+	Allocation allocate(const VkMemoryRequirements& requirements, uint32_t memoryType, VkMemoryPropertyFlags properties, bool linear);   //!< Get memory for a buffer or image (linear == true for buffers and linear images). Throws if it cannot allocate.
+	void free(Allocation& allocation);   //!< Give back the range of an allocation. Empty blocks are freed (except one per pool, kept for reuse).
+	MemoryStats getStats();
+	void destroy();   //!< Free all blocks. Call it before destroying the logical device.
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include "polygonum/bindings.hpp"   // buffers & textures
 #include "polygonum/vertex.hpp"
 #include "polygonum/shader.hpp"
+#include "polygonum/culling.hpp"
 
 #include <unordered_set>
 
@@ -43,6 +44,9 @@ struct ModelDataInfo
 	uint32_t renderPassIndex;				//!< 0 (geometry pass), 1 (lighting pass), 2 (forward pass), 3 (postprocessing pass)
 	uint32_t subpassIndex;
 	VkCullModeFlagBits cullMode;
+	float loadPriority;						//!< Models with lower values are loaded first (e.g., distance to camera). Default: 0.
+	bool useGeometryArena;					//!< Store vertices and indices in the shared buffers of Renderer::arena (good for many small meshes). Default: false.
+	bool gpuCulling;						//!< Cull instances in the GPU against Renderer::culling's frustum (see culling.hpp). Requires indices and maxNumInstances. Default: false.
 };
 
 /**
@@ -64,9 +68,16 @@ class ModelData
 	/// Layout for the descriptor set (descriptor: handle or pointer into a resource (buffer, sampler, texture...))
 	void createDescriptorSetLayout();
 
-	/// Create the graphics pipeline (sequence of operations that take the vertices and textures of your meshes all the way to the pixels in the render targets).
+	/// Get the graphics pipeline (sequence of operations that take the vertices and textures of your meshes all the way to the pixels in the render targets) from Renderer::pipelines. It's created only if no other model has the same pipeline state.
 	void createGraphicsPipeline();
 
+	/// Create a graphics pipeline and its layout (used by createGraphicsPipeline() when the pipeline is not in Renderer::pipelines).
+	void buildGraphicsPipeline(VkPipelineCache pipelineCache, VkPipeline& pipeline, VkPipelineLayout& layout);
+
+	std::string getPipelineKey();   //!< Describes the pipeline state (shaders, vertex type, topology, culling, transparency, render pass/subpass, descriptor set layouts). Models with the same key share a pipeline.
+	std::string setLayoutsKey;   //!< Description of the descriptor set layouts (set by createDescriptorSetLayout()). Part of the pipeline key.
+	std::string pipelineKey;   //!< Key of the pipeline in use (empty if none).
+
 	/// Descriptor pool creation (a descriptor set for each VkBuffer resource to bind it to the uniform buffer descriptor).
 	void createDescriptorPool();
 
@@ -84,14 +95,16 @@ public:
 
 	void fullConstruction(Renderer &ren);   //!< Creates graphic pipeline and descriptor sets, and loads data for creating buffers (vertex, indices, textures). Useful in a second thread
 
-	void cleanup_pipeline_and_descriptors();   //!< Destroys graphic pipeline and descriptor sets. Called by destructor, and for window resizing (by Renderer::recreateSwapChain()::cleanupSwapChain()).
-	void recreate_pipeline_and_descriptors();   //!< Creates graphic pipeline and descriptor sets. Called for window resizing (by Renderer::recreateSwapChain()).
+	void cleanup_pipeline_and_descriptors();   //!< Destroys graphic pipeline and descriptor sets. Called by destructor, and by Renderer::recreateSwapChain() if the swap chain format or number of images changed.
+	void recreate_pipeline_and_descriptors();   //!< Creates graphic pipeline and descriptor sets. Called by Renderer::recreateSwapChain() if the swap chain format or number of images changed.
+	void updateInputAttachments();   //!< Point the descriptor sets to the current input attachments (they are recreated when the window is resized). Called by Renderer::recreateSwapChain().
 
 	bool setNumInstances(uint32_t count);	//!< Set number of instances to render.
 	inline uint32_t getNumInstances() const;
+	VkPrimitiveTopology getTopology() const;
 
-	VkPipelineLayout				pipelineLayout;		//!< Pipeline layout. Allows to use uniform values in shaders (globals similar to dynamic state variables that can be changed at drawing time to alter the behavior of your shaders without having to recreate them).
-	VkPipeline						graphicsPipeline;	//!< Opaque handle to a pipeline object.
+	VkPipelineLayout				pipelineLayout;		//!< Pipeline layout (shared with models with the same pipeline state). Allows to use uniform values in shaders (globals similar to dynamic state variables that can be changed at drawing time to alter the behavior of your shaders without having to recreate them).
+	VkPipeline						graphicsPipeline;	//!< Opaque handle to a pipeline object (shared with models with the same pipeline state).
 
 	std::vector<std::shared_ptr<Shader>>  shaders;		//!< Vertex shader (0), Fragment shader (1)
 
@@ -101,6 +114,8 @@ public:
 	std::vector<VkDescriptorSetLayout> descriptorSetLayouts; //!< [set] Opaque handle to a descriptor set layout object (combines all of the descriptor bindings).
 	VkDescriptorPool				descriptorPool;	//!< [set] Opaque handle to a descriptor pool object.
 	vec2<VkDescriptorSet>			descriptorSets;		//!< [sc.img][set]. Opaque handle to a descriptor set object. One for each swap chain image.
+	bool							useGeometryArena;	//!< Vertices and indices are stored in Renderer::arena (see ModelDataInfo::useGeometryArena).
+	std::unique_ptr<InstanceCulling> culling;			//!< GPU culling data (bounds of each instance...). nullptr if not used (see ModelDataInfo::gpuCulling).
 
 	uint32_t						renderPassIndex;	//!< Index of the renderPass used (0 for rendering geometry, 1 for post processing)
 	uint32_t						subpassIndex;
@@ -108,6 +123,7 @@ public:
 
 	ResourcesLoader*				resLoader;			//!< Info used for loading resources (vertices, indices, shaders, textures). When resources are loaded, this is set to nullptr.
 	bool							fullyConstructed;	//!< Object fully constructed (i.e. model loaded into Vulkan).
+	uint64_t						uploadBatch;		//!< Last Uploader batch with transfers to its buffers. Waited for before freeing them.
 	bool							ready;				//!< Object ready for rendering (i.e., it's fully constructed and in Renderer::models)
 	std::string						name;				//!< For debugging purposes.
 };
@@ -125,6 +141,7 @@ public:
 	key64 newKey;
 
 	void create_pipelines_and_descriptors(std::mutex* waitMutex);
+	void updateInputAttachments(std::mutex* waitMutex);   //!< Update the input attachment descriptors of all the constructed models.
 	void cleanup_pipelines_and_descriptors(std::mutex* waitMutex);
 };
 
@@ -0,0 +1,72 @@
+#ifndef PACER_HPP
+#define PACER_HPP
+
+#include <chrono>
+#include <vector>
+
+#include "polygonum/commons.hpp"
+
+/*
+	Frame pacing:
+		- FramePacer::wait() is called at the beginning of each frame, before waiting for the frame's fence and acquiring the swap chain image (no locks held), so the user update and the acquired image are as recent as possible when the frame is submitted.
+		- Frames are scheduled at fixed deadlines (1/maxFPS apart). The pacer sleeps until shortly before the deadline (high resolution waitable timer on Windows, nanosleep elsewhere) and spin-waits the rest. The spin margin adapts to the oversleep observed.
+		- The present mode is chosen from a latency target (FramePacer::choosePresentMode()).
+		- Intervals between frames are recorded for jitter stats (FramePacer::getStats()).
+*/
+
+// Prototypes ----------
+
+struct PacingStats;
+class FramePacer;
+
+// Definitions ----------
+
+/// Present mode preference. Lower latency modes fall back to the next one if not supported (FIFO is always supported).
+enum LatencyTarget
+{
+	ltVsync,		//!< FIFO: No tearing. Up to one extra frame of latency (the presentation queue waits for vertical blank).
+	ltLow,			//!< MAILBOX (or FIFO): No tearing. The newest image replaces the queued one, so latency is low when rendering faster than the display.
+	ltLowest		//!< IMMEDIATE (or MAILBOX, or FIFO): Lowest latency. May tear.
+};
+
+/// Frame intervals (milliseconds) over some frames.
+struct PacingStats
+{
+	double avg = 0;
+	double jitter = 0;		//!< Standard deviation of the intervals.
+	double p99 = 0;			//!< 99th percentile
+	double max = 0;
+	size_t lateFrames = 0;	//!< Intervals longer than 1.5 target periods (missed deadlines). Only when FPS are capped.
+	size_t count = 0;		//!< Number of intervals.
+};
+
+/// Waits for the next frame's deadline (with maximum FPS) and records frame intervals. Used by a single thread (the render loop).
+class FramePacer
+{
+	typedef std::chrono::steady_clock Clock;
+
+	Clock::duration period;			//!< 0 if FPS are not capped.
+	Clock::time_point nextFrame;	//!< Deadline of the next frame.
+	Clock::time_point lastFrame;	//!< Last time wait() returned.
+	Clock::duration spinMargin;		//!< Time spin-waited before each deadline (sleep granularity). Adapted to the oversleep observed.
+	void* timer;					//!< Windows: high resolution waitable timer (HANDLE). Otherwise: nullptr.
+
+	std::vector<float> intervals;	//!< Ring buffer of frame intervals (ms).
+	size_t intervalsCount;			//!< Total number of intervals recorded.
+
+	void sleepUntil(Clock::time_point deadline);
+	void sleepFor(Clock::duration duration);   //!< OS sleep (may oversleep).
+
+public:
+	FramePacer(size_t capacity = 512);
+	~FramePacer();
+
+	void setMaxFPS(int maxFPS);		//!< 0: Uncapped.
+	int getMaxFPS() const;
+	void wait();					//!< Call it at the beginning of each frame. Sleeps until the frame's deadline. If it's late for more than a frame, the schedule restarts (instead of rushing frames to catch up).
+	PacingStats getStats(size_t frames = 120) const;   //!< Stats of the last "frames" intervals.
+
+	static VkPresentModeKHR choosePresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes, LatencyTarget target);
+};
+
+#endif
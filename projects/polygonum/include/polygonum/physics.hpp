@@ -56,6 +56,65 @@ public:
     void updateState(float deltaTime) override;
 };
 
+struct BindingBuffer;
+class JobPool;
+
+/// Batched floor height query. For each of the "count" positions (x[i], y[i], z[i]), write its floor height in heights[i] (Z in ParticleSystem::flat mode; distance to the nucleus in ParticleSystem::planet mode). Must be thread-safe if ParticleSystem::updateState() runs in a JobPool.
+typedef void(*FloorHeightsCallback)(const float* x, const float* y, const float* z, float* heights, size_t count);
+
+/**
+    @brief Container of many particles (debris, rain...) with the same semantics as Particle (flat mode) and PlanetParticle (planet mode), stored as SoA (one array per coordinate).
+
+    updateState() integrates them in batches of batchSize particles, with the widest SIMD type available (simd.hpp). For each batch, floor heights are taken from a single FloorHeightsCallback call, and new positions can be written straight into an instance buffer (setOutput()). Batches can be distributed among the threads of a JobPool.
+    Particles have a single (persistent) speed and no impulse speed. When a particle reaches the floor, it's placed on the floor (below its new position) and its speed is set to 0.
+*/
+class ParticleSystem
+{
+public:
+    enum Mode { flat, planet };
+
+    static constexpr size_t batchSize = 256;   //!< Particles per batch (floor heights query, job...).
+
+    ParticleSystem(float gValue = 9.8, glm::vec3 gDirection = glm::vec3(0,0,-1));   //!< Flat mode: Gravity acceleration towards gDirection.
+    ParticleSystem(float gValue, glm::vec3 nucleus, FloorHeightsCallback getFloorHeights);   //!< Planet mode: Gravity acceleration towards the nucleus.
+
+    size_t add(glm::vec3 position, glm::vec3 speed = glm::vec3(0,0,0));   //!< Returns the particle index.
+    void remove(size_t index);   //!< The last particle is moved to "index".
+    void clear();
+    void reserve(size_t count);
+    size_t size() const;
+
+    glm::vec3 getPos(size_t index) const;
+    glm::vec3 getSpeed(size_t index) const;
+    bool isOnFloor(size_t index) const;
+    void setPos(size_t index, glm::vec3 position);
+    void setSpeed(size_t index, glm::vec3 speed);
+    void setCallback(FloorHeightsCallback getFloorHeights);   //!< nullptr: No floor.
+
+    void setOutput(uint8_t* data, size_t stride);   //!< updateState() writes the position (3 floats) of particle i at data + i * stride. nullptr: No output.
+    void setOutput(BindingBuffer* buffer, size_t offset = 0);   //!< updateState() writes the position (3 floats) of particle i in the sub-descriptor i of "buffer" (plus "offset" bytes), flags it as modified, and sets its size to the number of particles. Particles beyond its sub-descriptors are simulated but not written.
+
+    void updateState(float deltaTime, JobPool* pool = nullptr);   //!< Integrate all particles. If a pool is provided, batches are processed in parallel.
+
+private:
+    Mode mode;
+    glm::vec3 gVec;   //!< g acceleration (flat mode)
+    glm::vec3 nucleus;   //!< Center of gravity (planet mode)
+    float g;   //!< g acceleration (magnitude)
+    FloorHeightsCallback getFloorHeights;
+
+    std::vector<float> posX, posY, posZ;
+    std::vector<float> speedX, speedY, speedZ;
+    std::vector<uint8_t> onFloor;
+
+    uint8_t* outData;
+    size_t outStride;
+    size_t outCount;   //!< Maximum number of positions written (sub-descriptors of outBuffer).
+    BindingBuffer* outBuffer;
+
+    void updateBatch(size_t begin, size_t end, float deltaTime);
+};
+
 
 // BulletPhysics ----------------------------------------------------------
 /*
@@ -95,7 +154,12 @@ public:
 
 // OTHERS --------------------------------------------------------
 
-/// Precompute all Optical Depth values through the atmosphere. Useful for creating a lookup table for atmosphere rendering.
+/**
+    @brief Precompute all Optical Depth values through the atmosphere. Useful for creating a lookup table for atmosphere rendering.
+
+    Table of heightSteps x angleSteps floats: Optical depth of a ray starting at some height over the surface and with some angle from the vertical. Rows (heights) are computed in parallel (JobPool), and angles with SIMD (simd.hpp).
+    Tables are cached on disk (keyed by the constructor parameters), so they're only computed the first time.
+*/
 class OpticalDepthTable
 {
     glm::vec3 planetCenter;
@@ -106,20 +170,21 @@ class OpticalDepthTable
     float angleStep;
     float densityFallOff;
 
-    float opticalDepth(glm::vec3 rayOrigin, glm::vec3 rayDir, float rayLength) const;
-    float densityAtPoint(glm::vec3 point) const;
-    glm::vec2 raySphere(glm::vec3 rayOrigin, glm::vec3 rayDir) const;
+    void computeRow(size_t row, const float* dirX, const float* dirY);   //!< Optical depths of a row (height) for all angles (ray directions dirX/dirY).
 
 public:
-    OpticalDepthTable(unsigned numOptDepthPoints, unsigned planetRadius, unsigned atmosphereRadius, float heightStep, float angleStep, float densityFallOff);
+    OpticalDepthTable(unsigned numOptDepthPoints, unsigned planetRadius, unsigned atmosphereRadius, float heightStep, float angleStep, float densityFallOff, JobPool* pool = nullptr);   //!< If no pool is provided, a temporary one is created (only if the table is not cached).
 
     std::vector<unsigned char> table;
     size_t heightSteps;
     size_t angleSteps;
     size_t bytes;
+
+    static std::string cacheDirectory;   //!< Directory of the tables' cache (shared with DensityVector). Empty if disabled.
+    static void setCacheDirectory(const std::string& directory);   //!< Directory where tables are cached between runs (default: "atmosphereCache"). Pass an empty string for disabling the cache.
 };
 
-/// Precompute all Density Values through the atmosphere. Useful for creating a lookup table for atmosphere rendering.
+/// Precompute all Density Values through the atmosphere. Useful for creating a lookup table for atmosphere rendering. Computed with SIMD (simd.hpp) and cached on disk like OpticalDepthTable.
 class DensityVector
 {
 public:
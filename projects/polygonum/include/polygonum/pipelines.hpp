@@ -0,0 +1,60 @@
+#ifndef PIPELINES_HPP
+#define PIPELINES_HPP
+
+#include <unordered_map>
+#include <functional>
+#include <condition_variable>
+
+#include "polygonum/environment.hpp"
+
+/*
+	Graphics pipelines are expensive to create (the driver compiles the shaders for the GPU). Two ways of reducing this cost:
+		- Pipeline cache (VkPipelineCache): The driver reuses previous compilations. It's saved to disk, so next runs start faster.
+		- Deduplication: Models with the same pipeline state (shaders, vertex type, topology, culling, transparency, render pass/subpass, descriptor set layouts) share one pipeline and pipeline layout.
+*/
+
+// Prototypes ----------
+
+class PipelineManager;
+
+// Definitions ----------
+
+/**
+	@brief Registry of graphics pipelines (and their layouts) shared between models, plus a persistent pipeline cache.
+
+	Each pipeline is identified by a key that describes its state (see ModelData::getPipelineKey()). The first model with a given key creates the pipeline; the next ones just get it. A pipeline is destroyed when no model uses it. Thread-safe.
+*/
+class PipelineManager
+{
+	/// Pipeline shared by all the models with the same key.
+	struct Entry
+	{
+		VkPipeline pipeline;
+		VkPipelineLayout layout;
+		size_t users;   //!< Number of models using it.
+		bool ready;   //!< The pipeline has been created (otherwise, a thread is creating it).
+	};
+
+	VulkanCore& c;
+	VkPipelineCache pipelineCache;
+	std::unordered_map<std::string, Entry> pipelines;   //!< <key, pipeline>
+	std::mutex mutPipelines;
+	std::condition_variable condReady;   //!< Notified when a pipeline has been created.
+
+	void createPipelineCache();   //!< Create the pipeline cache with the data saved in cacheFile (if any and compatible with this device).
+	bool isCompatible(const std::vector<char>& cacheData);   //!< Check the header of the cache data (vendor, device, and cache UUID must match this device's).
+
+public:
+	PipelineManager(VulkanCore& core);
+
+	const std::string cacheFile = "pipelineCache.bin";   //!< File where the pipeline cache is saved.
+
+	/// Get the pipeline and layout with this key. If it doesn't exist, it's created with "create" (which receives the pipeline cache). Call release() when no longer used.
+	void get(const std::string& key, VkPipeline& pipeline, VkPipelineLayout& layout, const std::function<void(VkPipelineCache, VkPipeline&, VkPipelineLayout&)>& create);
+	void release(const std::string& key);   //!< Stop using a pipeline. It's destroyed when no model uses it.
+	size_t size();   //!< Number of different pipelines.
+	void saveCache();   //!< Save the pipeline cache to cacheFile.
+	void destroy();   //!< Save the pipeline cache and destroy it, together with the remaining pipelines. Call it before destroying the logical device.
+};
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <atomic>
+#include <memory>
+#include <chrono>
+
+#include "polygonum/commons.hpp"
+
+/*
+	Frame profiler (always built, no debug macros required):
+		- CPU zones: A ProfileZone measures a scope (fence wait, acquire, user update...) and records it in a lock-free ring buffer (Profiler). Any thread can record zones.
+		- GPU zones: GpuTimestamps writes timestamp queries around the passes of each command buffer. Their results are read once the frame's fence is signaled, and recorded as zones of the "GPU" track.
+		- Stats: Profiler::getStats() gets min/avg/p99/max durations of a zone over the last frames.
+		- Trace: Profiler::exportChromeTrace() saves the zones in the ring buffer as Chrome trace JSON (open it in chrome://tracing or https://ui.perfetto.dev).
+*/
+
+// Prototypes ----------
+
+struct ProfileStats;
+class Profiler;
+class ProfileZone;
+class GpuTimestamps;
+
+// Definitions ----------
+
+/// Durations (milliseconds) of a zone over some frames.
+struct ProfileStats
+{
+	double min = 0;
+	double avg = 0;
+	double p99 = 0;   //!< 99th percentile
+	double max = 0;
+	size_t count = 0;   //!< Number of times the zone was recorded.
+};
+
+/**
+	@brief Records timed zones (name, begin, end, thread, frame) in a fixed-size ring buffer. Thread-safe and lock-free.
+
+	Writers reserve a slot with an atomic counter and publish it with a sequence number (seqlock), so readers (getStats(), exportChromeTrace()) skip slots being written. When the buffer is full, the oldest zones are overwritten.
+	Zone names must outlive the profiler (string literals).
+*/
+class Profiler
+{
+	struct Event
+	{
+		std::atomic<uint64_t> sequence;   //!< 2 * index + 2 when published; odd while being written.
+		std::atomic<const char*> name;
+		std::atomic<uint64_t> begin, end;   //!< Nanoseconds since the profiler was created.
+		std::atomic<uint64_t> frame;
+		std::atomic<uint32_t> track;   //!< Thread (or gpuTrack).
+	};
+
+	std::unique_ptr<Event[]> events;
+	const size_t capacity;
+	std::atomic<uint64_t> writeIndex;   //!< Total number of events recorded.
+	std::atomic<uint64_t> frame;
+	std::atomic<uint64_t> frameBegin;
+	std::atomic<bool> enabled;
+	const std::chrono::steady_clock::time_point startTime;
+
+	template<typename F> void forEachEvent(F&& function) const;   //!< Call function(name, begin, end, frame, track) for each published event in the buffer (oldest first).
+
+public:
+	Profiler(size_t capacity = 1 << 16);
+
+	static const uint32_t gpuTrack = 0;   //!< Track of GPU zones. Threads get tracks 1, 2, 3...
+
+	void record(const char* name, uint64_t begin, uint64_t end);   //!< Record a zone of the calling thread. Times from now().
+	void record(const char* name, uint64_t begin, uint64_t end, uint32_t track);
+	void newFrame();   //!< Record the "Frame" zone (time since the previous call) and start a new frame. Call it at the beginning of each frame.
+
+	uint64_t now() const;   //!< Nanoseconds since the profiler was created.
+	uint64_t getFrame() const;
+	static uint32_t getThreadTrack();   //!< Track of the calling thread.
+	void setEnabled(bool enabled);   //!< Disabled profilers don't record zones (default: enabled).
+	bool isEnabled() const;
+
+	ProfileStats getStats(const char* name, size_t frames = 120) const;   //!< Stats of a zone over the last "frames" frames.
+	bool exportChromeTrace(const std::string& fileName) const;   //!< Save the zones in the buffer as Chrome trace JSON. Returns false if the file cannot be written.
+};
+
+/// Measure the time between its construction and its destruction (or end()) and record it in a Profiler.
+class ProfileZone
+{
+	Profiler& profiler;
+	const char* name;
+	uint64_t begin;
+	bool active;
+
+public:
+	ProfileZone(Profiler& profiler, const char* name);
+	~ProfileZone();
+
+	void end();   //!< Record the zone now (the destructor won't record it again).
+};
+
+/**
+	@brief GPU zones with timestamp queries (one query pool per frame in flight).
+
+	Zone 0 is the GPU culling pass, and zone 1 + i is render pass i (up to maxZones - 1 render passes). When recording a command buffer, reset() must be called first and then begin()/end() around each zone.
+	After the frame's fence is signaled, collect() records the zones in a Profiler (GPU track). GPU and CPU clocks are not calibrated: GPU zones are placed on the CPU timeline relative to the submission time (setSubmitTime()).
+	Does nothing if the graphics queue doesn't support timestamps.
+*/
+class GpuTimestamps
+{
+	VkDevice device;
+	std::vector<VkQueryPool> queryPools;   //!< [frame]. 2 queries (begin, end) per zone.
+	std::vector<uint32_t> numZones;   //!< [frame]. Zones recorded in the command buffers of this frame.
+	std::vector<uint64_t> submitTimes;   //!< [frame]. CPU time of the last submission (0 if not submitted since last collect()).
+	float period;   //!< Nanoseconds per timestamp tick.
+	uint64_t validMask;   //!< Valid bits of timestamps.
+	std::vector<std::string> names;   //!< [zone]
+
+public:
+	GpuTimestamps();
+
+	static const uint32_t maxZones = 16;
+
+	void create(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t queueFamily, size_t numFrames);
+	void destroy();
+	bool isSupported() const;
+
+	void reset(VkCommandBuffer commandBuffer, size_t frameIndex, uint32_t numZones);   //!< Record the reset of this frame's queries. Call it at the beginning of each command buffer, outside render passes.
+	void begin(VkCommandBuffer commandBuffer, size_t frameIndex, uint32_t zone);
+	void end(VkCommandBuffer commandBuffer, size_t frameIndex, uint32_t zone);
+	void setSubmitTime(size_t frameIndex, uint64_t time);   //!< Call it when the frame's command buffer is submitted (time from Profiler::now()).
+	void collect(size_t frameIndex, Profiler& profiler);   //!< Read the results of the last submission of this frame and record them. Call it after waiting for the frame's fence.
+};
+
+#endif
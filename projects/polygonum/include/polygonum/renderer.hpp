@@ -1,14 +1,31 @@
 #ifndef RENDERER_HPP
 #define RENDERER_HPP
 
+#include <set>
+#include <unordered_set>
+#include <atomic>
+#include <exception>
+
 #include "polygonum/environment.hpp"
+#include "polygonum/uploader.hpp"
+#include "polygonum/pipelines.hpp"
+#include "polygonum/geometry.hpp"
+#include "polygonum/culling.hpp"
 #include "polygonum/models.hpp"
+#include "polygonum/frame.hpp"
 
 class LoadingWorker;
 class Renderer;
 class Help_RP_DS_PP;
 
-/// Reponsible for the loading thread and its processes.
+/**
+	@brief Reponsible for the loading threads and their processes.
+
+	A pool of loading threads takes tasks from a priority queue. Models with lower priority values are constructed first (e.g., distance to camera). Deletions go first.
+	Different models are constructed in parallel (vertices loading, shaders compilation, textures decoding...), but each model is processed by one thread at a time.
+	A delete task cancels the pending construct task of the same model. If the model is being constructed, it's deleted once it has been constructed.
+	Deleted models are extracted from Renderer::models and retired: they're destroyed by the render loop (releaseRetired()) once no frame in flight or cached command buffer uses them.
+*/
 class LoadingWorker
 {
 public:
@@ -18,38 +35,61 @@ public:
 	enum Task { none, construct, delet };   //!< Used in LoadingWorker::newTask().
 
 	std::mutex mutModels;   //!< for Renderer::models
-	std::mutex mutResources;   //!< for Renderer::shaders & Renderer::textures
 
 	std::mutex mutTasks;   //!< for LoadingWorker::tasks
-	std::condition_variable cond;   //!< for wake up or sleep the loading thread
+	std::condition_variable cond;   //!< for wake up or sleep the loading threads
 
 	void start();
 	void stop();
-	void newTask(key64 key, Task task);
-	void waitIdle();   //!< Wait for loading thread to be idle
-	size_t numTasks();
+	void newTask(key64 key, Task task, float priority = 0);   //!< Schedule a task. Construct tasks with lower priority values are processed first. Delete tasks are processed before construct tasks.
+	void setPriority(key64 key, float priority);   //!< Change the priority of a pending construct task.
+	void setThreads(unsigned numThreads);   //!< Number of loading threads (default: 1). Takes effect on the next start().
+	void waitIdle();   //!< Wait for loading threads to be idle
+	void pause();   //!< Stop taking new tasks (they stay queued) and wait for the running ones to finish. Used while the render pipeline is recreated, since new tasks can still arrive (pipelined mode).
+	void resume();   //!< Take tasks again (see pause()).
+	size_t numTasks();   //!< Pending and running tasks
+	void releaseRetired(bool all = false);   //!< Destroy the retired models that no frame uses anymore (all of them if "all", e.g., when the device is idle). Call it from the render loop.
 
 private:
 	Renderer& r;
 
-	std::queue<std::pair<key64, LoadingWorker::Task>> tasks;   //!< FIFO queue
-	std::unordered_map<key64, ModelData> modelTP;   //!< Model To Process: A model is moved here temporarily for processing. After processing, it's tranferred to its final destination.
+	/// Task in the priority queue.
+	struct TaskInfo
+	{
+		key64 key;
+		Task task;
+		float priority;
+		size_t order;   //!< Order of arrival. Tasks with the same priority are processed in FIFO order.
+
+		bool operator<(const TaskInfo& other) const;
+	};
+
+	std::set<TaskInfo> tasks;   //!< Priority queue
+	std::unordered_map<key64, std::set<TaskInfo>::iterator> pendingConstructs;   //!< Construct tasks in "tasks" (for cancelling and changing priorities).
+	std::unordered_set<key64> busyKeys;   //!< Models being processed by some thread.
+	size_t tasksCount;   //!< Number of tasks received (used for TaskInfo::order).
+	std::condition_variable condIdle;   //!< Notified each time a task is completed.
 
-	bool stopThread;   //!< Signals whether the secondary thread (loadingThread) should be running.
-	std::thread	thread_loadModels;   //!< Thread for loading new models. Initiated in the constructor. Finished if glfwWindowShouldClose
+	std::mutex mutRetired;   //!< for retiredModels
+	std::vector<std::pair<size_t, std::unordered_map<key64, ModelData>::node_type>> retiredModels;   //!< Deleted models, and the update (Commander::flagUpdate()) that removed them from the command buffers.
+
+	bool stopThread;   //!< Signals whether the loading threads should be running.
+	bool paused;   //!< Loading threads don't take tasks (see pause()).
+	unsigned numThreads;
+	std::vector<std::thread> threads_loadModels;   //!< Threads for loading new models. Initiated in start(). Finished if glfwWindowShouldClose
 
 	/**
 		@brief Load and delete models (including their shaders and textures)
 
 		<ul> Process:
-			<li>  Initializes and moves models from modelsToLoad to models </li>
-			<li>  Deletes models from modelsToDelete </li>
-				<li> Deletes shaders and textures with counter == 0 </li>
+			<li>  Takes the first task that can be executed (its model is not being processed by other thread) </li>
+			<li>  Constructs models (the model is not locked while being constructed, so other models can be used in the meantime) </li>
+			<li>  Deletes models (shaders and textures are deleted when no model uses them) </li>
 		</ul>
 	*/
 	void thread_loadData(Renderer& renderer, ModelsManager& models, Commander& commander);
-	void extractModel(ModelsManager& models, key64 key);   //!< Extract model from "models" to "modelTP"
-	void returnModel(ModelsManager& models, key64 key);   //!< Extract model from "modelTP" to "models"
+	std::set<TaskInfo>::iterator nextTask();   //!< First task whose model is not busy. Caller must hold mutTasks.
+	std::unordered_map<key64, ModelData>::node_type extractModel(ModelsManager& models, key64 key, size_t& update);   //!< Extract model from "models". "update" gets the command buffers update that removes it.
 };
 
 // LOOK Restart the Renderer object after finishing the render loop
@@ -74,15 +114,29 @@ protected:
 	VulkanCore c;
 	SwapChain swapChain;					// Final color. Swapchain elements.
 	Commander commander;
+	Uploader uploader;						//!< Batches resource uploads (vertex/index buffers, textures).
+	PipelineManager pipelines;				//!< Graphics pipelines shared between models + pipeline cache.
+	GeometryArena arena;					//!< Vertex and index buffers shared by models (see ModelDataInfo::useGeometryArena).
+	CullingManager culling;					//!< GPU frustum culling of instances (see ModelDataInfo::gpuCulling). Set the frustum each frame with culling.setFrustum().
 	std::shared_ptr<RenderPipeline> rp;		//!< Render pipeline
-	Timer timer, profiler;
+	Timer timer;
+	Profiler profiler;						//!< CPU and GPU zones of each frame (see getProfileStats(), exportProfile()).
 	ModelsManager models;
 	PointersManager<std::string, Texture> textures;
 	PointersManager<std::string, Shader> shaders;
 	LoadingWorker worker;
 
-	size_t renderedFramesCount; //!< Number of frames rendered
-	int maxFPS; //!< Maximum FPS (= 30 by default).
+	std::atomic<size_t> renderedFramesCount; //!< Number of frames rendered
+	uint32_t lastImageIndex;   //!< Image of the last frame rendered (headless mode; see readImage()).
+	FramePacer pacer;   //!< Maximum FPS (= 30 by default) and frame intervals.
+	std::atomic<bool> swapChainOutdated;   //!< Recreate the swap chain after the next present (see setLatencyTarget()).
+	std::atomic<LatencyTarget> latencyTarget;   //!< Latency target requested (see setLatencyTarget()). Copied to SwapChain::latencyTarget by the render thread when recreating the swap chain.
+
+	bool pipelined;   //!< User update and rendering run in different threads (see setPipelined()).
+	FramePipeline pipeline;   //!< Frame packets from the user update (main thread) to the render thread (pipelined mode).
+	std::exception_ptr renderException;   //!< Exception thrown by the render thread (rethrown by renderLoop()).
+	std::mutex mutInstances;   //!< for pendingInstances
+	std::vector<std::pair<key64, uint32_t>> pendingInstances;   //!< Instance counts set since the last frame packet (pipelined mode).
 
 	/// Callback used by the client for updating states of their models.
 	void(*userUpdate) (Renderer& rend);
@@ -105,18 +159,22 @@ protected:
 	/// Copy data from UBOs to GPU memory. This is not the most efficient way to pass frequently changing values to the shader. Push constants are more efficient for passing a small buffer of data to shaders.
 	void updateUBOs(uint32_t imageIndex);
 
+	void captureFrame(FramePacket& packet);   //!< Pipelined mode (main thread): Save the modified buffers, instance counts and frustum of the user update.
+	void applyFrame(const FramePacket& packet);   //!< Pipelined mode (render thread): Set the frame data of buffers, instance counts and frustum.
+	void renderLoopPipelined();   //!< Main thread: Events and user updates. Render thread: drawFrame().
+
 	void cleanup();   //!< Cleanup after render loop terminates
 	void recreateSwapChain();   //!< Used in drawFrame() in case the window surface changes (like when window resizing), making swap chain no longer compatible with it. Here, we catch these events (when acquiring/submitting an image from/to the swap chain) and recreate the swap chain.
 
 public:
-	/// Constructor. Requires a callback for user updates (update model matrix, add models, delete models...).
+	/// Constructor. Requires a callback for user updates (update model matrix, add models, delete models...). In headless mode, there's no window: frames are rendered into offscreen images (see readImage()), and the render loop runs until getIO().setWindowShouldClose(true).
 	template <typename RP = RP_DS_PP>
-	Renderer(void(*graphicsUpdate)(Renderer&), int width, int height);
+	Renderer(void(*graphicsUpdate)(Renderer&), int width, int height, bool headless = false);
 	~Renderer();
 
 	std::vector<BindingBuffer> globalBuffers;   //!< Shared between models.
 	//std::vector<BindingBuffer> localBuffers;    //!< Particular to each model. Deleted when model is destroyed.
-	void addGlobalUbo(const BindingBuffer& bindbuffer);
+	void addGlobalUbo(const BindingBuffer& bindbuffer);   //!< Call it before renderLoop().
 
 	void renderLoop();	//!< Create command buffer and start render loop.
 
@@ -129,7 +187,13 @@ public:
 	void setInstances(key64 key, size_t numberOfRenders);
 	void setInstances(std::vector<key64>& keys, size_t numberOfRenders);
 
-	void setMaxFPS(int maxFPS);
+	void setPipelined(bool pipelined);   //!< Run the user update (main thread) one frame ahead of the recording and submission of commands (render thread). Call it before renderLoop(). Default: false.
+	bool isPipelined() const;
+	void setMaxFPS(int maxFPS);   //!< 0: Uncapped.
+	void setLatencyTarget(LatencyTarget target);   //!< Choose the present mode (default: ltLow, i.e., mailbox if available). With ltVsync, FPS are also limited by the display refresh rate.
+	void setRecordingThreads(unsigned numThreads);   //!< Number of threads used for recording command buffers (default: 1). Useful with many models.
+	void setLoadingThreads(unsigned numThreads);   //!< Number of threads used for loading models (default: 1). Call it before renderLoop().
+	void setLoadPriority(key64 key, float priority);   //!< Change the loading priority of a model that is waiting to be constructed (see ModelDataInfo::loadPriority).
 
 	long double getDeltaTime() const;
 	size_t getFrameCount();
@@ -138,24 +202,45 @@ public:
 	size_t getCommandsCount();
 	size_t loadedShaders();	//!< Returns number of shaders in Renderer:shaders
 	size_t loadedTextures();	//!< Returns number of textures in Renderer:textures
+	size_t loadedPipelines();	//!< Returns number of different graphics pipelines (models with the same pipeline state share one)
 
 	int getMaxMemoryAllocationCount();			//!< Max. number of valid memory objects
 	int getMemAllocObjects();					//!< Number of memory allocated objects (must be <= maxMemoryAllocationCount)
+	MemoryStats getMemoryStats();				//!< Memory blocks, allocations and fragmentation of the device memory allocator
+
+	Profiler& getProfiler();   //!< Record your own zones with ProfileZone(getProfiler(), "name").
+	PacingStats getPacingStats(size_t frames = 120);   //!< Frame intervals (avg, jitter, p99, max, late frames) over the last frames.
+	ProfileStats getProfileStats(const char* zone, size_t frames = 120);   //!< Min/avg/p99/max duration (ms) of a zone over the last frames. CPU zones: Frame, waitFPS, waitPacket, waitFrame, acquire, waitImage, userUpdate, updateUBOs, recordCommands, submit, present, loadModel, deleteModel. GPU zones: "GPU culling", "GPU render pass <i>".
+	bool exportProfile(const std::string& fileName);   //!< Save the recorded zones as Chrome trace JSON (chrome://tracing, https://ui.perfetto.dev).
+
+	size_t getLoadingTasks();   //!< Models waiting to be constructed or deleted by the loading threads (0: scene fully loaded).
+	bool isHeadless() const;
+	VkExtent2D getImageExtent() const;   //!< Size of the final images (swap chain or offscreen images).
+	void readImage(std::vector<uint8_t>& pixels);   //!< Headless mode only (not pipelined). Get the last rendered image (BGRA, 4 bytes per pixel, rows top to bottom). Waits for it to be rendered.
 };
 
 
 template <typename RP>
-Renderer::Renderer(void(*graphicsUpdate)(Renderer&), int width, int height) :
-	c(width, height),
+Renderer::Renderer(void(*graphicsUpdate)(Renderer&), int width, int height, bool headless) :
+	c(width, height, headless),
 	swapChain(c, ADDITIONAL_SWAPCHAIN_IMAGES),
 	commander(c, swapChain.images.size(), MAX_FRAMES_IN_FLIGHT),
+	uploader(c, commander),
+	pipelines(c),
+	arena(c, commander, uploader),
+	culling(c),
 	rp(std::make_shared<RP>(c, swapChain, commander)),
 	models(rp),
 	userUpdate(graphicsUpdate),
 	renderedFramesCount(0),
-	maxFPS(30),
+	lastImageIndex(0),
+	swapChainOutdated(false),
+	latencyTarget(swapChain.latencyTarget),
+	pipelined(false),
 	worker(this)
 {
+	pacer.setMaxFPS(30);
+
 #ifdef DEBUG_RENDERER
 	std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 	std::cout << "Main thread ID: " << std::this_thread::get_id() << std::endl;
@@ -68,6 +68,11 @@ class ShaderLoader
 	std::vector<SMod> mods;				//!< Modifications to the shader.
 	void applyModifications(std::string& shader);	//!< Applies modifications defined by "mods".
 
+	static std::string cacheDirectory;	//!< Directory of the SPIR-V cache. Empty if disabled.
+	static uint64_t getCacheKey(const std::string& id, const std::string& options, const std::string& preprocessedGlsl);   //!< 64-bit FNV-1a hash of the shader id, compile options (including compiler version and target environment) and preprocessed source (it contains the included headers).
+	static bool readCache(uint64_t key, std::vector<uint32_t>& spirv);   //!< Load SPIR-V from the cache. Returns false if not found or not valid (the file's header {key, bytes} must match).
+	static void writeCache(uint64_t key, const std::vector<uint32_t>& spirv);
+
 protected:
 	ShaderLoader(const std::string& id, const std::initializer_list<SMod>& modifications);
 	virtual void getRawData(std::string& glslData) = 0;
@@ -77,8 +82,10 @@ protected:
 public:
 	virtual ~ShaderLoader() {};
 
-	std::shared_ptr<Shader> loadShader(PointersManager<std::string, Shader>& loadedShaders, VulkanCore& c);	//!< Get an iterator to the shader in loadedShaders. If it's not in that list, it loads it, saves it in the list, and gets the iterator. 
+	std::shared_ptr<Shader> loadShader(PointersManager<std::string, Shader>& loadedShaders, VulkanCore& c);	//!< Get an iterator to the shader in loadedShaders. If it's not in that list, it loads it, saves it in the list, and gets the iterator. Compiled SPIR-V is taken from the on-disk cache when possible.
 	virtual ShaderLoader* clone() = 0;
+
+	static void setCacheDirectory(const std::string& directory);   //!< Directory where compiled shaders (SPIR-V) are cached between runs (default: "shaderCache"). Pass an empty string for disabling the cache.
 };
 
 /// Pass the shader as a string at construction time. Call to getRawData will pass that string.
@@ -0,0 +1,173 @@
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+#if defined(__AVX__) || defined(__AVX512F__)
+	#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define POLYGONUM_SSE
+#endif
+
+#include <cmath>
+
+/*
+	SIMD types for batch algorithms over SoA data (frustum culling, particles...). Each type (width = number of floats per register) provides the same few operations, so algorithms are written once as templates.
+	The widest type available at compile time (-mavx2, -mavx512f, /arch:AVX2...) processes most elements, and narrower ones process the rest:
+
+		#ifdef __AVX512F__
+			batch<SimdAVX512>(..., i, count);
+		#endif
+		#ifdef __AVX__
+			batch<SimdAVX>(..., i, count);
+		#endif
+		#if defined(__AVX__) || defined(POLYGONUM_SSE)
+			batch<SimdSSE>(..., i, count);
+		#endif
+		batch<SimdScalar>(..., i, count);
+*/
+
+// Prototypes ----------
+
+struct SimdAVX512;
+struct SimdAVX;
+struct SimdSSE;
+struct SimdScalar;
+
+// Definitions ----------
+
+#ifdef __AVX512F__
+struct SimdAVX512
+{
+	typedef __m512 F;
+	typedef __mmask16 M;
+	static const size_t width = 16;
+	static const unsigned fullMask = 0xFFFF;
+	static F load(const float* p) { return _mm512_loadu_ps(p); }
+	static void store(float* p, F a) { _mm512_storeu_ps(p, a); }
+	static F set(float value) { return _mm512_set1_ps(value); }
+	static F add(F a, F b) { return _mm512_add_ps(a, b); }
+	static F sub(F a, F b) { return _mm512_sub_ps(a, b); }
+	static F mul(F a, F b) { return _mm512_mul_ps(a, b); }
+	static F div(F a, F b) { return _mm512_div_ps(a, b); }
+	static F sqrt(F a) { return _mm512_sqrt_ps(a); }
+	static F max(F a, F b) { return _mm512_max_ps(a, b); }
+	static F min(F a, F b) { return _mm512_min_ps(a, b); }
+	static F round(F a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+	static F pow2i(F n) { return _mm512_scalef_ps(_mm512_set1_ps(1.f), n); }   //!< 2^n (n: integral values)
+	static unsigned less(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }   //!< Bit i is set if a[i] < b[i]
+	static M lessMask(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+	static F select(M mask, F a, F b) { return _mm512_mask_blend_ps(mask, a, b); }   //!< mask[i] ? b[i] : a[i]
+};
+#endif
+
+#ifdef __AVX__
+struct SimdAVX
+{
+	typedef __m256 F;
+	typedef __m256 M;
+	static const size_t width = 8;
+	static const unsigned fullMask = 0xFF;
+	static F load(const float* p) { return _mm256_loadu_ps(p); }
+	static void store(float* p, F a) { _mm256_storeu_ps(p, a); }
+	static F set(float value) { return _mm256_set1_ps(value); }
+	static F add(F a, F b) { return _mm256_add_ps(a, b); }
+	static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+	static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+	static F div(F a, F b) { return _mm256_div_ps(a, b); }
+	static F sqrt(F a) { return _mm256_sqrt_ps(a); }
+	static F max(F a, F b) { return _mm256_max_ps(a, b); }
+	static F min(F a, F b) { return _mm256_min_ps(a, b); }
+	static F round(F a) { return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+	static F pow2i(F n)   // Exponent bits: (n + 127) << 23
+	{
+		__m256i i = _mm256_cvtps_epi32(n);
+#ifdef __AVX2__
+		return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(i, _mm256_set1_epi32(127)), 23));
+#else   // AVX has no 256-bit integer ops
+		__m128i low = _mm_slli_epi32(_mm_add_epi32(_mm256_castsi256_si128(i), _mm_set1_epi32(127)), 23);
+		__m128i high = _mm_slli_epi32(_mm_add_epi32(_mm256_extractf128_si256(i, 1), _mm_set1_epi32(127)), 23);
+		return _mm256_castsi256_ps(_mm256_insertf128_si256(_mm256_castsi128_si256(low), high, 1));
+#endif
+	}
+	static unsigned less(F a, F b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ)); }
+	static M lessMask(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	static F select(M mask, F a, F b) { return _mm256_blendv_ps(a, b, mask); }
+};
+#endif
+
+#if defined(__AVX__) || defined(POLYGONUM_SSE)
+struct SimdSSE
+{
+	typedef __m128 F;
+	typedef __m128 M;
+	static const size_t width = 4;
+	static const unsigned fullMask = 0xF;
+	static F load(const float* p) { return _mm_loadu_ps(p); }
+	static void store(float* p, F a) { _mm_storeu_ps(p, a); }
+	static F set(float value) { return _mm_set1_ps(value); }
+	static F add(F a, F b) { return _mm_add_ps(a, b); }
+	static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+	static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+	static F div(F a, F b) { return _mm_div_ps(a, b); }
+	static F sqrt(F a) { return _mm_sqrt_ps(a); }
+	static F max(F a, F b) { return _mm_max_ps(a, b); }
+	static F min(F a, F b) { return _mm_min_ps(a, b); }
+	static F round(F a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a)); }   // |a| < 2^31
+	static F pow2i(F n) { return _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23)); }
+	static unsigned less(F a, F b) { return _mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+	static M lessMask(F a, F b) { return _mm_cmplt_ps(a, b); }
+	static F select(M mask, F a, F b) { return _mm_or_ps(_mm_and_ps(mask, b), _mm_andnot_ps(mask, a)); }   // SSE2 has no blend
+};
+#endif
+
+struct SimdScalar
+{
+	typedef float F;
+	typedef bool M;
+	static const size_t width = 1;
+	static const unsigned fullMask = 0x1;
+	static F load(const float* p) { return *p; }
+	static void store(float* p, F a) { *p = a; }
+	static F set(float value) { return value; }
+	static F add(F a, F b) { return a + b; }
+	static F sub(F a, F b) { return a - b; }
+	static F mul(F a, F b) { return a * b; }
+	static F div(F a, F b) { return a / b; }
+	static F sqrt(F a) { return std::sqrt(a); }
+	static F max(F a, F b) { return a > b ? a : b; }
+	static F min(F a, F b) { return a < b ? a : b; }
+	static F round(F a) { return std::nearbyint(a); }
+	static F pow2i(F n) { return std::ldexp(1.f, (int)n); }
+	static unsigned less(F a, F b) { return a < b; }
+	static M lessMask(F a, F b) { return a < b; }
+	static F select(M mask, F a, F b) { return mask ? b : a; }
+};
+
+/// e^x for each element (Cephes' expf: e^x = 2^n * e^r, with |r| <= ln(2)/2 and e^r approximated by a polynomial). Relative error ~1e-7 for x in [-87, 88].
+template<typename S>
+typename S::F simdExp(typename S::F x)
+{
+	typedef typename S::F F;
+
+	if constexpr (S::width == 1)   // SimdScalar
+		return std::exp(x);
+	else
+	{
+		x = S::max(S::min(x, S::set(88.3762626647949f)), S::set(-87.3365447504019f));   // Avoid overflow and denormals
+
+		F n = S::round(S::mul(x, S::set(1.44269504088896341f)));   // x / ln(2)
+		F r = S::sub(S::sub(x, S::mul(n, S::set(0.693359375f))), S::mul(n, S::set(-2.12194440e-4f)));   // x - n ln(2) (ln(2) split in 2 parts for precision)
+
+		F p = S::set(1.9875691500E-4f);
+		p = S::add(S::mul(p, r), S::set(1.3981999507E-3f));
+		p = S::add(S::mul(p, r), S::set(8.3334519073E-3f));
+		p = S::add(S::mul(p, r), S::set(4.1665795894E-2f));
+		p = S::add(S::mul(p, r), S::set(1.6666665459E-1f));
+		p = S::add(S::mul(p, r), S::set(5.0000001201E-1f));
+		p = S::add(S::add(S::mul(S::mul(p, r), r), r), S::set(1.f));
+
+		return S::mul(p, S::pow2i(n));
+	}
+}
+
+#endif
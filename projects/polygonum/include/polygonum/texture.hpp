@@ -19,12 +19,12 @@ class Texture : public InterfaceForPointersManagerElements<std::string, Texture>
 {
 	virtual void getRawData(unsigned char*& pixels, int32_t& texWidth, int32_t& texHeight);
 
-	std::pair<VkImage, VkDeviceMemory> createTextureImage(unsigned char* pixels, int32_t texWidth, int32_t texHeight, uint32_t& mipLevels, Renderer& r);
+	std::pair<VkImage, Allocation> createTextureImage(unsigned char* pixels, int32_t texWidth, int32_t texHeight, uint32_t& mipLevels, Renderer& r);
 	VkImageView createTextureImageView(VkImage textureImage, uint32_t mipLevels, VulkanCore& c);
 	VkSampler createTextureSampler(uint32_t mipLevels, VulkanCore& c);
 
 public:
-	Texture(const std::string& id, TexType type, VulkanCore& c, VkImage textureImage, VkDeviceMemory textureImageMemory, VkImageView textureImageView, VkSampler textureSampler, VkFormat imageFormat, VkSamplerAddressMode addressMode);
+	Texture(const std::string& id, TexType type, VulkanCore& c, VkImage textureImage, Allocation textureImageMemory, VkImageView textureImageView, VkSampler textureSampler, VkFormat imageFormat, VkSamplerAddressMode addressMode);
 	Texture(const std::string& id, TexType type, VkFormat imageFormat, VkSamplerAddressMode addressMode);
 	~Texture();
 
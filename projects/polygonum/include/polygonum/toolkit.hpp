@@ -3,6 +3,7 @@
 
 #include <array>
 #include <chrono>
+#include <mutex>
 
 #include "polygonum/commons.hpp"
 
@@ -114,6 +115,8 @@ struct Frustum;
 struct BoundingShape;
 struct Sphere;
 struct AABB;
+struct SpheresSoA;
+struct AABBsSoA;
 
 // ADT for bounding shapes (usually, polygons) used for enveloping objects.
 struct BoundingShape
@@ -182,6 +185,36 @@ struct Frustum
 	bool isInFrustum(const glm::vec3& point, float distBeyond = 0) const;   //!< Check if a point appears in a frustum, or within a distance beyond it. Used for frustum culling. 
 	bool isInFrustum(const AABB& aabb) const;   //!< Check if an AABB appears in a frustum. Used for frustum culling. True if AABB is inside or intersects the frustum; false otherwise.
 	bool isInFrustum(const Sphere& sphere) const;   //!< Check if a sphere appears in a frustum. Used for frustum culling. True if sphere is inside or intersects the frustum; false otherwise.
+
+	/// Batch frustum culling (SIMD: 16, 8 or 4 objects at a time with AVX-512, AVX or SSE). Writes the indices of the visible objects (inside or intersecting the frustum) to "visible", in increasing order. Returns the number of visible objects.
+	size_t cullSpheres(const SpheresSoA& spheres, std::vector<uint32_t>& visible) const;
+	size_t cullSpheres(const float* x, const float* y, const float* z, const float* radius, size_t count, uint32_t* visible) const;   //!< "visible" must fit "count" indices.
+	size_t cullAABBs(const AABBsSoA& aabbs, std::vector<uint32_t>& visible) const;
+	size_t cullAABBs(const float* minX, const float* minY, const float* minZ, const float* maxX, const float* maxY, const float* maxZ, size_t count, uint32_t* visible) const;   //!< "visible" must fit "count" indices.
+};
+
+/// Bounding spheres stored as structure of arrays (one array per component), so many of them can be culled at once with SIMD (Frustum::cullSpheres()).
+struct SpheresSoA
+{
+	std::vector<float> x, y, z, radius;
+
+	void push_back(const Sphere& sphere);
+	void set(size_t index, const Sphere& sphere);
+	void resize(size_t size);
+	void clear();
+	size_t size() const;
+};
+
+/// AABBs stored as structure of arrays (one array per component), so many of them can be culled at once with SIMD (Frustum::cullAABBs()).
+struct AABBsSoA
+{
+	std::vector<float> minX, minY, minZ, maxX, maxY, maxZ;
+
+	void push_back(const AABB& aabb);
+	void set(size_t index, const AABB& aabb);
+	void resize(size_t size);
+	void clear();
+	size_t size() const;
 };
 
 
@@ -331,8 +364,6 @@ public:
 
 void sleep(int milliseconds);
 
-void waitForFPS(Timer& timer, int maxFPS);
-
 
 // Algorithms -----------------------------------------------------------------
 
@@ -552,34 +583,63 @@ void getDepthElements(QuadNode<T>* node, X* external)
 	//	std::get<0>(*external).push_back(node);
 }
 
-/// Data structure that stores pointers. When one of them is no longer used elsewhere, it's deleted from storage. The custom deleter used requires E to know its key and the PointersManager, which can be done by making E inherit from InterfaceForPointersManagerElements.
+/// Data structure that stores pointers. When one of them is no longer used elsewhere, it's deleted from storage. The custom deleter used requires E to know its key and the PointersManager, which can be done by making E inherit from InterfaceForPointersManagerElements. Thread-safe.
 template<typename K, typename E>
 class PointersManager
 {
 	std::unordered_map<K, std::weak_ptr<E>> elements;
+	std::mutex mutElements;
 
 public:
 	PointersManager() { };
 	~PointersManager() { };
 
 	template<typename... Args>
-	std::shared_ptr<E> emplace(K key, Args&&... args)   // Variadic template constructor. Arguments are forwarded to T's constructor.
+	std::shared_ptr<E> emplace(K key, Args&&... args)   // Variadic template constructor. Arguments are forwarded to T's constructor. If another thread stored an element with the same key meanwhile, the new element is returned but not stored.
 	{
 		std::shared_ptr<E> newElement(new E(std::forward<Args>(args)...), PointersManager::customDeleter);
 		newElement->setValues(this, key);
-		elements[key] = newElement;
+
+		const std::lock_guard<std::mutex> lock(mutElements);
+		if (elements[key].expired()) elements[key] = newElement;
 		return newElement;
 	}
 
-	std::shared_ptr<E> get(K key) { return elements[key].lock(); }
+	std::shared_ptr<E> get(K key)
+	{
+		const std::lock_guard<std::mutex> lock(mutElements);
+		return elements[key].lock();
+	}
 
-	bool contains(K key) { return elements.find(key) != elements.end(); }
+	std::shared_ptr<E> find(K key)   //!< Returns the element, or nullptr if it's not stored.
+	{
+		const std::lock_guard<std::mutex> lock(mutElements);
+		auto it = elements.find(key);
+		return it == elements.end() ? nullptr : it->second.lock();
+	}
 
-	size_t size() { return elements.size(); }
+	bool contains(K key)
+	{
+		const std::lock_guard<std::mutex> lock(mutElements);
+		return elements.find(key) != elements.end();
+	}
+
+	size_t size()
+	{
+		const std::lock_guard<std::mutex> lock(mutElements);
+		return elements.size();
+	}
 
 	static void customDeleter(E* elemPtr)
 	{
-		elemPtr->pointersManager->elements.erase(elemPtr->id);
+		{
+			PointersManager* manager = elemPtr->pointersManager;
+			const std::lock_guard<std::mutex> lock(manager->mutElements);
+			auto it = manager->elements.find(elemPtr->id);
+			if (it != manager->elements.end() && it->second.expired())   // Don't erase an element stored with the same key after this one.
+				manager->elements.erase(it);
+		}
+
 		delete elemPtr;
 	}
 };
@@ -2,6 +2,7 @@
 #define UBO_HPP
 
 #include "commons.hpp"
+#include "memory.hpp"
 
 // Forward declarations ----------
 
@@ -67,6 +68,7 @@ std::shared_ptr<T> BindingInfo::create(Args&&... args)
 
 /// Container for a binding of uniform buffers, which is an array of uniform buffer descriptors (UBOs). Multiple UBOs are useful for instance rendering.
 /// A UBO array is a type of Binding. A Binding is an array of descriptors. Each descriptor has attributes. There're different types of descriptors (UBO, sampler...).
+/// The user writes "binding". The modified bytes are copied to the frame data (publish(), or a FramePacket in pipelined mode), and GPU memory is updated from the frame data, so the user can write the next frame while the current one is uploaded.
 struct BindingBuffer
 {
 private:
@@ -74,8 +76,15 @@ private:
 	SwapChain* swapChain;
 
 	uint32_t size;   //!< Bytes we want to update.
+	uint32_t frameSize;   //!< "size" of the frame data.
+
+	std::pair<uint32_t, uint32_t> modifiedRange;   //!< Range of bytes [first, second) of "binding" modified since the last publish() or takeModified(). Empty if first >= second.
+	bool resized;   //!< "size" changed since the last publish() or takeModified().
+	std::vector<uint8_t> frameBinding;   //!< Frame data: Copy of "binding" used for updating GPU memory.
+	std::vector<std::pair<uint32_t, uint32_t>> dirtyRanges;   //!< [sc.img] Range of bytes [first, second) of "frameBinding" modified since the last copy to bindingMemories[sc.img]. Empty if first >= second.
 
 	uint32_t alignedDescriptorSize(size_t numDescriptors, BindingBufferType descriptorType, size_t originalDescriptorSize);
+	void setFrameDirty(uint32_t offset, uint32_t bytes);   //!< Flag a range of "frameBinding" as modified for every swapchain image.
 
 public:
 	BindingBuffer(BindingBufferType type, uint32_t numDescriptors, uint32_t numSubDescriptors, VkDeviceSize descriptorSize, const std::vector<std::string>& glslLines = { });
@@ -93,7 +102,7 @@ public:
 
 	std::vector<uint8_t>		binding;			//!< Array of UBOs will be passed to vertex shader (MVP, M for normals, light...). Its attributes are aligned to 16-byte boundary.
 	std::vector<VkBuffer>		bindingBuffers;		//!< [sc.img] Opaque handle to a buffer object (here, a binding).
-	std::vector<VkDeviceMemory>	bindingMemories;	//!< Opaque handle to a device memory object (here, memory for the binding). One for each swap chain image.
+	std::vector<Allocation>		bindingMemories;	//!< Range of a device memory block (here, memory for the binding). One for each swap chain image. Host visible and persistently mapped (Allocation::mapped).
 
 	std::vector<std::string> glslLines;				//!< (Optional) Used in ShaderCreator
 
@@ -101,7 +110,15 @@ public:
 	void destroyBuffer();							//!< Destroy the uniform buffers (VkBuffer) and their memories (VkDeviceMemory).
 
 	bool isFullyConstructed();
-	uint8_t* getDescriptor(size_t index = 0);
+	uint8_t* getDescriptor(size_t index = 0);   //!< Get pointer to a descriptor for writing on it. The descriptor is flagged as modified.
+	void setDirty(uint32_t offset, uint32_t bytes);   //!< Flag a range of "binding" as modified, so it's copied to GPU memory. Only needed when writing to "binding" without getDescriptor().
+	void updateMemory(uint32_t imageIndex);   //!< Copy the modified range of the frame data (up to its size) to the mapped memory of a swapchain image.
+
+	void publish();   //!< Copy the modified range of "binding", and "size", to the frame data.
+	bool takeModified(uint32_t& offset, uint32_t& bytes);   //!< Get the range of "binding" modified since the last call (or publish()) and reset it. Returns false if neither "binding" nor "size" changed.
+	void setFrameData(uint32_t offset, const void* data, uint32_t bytes);   //!< Write the frame data (render thread).
+	void setFrameSize(uint32_t newSize);
+	const uint8_t* getFrameData() const;
 	uint32_t getCapacity() const;
 	uint32_t getSize() const;
 	void setSize(uint32_t newSize);
@@ -0,0 +1,93 @@
+#ifndef UPLOADER_HPP
+#define UPLOADER_HPP
+
+#include "polygonum/environment.hpp"
+
+/*
+	Resource uploads (vertex buffers, index buffers, textures) go through a persistent staging ring buffer:
+		- Data is copied into the ring (host-visible, persistently mapped), and the copy commands are recorded into the command buffer of the current batch.
+		- A batch is submitted with a fence, without waiting for it. Its ring range is reclaimed once its fence is signaled.
+		- The CPU waits only when the ring (or the set of batches) is full, instead of waiting for each resource.
+		- Batches are numbered in submission order (submit() returns the number). Before destroying a resource, wait() for the batch that uploaded it, so the copy doesn't write into freed memory.
+
+	If the device has a dedicated transfer queue family (VulkanCore::transferQueue), copies run there, concurrently with rendering:
+		- Transfer queue: copies + release barriers (ownership: transfer family -> graphics family). Signals a semaphore.
+		- Graphics queue: waits for the semaphore, acquire barriers + mipmaps generation (blits require a graphics queue). Signals the batch fence.
+	Otherwise, everything is recorded in a single command buffer and submitted to the graphics queue.
+*/
+
+// Prototypes ----------
+
+class Uploader;
+
+// Definitions ----------
+
+/**
+	@brief Batches resource uploads. Copies data into a persistent staging ring buffer and records many transfers into a single command buffer.
+
+	Usage: Call uploadBuffer() / uploadImage() for each resource, then submit() before the resources are used for rendering. The last part of each batch is submitted to the graphics queue, so later submissions (drawFrame) are ordered after them by the barriers recorded in the batch (no need to wait for them in the CPU). Thread-safe.
+*/
+class Uploader
+{
+	/// Transfers recorded in a command buffer and submitted together.
+	struct Batch
+	{
+		VkCommandBuffer commandBuffer;								//!< Copies (transfer queue if dedicatedTransfer; otherwise, graphics queue).
+		VkCommandBuffer acquireCommandBuffer;						//!< [Only if dedicatedTransfer] Acquire barriers and mipmaps (graphics queue).
+		VkSemaphore transferFinished;								//!< [Only if dedicatedTransfer] Signaled by commandBuffer, waited by acquireCommandBuffer.
+		bool acquiring;												//!< acquireCommandBuffer is being recorded.
+		VkFence fence;												//!< Signaled when the whole batch completes.
+		VkDeviceSize ringEnd;										//!< Ring position (head) after the last staging range used by this batch.
+		size_t transfers;											//!< Number of uploads recorded.
+		std::vector<std::pair<VkBuffer, Allocation>> oversized;		//!< Temporary staging buffers for data bigger than the ring. Destroyed when the batch completes.
+	};
+
+	VulkanCore& c;
+	Commander& commander;
+
+	VkBuffer stagingBuffer;
+	Allocation stagingMemory;
+	VkDeviceSize head;		//!< Next free byte in the ring (absolute position, it's never wrapped: ring offset == position % ringSize).
+	VkDeviceSize tail;		//!< First byte still used by a batch (absolute position).
+
+	bool dedicatedTransfer;			//!< Copies are submitted to VulkanCore::transferQueue.
+	uint32_t transferFamily;		//!< Queue family of the copies.
+	uint32_t graphicsFamily;
+	VkQueue queue;					//!< Queue of the copies (transferQueue or graphicsQueue).
+
+	VkCommandPool commandPool;		//!< For Batch::commandBuffer (transferFamily)
+	VkCommandPool acquirePool;		//!< For Batch::acquireCommandBuffer (graphicsFamily). Only if dedicatedTransfer.
+	std::vector<Batch> batches;		//!< Circular queue: "pending" submitted batches starting at "oldest", followed by the batch being recorded.
+	size_t oldest;
+	size_t pending;
+	uint64_t submittedBatches;		//!< Number of batches submitted (the last one is batch number submittedBatches).
+	uint64_t retiredBatches;		//!< Number of batches completed and retired (batches are retired in submission order).
+
+	std::mutex mutUpload;
+
+	Batch& current();
+	void beginBatch();
+	VkCommandBuffer beginAcquire();   //!< Begin recording Batch::acquireCommandBuffer (if not done yet) and return it.
+	void transferOwnership(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size);   //!< Record release (transfer queue) and acquire (graphics queue) barriers for a buffer range.
+	void transferOwnership(VkImage image, uint32_t mipLevels);   //!< Record release (transfer queue) and acquire (graphics queue) barriers for an image in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL.
+	VkDeviceSize stage(const void* data, VkDeviceSize size, VkBuffer& srcBuffer);   //!< Copy data to staging memory. Returns the offset in srcBuffer.
+	void submitBatch();   //!< Submit the current batch (if it has transfers) without waiting for it.
+	bool retireOldest(bool wait);   //!< Reclaim ring space of the oldest submitted batch. If !wait, only if it has completed. Returns false if nothing was retired.
+
+public:
+	Uploader(VulkanCore& core, Commander& commander);
+
+	const VkDeviceSize ringSize = 32 * 1024 * 1024;		//!< Size of the staging ring buffer (32 MB). Bigger uploads get a temporary staging buffer.
+	const VkDeviceSize stagingAlignment = 16;			//!< Alignment of staging ranges (buffer-to-image copies require multiples of 4 and of the texel size).
+	const size_t maxBatches = 4;						//!< Maximum number of batches (command buffers) in flight + 1 being recorded.
+
+	void uploadBuffer(VkBuffer dstBuffer, const void* data, VkDeviceSize size);   //!< Copy data to a device-local buffer (created with VK_BUFFER_USAGE_TRANSFER_DST_BIT).
+	void uploadBuffer(VkBuffer dstBuffer, VkDeviceSize dstOffset, const void* data, VkDeviceSize size);   //!< Copy data to a range of a device-local buffer (e.g., a GeometryArena buffer shared by many meshes).
+	void uploadImage(VkImage image, VkFormat format, const void* pixels, VkDeviceSize size, uint32_t width, uint32_t height, uint32_t mipLevels);   //!< Copy pixels to the base level of an image (in VK_IMAGE_LAYOUT_UNDEFINED), generate its mipmaps, and leave it in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
+	uint64_t submit();   //!< Submit the transfers recorded so far. It doesn't wait for them to complete. Returns the number of the last batch submitted (0 if none), which contains every transfer recorded before this call.
+	void wait(uint64_t batch);   //!< Wait for a batch (and the previous ones) to complete. Returns immediately if it has already completed.
+	void flush();   //!< Submit the transfers recorded so far and wait for all of them to complete.
+	void destroy();   //!< Flush and destroy the staging ring, command pool and fences. Call it before destroying the logical device.
+};
+
+#endif
@@ -2,9 +2,11 @@
 #define VERTEX_HPP
 
 #include "polygonum/commons.hpp"
+#include "polygonum/memory.hpp"
 
 class VertexType;
 class VertexSet;
+struct Meshlet;
 struct VertexData;
 class VerticesModifier;
    class VerticesModifier_Scale;
@@ -76,18 +78,35 @@ private:
 	uint32_t numVertex;		// Number of vertex objects stored in buffer
 };
 
+/// Range of the vertex and index buffers drawn with one draw call. Its indices are relative to vertexOffset, so big meshes can be split into meshlets that use 16-bit indices (see VertexesLoader::splitIntoMeshlets()).
+struct Meshlet
+{
+	uint32_t firstIndex;	//!< First index in the index buffer.
+	uint32_t indexCount;
+	int32_t vertexOffset;	//!< Value added to each index before reading the vertex buffer (first vertex of the meshlet).
+	uint32_t vertexCount;
+};
+
 /// Container for buffers for Vertexes (position, color, texture coordinates...) and Indices.
 struct VertexData
 {
 	// Vertices
 	uint32_t					 vertexCount;
 	VkBuffer					 vertexBuffer;			//!< Opaque handle to a buffer object (here, vertex buffer).
-	VkDeviceMemory				 vertexBufferMemory;	//!< Opaque handle to a device memory object (here, memory for the vertex buffer).
+	Allocation					 vertexBufferMemory;	//!< Range of a device memory block (here, memory for the vertex buffer).
 
 	// Indices
 	uint32_t					 indexCount;			// <<< BUG WITH POINTS (= 7340144)
 	VkBuffer					 indexBuffer;			//!< Opaque handle to a buffer object (here, index buffer).
-	VkDeviceMemory				 indexBufferMemory;		//!< Opaque handle to a device memory object (here, memory for the index buffer).
+	Allocation					 indexBufferMemory;		//!< Range of a device memory block (here, memory for the index buffer).
+	VkIndexType					 indexType;				//!< VK_INDEX_TYPE_UINT16, or VK_INDEX_TYPE_UINT32 if some index doesn't fit in 16 bits.
+
+	// Geometry arena (buffers shared with other models)
+	uint32_t					 firstVertex = 0;		//!< First vertex of this mesh in the vertex buffer (added to vertexOffset when drawing).
+	uint32_t					 firstIndex = 0;		//!< First index of this mesh in the index buffer.
+	int32_t						 arenaPage = -1;		//!< Page of GeometryArena that stores this mesh, or -1 if the buffers belong to this mesh.
+
+	std::vector<Meshlet>		 meshlets;				//!< If not empty, each meshlet is drawn with its own draw call. Otherwise, the whole index buffer is drawn.
 };
 
 /// Apply modifications to vertices right after loading them. Assumes vertexes start with position and then normals.
@@ -138,13 +157,14 @@ protected:
 
 	const uint32_t vertexSize;	//!< Size (bytes) of a vertex object
 	std::vector<VerticesModifier*> modifiers;
+	uint32_t maxMeshletVertices;	//!< If > 0, the mesh is split into meshlets with up to this number of vertices (see useMeshlets()).
 
-	virtual void getRawData(VertexSet& destVertices, std::vector<uint16_t>& destIndices, ModelData& model) = 0;   //!< Get vertexes and indices from source. Subclasses define this.
-	void createBuffers(VertexData& result, const VertexSet& rawVertices, const std::vector<uint16_t>& rawIndices, Renderer& r);	//!< Upload raw vertex data to Vulkan (i.e., create Vulkan buffers)
+	virtual void getRawData(VertexSet& destVertices, std::vector<uint32_t>& destIndices, ModelData& model) = 0;   //!< Get vertexes and indices from source. Subclasses define this.
+	void createBuffers(VertexData& result, const VertexSet& rawVertices, const std::vector<uint32_t>& rawIndices, Renderer& r);	//!< Upload raw vertex data to Vulkan (i.e., create Vulkan buffers)
 	void applyModifiers(VertexSet& vertexes);
 
 	void createVertexBuffer(const VertexSet& rawVertices, VertexData& result, Renderer& r);									//!< Vertex buffer creation.
-	void createIndexBuffer(const std::vector<uint16_t>& rawIndices, VertexData& result, Renderer& r);							//!< Index buffer creation
+	void createIndexBuffer(const std::vector<uint32_t>& rawIndices, VertexData& result, Renderer& r);							//!< Index buffer creation. Indices are stored as uint16 if all of them fit in 16 bits; otherwise, as uint32.
 
 	glm::vec3 getVertexTangent(const glm::vec3& v1, const glm::vec3& v2, const glm::vec3& v3, const glm::vec2 uv1, const glm::vec2 uv2, const glm::vec2 uv3);
 
@@ -153,24 +173,29 @@ public:
 	virtual VertexesLoader* clone() = 0;		//!< Create a new object of children type and return its pointer.
 
 	void loadVertexes(Renderer& r, ModelData& model);   //!< Get vertexes from source and store them in "result" ("resources" is used to store additional resources, if they exist).
+	VertexesLoader* useMeshlets(uint32_t maxVertices = 65536);   //!< Split the mesh into meshlets of up to maxVertices vertices (<= 65536 keeps 16-bit indices). Only for list topologies (points, lines, triangles). Returns this object (so it can be chained with a factory method).
+
+	/// Reorder vertices and indices into meshlets of up to maxVertices vertices (vertices shared by different meshlets are duplicated). The resulting indices are relative to the first vertex of their meshlet (Meshlet::vertexOffset). primitiveSize: 1 (points), 2 (lines), 3 (triangles).
+	static void splitIntoMeshlets(VertexSet& vertices, std::vector<uint32_t>& indices, std::vector<Meshlet>& meshlets, uint32_t maxVertices, uint32_t primitiveSize);
 };
 
 /// Pass all the vertices at construction time. Call to getRawData will pass these vertices.
 class VL_fromBuffer : public VertexesLoader
 {
-	VL_fromBuffer(const void* verticesData, uint32_t vertexSize, uint32_t vertexCount, const std::vector<uint16_t>& indices = { }, std::initializer_list<VerticesModifier*> modifiers = { });
+	VL_fromBuffer(const void* verticesData, uint32_t vertexSize, uint32_t vertexCount, const std::vector<uint32_t>& indices, std::initializer_list<VerticesModifier*> modifiers);
 
 	VertexSet rawVertices;
-	std::vector<uint16_t> rawIndices;
+	std::vector<uint32_t> rawIndices;
 
-	void getRawData(VertexSet& destVertices, std::vector<uint16_t>& destIndices, ModelData& model) override;
+	void getRawData(VertexSet& destVertices, std::vector<uint32_t>& destIndices, ModelData& model) override;
 
 public:
 	static VL_fromBuffer* factory(const void* verticesData, size_t vertexSize, size_t vertexCount, const std::vector<uint16_t>& indices = { }, std::initializer_list<VerticesModifier*> modifiers = {});
+	static VL_fromBuffer* factory(const void* verticesData, size_t vertexSize, size_t vertexCount, const std::vector<uint32_t>& indices, std::initializer_list<VerticesModifier*> modifiers = {});   //!< For meshes with more than 65536 vertices.
 	VertexesLoader* clone() override;
 };
 
-/// Call to getRawData process a graphics file (OBJ, ...) and gets the meshes. Assumes vertexes are: position, normal, texture coordinates. <<< Problem: This takes all the meshes in each node and stores them together. However, meshes from different nodes have their own indices, all of them in the range [0, number of vertices in the mesh). Since each mesh is an independent object, they cannot be put together without messing up with the indices (they should be stored as different models). 
+/// Call to getRawData process a graphics file (OBJ, ...) and gets the meshes. Assumes vertexes are: position, normal, texture coordinates. All the meshes are stored together (the indices of each mesh are rebased to the position of its first vertex).
 class VL_fromFile : public VertexesLoader
 {
 	VL_fromFile(std::string filePath, std::initializer_list<VerticesModifier*> modifiers);	//!< vertexSize == (3+3+2) * sizeof(float)
@@ -178,14 +203,14 @@ class VL_fromFile : public VertexesLoader
 	std::string path;
 
 	VertexSet* vertices;
-	std::vector<uint16_t>* indices;
+	std::vector<uint32_t>* indices;
 	ModelData* model;   //!< Used to store textures if the file includes them.
 
 	void processNode(const aiScene* scene, aiNode* node);					//!< Recursive function. It goes through each node getting all the meshes in each one.
 	void processMeshes(const aiScene* scene, std::vector<aiMesh*>& meshes);	//!< Get Vertex data, Indices, and Resources (textures).
 	void allocateMemForTextures();   //!< Add set and binding in bindSets if they doesn't exist.
 
-	void getRawData(VertexSet& destVertices, std::vector<uint16_t>& destIndices, ModelData& model) override;
+	void getRawData(VertexSet& destVertices, std::vector<uint32_t>& destIndices, ModelData& model) override;
 
 public:
 	static VL_fromFile* factory(std::string filePath, std::initializer_list<VerticesModifier*> modifiers = {});	//!< From file (vertexSize == (3+3+2) * sizeof(float))
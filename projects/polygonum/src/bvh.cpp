@@ -0,0 +1,526 @@
+#include <iostream>
+#include <algorithm>
+#include <limits>
+
+#include "polygonum/bvh.hpp"
+
+
+namespace
+{
+	inline float surfaceArea(const glm::vec3& min, const glm::vec3& max)
+	{
+		glm::vec3 d = max - min;
+		return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	inline bool contains(const glm::vec3& outerMin, const glm::vec3& outerMax, const glm::vec3& innerMin, const glm::vec3& innerMax)
+	{
+		return glm::all(glm::lessThanEqual(outerMin, innerMin)) && glm::all(glm::lessThanEqual(innerMax, outerMax));
+	}
+
+	inline bool overlap(const glm::vec3& minA, const glm::vec3& maxA, const glm::vec3& minB, const glm::vec3& maxB)
+	{
+		return glm::all(glm::lessThanEqual(minA, maxB)) && glm::all(glm::lessThanEqual(minB, maxA));
+	}
+
+	/// Slab test. Returns the distance to the entry point (0 if the origin is inside), or -1 if missed or farther than maxDistance.
+	inline float rayAABB(const glm::vec3& origin, const glm::vec3& invDirection, float maxDistance, const glm::vec3& min, const glm::vec3& max)
+	{
+		float tNear = 0.f, tFar = maxDistance;
+
+		for (int i = 0; i < 3; i++)
+		{
+			float t0 = (min[i] - origin[i]) * invDirection[i];
+			float t1 = (max[i] - origin[i]) * invDirection[i];
+			if (t0 > t1) std::swap(t0, t1);
+
+			// An axis-parallel ray whose origin is on a slab's plane gives 0 * inf = NaN. std::max/std::min return their first argument if the comparison is false, so NaN is discarded (the ray is inside that slab).
+			tNear = std::max(tNear, t0);
+			tFar = std::min(tFar, t1);
+		}
+
+		return tNear <= tFar ? tNear : -1.f;
+	}
+}
+
+BVH::BVH(float margin)
+	: root(-1), numLeaves(0), internalArea(0), builtCost(-1), margin(margin) { }
+
+int32_t BVH::allocateNode()
+{
+	int32_t index;
+
+	if (freeNodes.size())
+	{
+		index = freeNodes.back();
+		freeNodes.pop_back();
+	}
+	else
+	{
+		index = static_cast<int32_t>(nodes.size());
+		nodes.emplace_back();
+	}
+
+	Node& node = nodes[index];
+	node.min = node.max = glm::vec3(0);
+	node.parent = node.left = node.right = -1;
+	node.item = BVHItem{ 0, 0 };
+	node.free = false;
+
+	return index;
+}
+
+void BVH::freeNode(int32_t node)
+{
+	nodes[node].free = true;
+	nodes[node].left = nodes[node].right = -1;
+	freeNodes.push_back(node);
+}
+
+void BVH::setBounds(int32_t node, const glm::vec3& min, const glm::vec3& max)
+{
+	Node& n = nodes[node];
+	if (!n.isLeaf()) internalArea += surfaceArea(min, max) - surfaceArea(n.min, n.max);
+	n.min = min;
+	n.max = max;
+}
+
+void BVH::refit(int32_t node)
+{
+	while (node >= 0)
+	{
+		const Node& n = nodes[node];
+		glm::vec3 min = glm::min(nodes[n.left].min, nodes[n.right].min);
+		glm::vec3 max = glm::max(nodes[n.left].max, nodes[n.right].max);
+		if (min == n.min && max == n.max) break;   // Ancestors don't change either.
+
+		setBounds(node, min, max);
+		node = nodes[node].parent;
+	}
+}
+
+/**
+	Descend from the root choosing, at each node, between making the new leaf its sibling (cost: area of the new parent) or going down to the child whose enlargement is cheaper.
+	Descending costs the enlargement of the current node (inherited by all the nodes below).
+*/
+void BVH::insertLeaf(int32_t leaf)
+{
+	if (root < 0)
+	{
+		root = leaf;
+		nodes[leaf].parent = -1;
+		return;
+	}
+
+	glm::vec3 leafMin = nodes[leaf].min, leafMax = nodes[leaf].max;
+	int32_t index = root;
+
+	while (!nodes[index].isLeaf())
+	{
+		const Node& node = nodes[index];
+		float area = surfaceArea(node.min, node.max);
+		float combinedArea = surfaceArea(glm::min(node.min, leafMin), glm::max(node.max, leafMax));
+		float siblingCost = 2.f * combinedArea;
+		float inheritanceCost = 2.f * (combinedArea - area);
+
+		float childCost[2];
+		int32_t children[2] = { node.left, node.right };
+		for (int i = 0; i < 2; i++)
+		{
+			const Node& child = nodes[children[i]];
+			float enlarged = surfaceArea(glm::min(child.min, leafMin), glm::max(child.max, leafMax));
+			childCost[i] = (child.isLeaf() ? enlarged : enlarged - surfaceArea(child.min, child.max)) + inheritanceCost;
+		}
+
+		if (siblingCost < childCost[0] && siblingCost < childCost[1]) break;
+		index = childCost[0] < childCost[1] ? children[0] : children[1];
+	}
+
+	// New parent for the sibling and the leaf
+	int32_t sibling = index;
+	int32_t oldParent = nodes[sibling].parent;
+	int32_t newParent = allocateNode();   // May reallocate "nodes".
+
+	nodes[newParent].parent = oldParent;
+	nodes[newParent].left = sibling;
+	nodes[newParent].right = leaf;
+	setBounds(newParent, glm::min(nodes[sibling].min, leafMin), glm::max(nodes[sibling].max, leafMax));
+	nodes[sibling].parent = newParent;
+	nodes[leaf].parent = newParent;
+
+	if (oldParent < 0) root = newParent;
+	else
+	{
+		if (nodes[oldParent].left == sibling) nodes[oldParent].left = newParent;
+		else nodes[oldParent].right = newParent;
+		refit(oldParent);
+	}
+}
+
+void BVH::removeLeaf(int32_t leaf)
+{
+	if (leaf == root)
+	{
+		root = -1;
+		return;
+	}
+
+	int32_t parent = nodes[leaf].parent;
+	int32_t grandParent = nodes[parent].parent;
+	int32_t sibling = (nodes[parent].left == leaf) ? nodes[parent].right : nodes[parent].left;
+
+	internalArea -= surfaceArea(nodes[parent].min, nodes[parent].max);
+	freeNode(parent);
+
+	nodes[sibling].parent = grandParent;
+	nodes[leaf].parent = -1;
+
+	if (grandParent < 0) root = sibling;
+	else
+	{
+		if (nodes[grandParent].left == parent) nodes[grandParent].left = sibling;
+		else nodes[grandParent].right = sibling;
+		refit(grandParent);
+	}
+}
+
+uint32_t BVH::insert(const AABB& aabb, key64 model, uint32_t instance)
+{
+	int32_t leaf = allocateNode();
+	nodes[leaf].item = BVHItem{ model, instance };
+	setBounds(leaf, aabb.min - glm::vec3(margin), aabb.max + glm::vec3(margin));
+
+	insertLeaf(leaf);
+	numLeaves++;
+
+	return static_cast<uint32_t>(leaf);
+}
+
+void BVH::remove(uint32_t proxy)
+{
+	if (proxy >= nodes.size() || nodes[proxy].free || !nodes[proxy].isLeaf())
+		throw std::runtime_error("Invalid BVH proxy!");
+
+	removeLeaf(proxy);
+	freeNode(proxy);
+	numLeaves--;
+}
+
+bool BVH::update(uint32_t proxy, const AABB& aabb)
+{
+	if (proxy >= nodes.size() || nodes[proxy].free || !nodes[proxy].isLeaf())
+		throw std::runtime_error("Invalid BVH proxy!");
+
+	if (contains(nodes[proxy].min, nodes[proxy].max, aabb.min, aabb.max)) return false;   // Still inside the enlarged AABB.
+
+	setBounds(proxy, aabb.min - glm::vec3(margin), aabb.max + glm::vec3(margin));
+	refit(nodes[proxy].parent);
+
+	return true;
+}
+
+bool BVH::optimize()
+{
+	if (numLeaves < 3) return false;
+
+	if (builtCost < 0)   // Never built top-down: the tree built by insertions is the reference.
+	{
+		builtCost = getCost();
+		return false;
+	}
+
+	if (getCost() <= rebuildThreshold * builtCost) return false;
+
+	rebuild();
+	return true;
+}
+
+void BVH::rebuild()
+{
+	std::vector<int32_t> leaves;
+	leaves.reserve(numLeaves);
+
+	for (int32_t i = 0; i < (int32_t)nodes.size(); i++)
+	{
+		if (nodes[i].free) continue;
+		if (nodes[i].isLeaf()) leaves.push_back(i);
+		else freeNode(i);
+	}
+
+	internalArea = 0;
+	root = leaves.size() ? build(leaves.data(), leaves.size()) : -1;
+	if (root >= 0) nodes[root].parent = -1;
+	builtCost = getCost();
+
+#ifdef DEBUG_MODELS
+	std::cout << typeid(*this).name() << "::" << __func__ << ": " << numLeaves << " objects, SAH cost " << builtCost << std::endl;
+#endif
+}
+
+/**
+	Leaves are distributed in bins along the axis where their centroids are more spread out. The split between bins with the lowest SAH cost (area * number of leaves, for each side) is chosen.
+	If all centroids are at the same point, leaves are split in halves.
+*/
+int32_t BVH::build(int32_t* leaves, size_t count)
+{
+	if (count == 1) return leaves[0];
+
+	// Centroid bounds
+	glm::vec3 centroidMin(std::numeric_limits<float>::max()), centroidMax(-std::numeric_limits<float>::max());
+	for (size_t i = 0; i < count; i++)
+	{
+		glm::vec3 centroid = (nodes[leaves[i]].min + nodes[leaves[i]].max) * 0.5f;
+		centroidMin = glm::min(centroidMin, centroid);
+		centroidMax = glm::max(centroidMax, centroid);
+	}
+
+	glm::vec3 extent = centroidMax - centroidMin;
+	int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+	size_t mid = count / 2;
+
+	if (extent[axis] > 0)
+	{
+		struct Bin
+		{
+			glm::vec3 min = glm::vec3(std::numeric_limits<float>::max()), max = glm::vec3(-std::numeric_limits<float>::max());
+			size_t count = 0;
+		} bins[numBins];
+
+		float scale = numBins / extent[axis];
+		auto getBin = [&](int32_t leaf)
+		{
+			float centroid = (nodes[leaf].min[axis] + nodes[leaf].max[axis]) * 0.5f;
+			return std::min(numBins - 1, (uint32_t)((centroid - centroidMin[axis]) * scale));
+		};
+
+		for (size_t i = 0; i < count; i++)
+		{
+			Bin& bin = bins[getBin(leaves[i])];
+			bin.min = glm::min(bin.min, nodes[leaves[i]].min);
+			bin.max = glm::max(bin.max, nodes[leaves[i]].max);
+			bin.count++;
+		}
+
+		// Areas and counts at the right of each split (sweep from the right)
+		float rightArea[numBins];
+		size_t rightCount[numBins];
+		Bin right;
+		for (uint32_t i = numBins - 1; i > 0; i--)
+		{
+			right.min = glm::min(right.min, bins[i].min);
+			right.max = glm::max(right.max, bins[i].max);
+			right.count += bins[i].count;
+			rightArea[i] = right.count ? surfaceArea(right.min, right.max) : 0;
+			rightCount[i] = right.count;
+		}
+
+		// Sweep from the left. Split i: bins [0, i) on the left, [i, numBins) on the right.
+		float bestCost = std::numeric_limits<float>::max();
+		uint32_t bestSplit = 0;
+		Bin left;
+		for (uint32_t i = 1; i < numBins; i++)
+		{
+			left.min = glm::min(left.min, bins[i - 1].min);
+			left.max = glm::max(left.max, bins[i - 1].max);
+			left.count += bins[i - 1].count;
+			if (!left.count || !rightCount[i]) continue;
+
+			float cost = left.count * surfaceArea(left.min, left.max) + rightCount[i] * rightArea[i];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestSplit = i;
+			}
+		}
+
+		if (bestSplit)   // Always found (the first and last bins contain leaves), unless precision issues.
+			mid = std::partition(leaves, leaves + count, [&](int32_t leaf) { return getBin(leaf) < bestSplit; }) - leaves;
+	}
+
+	int32_t left = build(leaves, mid);
+	int32_t right = build(leaves + mid, count - mid);
+	int32_t node = allocateNode();   // May reallocate "nodes".
+
+	nodes[node].left = left;
+	nodes[node].right = right;
+	nodes[left].parent = node;
+	nodes[right].parent = node;
+	setBounds(node, glm::min(nodes[left].min, nodes[right].min), glm::max(nodes[left].max, nodes[right].max));
+
+	return node;
+}
+
+void BVH::clear()
+{
+	nodes.clear();
+	freeNodes.clear();
+	root = -1;
+	numLeaves = 0;
+	internalArea = 0;
+	builtCost = -1;
+}
+
+const BVHItem& BVH::getItem(uint32_t proxy) const { return nodes[proxy].item; }
+
+AABB BVH::getBounds(uint32_t proxy) const { return AABB(nodes[proxy].min, nodes[proxy].max); }
+
+size_t BVH::size() const { return numLeaves; }
+
+float BVH::getCost() const
+{
+	if (root < 0) return 0;
+
+	float rootArea = surfaceArea(nodes[root].min, nodes[root].max);
+	return rootArea > 0 ? internalArea / rootArea : 0;
+}
+
+/**
+	Each node in the stack carries the planes that its parent intersects (bitmask). Planes that fully contain a node are not tested in its subtree.
+	When a node is fully inside the frustum, all the leaves below it are appended without further tests.
+*/
+size_t BVH::queryFrustum(const Frustum& frustum, std::vector<BVHItem>& result) const
+{
+	if (root < 0) return 0;
+
+	size_t initialSize = result.size();
+	std::vector<std::pair<int32_t, uint8_t>> stack;
+	stack.reserve(64);
+	stack.push_back({ root, 0x3F });
+
+	while (stack.size())
+	{
+		int32_t index = stack.back().first;
+		uint8_t planes = stack.back().second;
+		stack.pop_back();
+		const Node& node = nodes[index];
+
+		bool outside = false;
+		for (uint32_t i = 0; i < 6 && !outside; i++)
+		{
+			if (!(planes & (1 << i))) continue;
+
+			const Plane& plane = frustum.planes[i];
+			glm::vec3 positive = glm::mix(node.min, node.max, glm::greaterThan(plane.normal, glm::vec3(0)));   // Most aligned corner with the normal.
+			glm::vec3 negative = glm::mix(node.max, node.min, glm::greaterThan(plane.normal, glm::vec3(0)));
+
+			if (plane.distanceToPoint(positive) < 0) outside = true;
+			else if (plane.distanceToPoint(negative) >= 0) planes &= ~(1 << i);   // Fully inside this plane.
+		}
+
+		if (outside) continue;
+		if (node.isLeaf()) result.push_back(node.item);
+		else
+		{
+			stack.push_back({ node.right, planes });
+			stack.push_back({ node.left, planes });
+		}
+	}
+
+	return result.size() - initialSize;
+}
+
+size_t BVH::querySphere(const Sphere& sphere, std::vector<BVHItem>& result) const
+{
+	if (root < 0) return 0;
+
+	size_t initialSize = result.size();
+	float sqrRadius = sphere.radius * sphere.radius;
+	std::vector<int32_t> stack;
+	stack.reserve(64);
+	stack.push_back(root);
+
+	while (stack.size())
+	{
+		const Node& node = nodes[stack.back()];
+		stack.pop_back();
+
+		glm::vec3 closest = glm::clamp(sphere.center, node.min, node.max);   // Closest point of the AABB to the center.
+		glm::vec3 d = closest - sphere.center;
+		if (glm::dot(d, d) > sqrRadius) continue;
+
+		if (node.isLeaf()) result.push_back(node.item);
+		else
+		{
+			stack.push_back(node.right);
+			stack.push_back(node.left);
+		}
+	}
+
+	return result.size() - initialSize;
+}
+
+size_t BVH::queryAABB(const AABB& aabb, std::vector<BVHItem>& result) const
+{
+	if (root < 0) return 0;
+
+	size_t initialSize = result.size();
+	std::vector<int32_t> stack;
+	stack.reserve(64);
+	stack.push_back(root);
+
+	while (stack.size())
+	{
+		const Node& node = nodes[stack.back()];
+		stack.pop_back();
+
+		if (!overlap(node.min, node.max, aabb.min, aabb.max)) continue;
+
+		if (node.isLeaf()) result.push_back(node.item);
+		else
+		{
+			stack.push_back(node.right);
+			stack.push_back(node.left);
+		}
+	}
+
+	return result.size() - initialSize;
+}
+
+bool BVH::rayCast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, BVHHit& hit, const std::function<bool(const BVHItem&, float&)>& test) const
+{
+	if (root < 0) return false;
+
+	glm::vec3 invDirection = 1.f / direction;   // Infinite components for axis-parallel rays.
+	float closest = maxDistance;
+	bool found = false;
+
+	std::vector<std::pair<int32_t, float>> stack;   // <node, distance to its AABB>
+	stack.reserve(64);
+
+	float rootDistance = rayAABB(origin, invDirection, closest, nodes[root].min, nodes[root].max);
+	if (rootDistance >= 0) stack.push_back({ root, rootDistance });
+
+	while (stack.size())
+	{
+		int32_t index = stack.back().first;
+		float distance = stack.back().second;
+		stack.pop_back();
+		if (distance > closest) continue;   // A closer hit was found after pushing this node.
+
+		const Node& node = nodes[index];
+
+		if (node.isLeaf())
+		{
+			if (test && !test(node.item, distance)) continue;
+			if (distance > closest) continue;
+
+			closest = distance;
+			hit.item = node.item;
+			hit.proxy = static_cast<uint32_t>(index);
+			hit.distance = distance;
+			found = true;
+			continue;
+		}
+
+		// Push the farthest child first, so the nearest is visited first.
+		float leftDistance = rayAABB(origin, invDirection, closest, nodes[node.left].min, nodes[node.left].max);
+		float rightDistance = rayAABB(origin, invDirection, closest, nodes[node.right].min, nodes[node.right].max);
+		std::pair<int32_t, float> nearest = { node.left, leftDistance }, farthest = { node.right, rightDistance };
+		if (nearest.second < 0 || (farthest.second >= 0 && farthest.second < nearest.second)) std::swap(nearest, farthest);
+
+		if (farthest.second >= 0) stack.push_back(farthest);
+		if (nearest.second >= 0) stack.push_back(nearest);
+	}
+
+	return found;
+}
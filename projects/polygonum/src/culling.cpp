@@ -0,0 +1,374 @@
+#include <iostream>
+#include <limits>
+#include <cstring>
+
+#include "polygonum/culling.hpp"
+#include "polygonum/renderer.hpp"
+
+
+const char* CullingManager::shaderCode = R"(
+#version 450
+#pragma shader_stage(compute)
+
+layout(local_size_x = 64) in;
+
+struct DrawCommand { uint indexCount; uint instanceCount; uint firstIndex; int vertexOffset; uint firstInstance; };
+
+layout(std430, set = 0, binding = 0) readonly buffer Bounds { vec4 planes[6]; vec4 spheres[]; } bounds;   // planes: xyz (normal), w (distance). spheres: xyz (center), w (radius).
+layout(std430, set = 0, binding = 1) writeonly buffer Visible { uint instances[]; } visible;
+layout(std430, set = 0, binding = 2) buffer Indirect { uint drawCount; uint visibleCount; uint pad0; uint pad1; DrawCommand commands[]; } indirect;
+
+layout(push_constant) uniform Params { uint numInstances; uint numCommands; uint pass; } params;
+
+void main()
+{
+	uint i = gl_GlobalInvocationID.x;
+
+	if (params.pass == 0)   // Cull instances and compact the visible ones
+	{
+		if (i >= params.numInstances) return;
+
+		vec4 sphere = bounds.spheres[i];
+		for (int p = 0; p < 6; p++)
+			if (dot(bounds.planes[p].xyz, sphere.xyz) + bounds.planes[p].w < -sphere.w)
+				return;
+
+		visible.instances[atomicAdd(indirect.visibleCount, 1)] = i;
+	}
+	else   // Write instance count of each draw command
+	{
+		if (i >= params.numCommands) return;
+
+		indirect.commands[i].instanceCount = indirect.visibleCount;
+		if (i == 0) indirect.drawCount = indirect.visibleCount > 0 ? params.numCommands : 0;
+	}
+}
+)";
+
+/// Push constants of the culling compute shader.
+struct CullingParams
+{
+	uint32_t numInstances;
+	uint32_t numCommands;
+	uint32_t pass;   //!< 0 (cull instances), 1 (write instance counts)
+};
+
+CullingManager::CullingManager(VulkanCore& core)
+	: c(core), descriptorSetLayout(VK_NULL_HANDLE), pipelineLayout(VK_NULL_HANDLE), pipeline(VK_NULL_HANDLE)
+{
+	for (Plane& plane : frustum.planes)
+		plane.dist = std::numeric_limits<float>::max();   // Nothing is culled until setFrustum() is called.
+
+	frameFrustum = frustum;
+}
+
+void CullingManager::create(PointersManager<std::string, Shader>& loadedShaders)
+{
+	const std::lock_guard<std::mutex> lock(mutCulling);
+	if (pipeline) return;
+
+#ifdef DEBUG_RESOURCES
+	std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
+#endif
+
+	// Shader
+	std::unique_ptr<ShaderLoader> loader(SL_fromBuffer::factory("cullingComputeShader", shaderCode));
+	shader = loader->loadShader(loadedShaders, c);
+
+	// Descriptor set layout
+	std::vector<VkDescriptorSetLayoutBinding> bindings(3);
+	for (uint32_t i = 0; i < bindings.size(); i++)
+	{
+		bindings[i].binding = i;
+		bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		bindings[i].descriptorCount = 1;
+		bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		bindings[i].pImmutableSamplers = nullptr;
+	}
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+	layoutInfo.pBindings = bindings.data();
+
+	if (vkCreateDescriptorSetLayout(c.device, &layoutInfo, nullptr, &descriptorSetLayout) != VK_SUCCESS)
+		throw std::runtime_error("Failed to create culling descriptor set layout!");
+
+	// Pipeline layout
+	VkPushConstantRange pushConstant{};
+	pushConstant.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstant.offset = 0;
+	pushConstant.size = sizeof(CullingParams);
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &descriptorSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstant;
+
+	if (vkCreatePipelineLayout(c.device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
+		throw std::runtime_error("Failed to create culling pipeline layout!");
+
+	// Compute pipeline
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipelineInfo.stage.module = shader->shaderModule;
+	pipelineInfo.stage.pName = "main";
+	pipelineInfo.layout = pipelineLayout;
+
+	if (vkCreateComputePipelines(c.device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS)
+		throw std::runtime_error("Failed to create culling compute pipeline!");
+}
+
+void CullingManager::destroy()
+{
+	const std::lock_guard<std::mutex> lock(mutCulling);
+
+	if (pipeline) vkDestroyPipeline(c.device, pipeline, nullptr);
+	if (pipelineLayout) vkDestroyPipelineLayout(c.device, pipelineLayout, nullptr);
+	if (descriptorSetLayout) vkDestroyDescriptorSetLayout(c.device, descriptorSetLayout, nullptr);
+
+	pipeline = VK_NULL_HANDLE;
+	pipelineLayout = VK_NULL_HANDLE;
+	descriptorSetLayout = VK_NULL_HANDLE;
+	shader.reset();
+}
+
+void CullingManager::setFrustum(const Frustum& frustum) { this->frustum = frustum; }
+
+const Frustum& CullingManager::getFrustum() const { return frustum; }
+
+void CullingManager::setFrameFrustum(const Frustum& frustum) { frameFrustum = frustum; }
+
+InstanceCulling::InstanceCulling(CullingManager& manager, uint32_t maxInstances)
+	: manager(manager),
+	r(nullptr),
+	capacity(maxInstances),
+	bounds(ssbo, 1, 1, planesSize + (VkDeviceSize)maxInstances * sizeof(glm::vec4)),
+	descriptorPool(VK_NULL_HANDLE)
+{
+	for (uint32_t i = 0; i < capacity; i++)   // Instances without bounds are always visible.
+		setBounds(i, Sphere(glm::vec3(0), std::numeric_limits<float>::max()));
+}
+
+InstanceCulling::~InstanceCulling() { destroyResources(); }
+
+void InstanceCulling::setBounds(uint32_t instance, const Sphere& sphere)
+{
+	glm::vec4 data(sphere.center, sphere.radius);
+	setBounds(instance, 1, &data);
+}
+
+void InstanceCulling::setBounds(uint32_t firstInstance, uint32_t count, const glm::vec4* spheres)
+{
+	if ((uint64_t)firstInstance + count > capacity)
+		throw std::runtime_error("Failed to set bounds: Instance out of range!");
+
+	uint32_t offset = planesSize + firstInstance * sizeof(glm::vec4);
+	std::memcpy(bounds.binding.data() + offset, spheres, count * sizeof(glm::vec4));
+	bounds.setDirty(offset, count * sizeof(glm::vec4));
+}
+
+uint32_t InstanceCulling::getCapacity() const { return capacity; }
+
+BindingBuffer& InstanceCulling::getBounds() { return bounds; }
+
+void InstanceCulling::createResources(Renderer* renderer, const VertexData& vert)
+{
+	if (!vert.indexCount)
+		throw std::runtime_error("Failed to create culling resources: GPU culling requires indices!");
+
+	r = renderer;
+	VulkanCore& c = r->c;
+	manager.create(r->shaders);
+
+	// Draw commands (instanceCount is written by the compute pass)
+	commands.clear();
+	if (vert.meshlets.size())
+		for (const Meshlet& meshlet : vert.meshlets)
+			commands.push_back({ meshlet.indexCount, 0, vert.firstIndex + meshlet.firstIndex, static_cast<int32_t>(vert.firstVertex) + meshlet.vertexOffset, 0 });
+	else
+		commands.push_back({ vert.indexCount, 0, vert.firstIndex, static_cast<int32_t>(vert.firstVertex), 0 });
+
+	std::vector<uint8_t> indirectData(headerSize + commands.size() * sizeof(VkDrawIndexedIndirectCommand), 0);
+	std::memcpy(indirectData.data() + headerSize, commands.data(), commands.size() * sizeof(VkDrawIndexedIndirectCommand));
+
+	// Buffers (one set per swapchain image)
+	size_t numImages = r->swapChain.numImages();
+	bounds.createBuffer(r);
+	visibleBuffers.resize(numImages);
+	visibleMemories.resize(numImages);
+	indirectBuffers.resize(numImages);
+	indirectMemories.resize(numImages);
+
+	for (size_t i = 0; i < numImages; i++)
+	{
+		c.createBuffer(
+			(VkDeviceSize)std::max(capacity, 1u) * sizeof(uint32_t),
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			visibleBuffers[i],
+			visibleMemories[i]);
+
+		c.createBuffer(
+			indirectData.size(),
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			indirectBuffers[i],
+			indirectMemories[i]);
+
+		r->uploader.uploadBuffer(indirectBuffers[i], indirectData.data(), indirectData.size());
+	}
+
+	// Descriptor sets
+	VkDescriptorPoolSize poolSize;
+	poolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	poolSize.descriptorCount = static_cast<uint32_t>(3 * numImages);
+
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = 1;
+	poolInfo.pPoolSizes = &poolSize;
+	poolInfo.maxSets = static_cast<uint32_t>(numImages);
+
+	if (vkCreateDescriptorPool(c.device, &poolInfo, nullptr, &descriptorPool) != VK_SUCCESS)
+		throw std::runtime_error("Failed to create culling descriptor pool!");
+
+	std::vector<VkDescriptorSetLayout> layouts(numImages, manager.descriptorSetLayout);
+
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = descriptorPool;
+	allocInfo.descriptorSetCount = static_cast<uint32_t>(numImages);
+	allocInfo.pSetLayouts = layouts.data();
+
+	descriptorSets.resize(numImages);
+	if (vkAllocateDescriptorSets(c.device, &allocInfo, descriptorSets.data()) != VK_SUCCESS)
+		throw std::runtime_error("Failed to allocate culling descriptor sets!");
+
+	for (size_t i = 0; i < numImages; i++)
+	{
+		VkDescriptorBufferInfo bufferInfos[3] = {
+			{ bounds.bindingBuffers[i], 0, bounds.getCapacity() },
+			{ visibleBuffers[i], 0, VK_WHOLE_SIZE },
+			{ indirectBuffers[i], 0, VK_WHOLE_SIZE } };
+
+		VkWriteDescriptorSet writes[3]{};
+		for (uint32_t b = 0; b < 3; b++)
+		{
+			writes[b].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writes[b].dstSet = descriptorSets[i];
+			writes[b].dstBinding = b;
+			writes[b].dstArrayElement = 0;
+			writes[b].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			writes[b].descriptorCount = 1;
+			writes[b].pBufferInfo = &bufferInfos[b];
+		}
+
+		vkUpdateDescriptorSets(c.device, 3, writes, 0, nullptr);
+	}
+}
+
+void InstanceCulling::destroyResources()
+{
+	if (!r) return;
+
+	VulkanCore& c = r->c;
+
+	for (size_t i = 0; i < visibleBuffers.size(); i++)
+	{
+		c.destroyBuffer(c.device, visibleBuffers[i], visibleMemories[i]);
+		c.destroyBuffer(c.device, indirectBuffers[i], indirectMemories[i]);
+	}
+
+	visibleBuffers.clear();
+	visibleMemories.clear();
+	indirectBuffers.clear();
+	indirectMemories.clear();
+	bounds.destroyBuffer();
+
+	if (descriptorPool) vkDestroyDescriptorPool(c.device, descriptorPool, nullptr);   // Descriptor sets are freed with their pool.
+	descriptorPool = VK_NULL_HANDLE;
+	descriptorSets.clear();
+
+	r = nullptr;
+}
+
+void InstanceCulling::updateMemory(uint32_t imageIndex)
+{
+	glm::vec4 planes[6];
+	for (size_t p = 0; p < 6; p++)
+		planes[p] = glm::vec4(manager.frameFrustum.planes[p].normal, manager.frameFrustum.planes[p].dist);
+
+	if (std::memcmp(bounds.getFrameData(), planes, planesSize))
+		bounds.setFrameData(0, planes, planesSize);
+
+	bounds.updateMemory(imageIndex);
+}
+
+VkBuffer InstanceCulling::getVisibleBuffer(size_t imageIndex) const { return visibleBuffers[imageIndex]; }
+
+void InstanceCulling::recordDraw(VkCommandBuffer commandBuffer, size_t imageIndex) const
+{
+	const DeviceData& device = r->c.deviceData;
+	uint32_t numCommands = static_cast<uint32_t>(commands.size());
+	uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+	bool multiDraw = device.multiDrawIndirect && numCommands <= device.maxDrawIndirectCount;
+
+	if (device.drawIndirectCount && (multiDraw || numCommands == 1))   // Draw count taken from the buffer (0 if no instance is visible).
+		vkCmdDrawIndexedIndirectCount(commandBuffer, indirectBuffers[imageIndex], headerSize, indirectBuffers[imageIndex], 0, numCommands, stride);
+	else if (multiDraw)   // Commands with instanceCount == 0 draw nothing.
+		vkCmdDrawIndexedIndirect(commandBuffer, indirectBuffers[imageIndex], headerSize, numCommands, stride);
+	else
+		for (uint32_t i = 0; i < numCommands; i++)
+			vkCmdDrawIndexedIndirect(commandBuffer, indirectBuffers[imageIndex], headerSize + i * stride, 1, stride);
+}
+
+void InstanceCulling::recordCulling(VkCommandBuffer commandBuffer, size_t imageIndex, const std::vector<std::pair<InstanceCulling*, uint32_t>>& models)
+{
+	if (models.empty()) return;
+
+	CullingManager& manager = models[0].first->manager;
+	VkMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+
+	// Reset header (draw count, visible count)
+	for (auto& model : models)
+		vkCmdFillBuffer(commandBuffer, model.first->indirectBuffers[imageIndex], 0, headerSize, 0);
+
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, manager.pipeline);
+
+	// Pass 0: Cull instances. Pass 1: Write instance counts (needs the final visible count).
+	for (uint32_t pass = 0; pass < 2; pass++)
+	{
+		for (auto& model : models)
+		{
+			CullingParams params{ std::min(model.second, model.first->capacity), static_cast<uint32_t>(model.first->commands.size()), pass };
+			uint32_t numInvocations = pass == 0 ? params.numInstances : params.numCommands;
+			if (!numInvocations && pass == 0) continue;
+
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, manager.pipelineLayout, 0, 1, &model.first->descriptorSets[imageIndex], 0, nullptr);
+			vkCmdPushConstants(commandBuffer, manager.pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(CullingParams), &params);
+			vkCmdDispatch(commandBuffer, (numInvocations + manager.workgroupSize - 1) / manager.workgroupSize, 1, 1);
+		}
+
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		if (pass == 0)
+		{
+			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+			vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+		}
+		else
+		{
+			barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+			vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+		}
+	}
+}
@@ -3,6 +3,33 @@
 #include "polygonum/ecs.hpp"
 
 
+std::deque<ComponentInfo>& ComponentRegistry::getInfos()
+{
+	static std::deque<ComponentInfo> infos;
+	return infos;
+}
+
+std::mutex& ComponentRegistry::getMutex()
+{
+	static std::mutex mutRegistry;
+	return mutRegistry;
+}
+
+const ComponentInfo& ComponentRegistry::registerType(ComponentInfo info)
+{
+	const std::lock_guard<std::mutex> lock(getMutex());
+
+	info.type = static_cast<ComponentType>(getInfos().size());
+	getInfos().push_back(info);
+	return getInfos().back();
+}
+
+const ComponentInfo& ComponentRegistry::get(ComponentType type)
+{
+	const std::lock_guard<std::mutex> lock(getMutex());
+	return getInfos()[type];
+}
+
 Component::Component()
 	: typeIndex(typeid(Component))
 { }
@@ -35,12 +62,192 @@ void Entity::printInfo()
 	std::cout << name << '(' << typeid(Entity).name() << ")\n";
 	
 	for (const auto& pair : components)
-		std::cout << "   " << pair.first.name() << '\n';
-		//std::cout << "   " << typeid(pair.second).name() << '\n';
+		std::cout << "   " << pair.first->name << '\n';
+}
+
+Archetype::Archetype(const std::vector<ComponentType>& types)
+	: capacity(0), types(types)
+{
+	for (ComponentType type : types)
+		columns.push_back(Column{ &ComponentRegistry::get(type), nullptr });
+}
+
+Archetype::~Archetype()
+{
+	for (Column& column : columns)
+	{
+		for (size_t row = 0; row < entities.size(); row++)
+			column.info->destroy(column.get(row));
+
+		if (column.data)
+			::operator delete(column.data, std::align_val_t(column.info->alignment));
+	}
+}
+
+void Archetype::reserve(size_t newCapacity)
+{
+	for (Column& column : columns)
+	{
+		uint8_t* data = static_cast<uint8_t*>(::operator new(newCapacity * column.info->size, std::align_val_t(column.info->alignment)));
+
+		for (size_t row = 0; row < entities.size(); row++)
+		{
+			column.info->moveConstruct(data + row * column.info->size, column.get(row));
+			column.info->destroy(column.get(row));
+		}
+
+		if (column.data)
+			::operator delete(column.data, std::align_val_t(column.info->alignment));
+
+		column.data = data;
+	}
+
+	capacity = newCapacity;
+}
+
+size_t Archetype::size() const { return entities.size(); }
+
+int Archetype::findColumn(ComponentType type) const
+{
+	auto it = std::lower_bound(types.begin(), types.end(), type);
+	return (it != types.end() && *it == type) ? static_cast<int>(it - types.begin()) : -1;
+}
+
+size_t Archetype::addRow(EntityId entity)
+{
+	if (entities.size() == capacity)
+		reserve(capacity ? 2 * capacity : 64);
+
+	entities.push_back(entity);
+	return entities.size() - 1;
+}
+
+EntityId Archetype::removeRow(size_t row)
+{
+	size_t last = entities.size() - 1;
+
+	for (Column& column : columns)
+	{
+		column.info->destroy(column.get(row));
+
+		if (row != last)
+		{
+			column.info->moveConstruct(column.get(row), column.get(last));
+			column.info->destroy(column.get(last));
+		}
+	}
+
+	EntityId moved = (row != last) ? entities[last] : 0;
+	entities[row] = entities[last];
+	entities.pop_back();
+
+	return moved;
+}
+
+namespace
+{
+	std::atomic<uint64_t> commandBuffersCount(0);   //!< For EntityCommandBuffer::id.
+}
+
+EntityCommandBuffer::EntityCommandBuffer() : id(++commandBuffersCount) { }
+
+EntityCommandBuffer::~EntityCommandBuffer() { }
+
+EntityCommandBuffer::Stream::~Stream()
+{
+	clear();
+
+	for (uint8_t* block : blocks)
+		::operator delete(block, std::align_val_t(blockAlignment));
+}
+
+void* EntityCommandBuffer::Stream::allocate(size_t size, size_t alignment)
+{
+	if (size > blockSize || alignment > blockAlignment)
+	{
+		uint8_t* data = static_cast<uint8_t*>(::operator new(size, std::align_val_t(alignment)));
+		bigAllocations.push_back({ data, alignment });
+		return data;
+	}
+
+	offset = alignment * ((offset + alignment - 1) / alignment);
+	if (currentBlock < blocks.size() && offset + size > blockSize)   // Doesn't fit: Go to next block.
+	{
+		currentBlock++;
+		offset = 0;
+	}
+
+	if (currentBlock == blocks.size())
+		blocks.push_back(static_cast<uint8_t*>(::operator new(blockSize, std::align_val_t(blockAlignment))));
+
+	void* data = blocks[currentBlock] + offset;
+	offset += size;
+	return data;
+}
+
+void EntityCommandBuffer::Stream::clear()
+{
+	for (ComponentData& component : components)   // Moved-from (played back) or not, they still have to be destroyed.
+		component.info->destroy(component.data);
+
+	for (auto& allocation : bigAllocations)
+		::operator delete(allocation.first, std::align_val_t(allocation.second));
+
+	commands.clear();
+	components.clear();
+	bigAllocations.clear();
+	currentBlock = 0;
+	offset = 0;
+}
+
+EntityCommandBuffer::Stream& EntityCommandBuffer::getStream()
+{
+	// Cache of the last stream used by this thread (avoids locking for each command)
+	thread_local uint64_t cachedBuffer = 0;
+	thread_local Stream* cachedStream = nullptr;
+	if (cachedBuffer == id) return *cachedStream;
+
+	const std::lock_guard<std::mutex> lock(mutStreams);
+
+	Stream*& stream = threadStreams[std::this_thread::get_id()];
+	if (!stream)
+	{
+		streams.push_back(std::make_unique<Stream>());
+		stream = streams.back().get();
+	}
+
+	cachedBuffer = id;
+	cachedStream = stream;
+	return *stream;
+}
+
+void EntityCommandBuffer::destroy(EntityId entityId)
+{
+	Stream& stream = getStream();
+	stream.commands.push_back(Command{ CommandType::destroy, entityId, nullptr, 0, 0, {} });
+}
+
+void EntityCommandBuffer::clear()
+{
+	const std::lock_guard<std::mutex> lock(mutStreams);
+
+	for (auto& stream : streams)
+		stream->clear();
+}
+
+size_t EntityCommandBuffer::size()
+{
+	const std::lock_guard<std::mutex> lock(mutStreams);
+
+	size_t count = 0;
+	for (auto& stream : streams)
+		count += stream->commands.size();
+
+	return count;
 }
 
 System::System(EntitiesManager* entityManager)
-	: typeIndex(typeid(System)), em(entityManager)
+	: typeIndex(typeid(System)), em(entityManager), declared(false)
 { }
 
 System::~System()
@@ -50,7 +257,23 @@ System::~System()
 	#endif
 };
 
-EntitiesManager::EntitiesManager() : singletonId(1) { }
+bool System::conflicts(const System& other) const
+{
+	if (!declared || !other.declared) return true;
+
+	auto intersect = [](const std::vector<ComponentType>& a, const std::vector<ComponentType>& b)
+	{
+		for (ComponentType type : a)
+			if (std::find(b.begin(), b.end(), type) != b.end())
+				return true;
+
+		return false;
+	};
+
+	return intersect(writes, other.reads) || intersect(writes, other.writes) || intersect(reads, other.writes);
+}
+
+EntitiesManager::EntitiesManager() : records(1), numEntities(0), numThreads(0), graphOutdated(true), singletonId(1) { }
 
 EntitiesManager::~EntitiesManager()
 { 
@@ -59,16 +282,27 @@ EntitiesManager::~EntitiesManager()
 	#endif
 };
 
-uint32_t EntitiesManager::getNewId()
+EntityId EntitiesManager::getNewId()
 {
-	if (lowestUnassignedId < UINT32_MAX) return lowestUnassignedId++;
-	
-	for (uint32_t i = 1; i < UINT32_MAX; ++i)
-		if (entities.find(i) == entities.end())
-			return i;
+	uint32_t index;
 
-	std::cout << "ERROR: No available IDs!" << std::endl;
-	return 0;
+	if (freeRecords.size())
+	{
+		index = freeRecords.back();
+		freeRecords.pop_back();
+	}
+	else if (records.size() < UINT32_MAX)
+	{
+		index = static_cast<uint32_t>(records.size());
+		records.emplace_back();
+	}
+	else
+	{
+		std::cout << "ERROR: No available IDs!" << std::endl;
+		return 0;
+	}
+
+	return (EntityId)records[index].generation << 32 | index;
 }
 
 void EntitiesManager::update(float timeStep)
@@ -77,45 +311,315 @@ void EntitiesManager::update(float timeStep)
 		std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 	#endif
 
-	for (auto& s : systems)
-		s->update(timeStep);
+	if (numThreads == 1 || systems.size() < 2)
+	{
+		for (auto& s : systems)
+			s->update(timeStep);
+
+		playback(commands);
+		return;
+	}
+
+	if (graphOutdated) buildGraph();
+	JobPool& pool = getJobPool();
+
+	for (size_t i = 0; i < systems.size(); i++)
+		remainingDependencies[i] = graph[i].numDependencies;
+
+	// Each system submits its dependents when they have no pending dependencies.
+	std::atomic<size_t> counter(0);
+	std::function<void(size_t)> runSystem = [&](size_t index)
+	{
+		systems[index]->update(timeStep);
+
+		for (size_t dependent : graph[index].dependents)
+			if (--remainingDependencies[dependent] == 0)
+				pool.submit([&runSystem, dependent] { runSystem(dependent); }, counter);
+	};
+
+	for (size_t i = 0; i < systems.size(); i++)
+		if (graph[i].numDependencies == 0)
+			pool.submit([&runSystem, i] { runSystem(i); }, counter);
+
+	pool.wait(counter);
+	playback(commands);   // Sync point: No system is running.
+}
+
+/**
+	Systems keep their insertion order when they conflict. Only direct conflicts are stored as edges (redundant transitive edges are harmless).
+*/
+void EntitiesManager::buildGraph()
+{
+	graph.assign(systems.size(), SystemNode{ {}, 0 });
+	remainingDependencies = std::vector<std::atomic<size_t>>(systems.size());
+
+	for (size_t j = 0; j < systems.size(); j++)
+		for (size_t i = 0; i < j; i++)
+			if (systems[i]->conflicts(*systems[j]))
+			{
+				graph[i].dependents.push_back(j);
+				graph[j].numDependencies++;
+			}
+
+	graphOutdated = false;
+
+	#ifdef DEBUG_ECS
+		for (size_t i = 0; i < systems.size(); i++)
+			std::cout << "   " << systems[i]->typeIndex.name() << ": " << graph[i].numDependencies << " dependencies, " << graph[i].dependents.size() << " dependents" << std::endl;
+	#endif
+}
+
+void EntitiesManager::setThreads(unsigned numThreads)
+{
+	if (numThreads == this->numThreads) return;
+
+	this->numThreads = numThreads;
+	jobs.reset();
+}
+
+JobPool& EntitiesManager::getJobPool()
+{
+	if (!jobs) jobs = std::make_unique<JobPool>(numThreads);
+	return *jobs;
 }
 
 void EntitiesManager::printInfo()
 {
 	std::cout << "Entities ----------\n";
-	for (const auto& e : entities)
-		e.second->printInfo();
+	for (size_t i = 0; i < records.size(); i++)
+	{
+		if (!records[i].archetype) continue;
+
+		std::cout << records[i].name << " (index: " << i << ", generation: " << records[i].generation << ")\n";
+		for (const auto& column : records[i].archetype->columns)
+			std::cout << "   " << column.info->name << '\n';
+	}
+
+	std::cout << "Archetypes --------\n";
+	for (const auto& a : archetypes)
+		std::cout << "   " << a.second->types.size() << " components, " << a.second->size() << " entities\n";
 
 	std::cout << "Systems -----------\n";
 	for (const auto& s : systems)
 		std::cout << "   " << s->typeIndex.name() << '\n';
 }
 
-uint32_t EntitiesManager::addEntity(Entity* entity)
+EntityId EntitiesManager::addEntity(Entity* entity)
 {
 	#ifdef DEBUG_ECS
 		std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 	#endif
 
-	uint32_t newId = getNewId();
+	std::vector<ComponentType> types;
+	for (auto& pair : entity->components)
+		types.push_back(pair.first->type);
+	std::sort(types.begin(), types.end());
+
+	Archetype* archetype = getArchetype(types);
+	size_t row;
+	EntityId newId = createEntity(archetype, entity->name, row);
+
 	if (newId)
-		entities[newId] = std::unique_ptr<Entity>(entity);
+		for (auto& pair : entity->components)
+			pair.first->moveConstruct(archetype->columns[archetype->findColumn(pair.first->type)].get(row), pair.second.get());
 
+	delete entity;   // Its (moved) components are destroyed.
 	return newId;
 }
 
-void EntitiesManager::removeEntity(uint32_t entityId)
+EntityId EntitiesManager::createEntity(Archetype* archetype, const std::string& name, size_t& row)
+{
+	EntityId newId = getNewId();
+	if (!newId) return 0;
+
+	row = archetype->addRow(newId);
+
+	EntityRecord& record = records[getIndex(newId)];
+	record.archetype = archetype;
+	record.row = row;
+	record.name = name;
+	numEntities++;
+
+	return newId;
+}
+
+void EntitiesManager::moveComponent(EntityId entityId, const ComponentInfo& info, void* component)
+{
+	EntityRecord* record = getRecord(entityId);
+	if (!record) return;
+
+	int column = record->archetype->findColumn(info.type);
+	if (column >= 0)   // Already there: Replace it.
+	{
+		void* destination = record->archetype->columns[column].get(record->row);
+		info.destroy(destination);
+		info.moveConstruct(destination, component);
+		return;
+	}
+
+	Archetype* destination = getArchetypeWith(record->archetype, info.type);
+	size_t row = moveEntity(entityId, *record, destination);
+	info.moveConstruct(destination->columns[destination->findColumn(info.type)].get(row), component);
+}
+
+void EntitiesManager::removeComponent(EntityId entityId, ComponentType type)
+{
+	EntityRecord* record = getRecord(entityId);
+	if (!record || record->archetype->findColumn(type) < 0) return;
+
+	moveEntity(entityId, *record, getArchetypeWithout(record->archetype, type));
+}
+
+EntityCommandBuffer& EntitiesManager::getCommands() { return commands; }
+
+/**
+	Consecutive creations with the same component types (e.g., spawning bursts) reuse the archetype found for the first one.
+	Commands on removed entities are ignored (stale handles).
+*/
+void EntitiesManager::playback(EntityCommandBuffer& buffer)
 {
 	#ifdef DEBUG_ECS
 		std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 	#endif
 
-	if (entities.find(entityId) != entities.end())
-		entities.erase(entityId);
+	const std::lock_guard<std::mutex> lock(buffer.mutStreams);
+
+	for (auto& stream : buffer.streams)
+	{
+		const EntityCommandBuffer::CreateLayout* lastLayout = nullptr;
+		Archetype* archetype = nullptr;
+
+		for (EntityCommandBuffer::Command& command : stream->commands)
+			switch (command.type)
+			{
+			case EntityCommandBuffer::CommandType::create:
+			{
+				if (command.layout != lastLayout)
+				{
+					archetype = getArchetype(command.layout->types);
+					lastLayout = command.layout;
+				}
+
+				size_t row;
+				if (!createEntity(archetype, command.name, row)) break;
+
+				for (size_t i = 0; i < command.layout->columns.size(); i++)
+				{
+					EntityCommandBuffer::ComponentData& component = stream->components[command.firstComponent + i];
+					component.info->moveConstruct(archetype->columns[command.layout->columns[i]].get(row), component.data);
+				}
+				break;
+			}
+			case EntityCommandBuffer::CommandType::destroy:
+				removeEntity(command.entity);
+				break;
+			case EntityCommandBuffer::CommandType::add:
+			{
+				EntityCommandBuffer::ComponentData& component = stream->components[command.firstComponent];
+				moveComponent(command.entity, *component.info, component.data);
+				break;
+			}
+			case EntityCommandBuffer::CommandType::remove:
+				removeComponent(command.entity, command.componentType);
+				break;
+			}
+
+		stream->clear();
+	}
+}
+
+Archetype* EntitiesManager::getArchetype(const std::vector<ComponentType>& types)
+{
+	auto it = archetypes.find(types);
+	if (it != archetypes.end()) return it->second.get();
+
+	Archetype* archetype = new Archetype(types);
+	archetypes[types] = std::unique_ptr<Archetype>(archetype);
+
+	const std::lock_guard<std::mutex> lock(mutQueries);
+	for (auto& pair : queries)
+		pair.second->addArchetype(archetype);
+
+	return archetype;
 }
 
-std::string EntitiesManager::getName(uint32_t entityId)
+Archetype* EntitiesManager::getArchetypeWith(Archetype* archetype, ComponentType type)
+{
+	auto it = archetype->addEdges.find(type);
+	if (it != archetype->addEdges.end()) return it->second;
+
+	std::vector<ComponentType> types = archetype->types;
+	types.insert(std::upper_bound(types.begin(), types.end(), type), type);
+
+	Archetype* result = getArchetype(types);
+	archetype->addEdges[type] = result;
+	result->removeEdges[type] = archetype;
+
+	return result;
+}
+
+Archetype* EntitiesManager::getArchetypeWithout(Archetype* archetype, ComponentType type)
+{
+	auto it = archetype->removeEdges.find(type);
+	if (it != archetype->removeEdges.end()) return it->second;
+
+	std::vector<ComponentType> types = archetype->types;
+	types.erase(std::find(types.begin(), types.end(), type));
+
+	Archetype* result = getArchetype(types);
+	archetype->removeEdges[type] = result;
+	result->addEdges[type] = archetype;
+
+	return result;
+}
+
+size_t EntitiesManager::moveEntity(EntityId entityId, EntityRecord& record, Archetype* destination)
+{
+	Archetype* source = record.archetype;
+	size_t row = destination->addRow(entityId);
+
+	for (size_t i = 0; i < destination->columns.size(); i++)
+	{
+		int column = source->findColumn(destination->types[i]);
+		if (column >= 0)
+			destination->columns[i].info->moveConstruct(destination->columns[i].get(row), source->columns[column].get(record.row));
+	}
+
+	EntityId moved = source->removeRow(record.row);   // Destroys the (moved) components.
+	if (moved) records[getIndex(moved)].row = record.row;
+
+	record.archetype = destination;
+	record.row = row;
+
+	return row;
+}
+
+void EntitiesManager::removeEntity(EntityId entityId)
+{
+	#ifdef DEBUG_ECS
+		std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
+	#endif
+
+	EntityRecord* record = getRecord(entityId);
+	if (!record) return;
+
+	EntityId moved = record->archetype->removeRow(record->row);
+	if (moved) records[getIndex(moved)].row = record->row;
+
+	record->archetype = nullptr;
+	record->name.clear();
+	numEntities--;
+
+	if (++record->generation != UINT32_MAX)   // Records whose generation is exhausted are not reused.
+		freeRecords.push_back(getIndex(entityId));
+}
+
+bool EntitiesManager::isValid(EntityId entityId) { return getRecord(entityId) != nullptr; }
+
+size_t EntitiesManager::getNumEntities() const { return numEntities; }
+
+std::string EntitiesManager::getName(EntityId entityId)
 {
-	return entities[entityId]->name;
+	EntityRecord* record = getRecord(entityId);
+	return record ? record->name : "";
 }
@@ -4,6 +4,7 @@
 //#include <memory>			// std::unique_ptr, std::shared_ptr (used instead of RAII)
 #include <stdexcept>
 #include <array>
+#include <algorithm>
 
 #include "polygonum/environment.hpp"
 #include "polygonum/models.hpp"
@@ -14,7 +15,7 @@ bool QueueFamilyIndices::isComplete()
 	return	graphicsFamily.has_value() && presentFamily.has_value();
 }
 
-Image::Image(VulkanCore* core, VkImage image, VkDeviceMemory memory, VkImageView view, VkSampler sampler) :
+Image::Image(VulkanCore* core, VkImage image, Allocation memory, VkImageView view, VkSampler sampler) :
 	c(core), image(image), memory(memory), view(view), sampler(sampler) { }
 
 void Image::createFullImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkSampleCountFlagBits numSamples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImageAspectFlags aspectFlags)
@@ -33,7 +34,7 @@ void Image::destroy()
 	c->destroyImage(this);
 }
 
-void VulkanCore::createImage(VkImage& destImage, VkDeviceMemory& destMemory, uint32_t width, uint32_t height, uint32_t mipLevels, VkSampleCountFlagBits numSamples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties)
+void VulkanCore::createImage(VkImage& destImage, Allocation& destMemory, uint32_t width, uint32_t height, uint32_t mipLevels, VkSampleCountFlagBits numSamples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties)
 {
 	// Create image objects for letting the shader access the pixel values (better option than setting up the shader to access the pixel values in the buffer). Pixels within an image object are known as texels.
 	VkImageCreateInfo imageInfo{};
@@ -59,17 +60,9 @@ void VulkanCore::createImage(VkImage& destImage, VkDeviceMemory& destMemory, uin
 	VkMemoryRequirements memRequirements;
 	vkGetImageMemoryRequirements(device, destImage, &memRequirements);
 
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+	destMemory = allocator.allocate(memRequirements, findMemoryType(memRequirements.memoryTypeBits, properties), properties, tiling == VK_IMAGE_TILING_LINEAR);
 
-	if (vkAllocateMemory(device, &allocInfo, nullptr, &destMemory) != VK_SUCCESS)
-		throw std::runtime_error("Failed to allocate image memory!");
-
-	memAllocObjects++;
-
-	vkBindImageMemory(device, destImage, destMemory, 0);
+	vkBindImageMemory(device, destImage, destMemory.memory, destMemory.offset);
 }
 
 void VulkanCore::createImageView(VkImageView& destImageView, VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, uint32_t mipLevels)
@@ -107,16 +100,14 @@ void VulkanCore::destroyImage(Image* image)
 		vkDestroyImageView(device, image->view, nullptr);   // Resolve buffer	(VkImageView)
 	if (image->image)
 		vkDestroyImage(device, image->image, nullptr);   // Resolve buffer	(VkImage)
-	if (image->memory) {
-		vkFreeMemory(device, image->memory, nullptr);   // Resolve buffer	(VkDeviceMemory)
-		memAllocObjects--;
-	}
+	if (image->memory.isValid())
+		allocator.free(image->memory);   // Resolve buffer	(memory)
 	if (image->sampler)
 		vkDestroySampler(device, image->sampler, nullptr);
 }
 
 SwapChain::SwapChain(VulkanCore& core, uint32_t additionalSwapChainImages)
-	: c(core), swapChain(nullptr), imageFormat(VK_FORMAT_UNDEFINED), extent(VkExtent2D{0,0}), additionalSwapChainImages(additionalSwapChainImages)
+	: c(core), swapChain(nullptr), imageFormat(VK_FORMAT_UNDEFINED), extent(VkExtent2D{0,0}), finalLayout(core.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR), latencyTarget(ltLow), presentMode(VK_PRESENT_MODE_FIFO_KHR), additionalSwapChainImages(additionalSwapChainImages)
 {
 	createSwapChain();
 }
@@ -127,8 +118,17 @@ void SwapChain::destroy()
 	for (auto imageView : views)
 		vkDestroyImageView(c.device, imageView, nullptr);
 
+	// Offscreen images (headless)
+	for (size_t i = 0; i < memories.size(); i++)
+	{
+		vkDestroyImage(c.device, images[i], nullptr);
+		c.allocator.free(memories[i]);
+	}
+	memories.clear();
+
 	// Swap chain
-	vkDestroySwapchainKHR(c.device, swapChain, nullptr);
+	if (swapChain)
+		vkDestroySwapchainKHR(c.device, swapChain, nullptr);
 }
 
 size_t SwapChain::numImages() { return images.size(); }
@@ -156,10 +156,26 @@ void DeviceData::fillWithDeviceData(VkPhysicalDevice physicalDevice)
 	framebufferDepthSampleCounts = deviceProperties.limits.framebufferDepthSampleCounts;
 	minUniformBufferOffsetAlignment = deviceProperties.limits.minUniformBufferOffsetAlignment;
 	minStorageBufferOffsetAlignment = deviceProperties.limits.minStorageBufferOffsetAlignment;
+	maxDrawIndirectCount = deviceProperties.limits.maxDrawIndirectCount;
 
 	samplerAnisotropy = deviceFeatures.samplerAnisotropy;
 	largePoints = deviceFeatures.largePoints;
 	wideLines = deviceFeatures.wideLines;
+	multiDrawIndirect = deviceFeatures.multiDrawIndirect;
+
+	drawIndirectCount = VK_FALSE;
+	if (apiVersion >= VK_API_VERSION_1_2)
+	{
+		VkPhysicalDeviceVulkan12Features features12{};
+		features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+
+		VkPhysicalDeviceFeatures2 features2{};
+		features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		features2.pNext = &features12;
+
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+		drawIndirectCount = features12.drawIndirectCount;
+	}
 
 	/// Find the right format for a depth image. Select a format with a depth component that supports usage as depth attachment. We don't need a specific format because we won't be directly accessing the texels from the program. It just needs to have a reasonable accuracy (usually, at least 24 bits). Several formats fit this requirement: VK_FORMAT_ ... D32_SFLOAT (32-bit signed float depth), D32_SFLOAT_S8_UINT (32-bit signed float depth and 8 bit stencil), D24_UNORM_S8_UINT (24-bit float depth and 8 bit stencil).
 	depthFormat = findSupportedFormat(physicalDevice,
@@ -207,6 +223,8 @@ void DeviceData::printData()
 		<< "   samplerAnisotropy: " << samplerAnisotropy << '\n'
 		<< "   largePoints: " << largePoints << '\n'
 		<< "   wideLines: " << wideLines << '\n'
+		<< "   multiDrawIndirect: " << multiDrawIndirect << " (maxDrawIndirectCount: " << maxDrawIndirectCount << ")\n"
+		<< "   drawIndirectCount: " << drawIndirectCount << '\n'
 
 		<< "   depthFormat: " << depthFormat << '\n';
 }
@@ -220,8 +238,16 @@ Commander::Commander(VulkanCore& core, size_t swapChainImagesCount, size_t maxFr
 	commandBuffers(maxFramesInFlight),
 	mutCommandPool(maxFramesInFlight),
 	mutFrame(maxFramesInFlight),
-	updateCommandBuffer(false),
-	commandsCount(0)
+	commandsCount(0),
+	updatesCount(1),
+	recordedUpdates(maxFramesInFlight, 0),
+	recordingThreads(1),
+	secondaryPools(maxFramesInFlight),
+	secondaryCommandBuffers(maxFramesInFlight),
+	indirectBuffers(maxFramesInFlight, VK_NULL_HANDLE),
+	indirectMemory(maxFramesInFlight),
+	indirectCapacity(maxFramesInFlight, 0),
+	indirectCount(maxFramesInFlight)
 {
 #if defined(DEBUG_RENDERER) || defined(DEBUG_COMMANDBUFFERS)
 	std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
@@ -230,6 +256,7 @@ Commander::Commander(VulkanCore& core, size_t swapChainImagesCount, size_t maxFr
 	createSynchronizers(swapChainImagesCount, maxFramesInFlight);
 	createCommandPool(maxFramesInFlight);
 	createCommandBuffers(swapChainImagesCount, maxFramesInFlight);
+	timestamps.create(c.physicalDevice, c.device, c.findQueueFamilies(c.physicalDevice).graphicsFamily.value(), maxFramesInFlight);
 }
 
 void Commander::createSynchronizers(size_t numSwapchainImages, size_t numFrames)
@@ -260,11 +287,34 @@ void Commander::updateCommandBuffers(ModelsManager& models, std::shared_ptr<Rend
 	std::cout << typeid(*this).name() << "::" << __func__ << "(" << frameIndex << ") BEGIN" << std::endl;
 #endif
 
+	size_t updates = updatesCount;   // Taken before distributing keys, so any change made from now on flags these command buffers again.
+	models.distributeKeys();
+	reserveIndirectCommands(models, commandBuffers[frameIndex].size(), frameIndex);
+
+	// Models culled in the GPU (their compute pass is recorded before the render passes)
+	std::vector<std::pair<InstanceCulling*, uint32_t>> culledModels;
+	for (auto& rp : models.keys)
+		for (auto& sp : rp)
+			for (key64 key : sp)
+			{
+				ModelData& model = models.data.at(key);
+				if (model.culling && model.getNumInstances())
+					culledModels.push_back({ model.culling.get(), model.getNumInstances() });
+			}
+
 	commandsCount = 0;
-	VkDeviceSize offsets[] = { 0 };
-	ModelData* model;
 	std::vector<VkCommandBuffer>& CBs = commandBuffers[frameIndex];   // Take command buffers of this frame (one per swapchain).
 
+	// Record draw commands in secondary command buffers (multithreaded mode)
+	bool useSecondaries = recordingThreads > 1;
+	VkSubpassContents contents = useSecondaries ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE;   // VK_SUBPASS_CONTENTS_INLINE (the render pass commands will be embedded in the primary command buffer itself and no secondary command buffers will be executed), VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS (the render pass commands will be executed from secondary command buffers).
+	std::vector<RecordingTask> tasks;
+	std::vector<VkCommandBuffer> secondaries;   // One per task
+	size_t task = 0;
+
+	if (useSecondaries)
+		recordSecondaryCommandBuffers(models, renderPipeline, CBs.size(), frameIndex, tasks, secondaries);
+
 	// Start command buffer recording
 	for (size_t i = 0; i < CBs.size(); i++)		// for each SWAPCHAIN IMAGE
 	{
@@ -284,63 +334,323 @@ void Commander::updateCommandBuffers(ModelsManager& models, std::shared_ptr<Rend
 		if (vkBeginCommandBuffer(CBs[i], &beginInfo) != VK_SUCCESS)		// If a command buffer was already recorded once, this call resets it. It's not possible to append commands to a buffer at a later time.
 			throw std::runtime_error("Failed to begin recording command buffer!");
 
+		timestamps.reset(CBs[i], frameIndex, static_cast<uint32_t>(1 + models.keys.size()));
+		timestamps.begin(CBs[i], frameIndex, 0);
+		InstanceCulling::recordCulling(CBs[i], i, culledModels);   // Compute pass (must be outside render passes)
+		timestamps.end(CBs[i], frameIndex, 0);
+
 		for (size_t rp = 0; rp < models.keys.size(); rp++)		// for each RENDER PASS (color pass, post-processing...)
 		{
 #ifdef DEBUG_COMMANDBUFFERS
 	std::cout << "    Render pass " << rp << std::endl;
 #endif
 
-			vkCmdBeginRenderPass(CBs[i], &renderPipeline->renderPasses[rp].renderPassInfos[i], VK_SUBPASS_CONTENTS_INLINE);	// Start RENDER PASS. VK_SUBPASS_CONTENTS_INLINE (the render pass commands will be embedded in the primary command buffer itself and no secondary command buffers will be executed), VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS (the render pass commands will be executed from secondary command buffers).
-			//vkCmdNextSubpass(CBs[i], VK_SUBPASS_CONTENTS_INLINE);						// Start SUBPASS
+			timestamps.begin(CBs[i], frameIndex, static_cast<uint32_t>(1 + rp));
+			vkCmdBeginRenderPass(CBs[i], &renderPipeline->renderPasses[rp].renderPassInfos[i], contents);	// Start RENDER PASS.
 
 			for (size_t sp = 0; sp < models.keys[rp].size(); sp++)		// for each SUB-PASS
 			{
-				if (sp > 0) vkCmdNextSubpass(CBs[i], VK_SUBPASS_CONTENTS_INLINE);   // Start SUBPASS
+				if (sp > 0) vkCmdNextSubpass(CBs[i], contents);   // Start SUBPASS
 				//clearDepthBuffer(CBs[i]);		// Already done in createRenderPass() (loadOp). Previously used for implementing layers (Painter's algorithm).
 
-				for (key64 key : models.keys[rp][sp])		// for each MODEL
+				if (useSecondaries)   // Tasks are sorted by swapchain image, render pass and subpass.
 				{
-#ifdef DEBUG_COMMANDBUFFERS
-	std::cout << "        Model: " << models.data[key].name << std::endl;
-#endif
-
-					model = &models.data[key];
-					if (model->getNumInstances() == 0) continue;
-
-					vkCmdBindPipeline(CBs[i], VK_PIPELINE_BIND_POINT_GRAPHICS, model->graphicsPipeline);	// Second parameter: Specifies if the pipeline object is a graphics or compute pipeline.
-					vkCmdBindVertexBuffers(CBs[i], 0, 1, &model->vert.vertexBuffer, offsets);
+					size_t first = task;
+					while (task < tasks.size() && tasks[task].image == i && tasks[task].renderPass == rp && tasks[task].subpass == sp)
+						commandsCount += tasks[task++].commandsCount;
 
-					if (model->vert.indexCount)		// has indices (it doesn't if data represents points)
-						vkCmdBindIndexBuffer(CBs[i], model->vert.indexBuffer, 0, VK_INDEX_TYPE_UINT16);
-
-					if (model->descriptorSets.size())	// has descriptor set (UBOs, SSBOs, textures, input attachments)
-						vkCmdBindDescriptorSets(CBs[i], VK_PIPELINE_BIND_POINT_GRAPHICS, model->pipelineLayout, 0, model->descriptorSets[i].size(), model->descriptorSets[i].data(), 0, 0);
-
-					if (model->vert.indexCount)		// has indices
-						vkCmdDrawIndexed(CBs[i], static_cast<uint32_t>(model->vert.indexCount), model->getNumInstances(), 0, 0, 0);
-					else
-						vkCmdDraw(CBs[i], model->vert.vertexCount, model->getNumInstances(), 0, 0);
-
-					commandsCount++;
+					if (task > first)
+						vkCmdExecuteCommands(CBs[i], static_cast<uint32_t>(task - first), &secondaries[first]);
 				}
+				else
+					commandsCount += recordModels(CBs[i], models, models.keys[rp][sp], 0, models.keys[rp][sp].size(), i, frameIndex, renderPipeline->renderPasses[rp].renderPassInfos[i].renderArea.extent);
 			}
 
 			vkCmdEndRenderPass(CBs[i]);
+			timestamps.end(CBs[i], frameIndex, static_cast<uint32_t>(1 + rp));
 		}
 
 		if (vkEndCommandBuffer(CBs[i]) != VK_SUCCESS)
 			throw std::runtime_error("Failed to record command buffer!");
 	}
 
-	updateCommandBuffer = false;
+	recordedUpdates[frameIndex] = updates;
 
 #if defined(DEBUG_RENDERER) || defined(DEBUG_COMMANDBUFFERS)
 	std::cout << typeid(*this).name() << "::" << __func__ << " END" << std::endl;
 #endif
 }
 
-VulkanCore::VulkanCore(int width, int height)
-	: io(width, height), physicalDevice(VK_NULL_HANDLE), msaaSamples(VK_SAMPLE_COUNT_1_BIT), memAllocObjects(0)
+void Commander::reserveIndirectCommands(ModelsManager& models, size_t numCommandBuffers, size_t frameIndex)
+{
+	indirectCount[frameIndex] = 0;
+	if (!c.deviceData.multiDrawIndirect) return;   // Meshlets are drawn with one vkCmdDrawIndexed each.
+
+	size_t required = 0;
+	for (auto& rp : models.keys)
+		for (auto& sp : rp)
+			for (key64 key : sp)
+			{
+				const ModelData& model = models.data.at(key);
+				if (model.vert.meshlets.size() > 1 && !model.culling) required += model.vert.meshlets.size();   // Culled models have their own indirect buffers.
+			}
+
+	required *= numCommandBuffers;
+	if (required <= indirectCapacity[frameIndex]) return;
+
+	// Grow the buffer (this frame's fence was already waited, so it's not in use).
+	if (indirectBuffers[frameIndex] != VK_NULL_HANDLE)
+		c.destroyBuffer(c.device, indirectBuffers[frameIndex], indirectMemory[frameIndex]);
+
+	uint32_t capacity = static_cast<uint32_t>(std::max<size_t>(required + required / 2, 256));   // Some margin, so it doesn't grow each time a model is added.
+
+	c.createBuffer(
+		capacity * sizeof(VkDrawIndexedIndirectCommand),
+		VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,   // Coherent: Writes are visible to the GPU at the next vkQueueSubmit.
+		indirectBuffers[frameIndex],
+		indirectMemory[frameIndex]);
+
+	indirectCapacity[frameIndex] = capacity;
+}
+
+void Commander::destroyIndirectBuffers()
+{
+	for (size_t i = 0; i < indirectBuffers.size(); i++)
+		if (indirectBuffers[i] != VK_NULL_HANDLE)
+		{
+			c.destroyBuffer(c.device, indirectBuffers[i], indirectMemory[i]);
+			indirectBuffers[i] = VK_NULL_HANDLE;
+			indirectCapacity[i] = 0;
+		}
+}
+
+size_t Commander::recordModels(VkCommandBuffer commandBuffer, ModelsManager& models, const std::vector<key64>& keys, size_t begin, size_t end, size_t imageIndex, size_t frameIndex, VkExtent2D extent)
+{
+	size_t count = 0;
+	VkDeviceSize offsets[] = { 0 };
+	ModelData* model;
+
+	// Last bindings (models sharing pipeline or buffers, like the ones in GeometryArena, don't rebind them)
+	VkPipeline boundPipeline = VK_NULL_HANDLE;
+	VkBuffer boundVertexBuffer = VK_NULL_HANDLE;
+	VkBuffer boundIndexBuffer = VK_NULL_HANDLE;
+	VkIndexType boundIndexType = VK_INDEX_TYPE_MAX_ENUM;
+
+	if (begin == end) return count;
+
+	// Viewport and scissor are dynamic states (each command buffer must set them, secondary ones don't inherit them).
+	VkViewport viewport{};
+	viewport.x = 0.0f;
+	viewport.y = 0.0f;
+	viewport.width = (float)extent.width;
+	viewport.height = (float)extent.height;
+	viewport.minDepth = 0.0f;
+	viewport.maxDepth = 1.0f;
+
+	VkRect2D scissor{};
+	scissor.offset = { 0, 0 };
+	scissor.extent = extent;
+
+	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+	vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+	for (size_t k = begin; k < end; k++)		// for each MODEL
+	{
+		model = &models.data.at(keys[k]);   // at() doesn't insert, so it's safe when many threads read "models" at the same time.
+
+#ifdef DEBUG_COMMANDBUFFERS
+	std::cout << "        Model: " << model->name << std::endl;
+#endif
+
+		if (model->getNumInstances() == 0) continue;
+
+		const VertexData& vert = model->vert;
+
+		if (model->graphicsPipeline != boundPipeline)
+		{
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, model->graphicsPipeline);	// Second parameter: Specifies if the pipeline object is a graphics or compute pipeline.
+			boundPipeline = model->graphicsPipeline;
+		}
+
+		if (vert.vertexBuffer != boundVertexBuffer)
+		{
+			vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vert.vertexBuffer, offsets);
+			boundVertexBuffer = vert.vertexBuffer;
+		}
+
+		if (vert.indexCount && (vert.indexBuffer != boundIndexBuffer || vert.indexType != boundIndexType))		// has indices (it doesn't if data represents points)
+		{
+			vkCmdBindIndexBuffer(commandBuffer, vert.indexBuffer, 0, vert.indexType);
+			boundIndexBuffer = vert.indexBuffer;
+			boundIndexType = vert.indexType;
+		}
+
+		if (model->descriptorSets.size())	// has descriptor set (UBOs, SSBOs, textures, input attachments)
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, model->pipelineLayout, 0, model->descriptorSets[imageIndex].size(), model->descriptorSets[imageIndex].data(), 0, 0);
+
+		if (model->culling)		// GPU culling: Visible instances (binding 1) and draw commands were written by the compute pass.
+		{
+			VkBuffer visibleBuffer = model->culling->getVisibleBuffer(imageIndex);
+			vkCmdBindVertexBuffers(commandBuffer, 1, 1, &visibleBuffer, offsets);
+			model->culling->recordDraw(commandBuffer, imageIndex);
+			count++;
+			continue;
+		}
+
+		// Meshes in GeometryArena start at firstIndex/firstVertex of the shared buffers (0 otherwise).
+		uint32_t numMeshlets = static_cast<uint32_t>(vert.meshlets.size());
+		uint32_t first = numMeshlets > 1 && numMeshlets <= c.deviceData.maxDrawIndirectCount ? indirectCount[frameIndex].fetch_add(numMeshlets) : UINT32_MAX;
+
+		if (first != UINT32_MAX && first + numMeshlets <= indirectCapacity[frameIndex])		// split into meshlets: all of them are drawn with a single indirect draw
+		{
+			VkDrawIndexedIndirectCommand* commands = reinterpret_cast<VkDrawIndexedIndirectCommand*>(indirectMemory[frameIndex].mapped) + first;
+
+			for (const Meshlet& meshlet : vert.meshlets)
+				*commands++ = { meshlet.indexCount, model->getNumInstances(), vert.firstIndex + meshlet.firstIndex, static_cast<int32_t>(vert.firstVertex) + meshlet.vertexOffset, 0 };
+
+			vkCmdDrawIndexedIndirect(commandBuffer, indirectBuffers[frameIndex], first * sizeof(VkDrawIndexedIndirectCommand), numMeshlets, sizeof(VkDrawIndexedIndirectCommand));
+		}
+		else if (numMeshlets)		// split into meshlets (indices relative to each meshlet's first vertex)
+			for (const Meshlet& meshlet : vert.meshlets)
+				vkCmdDrawIndexed(commandBuffer, meshlet.indexCount, model->getNumInstances(), vert.firstIndex + meshlet.firstIndex, static_cast<int32_t>(vert.firstVertex) + meshlet.vertexOffset, 0);
+		else if (vert.indexCount)		// has indices
+			vkCmdDrawIndexed(commandBuffer, vert.indexCount, model->getNumInstances(), vert.firstIndex, static_cast<int32_t>(vert.firstVertex), 0);
+		else
+			vkCmdDraw(commandBuffer, vert.vertexCount, model->getNumInstances(), vert.firstVertex, 0);
+
+		count++;
+	}
+
+	return count;
+}
+
+void Commander::recordSecondaryCommandBuffers(ModelsManager& models, std::shared_ptr<RenderPipeline> renderPipeline, size_t swapChainImagesCount, size_t frameIndex, std::vector<RecordingTask>& tasks, std::vector<VkCommandBuffer>& secondaries)
+{
+	const size_t numThreads = recordingThreads;
+
+	// Split the keys of each subpass into chunks (one task per chunk).
+	for (size_t i = 0; i < swapChainImagesCount; i++)
+		for (size_t rp = 0; rp < models.keys.size(); rp++)
+			for (size_t sp = 0; sp < models.keys[rp].size(); sp++)
+			{
+				size_t numKeys = models.keys[rp][sp].size();
+				size_t chunkSize = std::max(minKeysPerTask, (numKeys + numThreads - 1) / numThreads);
+
+				for (size_t begin = 0; begin < numKeys; begin += chunkSize)
+					tasks.push_back({ i, rp, sp, begin, std::min(begin + chunkSize, numKeys), 0 });
+			}
+
+	secondaries.resize(tasks.size());
+	if (tasks.empty()) return;
+
+	// Get one command pool per thread, and enough secondary command buffers for its tasks (task k is recorded by thread k % numThreads).
+	std::vector<VkCommandPool>& pools = secondaryPools[frameIndex];
+	std::vector<std::vector<VkCommandBuffer>>& poolCBs = secondaryCommandBuffers[frameIndex];
+
+	QueueFamilyIndices queueFamilyIndices = c.findQueueFamilies(c.physicalDevice);
+
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;   // Command buffers are reset all together (vkResetCommandPool).
+
+	while (pools.size() < numThreads)
+	{
+		pools.push_back(VK_NULL_HANDLE);
+		poolCBs.push_back({});
+		if (vkCreateCommandPool(c.device, &poolInfo, nullptr, &pools.back()) != VK_SUCCESS)
+			throw std::runtime_error("Failed to create secondary command pool!");
+	}
+
+	for (size_t t = 0; t < numThreads; t++)
+	{
+		vkResetCommandPool(c.device, pools[t], 0);   // Frame's fence was already waited, so its secondary command buffers aren't in use.
+
+		size_t numTasks = t < tasks.size() ? (tasks.size() - t + numThreads - 1) / numThreads : 0;
+		if (poolCBs[t].size() >= numTasks) continue;
+
+		size_t oldSize = poolCBs[t].size();
+		poolCBs[t].resize(numTasks);
+
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = pools[t];
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		allocInfo.commandBufferCount = static_cast<uint32_t>(numTasks - oldSize);
+
+		if (vkAllocateCommandBuffers(c.device, &allocInfo, &poolCBs[t][oldSize]) != VK_SUCCESS)
+			throw std::runtime_error("Failed to allocate secondary command buffers!");
+	}
+
+	// Record tasks. Each thread only uses its own command pool.
+	std::atomic<bool> failed(false);
+
+	auto recordTasks = [&](size_t t)
+	{
+		VkCommandBufferInheritanceInfo inheritanceInfo{};
+		inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;   // Secondary command buffer entirely within a single render pass.
+		beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+		for (size_t k = t, n = 0; k < tasks.size(); k += numThreads, n++)
+		{
+			RecordingTask& tsk = tasks[k];
+			secondaries[k] = poolCBs[t][n];
+
+			inheritanceInfo.renderPass = renderPipeline->renderPasses[tsk.renderPass].renderPass;
+			inheritanceInfo.subpass = static_cast<uint32_t>(tsk.subpass);
+			inheritanceInfo.framebuffer = renderPipeline->renderPasses[tsk.renderPass].framebuffers[tsk.image];
+
+			if (vkBeginCommandBuffer(secondaries[k], &beginInfo) != VK_SUCCESS) { failed = true; return; }
+			tsk.commandsCount = recordModels(secondaries[k], models, models.keys[tsk.renderPass][tsk.subpass], tsk.begin, tsk.end, tsk.image, frameIndex, renderPipeline->renderPasses[tsk.renderPass].renderPassInfos[tsk.image].renderArea.extent);
+			if (vkEndCommandBuffer(secondaries[k]) != VK_SUCCESS) { failed = true; return; }
+		}
+	};
+
+	if (!recordingPool || recordingPool->getNumThreads() != numThreads - 1)
+		recordingPool = std::make_unique<JobPool>(static_cast<unsigned>(numThreads));   // Workers persist between recordings (only recreated if recordingThreads changes).
+
+	std::atomic<size_t> counter(0);
+	for (size_t t = 1; t < numThreads && t < tasks.size(); t++)
+		recordingPool->submit([&recordTasks, t]() { recordTasks(t); }, counter);
+
+	recordTasks(0);   // This thread records too.
+	recordingPool->wait(counter);
+
+	if (failed)
+		throw std::runtime_error("Failed to record secondary command buffer!");
+}
+
+void Commander::setRecordingThreads(unsigned numThreads)
+{
+	if (numThreads == 0) numThreads = 1;
+	if (numThreads == recordingThreads) return;
+
+	recordingThreads = numThreads;
+	flagUpdate();
+}
+
+size_t Commander::flagUpdate() { return ++updatesCount; }
+
+bool Commander::isOutdated(size_t frameIndex) { return recordedUpdates[frameIndex] != updatesCount; }
+
+bool Commander::isRetired(size_t update)
+{
+	for (size_t i = 0; i < recordedUpdates.size(); i++)
+	{
+		if (recordedUpdates[i] < update) return false;   // Its command buffers may still be submitted.
+		if (vkGetFenceStatus(c.device, framesInFlight[i]) != VK_SUCCESS) return false;   // Fences are reset before recording, so this is the submission of the new command buffers (or a later one).
+	}
+
+	return true;
+}
+
+VulkanCore::VulkanCore(int width, int height, bool headless)
+	: headless(headless), io(width, height, headless), physicalDevice(VK_NULL_HANDLE), msaaSamples(VK_SAMPLE_COUNT_1_BIT), transferQueue(VK_NULL_HANDLE), memAllocObjects(0), allocator(*this)
 {
 	#ifdef DEBUG_ENV_CORE
 		std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
@@ -393,7 +703,7 @@ void VulkanCore::createInstance()
 		createInfo.pNext = nullptr;
 	}
 
-	auto extensions = ext.getRequiredExtensions_glfw_valLayers();
+	auto extensions = ext.getRequiredExtensions_glfw_valLayers(!headless);
 	createInfo.ppEnabledExtensionNames = extensions.data();
 	createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
 
@@ -506,22 +816,26 @@ VKAPI_ATTR VkBool32 VKAPI_CALL ValLayers::debugCallback(VkDebugUtilsMessageSever
 	return VK_FALSE;
 }
 
-std::vector<const char*> Extensions::getRequiredExtensions_device()
+std::vector<const char*> Extensions::getRequiredExtensions_device(bool swapChain)
 {
-	const std::vector<const char*> requiredDeviceExtensions = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+	std::vector<const char*> requiredDeviceExtensions;
+	if (swapChain) requiredDeviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 	return requiredDeviceExtensions;
 }
 
 /// Get a list of required extensions (based on whether validation layers are enabled or not)
-std::vector<const char*> Extensions::getRequiredExtensions_glfw_valLayers()
+std::vector<const char*> Extensions::getRequiredExtensions_glfw_valLayers(bool window)
 {
-	// Get required extensions (glfwExtensions)
-	const char** glfwExtensions;
-	uint32_t glfwExtensionCount = 0;
-	glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+	std::vector<const char*> extensions;
 
-	// Store them in a vector
-	std::vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+	// Get required extensions (glfwExtensions) and store them in the vector
+	if (window)
+	{
+		const char** glfwExtensions;
+		uint32_t glfwExtensionCount = 0;
+		glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+		extensions.insert(extensions.end(), glfwExtensions, glfwExtensions + glfwExtensionCount);
+	}
 
 	// Add additional optional extensions
 
@@ -636,6 +950,12 @@ void VulkanCore::createSurface()
 		std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 	#endif
 
+	if (headless)
+	{
+		surface = VK_NULL_HANDLE;   // Nothing to present to
+		return;
+	}
+
 	io.createWindowSurface(instance, nullptr, &surface);
 
 	//if (glfwCreateWindowSurface(instance, window, nullptr, &surface) != VK_SUCCESS)
@@ -717,11 +1037,11 @@ int VulkanCore::evaluateDevice(VkPhysicalDevice device)
 	QueueFamilyIndices indices = findQueueFamilies(device);
 
 	// Check whether required device extensions are supported 
-	bool extensionsSupported = ext.checkDeviceExtensionSupport(device);
+	bool extensionsSupported = ext.checkDeviceExtensionSupport(device, !headless);
 
-	// Check whether swap chain extension is compatible with the window surface (adequately supported)
-	bool swapChainAdequate = false;
-	if (extensionsSupported)
+	// Check whether swap chain extension is compatible with the window surface (adequately supported). No swap chain in headless mode.
+	bool swapChainAdequate = headless;
+	if (extensionsSupported && !headless)
 	{
 		SwapChainSupportDetails swapChainSupport = SwapChain::querySwapChainSupport(device, surface);
 		swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();	// Adequate if there's at least one supported image format and one supported presentation mode.
@@ -769,16 +1089,24 @@ QueueFamilyIndices VulkanCore::findQueueFamilies(VkPhysicalDevice device)
 	int i = 0;
 	for (const auto& queueFamily : queueFamilies)
 	{
-		// Check queue families capable of presenting to our window surface
-		VkBool32 presentSupport = false;
-		vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
-		if (presentSupport) indices.presentFamily = i;
+		if (!indices.isComplete())
+		{
+			// Check queue families capable of presenting to our window surface
+			VkBool32 presentSupport = false;
+			if (surface) vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+			else presentSupport = (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;   // Headless: "present" queue is the graphics queue.
+			if (presentSupport) indices.presentFamily = i;
+
+			// Check queue families capable of computer graphics
+			if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)
+				indices.graphicsFamily = i;
+		}
 
-		// Check queue families capable of computer graphics
-		if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)
-			indices.graphicsFamily = i;
+		// Check queue families capable of transfers but not graphics. Prefer the ones without compute either (usually, DMA engines).
+		if ((queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT))
+			if (!indices.transferFamily.has_value() || !(queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT))
+				indices.transferFamily = i;
 
-		if (indices.isComplete()) break;
 		i++;
 	}
 
@@ -787,9 +1115,10 @@ QueueFamilyIndices VulkanCore::findQueueFamilies(VkPhysicalDevice device)
 
 void VulkanCore::destroy()
 {
+	allocator.destroy();													// Memory blocks
 	vkDestroyDevice(device, nullptr);										// Logical device & device queues
 	valLayers.DestroyDebugUtilsMessengerEXT();
-	vkDestroySurfaceKHR(instance, surface, nullptr);						// Surface KHR
+	if (surface) vkDestroySurfaceKHR(instance, surface, nullptr);			// Surface KHR
 	vkDestroyInstance(instance, nullptr);									// Instance
 	io.destroy();
 }
@@ -807,7 +1136,7 @@ void VulkanCore::queueWaitIdle(VkQueue queue, std::mutex* waitMutex)
 	@param device Device to evaluate
 	@return True if all the required device extensions are supported. False otherwise.
 */
-bool Extensions::checkDeviceExtensionSupport(VkPhysicalDevice device)
+bool Extensions::checkDeviceExtensionSupport(VkPhysicalDevice device, bool swapChain)
 {
 	uint32_t extensionCount;
 	vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, nullptr);
@@ -815,7 +1144,7 @@ bool Extensions::checkDeviceExtensionSupport(VkPhysicalDevice device)
 	std::vector<VkExtensionProperties> availableExtensions(extensionCount);
 	vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
 
-	auto extensions = getRequiredExtensions_device();
+	auto extensions = getRequiredExtensions_device(swapChain);
 	std::set<std::string> requiredExtensions(extensions.begin(), extensions.end());
 
 	for (const auto& extension : availableExtensions)
@@ -881,6 +1210,8 @@ void VulkanCore::createLogicalDevice()
 
 	// Describe the number of queues you want for each queue family
 	std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value(), indices.presentFamily.value() };
+	if (useTransferQueue && indices.transferFamily.has_value())
+		uniqueQueueFamilies.insert(indices.transferFamily.value());
 	float queuePriority = 1.0f;
 	std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 
@@ -900,6 +1231,11 @@ void VulkanCore::createLogicalDevice()
 	deviceFeatures.samplerAnisotropy = deviceData.samplerAnisotropy ? VK_TRUE : VK_FALSE;	// Anisotropic filtering is an optional device feature (most modern graphics cards support it, but we should check it in isDeviceSuitable)
 	deviceFeatures.sampleRateShading = (add_SS ? VK_TRUE : VK_FALSE);						// Enable sample shading feature for the device
 	deviceFeatures.wideLines = (deviceData.wideLines ? VK_TRUE : VK_FALSE);					// Enable line width configuration (in VkPipeline)
+	deviceFeatures.multiDrawIndirect = (deviceData.multiDrawIndirect ? VK_TRUE : VK_FALSE);	// Enable drawCount > 1 in indirect draws (meshlets of a model are drawn with one call)
+
+	VkPhysicalDeviceVulkan12Features features12{};   // Vulkan 1.2 features (only chained if the device supports Vulkan 1.2)
+	features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	features12.drawIndirectCount = deviceData.drawIndirectCount;						// Enable vkCmdDrawIndexedIndirectCount (GPU culling)
 
 	// Describe queue parameters
 	VkDeviceCreateInfo createInfo{};
@@ -907,7 +1243,8 @@ void VulkanCore::createLogicalDevice()
 	createInfo.pQueueCreateInfos = queueCreateInfos.data();
 	createInfo.queueCreateInfoCount = static_cast<uint32_t>(queueCreateInfos.size());
 	createInfo.pEnabledFeatures = &deviceFeatures;
-	auto extensions = ext.getRequiredExtensions_device();
+	createInfo.pNext = deviceData.apiVersion >= VK_API_VERSION_1_2 ? &features12 : nullptr;
+	auto extensions = ext.getRequiredExtensions_device(!headless);
 	createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
 	createInfo.ppEnabledExtensionNames = extensions.data();
 
@@ -926,6 +1263,8 @@ void VulkanCore::createLogicalDevice()
 	// Retrieve queue handles for each queue family (in this case, we created a single queue from each family, so we simply use index 0)
 	vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
 	vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+	if (useTransferQueue && indices.transferFamily.has_value())
+		vkGetDeviceQueue(device, indices.transferFamily.value(), 0, &transferQueue);
 }
 
 // (6)
@@ -936,13 +1275,19 @@ void SwapChain::createSwapChain()
 		std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 	#endif
 
+	if (c.headless)
+	{
+		createOffscreenImages();
+		return;
+	}
+
 	// 1. Create swap chain
 
 	// 1.1. Get some properties
 	SwapChainSupportDetails swapChainSupport = querySwapChainSupport(c.physicalDevice, c.surface);
 
 	VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);	// Surface formats (pixel format, color space)
-	VkPresentModeKHR presentMode = chooseSwapPresentMode(swapChainSupport.presentModes);	// Presentation modes
+	presentMode = chooseSwapPresentMode(swapChainSupport.presentModes);	// Presentation modes
 	VkExtent2D extent = chooseSwapExtent(c.io, swapChainSupport.capabilities);		// Basic surface capabilities
 
 	uint32_t imageCount = swapChainSupport.capabilities.minImageCount + additionalSwapChainImages;		// How many images in the swap chain? We choose the minimum required + 1 (this way, we won't have to wait sometimes on the driver to complete internal operations before we can acquire another image to render to.
@@ -1008,6 +1353,40 @@ void SwapChain::createSwapChain()
 		c.createImageView(views[i], images[i], imageFormat, VK_IMAGE_ASPECT_COLOR_BIT, 1);
 }
 
+void SwapChain::createOffscreenImages()
+{
+	int width, height;
+	c.io.getFramebufferSize(&width, &height);
+
+	imageFormat = VK_FORMAT_B8G8R8A8_SRGB;   // Same as the preferred swap chain format (see chooseSwapSurfaceFormat())
+	extent = { static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+
+	size_t imageCount = 2 + additionalSwapChainImages;   // Like a typical swap chain (minImageCount == 2)
+	images.resize(imageCount);
+	memories.resize(imageCount);
+	views.resize(imageCount);
+
+	for (size_t i = 0; i < imageCount; i++)
+	{
+		c.createImage(
+			images[i], 
+			memories[i], 
+			extent.width, extent.height, 
+			1, 
+			VK_SAMPLE_COUNT_1_BIT, 
+			imageFormat, 
+			VK_IMAGE_TILING_OPTIMAL, 
+			VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,   // Rendered and read back (Renderer::readImage())
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+		c.createImageView(views[i], images[i], imageFormat, VK_IMAGE_ASPECT_COLOR_BIT, 1);
+	}
+
+	#ifdef DEBUG_ENV_INFO
+		std::cout << "   Offscreen images: " << images.size() << std::endl;
+	#endif
+}
+
 /// Chooses the surface format (color depth) for the swap chain.
 VkSurfaceFormatKHR SwapChain::chooseSwapSurfaceFormat(const std::vector<VkSurfaceFormatKHR>& availableFormats)
 {
@@ -1061,13 +1440,13 @@ VkExtent2D SwapChain::chooseSwapExtent(IOmanager& io, const VkSurfaceCapabilitie
 */
 VkPresentModeKHR SwapChain::chooseSwapPresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes)
 {
-	// Choose VK_PRESENT_MODE_MAILBOX_KHR if available
-	for (const auto& mode : availablePresentModes)
-		if (mode == VK_PRESENT_MODE_MAILBOX_KHR)
-			return mode;
+	VkPresentModeKHR mode = FramePacer::choosePresentMode(availablePresentModes, latencyTarget);
+
+	#ifdef DEBUG_ENV_INFO
+		std::cout << "   Present mode: " << mode << std::endl;
+	#endif
 
-	// Otherwise, choose VK_PRESENT_MODE_FIFO_KHR
-	return VK_PRESENT_MODE_FIFO_KHR;
+	return mode;
 }
 
 
@@ -1094,6 +1473,17 @@ void Commander::destroyCommandPool()
 {
 	for (VkCommandPool& commandPool : commandPools)
 		vkDestroyCommandPool(c.device, commandPool, nullptr);
+
+	for (size_t i = 0; i < secondaryPools.size(); i++)   // Secondary command buffers are freed with their pools.
+	{
+		for (VkCommandPool& commandPool : secondaryPools[i])
+			vkDestroyCommandPool(c.device, commandPool, nullptr);
+
+		secondaryPools[i].clear();
+		secondaryCommandBuffers[i].clear();
+	}
+
+	destroyIndirectBuffers();
 }
 
 void Commander::destroySynchronizers()
@@ -1104,6 +1494,8 @@ void Commander::destroySynchronizers()
 		vkDestroySemaphore(c.device, imageAvailableSemaphores[i], nullptr);
 		vkDestroyFence(c.device, framesInFlight[i], nullptr);
 	}
+
+	timestamps.destroy();
 }
 
 /**
@@ -1173,18 +1565,25 @@ void Commander::createCommandBuffers(size_t numSwapChainImages, size_t numFrames
 		if (vkAllocateCommandBuffers(c.device, &allocInfo, commandBuffers[i].data()) != VK_SUCCESS)
 			throw std::runtime_error("Failed to allocate command buffers!");
 	}
+
+	flagUpdate();   // New command buffers are empty.
 }
 
 void Commander::transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels)
 {
-#if defined(DEBUG_RENDERER) || defined(DEBUG_COMMANDBUFFERS)
-	std::cout << typeid(*this).name() << "::" << __func__ << " BEGIN" << std::endl;
-#endif
-
 	uint32_t frameIndex = getNextFrame();
 	const std::lock_guard<std::mutex> lock(mutFrame[frameIndex]);
 
 	VkCommandBuffer commandBuffer = beginSingleTimeCommands(frameIndex);
+	transitionImageLayout(commandBuffer, image, format, oldLayout, newLayout, mipLevels);
+	endSingleTimeCommands(frameIndex, commandBuffer);
+}
+
+void Commander::transitionImageLayout(VkCommandBuffer commandBuffer, VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels)
+{
+#if defined(DEBUG_RENDERER) || defined(DEBUG_COMMANDBUFFERS)
+	std::cout << typeid(*this).name() << "::" << __func__ << " BEGIN" << std::endl;
+#endif
 
 	VkImageMemoryBarrier barrier{};			// One of the most common way to perform layout transitions is using an image memory barrier. A pipeline barrier like that is generally used to synchronize access to resources, like ensuring that a write to a buffer completes before reading from it, but it can also be used to transition image layouts and transfer queue family ownership when VK_SHARING_MODE_EXCLUSIVE is used. There is an equivalent buffer memory barrier to do this for buffers.
 	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
@@ -1248,8 +1647,6 @@ void Commander::transitionImageLayout(VkImage image, VkFormat format, VkImageLay
 		0, nullptr,			// Array of pipeline barriers of type buffer memory barriers
 		1, &barrier);		// Array of pipeline barriers of type image memory barriers
 
-	endSingleTimeCommands(frameIndex, commandBuffer);
-	
 	/*
 		Note:
 		The pipeline stages that you are allowed to specify before and after the barrier depend on how you use the resource before and after the barrier.
@@ -1274,11 +1671,8 @@ void Commander::transitionImageLayout(VkImage image, VkFormat format, VkImageLay
 		VK_IMAGE_LAYOUT_GENERAL: Special type of image layout that supports all operations, although it doesn't necessarily offer the best performance for any
 		operation. It is required for some special cases (using an image as both input and output, reading an image after it has left the preinitialized layout, etc.).
 
-		All of the helper functions that submit commands so far have been set up to execute synchronously by waiting for the queue to become idle. For practical
-		applications it is recommended to combine these operations in a single command buffer and execute them asynchronously for higher throughput (especially the
-		transitions and copy in the createTextureImage function). Exercise: Try to experiment with this by creating a setupCommandBuffer that the helper functions
-		record commands into, and add a flushSetupCommands to execute the commands that have been recorded so far. It's best to do this after the texture mapping works
-		to check if the texture resources are still set up correctly.
+		The single time versions of these helper functions execute synchronously (they wait for their command buffer to complete). Resource uploads don't use them:
+		Uploader records the transitions and copies of many resources into a single command buffer, which is submitted asynchronously (see uploader.hpp).
 	*/
 
 #if defined(DEBUG_RENDERER) || defined(DEBUG_COMMANDBUFFERS)
@@ -1301,20 +1695,23 @@ void Commander::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize
 	const std::lock_guard<std::mutex> lock(mutFrame[frameIndex]);
 
 	VkCommandBuffer commandBuffer = beginSingleTimeCommands(frameIndex);
+	copyBuffer(commandBuffer, srcBuffer, 0, dstBuffer, 0, size);
+	endSingleTimeCommands(frameIndex, commandBuffer);
+	
+#if defined(DEBUG_RENDERER) || defined(DEBUG_COMMANDBUFFERS)
+	std::cout << typeid(*this).name() << "::" << __func__ << " END" << std::endl;
+#endif
+}
 
+void Commander::copyBuffer(VkCommandBuffer commandBuffer, VkBuffer srcBuffer, VkDeviceSize srcOffset, VkBuffer dstBuffer, VkDeviceSize dstOffset, VkDeviceSize size)
+{
 	// Specify buffers and the size of the contents you will transfer (it's not possible to specify VK_WHOLE_SIZE here, unlike vkMapMemory command).
 	VkBufferCopy copyRegion{};
 	copyRegion.size = size;
-	copyRegion.srcOffset = 0;	// Optional
-	copyRegion.dstOffset = 0;	// Optional
+	copyRegion.srcOffset = srcOffset;
+	copyRegion.dstOffset = dstOffset;
 
 	vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
-
-	endSingleTimeCommands(frameIndex, commandBuffer);
-	
-#if defined(DEBUG_RENDERER) || defined(DEBUG_COMMANDBUFFERS)
-	std::cout << typeid(*this).name() << "::" << __func__ << " END" << std::endl;
-#endif
 }
 
 void Commander::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height)
@@ -1327,10 +1724,19 @@ void Commander::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width
 	const std::lock_guard<std::mutex> lock(mutFrame[frameIndex]);
 
 	VkCommandBuffer commandBuffer = beginSingleTimeCommands(frameIndex);
+	copyBufferToImage(commandBuffer, buffer, 0, image, width, height);
+	endSingleTimeCommands(frameIndex, commandBuffer);
+	
+#if defined(DEBUG_RENDERER) || defined(DEBUG_COMMANDBUFFERS)
+	std::cout << typeid(*this).name() << "::" << __func__ << " END" << std::endl;
+#endif
+}
 
+void Commander::copyBufferToImage(VkCommandBuffer commandBuffer, VkBuffer buffer, VkDeviceSize bufferOffset, VkImage image, uint32_t width, uint32_t height)
+{
 	// Specify which part of the buffer is going to be copied to which part of the image
 	VkBufferImageCopy region{};
-	region.bufferOffset = 0;							// Byte offset in the buffer at which the pixel values start
+	region.bufferOffset = bufferOffset;					// Byte offset in the buffer at which the pixel values start (must be a multiple of 4 and of the texel size)
 	region.bufferRowLength = 0;							// How the pixels are laid out in memory. 0 indicates that the pixels are thightly packed. Otherwise, you could have some padding bytes between rows of the image, for example. 
 	region.bufferImageHeight = 0;							// How the pixels are laid out in memory. 0 indicates that the pixels are thightly packed. Otherwise, you could have some padding bytes between rows of the image, for example.
 	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;	// imageSubresource indicate to which part of the image we want to copy the pixels
@@ -1348,15 +1754,72 @@ void Commander::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width
 		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,			// Layout the image is currently using
 		1,
 		&region);
+}
+
+/**
+	@brief Copies a color image into a buffer (tightly packed rows). Used for reading back rendered images (headless mode).
+
+	The barrier waits for the color attachment writes of previous submissions (render passes) and makes them available to the copy. The image stays in "layout", which must allow transfers (TRANSFER_SRC_OPTIMAL or GENERAL).
+*/
+void Commander::copyImageToBuffer(VkImage image, VkImageLayout layout, VkBuffer buffer, uint32_t width, uint32_t height)
+{
+#if defined(DEBUG_RENDERER) || defined(DEBUG_COMMANDBUFFERS)
+	std::cout << typeid(*this).name() << "::" << __func__ << " BEGIN" << std::endl;
+#endif
+
+	uint32_t frameIndex = getNextFrame();
+	const std::lock_guard<std::mutex> lock(mutFrame[frameIndex]);
+
+	VkCommandBuffer commandBuffer = beginSingleTimeCommands(frameIndex);
+
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barrier.oldLayout = layout;
+	barrier.newLayout = layout;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = 1;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	VkBufferImageCopy region{};
+	region.bufferOffset = 0;
+	region.bufferRowLength = 0;							// Tightly packed
+	region.bufferImageHeight = 0;
+	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.imageSubresource.mipLevel = 0;
+	region.imageSubresource.baseArrayLayer = 0;
+	region.imageSubresource.layerCount = 1;
+	region.imageOffset = { 0, 0, 0 };
+	region.imageExtent = { width, height, 1 };
+
+	vkCmdCopyImageToBuffer(commandBuffer, image, layout, buffer, 1, &region);
 
 	endSingleTimeCommands(frameIndex, commandBuffer);
-	
+
 #if defined(DEBUG_RENDERER) || defined(DEBUG_COMMANDBUFFERS)
 	std::cout << typeid(*this).name() << "::" << __func__ << " END" << std::endl;
 #endif
 }
 
 void Commander::generateMipmaps(VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels)
+{
+	uint32_t frameIndex = getNextFrame();
+	const std::lock_guard<std::mutex> lock(mutFrame[frameIndex]);
+
+	VkCommandBuffer commandBuffer = beginSingleTimeCommands(frameIndex);
+	generateMipmaps(commandBuffer, image, imageFormat, texWidth, texHeight, mipLevels);
+	endSingleTimeCommands(frameIndex, commandBuffer);
+}
+
+void Commander::generateMipmaps(VkCommandBuffer commandBuffer, VkImage image, VkFormat imageFormat, int32_t texWidth, int32_t texHeight, uint32_t mipLevels)
 {
 #if defined(DEBUG_RENDERER) || defined(DEBUG_COMMANDBUFFERS)
 	std::cout << typeid(*this).name() << "::" << __func__ << " BEGIN" << std::endl;
@@ -1374,11 +1837,6 @@ void Commander::generateMipmaps(VkImage image, VkFormat imageFormat, int32_t tex
 		// It's uncommon to generate the mipmap levels at runtime anyway. Usually they are pregenerated and stored in the texture file alongside the base level to improve loading speed. <<<<<
 	}
 
-	uint32_t frameIndex = getNextFrame();
-	const std::lock_guard<std::mutex> lock(mutFrame[frameIndex]);
-
-	VkCommandBuffer commandBuffer = beginSingleTimeCommands(frameIndex);
-
 	// Specify the barriers
 	VkImageMemoryBarrier barrier{};
 	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
@@ -1457,8 +1915,6 @@ void Commander::generateMipmaps(VkImage image, VkFormat imageFormat, int32_t tex
 		0, nullptr,
 		0, nullptr,
 		1, &barrier);
-
-	endSingleTimeCommands(frameIndex, commandBuffer);
 	
 #if defined(DEBUG_RENDERER) || defined(DEBUG_COMMANDBUFFERS)
 	std::cout << typeid(*this).name() << "::" << __func__ << " END" << std::endl;
@@ -1554,7 +2010,7 @@ void ValLayers::DestroyDebugUtilsMessengerEXT()
 		func(instance, debugMessenger, nullptr);
 }
 
-void VulkanCore::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory)
+void VulkanCore::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, Allocation& bufferMemory)
 {
 	// Create buffer.
 	VkBufferCreateInfo bufferInfo{};
@@ -1571,25 +2027,17 @@ void VulkanCore::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMem
 	VkMemoryRequirements memRequirements;		// Members: size (amount of memory in bytes. May differ from bufferInfo.size), alignment (offset in bytes where the buffer begins in the allocated region. Depends on bufferInfo.usage and bufferInfo.flags), memoryTypeBits (bit field of the memory types that are suitable for the buffer).
 	vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-	// Allocate memory for the buffer.
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);		// Properties parameter: We need to be able to write our vertex data to that memory. The properties define special features of the memory, like being able to map it so we can write to it from the CPU.
-
-	if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS)
-		throw std::runtime_error("Failed to allocate buffer memory!");
-
-	memAllocObjects++;
+	// Get memory for the buffer (sub-allocated from a bigger memory block).
+	uint32_t memoryType = findMemoryType(memRequirements.memoryTypeBits, properties);		// Properties parameter: We need to be able to write our vertex data to that memory. The properties define special features of the memory, like being able to map it so we can write to it from the CPU.
+	bufferMemory = allocator.allocate(memRequirements, memoryType, properties, true);
 
-	vkBindBufferMemory(device, buffer, bufferMemory, 0);	// Associate this memory with the buffer. If the offset (4th parameter) is non-zero, it's required to be divisible by memRequirements.alignment.
+	vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);	// Associate this memory with the buffer. If the offset (4th parameter) is non-zero, it's required to be divisible by memRequirements.alignment (the allocator takes care of it).
 }
 
-void VulkanCore::destroyBuffer(VkDevice device, VkBuffer buffer, VkDeviceMemory memory)
+void VulkanCore::destroyBuffer(VkDevice device, VkBuffer buffer, Allocation& memory)
 {
 	vkDestroyBuffer(device, buffer, nullptr);
-	vkFreeMemory(device, memory, nullptr);
-	memAllocObjects--;
+	allocator.free(memory);
 }
 
 RenderPipeline::RenderPipeline(VulkanCore& core, SwapChain& swapChain, Commander& commander)
@@ -1911,7 +2359,7 @@ void RP_DS::createRenderPass()
 	finalColorAtt_2.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	finalColorAtt_2.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 	finalColorAtt_2.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	finalColorAtt_2.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	finalColorAtt_2.finalLayout = swapChain.finalLayout;
 	
 	finalColorAttRef_2.attachment = 4;
 	finalColorAttRef_2.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
@@ -2357,7 +2805,7 @@ void RP_DS_PP::createRenderPass()
 	VkAttachmentDescription caColorAtt41 = defaultAtt;
 	caColorAtt41.format = swapChain.imageFormat;
 	caColorAtt41.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-	caColorAtt41.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	caColorAtt41.finalLayout = swapChain.finalLayout;
 
 	VkAttachmentReference caColorAttRef41{};
 	caColorAttRef41.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
@@ -0,0 +1,108 @@
+#include <iostream>
+#include <algorithm>
+
+#include "polygonum/frame.hpp"
+
+
+void FramePacket::clear()
+{
+	buffers.clear();
+	data.clear();
+	instances.clear();
+}
+
+void FramePacket::addBuffer(key64 model, BindingBuffer& buffer)
+{
+	uint32_t offset, bytes;
+	if (!buffer.takeModified(offset, bytes)) return;
+
+	buffers.push_back({ model, &buffer, offset, bytes, buffer.getSize(), data.size() });
+	data.insert(data.end(), buffer.binding.begin() + offset, buffer.binding.begin() + offset + bytes);
+}
+
+FramePipeline::FramePipeline(size_t depth)
+	: packets(std::max(depth, size_t(1)) + 1), writing(nullptr), reading(nullptr), stopped(false)
+{
+	reset();
+}
+
+FramePacket* FramePipeline::beginPacket(std::chrono::milliseconds timeout)
+{
+	std::unique_lock<std::mutex> lock(mutPackets);
+	condPackets.wait_for(lock, timeout, [this]() { return stopped || !freePackets.empty(); });
+	if (stopped || freePackets.empty()) return nullptr;
+
+	writing = freePackets.back();
+	freePackets.pop_back();
+	writing->clear();
+
+	return writing;
+}
+
+void FramePipeline::publish()
+{
+	{
+		const std::lock_guard<std::mutex> lock(mutPackets);
+		if (!writing) return;
+
+		readyPackets.push_back(writing);
+		writing = nullptr;
+	}
+
+	condPackets.notify_all();
+}
+
+FramePacket* FramePipeline::acquire()
+{
+	std::unique_lock<std::mutex> lock(mutPackets);
+	condPackets.wait(lock, [this]() { return stopped || !readyPackets.empty(); });
+	if (stopped) return nullptr;
+
+	reading = readyPackets.front();
+	readyPackets.erase(readyPackets.begin());
+
+	return reading;
+}
+
+void FramePipeline::release()
+{
+	{
+		const std::lock_guard<std::mutex> lock(mutPackets);
+		if (!reading) return;
+
+		freePackets.push_back(reading);
+		reading = nullptr;
+	}
+
+	condPackets.notify_all();
+}
+
+void FramePipeline::stop()
+{
+	{
+		const std::lock_guard<std::mutex> lock(mutPackets);
+		stopped = true;
+	}
+
+	condPackets.notify_all();
+}
+
+void FramePipeline::reset()
+{
+	const std::lock_guard<std::mutex> lock(mutPackets);
+
+	freePackets.clear();
+	readyPackets.clear();
+	for (FramePacket& packet : packets)
+		freePackets.push_back(&packet);
+
+	writing = nullptr;
+	reading = nullptr;
+	stopped = false;
+}
+
+bool FramePipeline::isStopped()
+{
+	const std::lock_guard<std::mutex> lock(mutPackets);
+	return stopped;
+}
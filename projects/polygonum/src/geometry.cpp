@@ -0,0 +1,205 @@
+#include <iostream>
+#include <algorithm>
+
+#include "polygonum/geometry.hpp"
+
+
+GeometryArena::GeometryArena(VulkanCore& core, Commander& commander, Uploader& uploader)
+	: c(core), commander(commander), uploader(uploader) { }
+
+bool GeometryArena::allocateRange(std::map<uint32_t, uint32_t>& freeRanges, uint32_t count, uint32_t& first)
+{
+	if (!count) { first = 0; return true; }
+
+	for (auto it = freeRanges.begin(); it != freeRanges.end(); it++)   // First fit
+	{
+		if (it->second < count) continue;
+
+		first = it->first;
+		uint32_t remaining = it->second - count;
+		freeRanges.erase(it);
+		if (remaining) freeRanges[first + count] = remaining;
+
+		return true;
+	}
+
+	return false;
+}
+
+void GeometryArena::freeRange(std::map<uint32_t, uint32_t>& freeRanges, uint32_t first, uint32_t count)
+{
+	if (!count) return;
+
+	// Insert free range and merge it with adjacent free ranges
+	auto it = freeRanges.emplace(first, count).first;
+
+	auto next = std::next(it);
+	if (next != freeRanges.end() && it->first + it->second == next->first)
+	{
+		it->second += next->second;
+		freeRanges.erase(next);
+	}
+
+	if (it != freeRanges.begin())
+	{
+		auto prev = std::prev(it);
+		if (prev->first + prev->second == it->first)
+		{
+			prev->second += it->second;
+			freeRanges.erase(it);
+		}
+	}
+}
+
+uint32_t GeometryArena::createPage(uint32_t vertexSize, uint32_t minVertices, uint32_t minIndices)
+{
+	Page page;
+	page.vertexSize = vertexSize;
+	page.vertexCapacity = std::max(verticesPerPage, minVertices);   // Big meshes get a dedicated page.
+	page.indexCapacity = std::max(indicesPerPage, std::max(minIndices, 1u));
+	page.freeVertices[0] = page.vertexCapacity;
+	page.freeIndices[0] = page.indexCapacity;
+	page.meshes = 0;
+
+	c.createBuffer(
+		(VkDeviceSize)page.vertexCapacity * vertexSize,
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		page.vertexBuffer,
+		page.vertexMemory);
+
+	c.createBuffer(
+		(VkDeviceSize)page.indexCapacity * sizeof(uint32_t),
+		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		page.indexBuffer,
+		page.indexMemory);
+
+	// Reuse the slot of a destroyed page, if any.
+	for (uint32_t i = 0; i < pages.size(); i++)
+		if (pages[i].vertexBuffer == VK_NULL_HANDLE)
+		{
+			pages[i] = page;
+			return i;
+		}
+
+	pages.push_back(page);
+	return static_cast<uint32_t>(pages.size() - 1);
+}
+
+void GeometryArena::destroyPage(Page& page)
+{
+	c.destroyBuffer(c.device, page.vertexBuffer, page.vertexMemory);
+	c.destroyBuffer(c.device, page.indexBuffer, page.indexMemory);
+	page.vertexBuffer = VK_NULL_HANDLE;
+	page.indexBuffer = VK_NULL_HANDLE;
+	page.freeVertices.clear();
+	page.freeIndices.clear();
+}
+
+void GeometryArena::allocate(const VertexSet& vertices, const std::vector<uint32_t>& indices, VertexData& result)
+{
+	uint32_t vertexSize = static_cast<uint32_t>(vertices.vertexSize);
+	uint32_t vertexCount = vertices.getNumVertex();
+	uint32_t indexCount = static_cast<uint32_t>(indices.size());
+	uint32_t pageIndex, firstVertex, firstIndex;
+
+	{
+		const std::lock_guard<std::mutex> lock(mutArena);
+
+		// Find a page with enough free space
+		bool found = false;
+		for (pageIndex = 0; pageIndex < pages.size() && !found; pageIndex++)
+		{
+			Page& page = pages[pageIndex];
+			if (page.vertexBuffer == VK_NULL_HANDLE || page.vertexSize != vertexSize) continue;
+			if (!allocateRange(page.freeVertices, vertexCount, firstVertex)) continue;
+			if (!allocateRange(page.freeIndices, indexCount, firstIndex))
+			{
+				freeRange(page.freeVertices, firstVertex, vertexCount);
+				continue;
+			}
+			found = true;
+		}
+
+		if (found) pageIndex--;
+		else
+		{
+			pageIndex = createPage(vertexSize, vertexCount, indexCount);
+			allocateRange(pages[pageIndex].freeVertices, vertexCount, firstVertex);
+			allocateRange(pages[pageIndex].freeIndices, indexCount, firstIndex);
+		}
+
+		pages[pageIndex].meshes++;
+		result.vertexBuffer = pages[pageIndex].vertexBuffer;   // Take the handles while locked (other threads may append pages).
+		result.indexBuffer = pages[pageIndex].indexBuffer;
+	}
+
+	result.vertexBufferMemory = Allocation();
+	result.indexBufferMemory = Allocation();
+	result.indexType = VK_INDEX_TYPE_UINT32;
+	result.vertexCount = vertexCount;
+	result.indexCount = indexCount;
+	result.firstVertex = firstVertex;
+	result.firstIndex = firstIndex;
+	result.arenaPage = static_cast<int32_t>(pageIndex);
+
+	// Upload the mesh to its ranges (recorded in the current upload batch)
+	uploader.uploadBuffer(result.vertexBuffer, (VkDeviceSize)firstVertex * vertexSize, vertices.data(), vertices.totalBytes());
+	uploader.uploadBuffer(result.indexBuffer, (VkDeviceSize)firstIndex * sizeof(uint32_t), indices.data(), indexCount * sizeof(uint32_t));
+
+#ifdef DEBUG_RESOURCES
+	std::cout << "   Mesh stored in geometry page " << pageIndex << " (vertices: " << firstVertex << " + " << vertexCount << ", indices: " << firstIndex << " + " << indexCount << ')' << std::endl;
+#endif
+}
+
+void GeometryArena::free(VertexData& data)
+{
+	if (data.arenaPage < 0) return;
+
+	// Frames in flight and cached command buffers may still draw this mesh: its ranges are given back by releasePending().
+	size_t update = commander.flagUpdate();
+
+	const std::lock_guard<std::mutex> lock(mutArena);
+
+	pendingFrees.push_back({ update, static_cast<uint32_t>(data.arenaPage), data.firstVertex, data.vertexCount, data.firstIndex, data.indexCount });
+	data.arenaPage = -1;
+}
+
+void GeometryArena::releasePending(bool all)
+{
+	const std::lock_guard<std::mutex> lock(mutArena);
+
+	size_t count = 0;   // Oldest first (stopping at the first one still in use only delays the next ones).
+	while (count < pendingFrees.size() && (all || commander.isRetired(pendingFrees[count].update)))
+		releaseMesh(pendingFrees[count++]);
+
+	pendingFrees.erase(pendingFrees.begin(), pendingFrees.begin() + count);
+}
+
+void GeometryArena::releaseMesh(const PendingFree& mesh)
+{
+	Page& page = pages[mesh.page];
+	freeRange(page.freeVertices, mesh.firstVertex, mesh.vertexCount);
+	freeRange(page.freeIndices, mesh.firstIndex, mesh.indexCount);
+
+	// Release empty pages, but keep one per vertex size (avoids creating/destroying a page each time a model is created/deleted).
+	if (--page.meshes == 0)
+	{
+		size_t emptyPages = std::count_if(pages.begin(), pages.end(), [&page](const Page& p) { return p.vertexBuffer != VK_NULL_HANDLE && p.vertexSize == page.vertexSize && p.meshes == 0; });
+		if (emptyPages > 1 || page.vertexCapacity > verticesPerPage || page.indexCapacity > indicesPerPage)
+			destroyPage(page);
+	}
+}
+
+void GeometryArena::destroy()
+{
+	const std::lock_guard<std::mutex> lock(mutArena);
+
+	for (Page& page : pages)
+		if (page.vertexBuffer != VK_NULL_HANDLE)
+			destroyPage(page);
+
+	pages.clear();
+	pendingFrees.clear();
+}
@@ -22,16 +22,12 @@ void ResourcesLoader::loadResources(ModelData& model, Renderer& rend)
 	// Load vertexes and indices
 	vertices->loadVertexes(rend, model);
 	
-	{
-		const std::lock_guard<std::mutex> lock(rend.worker.mutResources);
-		
-		// Load shaders
-		for (unsigned i = 0; i < shaders.size(); i++)
-			model.shaders.push_back(shaders[i]->loadShader(rend.shaders, rend.c));
-		
-		// Load textures
-		//for (unsigned i = 0; i < textures.size(); i++)
-		//	model.binds.fsTextures.push_back(textures[i]->loadTexture(rend.textures, rend));
-	}
+	// Load shaders (Renderer::shaders is thread-safe, so other loading threads can compile shaders meanwhile)
+	for (unsigned i = 0; i < shaders.size(); i++)
+		model.shaders.push_back(shaders[i]->loadShader(rend.shaders, rend.c));
+	
+	// Load textures
+	//for (unsigned i = 0; i < textures.size(); i++)
+	//	model.binds.fsTextures.push_back(textures[i]->loadTexture(rend.textures, rend));
 }
 
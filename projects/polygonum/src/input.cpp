@@ -4,8 +4,11 @@
 #include "polygonum/input.hpp"
 
 
-IOmanager::IOmanager(int width, int height)
+IOmanager::IOmanager(int width, int height, bool headless)
+	: width(width), height(height), shouldClose(false), window(nullptr)
 {
+	if (headless) return;
+
 	initWindow(width, height);
 	setCallbacks();
 }
@@ -29,6 +32,11 @@ void IOmanager::initWindow(int width, int height)
 	//glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);	// This callback has been set in Input
 
 	glfwSetInputMode(window, GLFW_STICKY_KEYS, GLFW_TRUE);
+
+	int fbWidth, fbHeight;
+	glfwGetFramebufferSize(window, &fbWidth, &fbHeight);   // May differ from the window size (high DPI displays).
+	this->width = fbWidth;
+	this->height = fbHeight;
 }
 
 void IOmanager::setCallbacks()
@@ -38,13 +46,21 @@ void IOmanager::setCallbacks()
 	glfwSetScrollCallback(window, mouseScroll_callback);				// Set callback (get mouse scrolling)
 }
 
+bool IOmanager::isHeadless() const { return !window; }
+
 void IOmanager::createWindowSurface(VkInstance instance, VkAllocationCallbacks* allocator, VkSurfaceKHR* surface)
 {
+	if (!window) throw std::runtime_error("Cannot create a window surface in headless mode!");
+
 	if (glfwCreateWindowSurface(instance, window, nullptr, surface) != VK_SUCCESS)
 		throw std::runtime_error("Failed to create window surface!");
 }
 
-void IOmanager::getFramebufferSize(int* width, int* height) { glfwGetFramebufferSize(window, width, height); }
+void IOmanager::getFramebufferSize(int* width, int* height)
+{
+	*width = this->width;   // Not glfwGetFramebufferSize(), so it can be called from the render thread.
+	*height = this->height;
+}
 
 float IOmanager::getAspectRatio()
 {
@@ -53,31 +69,41 @@ float IOmanager::getAspectRatio()
 	return (float)width / height;
 }
 
-void IOmanager::setWindowShouldClose(bool b) { return glfwSetWindowShouldClose(window, b); }
+void IOmanager::setWindowShouldClose(bool b)
+{
+	if (window) glfwSetWindowShouldClose(window, b);
+	else shouldClose = b;
+}
 
-bool IOmanager::getWindowShouldClose() { return glfwWindowShouldClose(window); }
+bool IOmanager::getWindowShouldClose() { return window ? glfwWindowShouldClose(window) : shouldClose; }
 
 void IOmanager::destroy()
 {
+	if (!window) return;
+
 	glfwDestroyWindow(window);		// GLFW window
 	glfwTerminate();				// GLFW
 }
 
-bool IOmanager::isKeyPressed(int key) { return glfwGetKey(window, key) == GLFW_PRESS; }
+bool IOmanager::isKeyPressed(int key) { return window && glfwGetKey(window, key) == GLFW_PRESS; }
 
-bool IOmanager::isKeyReleased(int key) { return glfwGetKey(window, key) == GLFW_RELEASE; }
+bool IOmanager::isKeyReleased(int key) { return !window || glfwGetKey(window, key) == GLFW_RELEASE; }
 
-bool IOmanager::isMouseButtonPressed(int button) { return glfwGetMouseButton(window, button) == GLFW_PRESS; }
+bool IOmanager::isMouseButtonPressed(int button) { return window && glfwGetMouseButton(window, button) == GLFW_PRESS; }
 
-bool IOmanager::isMouseButtonReleased(int button) { return glfwGetMouseButton(window, button) == GLFW_RELEASE; }
+bool IOmanager::isMouseButtonReleased(int button) { return !window || glfwGetMouseButton(window, button) == GLFW_RELEASE; }
 
-void IOmanager::getCursorPos(double* xpos, double* ypos) { glfwGetCursorPos(window, xpos, ypos); }
+void IOmanager::getCursorPos(double* xpos, double* ypos)
+{
+	if (window) glfwGetCursorPos(window, xpos, ypos);
+	else *xpos = *ypos = 0;
+}
 
-void IOmanager::setInputMode(int mode, int value) { glfwSetInputMode(window, mode, value); }
+void IOmanager::setInputMode(int mode, int value) { if (window) glfwSetInputMode(window, mode, value); }
 
-void IOmanager::pollEvents() { glfwPollEvents(); }
+void IOmanager::pollEvents() { if (window) glfwPollEvents(); }
 
-void IOmanager::waitEvents() { glfwWaitEvents(); }
+void IOmanager::waitEvents() { if (window) glfwWaitEvents(); }
 
 float IOmanager::getYscrollOffset()
 {
@@ -89,6 +115,8 @@ float IOmanager::getYscrollOffset()
 void IOmanager::framebufferResizeCallback(GLFWwindow* window, int width, int height)
 {
 	auto windowUserPointer = reinterpret_cast<IOmanager*>(glfwGetWindowUserPointer(window));
+	windowUserPointer->width = width;
+	windowUserPointer->height = height;
 	windowUserPointer->framebufferResized = true;
 }
 
@@ -0,0 +1,160 @@
+#include <iostream>
+#include <algorithm>
+
+#include "polygonum/jobs.hpp"
+
+
+namespace
+{
+	thread_local const JobPool* currentPool = nullptr;   //!< Pool of the calling worker thread (nullptr if it's not a worker).
+	thread_local size_t currentQueue = 0;
+}
+
+JobPool::JobPool(unsigned numThreads)
+	: pendingJobs(0), stop(false)
+{
+	if (numThreads == 0) numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	for (unsigned i = 0; i < numThreads; i++)   // Workers' queues + external queue
+		queues.push_back(std::make_unique<Queue>());
+
+	for (unsigned i = 0; i + 1 < numThreads; i++)
+		threads.push_back(std::thread(&JobPool::worker, this, i));
+
+#ifdef DEBUG_WORKER
+	std::cout << typeid(*this).name() << "::" << __func__ << ": " << threads.size() << " workers" << std::endl;
+#endif
+}
+
+JobPool::~JobPool()
+{
+	{
+		const std::lock_guard<std::mutex> lock(mutSleep);
+		stop = true;
+	}
+	condJobs.notify_all();
+
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+size_t JobPool::getQueueIndex() const
+{
+	return currentPool == this ? currentQueue : queues.size() - 1;
+}
+
+void JobPool::worker(size_t queueIndex)
+{
+	currentPool = this;
+	currentQueue = queueIndex;
+
+	while (true)
+	{
+		if (runJob(queueIndex)) continue;
+
+		std::unique_lock<std::mutex> lock(mutSleep);
+		condJobs.wait(lock, [this] { return stop || pendingJobs > 0; });
+		if (stop) return;
+	}
+}
+
+bool JobPool::runJob(size_t queueIndex)
+{
+	Job job;
+	bool found = false;
+
+	// Newest job of this queue
+	{
+		Queue& queue = *queues[queueIndex];
+		const std::lock_guard<std::mutex> lock(queue.mutQueue);
+		if (queue.jobs.size())
+		{
+			job = std::move(queue.jobs.back());
+			queue.jobs.pop_back();
+			found = true;
+		}
+	}
+
+	// Oldest job of other queues
+	for (size_t i = 1; i < queues.size() && !found; i++)
+	{
+		Queue& queue = *queues[(queueIndex + i) % queues.size()];
+		const std::lock_guard<std::mutex> lock(queue.mutQueue);
+		if (queue.jobs.size())
+		{
+			job = std::move(queue.jobs.front());
+			queue.jobs.pop_front();
+			found = true;
+		}
+	}
+
+	if (!found) return false;
+
+	pendingJobs--;
+
+	try { job.function(); }
+	catch (...)
+	{
+		const std::lock_guard<std::mutex> lock(mutException);
+		if (!exception) exception = std::current_exception();
+	}
+
+	(*job.counter)--;
+	{ const std::lock_guard<std::mutex> lock(mutSleep); }   // A thread in wait() is either before checking the counter or already waiting.
+	condDone.notify_all();
+
+	return true;
+}
+
+void JobPool::submit(std::function<void()> job, std::atomic<size_t>& counter)
+{
+	counter++;
+
+	{
+		Queue& queue = *queues[getQueueIndex()];
+		const std::lock_guard<std::mutex> lock(queue.mutQueue);
+		queue.jobs.push_back(Job{ std::move(job), &counter });
+	}
+
+	pendingJobs++;
+	{ const std::lock_guard<std::mutex> lock(mutSleep); }   // A worker checking pendingJobs is either before the check or already waiting.
+	condJobs.notify_one();
+}
+
+void JobPool::wait(std::atomic<size_t>& counter)
+{
+	size_t queueIndex = getQueueIndex();
+
+	while (counter > 0)
+		if (!runJob(queueIndex))
+		{
+			// Remaining jobs are running in other threads. Sleep until one finishes (or there are jobs to run).
+			std::unique_lock<std::mutex> lock(mutSleep);
+			condDone.wait(lock, [&] { return counter == 0 || pendingJobs > 0; });
+		}
+
+	const std::lock_guard<std::mutex> lock(mutException);
+	if (exception)
+	{
+		std::exception_ptr thrown = exception;
+		exception = nullptr;
+		std::rethrow_exception(thrown);
+	}
+}
+
+void JobPool::parallelFor(size_t count, size_t grainSize, const std::function<void(size_t begin, size_t end)>& function)
+{
+	if (grainSize == 0) grainSize = 1;
+
+	std::atomic<size_t> counter(0);
+
+	for (size_t begin = 0; begin < count; begin += grainSize)
+	{
+		size_t end = std::min(begin + grainSize, count);
+		submit([&function, begin, end] { function(begin, end); }, counter);
+	}
+
+	wait(counter);
+}
+
+unsigned JobPool::getNumThreads() const { return static_cast<unsigned>(threads.size()); }
@@ -0,0 +1,213 @@
+#include <iostream>
+#include <algorithm>
+
+#include "polygonum/memory.hpp"
+#include "polygonum/environment.hpp"
+
+
+Allocation::Allocation()
+	: memory(VK_NULL_HANDLE), offset(0), size(0), mapped(nullptr), poolIndex(0) { }
+
+bool Allocation::isValid() const { return memory != VK_NULL_HANDLE; }
+
+MemoryStats::MemoryStats()
+	: blocks(0), allocations(0), blockBytes(0), usedBytes(0), freeRanges(0), largestFreeRange(0) { }
+
+float MemoryStats::fragmentation() const
+{
+	VkDeviceSize freeBytes = blockBytes - usedBytes;
+	if (!freeBytes) return 0.f;
+
+	return 1.f - (float)largestFreeRange / freeBytes;
+}
+
+void MemoryStats::print() const
+{
+	std::cout
+		<< "Memory stats: \n"
+		<< "   Blocks: " << blocks << " (" << blockBytes / (1024 * 1024) << " MB)" << '\n'
+		<< "   Allocations: " << allocations << " (" << usedBytes / (1024 * 1024) << " MB)" << '\n'
+		<< "   Free ranges: " << freeRanges << '\n'
+		<< "   Largest free range: " << largestFreeRange / 1024 << " KB" << '\n'
+		<< "   Fragmentation: " << fragmentation() << std::endl;
+}
+
+MemoryAllocator::MemoryAllocator(VulkanCore& core)
+	: c(core), pools(VK_MAX_MEMORY_TYPES * 2), memProperties{} { }
+
+Allocation MemoryAllocator::allocate(const VkMemoryRequirements& requirements, uint32_t memoryType, VkMemoryPropertyFlags properties, bool linear)
+{
+	const std::lock_guard<std::mutex> lock(mutAlloc);
+
+	Allocation result;
+	result.poolIndex = memoryType * 2 + (linear ? 1 : 0);
+	std::vector<Block>& pool = pools[result.poolIndex];
+
+	// Look for a free range in existing blocks
+	for (Block& block : pool)
+		if (allocateFromBlock(block, requirements.size, requirements.alignment, result))
+			return result;
+
+	// Create new block
+	if (!memProperties.memoryTypeCount)   // The physical device is chosen after constructing the allocator.
+		vkGetPhysicalDeviceMemoryProperties(c.physicalDevice, &memProperties);
+
+	bool hostVisible = memProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;   // Map it even if not requested: on unified memory, device-local types are host-visible too, and host-visible requests may take this block later.
+	VkDeviceSize blockSize = (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ? hostBlockSize : deviceBlockSize;
+
+	Block block;
+	block.size = std::max(blockSize, requirements.size);   // Big resources get a dedicated block.
+	block.mapped = nullptr;
+	block.allocations = 0;
+	block.dedicated = requirements.size > blockSize;
+	block.freeRanges[0] = block.size;
+
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = block.size;
+	allocInfo.memoryTypeIndex = memoryType;
+
+	if (vkAllocateMemory(c.device, &allocInfo, nullptr, &block.memory) != VK_SUCCESS)
+		throw std::runtime_error("Failed to allocate memory block!");
+
+	c.memAllocObjects++;
+
+	if (hostVisible)
+	{
+		void* data;
+		if (vkMapMemory(c.device, block.memory, 0, VK_WHOLE_SIZE, 0, &data) != VK_SUCCESS)   // Persistent mapping (a memory object can only be mapped once at a time, so allocations cannot map it by themselves).
+			throw std::runtime_error("Failed to map memory block!");
+		block.mapped = static_cast<uint8_t*>(data);
+	}
+
+	pool.push_back(block);
+
+	if (!allocateFromBlock(pool.back(), requirements.size, requirements.alignment, result))
+		throw std::runtime_error("Failed to allocate from a new memory block!");
+
+	return result;
+}
+
+bool MemoryAllocator::allocateFromBlock(Block& block, VkDeviceSize size, VkDeviceSize alignment, Allocation& result)
+{
+	if (!alignment) alignment = 1;
+
+	for (auto it = block.freeRanges.begin(); it != block.freeRanges.end(); it++)   // First fit
+	{
+		VkDeviceSize rangeOffset = it->first;
+		VkDeviceSize rangeSize = it->second;
+		VkDeviceSize alignedOffset = alignment * ((rangeOffset + alignment - 1) / alignment);
+		VkDeviceSize padding = alignedOffset - rangeOffset;
+
+		if (rangeSize < padding + size) continue;
+
+		block.freeRanges.erase(it);
+		if (padding) block.freeRanges[rangeOffset] = padding;   // Padding stays free
+		if (rangeSize > padding + size) block.freeRanges[alignedOffset + size] = rangeSize - padding - size;
+
+		result.memory = block.memory;
+		result.offset = alignedOffset;
+		result.size = size;
+		result.mapped = block.mapped ? block.mapped + alignedOffset : nullptr;
+		block.allocations++;
+
+		return true;
+	}
+
+	return false;
+}
+
+void MemoryAllocator::free(Allocation& allocation)
+{
+	if (!allocation.isValid()) return;
+
+	const std::lock_guard<std::mutex> lock(mutAlloc);
+
+	std::vector<Block>& pool = pools[allocation.poolIndex];
+	auto block = std::find_if(pool.begin(), pool.end(), [&allocation](const Block& b) { return b.memory == allocation.memory; });
+	if (block == pool.end())
+		throw std::runtime_error("Freeing an allocation that doesn't belong to the allocator!");
+
+	// Insert free range and merge it with adjacent free ranges
+	std::map<VkDeviceSize, VkDeviceSize>& ranges = block->freeRanges;
+	auto it = ranges.emplace(allocation.offset, allocation.size).first;
+
+	auto next = std::next(it);
+	if (next != ranges.end() && it->first + it->second == next->first)
+	{
+		it->second += next->second;
+		ranges.erase(next);
+	}
+
+	if (it != ranges.begin())
+	{
+		auto prev = std::prev(it);
+		if (prev->first + prev->second == it->first)
+		{
+			prev->second += it->second;
+			ranges.erase(it);
+		}
+	}
+
+	block->allocations--;
+	allocation = Allocation();
+
+	// Free empty blocks, but keep one per pool (avoids allocating/freeing a block each time a staging buffer is created/destroyed).
+	if (block->allocations == 0)
+	{
+		size_t emptyBlocks = std::count_if(pool.begin(), pool.end(), [](const Block& b) { return b.allocations == 0; });
+
+		if (emptyBlocks > 1 || block->dedicated)
+		{
+			freeBlock(*block);
+			pool.erase(block);
+		}
+	}
+}
+
+void MemoryAllocator::freeBlock(Block& block)
+{
+	if (block.mapped) vkUnmapMemory(c.device, block.memory);
+	vkFreeMemory(c.device, block.memory, nullptr);
+	c.memAllocObjects--;
+}
+
+MemoryStats MemoryAllocator::getStats()
+{
+	const std::lock_guard<std::mutex> lock(mutAlloc);
+
+	MemoryStats stats;
+
+	for (const auto& pool : pools)
+		for (const Block& block : pool)
+		{
+			VkDeviceSize freeBytes = 0;
+
+			for (const auto& range : block.freeRanges)
+			{
+				freeBytes += range.second;
+				stats.largestFreeRange = std::max(stats.largestFreeRange, range.second);
+			}
+
+			stats.blocks++;
+			stats.allocations += block.allocations;
+			stats.blockBytes += block.size;
+			stats.usedBytes += block.size - freeBytes;
+			stats.freeRanges += block.freeRanges.size();
+		}
+
+	return stats;
+}
+
+void MemoryAllocator::destroy()
+{
+	const std::lock_guard<std::mutex> lock(mutAlloc);
+
+	for (auto& pool : pools)
+	{
+		for (Block& block : pool)
+			freeBlock(block);
+
+		pool.clear();
+	}
+}
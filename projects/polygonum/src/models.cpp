@@ -1,4 +1,5 @@
 #include <iostream>
+#include <sstream>
 
 #include "polygonum/renderer.hpp"
 #include "polygonum/importer.hpp"
@@ -14,7 +15,10 @@ ModelDataInfo::ModelDataInfo()
 	transparency(false),
 	renderPassIndex(0),
 	subpassIndex(0),
-	cullMode(VK_CULL_MODE_BACK_BIT)
+	cullMode(VK_CULL_MODE_BACK_BIT),
+	loadPriority(0),
+	useGeometryArena(false),
+	gpuCulling(false)
 { }
 
 
@@ -28,7 +32,9 @@ ModelData::ModelData(Renderer* renderer, ModelDataInfo& modelInfo)
 	renderPassIndex(modelInfo.renderPassIndex),
 	subpassIndex(modelInfo.subpassIndex),
 	bindSets(modelInfo.bindSets),
+	useGeometryArena(modelInfo.useGeometryArena),
 	fullyConstructed(false),
+	uploadBatch(0),
 	ready(false)
 {
 	#ifdef DEBUG_MODELS
@@ -37,6 +43,14 @@ ModelData::ModelData(Renderer* renderer, ModelDataInfo& modelInfo)
 
 	setNumInstances(modelInfo.numInstances);
 
+	if (modelInfo.gpuCulling)
+	{
+		if (modelInfo.maxNumInstances == UINT32_MAX)
+			throw std::runtime_error("Failed to create model: GPU culling requires maxNumInstances!");
+
+		culling = std::make_unique<InstanceCulling>(r->culling, modelInfo.maxNumInstances);
+	}
+
 	resLoader = new ResourcesLoader(modelInfo.vertexesLoader, modelInfo.shadersInfo);
 }
 
@@ -48,6 +62,8 @@ ModelData::~ModelData()
 
 	if (fullyConstructed)
 	{
+		r->uploader.wait(uploadBatch);   // Copies into its buffers may still be running (e.g., deleted right after being constructed).
+
 		// Pipeline & Descriptors
 		cleanup_pipeline_and_descriptors();
 
@@ -55,12 +71,17 @@ ModelData::~ModelData()
 		for(auto& set : descriptorSetLayouts)
 			vkDestroyDescriptorSetLayout(r->c.device, set, nullptr);
 
-		// Index buffer
-		if (vert.indexCount)
-			r->c.destroyBuffer(r->c.device, vert.indexBuffer, vert.indexBufferMemory);
+		if (vert.arenaPage >= 0)   // Shared buffers
+			r->arena.free(vert);
+		else
+		{
+			// Index buffer
+			if (vert.indexCount)
+				r->c.destroyBuffer(r->c.device, vert.indexBuffer, vert.indexBufferMemory);
 
-		// Vertex buffer
-		r->c.destroyBuffer(r->c.device, vert.vertexBuffer, vert.vertexBufferMemory);
+			// Vertex buffer
+			r->c.destroyBuffer(r->c.device, vert.vertexBuffer, vert.vertexBufferMemory);
+		}
 	}
 
 	// Resources loader
@@ -74,6 +95,8 @@ ModelData::ModelData(ModelData&& other) noexcept
 	hasTransparencies(std::move(other.hasTransparencies)),
 	cullMode(std::move(other.cullMode)),
 	numInstances(std::move(other.numInstances)),
+	setLayoutsKey(std::move(other.setLayoutsKey)),
+	pipelineKey(std::move(other.pipelineKey)),
 	pipelineLayout(std::move(other.pipelineLayout)),
 	graphicsPipeline(std::move(other.graphicsPipeline)),
 	bindSets(std::move(other.bindSets)),
@@ -82,15 +105,19 @@ ModelData::ModelData(ModelData&& other) noexcept
 	descriptorSetLayouts(std::move(other.descriptorSetLayouts)),
 	descriptorPool(std::move(other.descriptorPool)),
 	descriptorSets(std::move(other.descriptorSets)),
+	useGeometryArena(std::move(other.useGeometryArena)),
+	culling(std::move(other.culling)),
 	renderPassIndex(std::move(other.renderPassIndex)),
 	subpassIndex(std::move(other.subpassIndex)),
 	resLoader(std::move(other.resLoader)),
 	fullyConstructed(std::move(other.fullyConstructed)),
+	uploadBatch(other.uploadBatch),
 	ready(std::move(other.ready)),
 	name(std::move(other.name))
 {
 	other.r = nullptr;
 	other.resLoader = nullptr;
+	other.pipelineKey.clear();   // Only one model releases the pipeline.
 }
 
 ModelData& ModelData::operator=(ModelData&& other) noexcept
@@ -110,17 +137,22 @@ ModelData& ModelData::operator=(ModelData&& other) noexcept
 	graphicsPipeline = other.graphicsPipeline;
 	descriptorSetLayouts = other.descriptorSetLayouts;
 	descriptorPool = other.descriptorPool;
+	useGeometryArena = other.useGeometryArena;
 	renderPassIndex = other.renderPassIndex;
 	subpassIndex = other.subpassIndex;
 	resLoader = other.resLoader;
 	fullyConstructed = other.fullyConstructed;
+	uploadBatch = other.uploadBatch;
 	ready = other.ready;
 
 	vertexType = std::move(other.vertexType);
+	setLayoutsKey = std::move(other.setLayoutsKey);
+	pipelineKey = std::move(other.pipelineKey);
 	shaders = std::move(other.shaders);
 	bindSets = std::move(other.bindSets);
 	vert = std::move(other.vert);
 	descriptorSets = std::move(other.descriptorSets);
+	culling = std::move(other.culling);
 	name = std::move(other.name);
 
 	// Leave other in valid state
@@ -133,6 +165,7 @@ ModelData& ModelData::operator=(ModelData&& other) noexcept
 	other.graphicsPipeline = other.graphicsPipeline;
 	other.descriptorSetLayouts = other.descriptorSetLayouts;
 	other.descriptorPool = other.descriptorPool;
+	other.useGeometryArena = false;
 	other.renderPassIndex = 0;
 	other.subpassIndex = 0;
 	other.resLoader = nullptr;
@@ -141,6 +174,8 @@ ModelData& ModelData::operator=(ModelData&& other) noexcept
 	other.name = "";
 	
 	other.vertexType = VertexType();
+	other.setLayoutsKey.clear();
+	other.pipelineKey.clear();
 	other.shaders.clear();
 	other.bindSets.clear();
 	other.vert = VertexData();
@@ -160,9 +195,13 @@ void ModelData::fullConstruction(Renderer& ren)
 		deleteLoader();
 	} else std::cout << "Error: No loading info data" << std::endl;
 
+	if (culling) culling->createResources(r, vert);   // Uploads its draw commands in the same batch.
+
 	//binds.createTextures();
 	for(BindingSet& set : bindSets) set.createBindings(r);
 
+	uploadBatch = ren.uploader.submit();   // Vertices, indices and textures are uploaded before the model is rendered (same queue). No need to wait for them.
+
 	createDescriptorSetLayout();
 	createGraphicsPipeline();
 	
@@ -181,6 +220,7 @@ void ModelData::createDescriptorSetLayout()
 	#endif
 
 	bool inputAttsAdded = false;
+	std::ostringstream layoutsKey;
 
 	for(const auto& set : bindSets)   // each set
 	{
@@ -285,6 +325,10 @@ void ModelData::createDescriptorSetLayout()
 			bindings.push_back(inputAttachmentLayoutBinding);
 		}
 
+		for (const auto& binding : bindings)
+			layoutsKey << binding.binding << ':' << binding.descriptorType << ':' << binding.descriptorCount << ':' << binding.stageFlags << ',';
+		layoutsKey << '/';
+
 		// Create all descriptor set layouts (one per binding set).
 
 		VkDescriptorSetLayoutCreateInfo layoutInfo{};
@@ -297,6 +341,8 @@ void ModelData::createDescriptorSetLayout()
 			throw std::runtime_error("Failed to create descriptor set layout!");
 		descriptorSetLayouts.push_back(descSetLayout);
 	}
+
+	setLayoutsKey = layoutsKey.str();
 }
 
 // (10)
@@ -306,6 +352,35 @@ void ModelData::createGraphicsPipeline()
 		std::cout << typeid(*this).name() << "::" << __func__ << " (" << name << ')' << std::endl;
 	#endif
 
+	pipelineKey = getPipelineKey();
+
+	r->pipelines.get(pipelineKey, graphicsPipeline, pipelineLayout,
+		[this](VkPipelineCache pipelineCache, VkPipeline& pipeline, VkPipelineLayout& layout) { buildGraphicsPipeline(pipelineCache, pipeline, layout); });
+}
+
+std::string ModelData::getPipelineKey()
+{
+	std::ostringstream key;
+
+	for (const auto& shader : shaders)
+		key << shader->id << '|';
+
+	for (const auto& attribute : vertexType.getAttributeDescriptions())
+		key << attribute.location << ':' << attribute.format << ':' << attribute.offset << ',';
+
+	key << '|' << vertexType.vertexSize
+		<< '|' << primitiveTopology
+		<< '|' << cullMode
+		<< '|' << hasTransparencies
+		<< '|' << renderPassIndex << ':' << subpassIndex
+		<< '|' << setLayoutsKey
+		<< '|' << (culling ? "culled" : "");
+
+	return key.str();
+}
+
+void ModelData::buildGraphicsPipeline(VkPipelineCache pipelineCache, VkPipeline& pipeline, VkPipelineLayout& layout)
+{
 	// Create pipeline layout   <<< sameMod
 	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
 	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
@@ -314,7 +389,7 @@ void ModelData::createGraphicsPipeline()
 	pipelineLayoutInfo.pushConstantRangeCount = 0;					// <<< Push constants are another way of passing dynamic values to shaders.
 	pipelineLayoutInfo.pPushConstantRanges = nullptr;
 
-	if (vkCreatePipelineLayout(r->c.device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
+	if (vkCreatePipelineLayout(r->c.device, &pipelineLayoutInfo, nullptr, &layout) != VK_SUCCESS)
 		throw std::runtime_error("Failed to create pipeline layout!");
 	
 	// Read shader files
@@ -344,10 +419,15 @@ void ModelData::createGraphicsPipeline()
 	// Vertex input: Describes format of the vertex data that will be passed to the vertex shader.
 	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
 	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	auto bindingDescription = vertexType.getBindingDescription();
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;							// Optional
+	std::vector<VkVertexInputBindingDescription> bindingDescriptions = { vertexType.getBindingDescription() };
 	auto attributeDescriptions = vertexType.getAttributeDescriptions();
+	if (culling)   // GPU culling: Index of each visible instance (binding 1, one uint per instance, located after the vertex attributes).
+	{
+		bindingDescriptions.push_back({ 1, sizeof(uint32_t), VK_VERTEX_INPUT_RATE_INSTANCE });
+		attributeDescriptions.push_back({ static_cast<uint32_t>(attributeDescriptions.size()), 1, VK_FORMAT_R32_UINT, 0 });
+	}
+	vertexInputInfo.vertexBindingDescriptionCount = static_cast<uint32_t>(bindingDescriptions.size());
+	vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();					// Optional
 	vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size());
 	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();				// Optional
 
@@ -357,27 +437,14 @@ void ModelData::createGraphicsPipeline()
 	inputAssembly.topology = primitiveTopology;		// VK_PRIMITIVE_TOPOLOGY_ ... POINT_LIST, LINE_LIST, LINE_STRIP, TRIANGLE_LIST, TRIANGLE_STRIP
 	inputAssembly.primitiveRestartEnable = VK_FALSE;					// If VK_TRUE, then it's possible to break up lines and triangles in the _STRIP topology modes by using a special index of 0xFFFF or 0xFFFFFFFF.
 
-	// Viewport: Describes the region of the framebuffer that the output will be rendered to.
-	VkViewport viewport{};
-	viewport.x = 0.0f;
-	viewport.y = 0.0f;
-	viewport.width = (float)r->swapChain.extent.width;
-	viewport.height = (float)r->swapChain.extent.height;
-	viewport.minDepth = 0.0f;
-	viewport.maxDepth = 1.0f;
-
-	// Scissor rectangle: Defines in which region pixels will actually be stored. Pixels outside the scissor rectangles will be discarded by the rasterizer. It works like a filter rather than a transformation.
-	VkRect2D scissor{};
-	scissor.offset = { 0, 0 };
-	scissor.extent = r->swapChain.extent;
-
-	// Viewport state: Combines the viewport and scissor rectangle into a viewport state. Multiple viewports and scissors require enabling a GPU feature.
+	// Viewport state: Combines the viewport (region of the framebuffer that the output will be rendered to) and scissor rectangle (region where pixels will actually be stored) into a viewport state. Multiple viewports and scissors require enabling a GPU feature.
+	// Both are dynamic states (set with vkCmdSetViewport/vkCmdSetScissor when recording command buffers; see Commander::recordModels()), so pipelines don't depend on the window size.
 	VkPipelineViewportStateCreateInfo viewportState{};
 	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 	viewportState.viewportCount = 1;
-	viewportState.pViewports = &viewport;
+	viewportState.pViewports = nullptr;		// Dynamic state
 	viewportState.scissorCount = 1;
-	viewportState.pScissors = &scissor;
+	viewportState.pScissors = nullptr;		// Dynamic state
 
 	// Rasterizer: It takes the geometry shaped by the vertices from the vertex shader and turns it into fragments to be colored by the fragment shader. It also performs depth testing, face culling and the scissor test, and can be configured to output fragments that fill entire polygons or just the edges (wireframe rendering).
 	VkPipelineRasterizationStateCreateInfo rasterizer{};
@@ -466,7 +533,7 @@ void ModelData::createGraphicsPipeline()
 	colorBlending.blendConstants[3] = 0.0f;						// Optional
 
 	// Dynamic states: A limited amount of the state that we specified in the previous structs can actually be changed without recreating the pipeline (size of viewport, lined width, blend constants...). If you want to do that, you have to fill this struct. This will cause the configuration of these values to be ignored and you will be required to specify the data at drawing time. This struct can be substituted by a nullptr later on if you don't have any dynamic state.
-	VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_LINE_WIDTH };
+	VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
 
 	VkPipelineDynamicStateCreateInfo dynamicState{};
 	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
@@ -489,15 +556,18 @@ void ModelData::createGraphicsPipeline()
 	pipelineInfo.pMultisampleState = &multisampling;
 	pipelineInfo.pDepthStencilState = &depthStencil;		// [Optional]
 	pipelineInfo.pColorBlendState = &colorBlending;
-	pipelineInfo.pDynamicState = nullptr;					// [Optional] <<< dynamic state not passed. If the bound graphics pipeline state was created with the VK_DYNAMIC_STATE_VIEWPORT dynamic state enabled then vkCmdSetViewport must have been called in the current command buffer prior to this drawing command. 
-	pipelineInfo.layout = pipelineLayout;
+	pipelineInfo.pDynamicState = &dynamicState;				// [Optional] Since the pipeline is created with VK_DYNAMIC_STATE_VIEWPORT and VK_DYNAMIC_STATE_SCISSOR, vkCmdSetViewport and vkCmdSetScissor must be called in the command buffer before drawing.
+	pipelineInfo.layout = layout;
 	pipelineInfo.renderPass = r->rp->renderPasses[renderPassIndex].renderPass;// It's possible to use other render passes with this pipeline instead of this specific instance, but they have to be compatible with "renderPass" (https://www.khronos.org/registry/vulkan/specs/1.0/html/vkspec.html#renderpass-compatibility).
 	pipelineInfo.subpass = 0;
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;		// [Optional] Specify the handle of an existing pipeline.
 	pipelineInfo.basePipelineIndex = -1;					// [Optional] Reference another pipeline that is about to be created by index.
 	
-	if (vkCreateGraphicsPipelines(r->c.device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS)
+	if (vkCreateGraphicsPipelines(r->c.device, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS)
+	{
+		vkDestroyPipelineLayout(r->c.device, layout, nullptr);
 		throw std::runtime_error("Failed to create graphics pipeline!");
+	}
 	
 	// Cleanup
 	//vkDestroyShaderModule(e.device, fragShaderModule, nullptr);
@@ -839,11 +909,57 @@ void ModelData::recreate_pipeline_and_descriptors()
 		std::cout << typeid(*this).name() << "::" << __func__ << " (" << name << ')' << std::endl;
 	#endif
 
-	createGraphicsPipeline();   // Recreate graphics pipeline because viewport and scissor rectangle size is specified during graphics pipeline creation (this can be avoided by using dynamic state for the viewport and scissor rectangles).
+	createGraphicsPipeline();   // Viewport and scissor are dynamic states, so this is only required if the render passes are no longer compatible (e.g., the swap chain format changed).
 
 	//binds.createBuffers();   //<<< Necessary?   Uniform buffers depend on the number of swap chain images.
 	createDescriptorPool();   // Descriptor pool depends on the swap chain images.
 	createDescriptorSets();   // Descriptor sets
+
+	if (culling)   // Culling buffers depend on the swap chain images.
+	{
+		culling->createResources(r, vert);
+		uploadBatch = r->uploader.submit();
+	}
+}
+
+void ModelData::updateInputAttachments()
+{
+	#ifdef DEBUG_MODELS
+		std::cout << typeid(*this).name() << "::" << __func__ << " (" << name << ')' << std::endl;
+	#endif
+
+	Subpass& subpass = r->rp->getSubpass(renderPassIndex, subpassIndex);
+	if (subpass.inputAtts.empty() || bindSets.empty() || descriptorSets.empty()) return;
+
+	const BindingSet& set = bindSets[0];   // Input attachments are the last binding of the 1st set (see createDescriptorSetLayout()).
+	uint32_t binding = static_cast<uint32_t>(set.vsGlobal.size() + set.vsLocal.size() + set.vsTextures.size() + set.fsGlobal.size() + set.fsLocal.size() + set.fsTextures.size());
+
+	std::vector<VkDescriptorImageInfo> inputAttachInfo;
+	for (const Image* attachment : subpass.inputAtts)
+	{
+		VkDescriptorImageInfo descriptorImageInfo;
+		descriptorImageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		descriptorImageInfo.imageView = attachment->view;
+		descriptorImageInfo.sampler = attachment->sampler;
+		inputAttachInfo.push_back(descriptorImageInfo);
+	}
+
+	std::vector<VkWriteDescriptorSet> descriptorWrites;
+	for (const auto& sets : descriptorSets)   // each swapchain image
+	{
+		VkWriteDescriptorSet descriptor{};
+		descriptor.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptor.dstSet = sets[0];
+		descriptor.dstBinding = binding;
+		descriptor.dstArrayElement = 0;
+		descriptor.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;	// VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+		descriptor.descriptorCount = static_cast<uint32_t>(inputAttachInfo.size());
+		descriptor.pImageInfo = inputAttachInfo.data();
+
+		descriptorWrites.push_back(descriptor);
+	}
+
+	vkUpdateDescriptorSets(r->c.device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
 }
 
 void ModelData::cleanup_pipeline_and_descriptors()
@@ -852,15 +968,21 @@ void ModelData::cleanup_pipeline_and_descriptors()
 		std::cout << typeid(*this).name() << "::" << __func__ << " (" << name << ')' << std::endl;
 	#endif
 	
-	// Graphics pipeline
-	vkDestroyPipeline(r->c.device, graphicsPipeline, nullptr);
-	vkDestroyPipelineLayout(r->c.device, pipelineLayout, nullptr);
+	// Graphics pipeline (destroyed when no model uses it)
+	if (pipelineKey.size())
+	{
+		r->pipelines.release(pipelineKey);
+		pipelineKey.clear();
+	}
 
 	// Uniform buffers & memory
 	//binds.destroyBuffers();
 
 	// Descriptor pool & Descriptor set (When a descriptor pool is destroyed, all descriptor-sets allocated from the pool are implicitly/automatically freed and become invalid)
 	vkDestroyDescriptorPool(r->c.device, descriptorPool, nullptr);
+
+	// GPU culling buffers & descriptors
+	if (culling) culling->destroyResources();
 }
 
 void ModelData::deleteLoader()
@@ -900,6 +1022,8 @@ bool ModelData::setNumInstances(uint32_t count)
 
 uint32_t ModelData::getNumInstances() const { return numInstances; }
 
+VkPrimitiveTopology ModelData::getTopology() const { return primitiveTopology; }
+
 ModelsManager::ModelsManager(const std::shared_ptr<RenderPipeline>& renderPipeline) :
 	newKey(0)
 {
@@ -937,6 +1061,16 @@ void ModelsManager::cleanup_pipelines_and_descriptors(std::mutex* waitMutex)
 		it->second.cleanup_pipeline_and_descriptors();
 }
 
+void ModelsManager::updateInputAttachments(std::mutex* waitMutex)
+{
+	std::unique_lock<std::mutex> lock;
+	if (waitMutex) lock = std::unique_lock<std::mutex>(*waitMutex);
+
+	for (auto it = data.begin(); it != data.end(); it++)
+		if (it->second.fullyConstructed)
+			it->second.updateInputAttachments();
+}
+
 void ModelsManager::create_pipelines_and_descriptors(std::mutex* waitMutex)
 {
 	if (waitMutex)
@@ -972,8 +1106,7 @@ void ModelSet::setNumInstances(uint32_t count)
 		count = maxNumInstances;
 	}
 
-	for (auto& modelKey : models)
-		r->getModel(modelKey)->setNumInstances(count);
+	r->setInstances(models, count);   // Flags command buffers for update if needed
 
 	numInstances = count;
 }
@@ -0,0 +1,166 @@
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <cmath>
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+	#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+		#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+	#endif
+#endif
+
+#include "polygonum/pacer.hpp"
+
+
+namespace
+{
+	const std::chrono::microseconds minSpinMargin(100);
+	const std::chrono::microseconds maxSpinMargin(4000);
+}
+
+FramePacer::FramePacer(size_t capacity)
+	: period(Clock::duration::zero()), nextFrame(Clock::now()), lastFrame(nextFrame), spinMargin(std::chrono::milliseconds(1)), timer(nullptr), intervals(std::max(capacity, size_t(1)), 0.f), intervalsCount(0)
+{
+#ifdef _WIN32
+	timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);   // Windows 10 1803+
+	if (!timer) timer = CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);   // Default timer resolution (~1-15 ms): the spin margin will grow.
+#endif
+}
+
+FramePacer::~FramePacer()
+{
+#ifdef _WIN32
+	if (timer) CloseHandle(timer);
+#endif
+}
+
+void FramePacer::setMaxFPS(int maxFPS)
+{
+	if (maxFPS > 0)
+		period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / maxFPS));
+	else
+		period = Clock::duration::zero();
+
+	nextFrame = Clock::now();
+}
+
+int FramePacer::getMaxFPS() const
+{
+	if (period == Clock::duration::zero()) return 0;
+	return static_cast<int>(std::round(1 / std::chrono::duration<double>(period).count()));
+}
+
+void FramePacer::wait()
+{
+	Clock::time_point now = Clock::now();
+
+	if (period != Clock::duration::zero())
+	{
+		if (now - nextFrame > period)   // Late for more than a frame (hitch, window moved...): restart the schedule.
+			nextFrame = now;
+		else if (now < nextFrame)
+		{
+			sleepUntil(nextFrame);
+			now = Clock::now();
+		}
+
+		nextFrame += period;
+	}
+
+	// Record interval
+	intervals[intervalsCount % intervals.size()] = std::chrono::duration<float, std::milli>(now - lastFrame).count();
+	intervalsCount++;
+	lastFrame = now;
+}
+
+void FramePacer::sleepUntil(Clock::time_point deadline)
+{
+	// Sleep (coarse) and adapt the spin margin to the oversleep
+	Clock::time_point wakeUp = deadline - spinMargin;
+	Clock::time_point now = Clock::now();
+
+	if (wakeUp > now)
+	{
+		sleepFor(wakeUp - now);
+
+		Clock::duration oversleep = Clock::now() - wakeUp;
+		if (oversleep > spinMargin / 2)
+			spinMargin = std::min<Clock::duration>(oversleep * 2, maxSpinMargin);   // Grow fast (missing a deadline is worse than spinning)
+		else
+			spinMargin = std::max<Clock::duration>(spinMargin - spinMargin / 16, minSpinMargin);   // Shrink slowly
+	}
+
+	// Spin (fine)
+	while (Clock::now() < deadline)
+		std::this_thread::yield();
+}
+
+void FramePacer::sleepFor(Clock::duration duration)
+{
+#ifdef _WIN32
+	if (timer)
+	{
+		LARGE_INTEGER dueTime;
+		dueTime.QuadPart = -static_cast<LONGLONG>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() / 100);   // Relative time in 100 ns units
+		if (SetWaitableTimerEx(timer, &dueTime, 0, nullptr, nullptr, nullptr, 0))
+		{
+			WaitForSingleObject(timer, INFINITE);
+			return;
+		}
+	}
+#endif
+
+	std::this_thread::sleep_for(duration);
+}
+
+PacingStats FramePacer::getStats(size_t frames) const
+{
+	PacingStats stats;
+
+	size_t count = std::min({ frames, intervalsCount, intervals.size() });
+	if (intervalsCount == count && count) count--;   // The first interval is measured from the pacer's creation.
+	if (!count) return stats;
+
+	std::vector<float> values(count);
+	for (size_t i = 0; i < count; i++)
+		values[i] = intervals[(intervalsCount - count + i) % intervals.size()];
+
+	double sum = 0, sumSquares = 0;
+	double lateThreshold = 1.5 * std::chrono::duration<double, std::milli>(period).count();
+
+	for (float value : values)
+	{
+		sum += value;
+		sumSquares += double(value) * value;
+		if (period != Clock::duration::zero() && value > lateThreshold) stats.lateFrames++;
+	}
+
+	std::sort(values.begin(), values.end());
+
+	stats.count = count;
+	stats.avg = sum / count;
+	stats.jitter = std::sqrt(std::max(sumSquares / count - stats.avg * stats.avg, 0.0));
+	stats.p99 = values[(count * 99 + 99) / 100 - 1];
+	stats.max = values.back();
+
+	return stats;
+}
+
+VkPresentModeKHR FramePacer::choosePresentMode(const std::vector<VkPresentModeKHR>& availablePresentModes, LatencyTarget target)
+{
+	auto isAvailable = [&availablePresentModes](VkPresentModeKHR mode)
+	{
+		return std::find(availablePresentModes.begin(), availablePresentModes.end(), mode) != availablePresentModes.end();
+	};
+
+	if (target == ltLowest && isAvailable(VK_PRESENT_MODE_IMMEDIATE_KHR))
+		return VK_PRESENT_MODE_IMMEDIATE_KHR;
+
+	if (target >= ltLow && isAvailable(VK_PRESENT_MODE_MAILBOX_KHR))
+		return VK_PRESENT_MODE_MAILBOX_KHR;
+
+	return VK_PRESENT_MODE_FIFO_KHR;   // Always supported
+}
@@ -1,6 +1,15 @@
 ﻿#include <iostream>
+#include <algorithm>
+#include <limits>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <thread>
 
 #include "polygonum/physics.hpp"
+#include "polygonum/ubo.hpp"
+#include "polygonum/jobs.hpp"
+#include "polygonum/simd.hpp"
 
 
 // BulletPhysics ----------------------------------------------------------
@@ -169,130 +178,506 @@ void PlanetParticle::updateState(float deltaTime)
 	gVec = gDir * g;
 }
 
-// OpticalDepthTable ----------------------------------------------------------
+// ParticleSystem ----------------------------------------------------------
 
-/*
-	getOpticalDepthTable
-		operator ()
-			raySphere()
-			opticalDepth()
-				densityAtPoint()
-*/
+ParticleSystem::ParticleSystem(float gValue, glm::vec3 gDirection)
+	: mode(flat), gVec(gDirection * gValue), nucleus(0,0,0), g(gValue), getFloorHeights(nullptr), outData(nullptr), outStride(0), outCount(std::numeric_limits<size_t>::max()), outBuffer(nullptr) { }
 
-OpticalDepthTable::OpticalDepthTable(unsigned numOptDepthPoints, unsigned planetRadius, unsigned atmosphereRadius, float heightStep, float angleStep, float densityFallOff)
-	: planetCenter(0, 0, 0), planetRadius(planetRadius), atmosphereRadius(atmosphereRadius), numOptDepthPoints(numOptDepthPoints), heightStep(heightStep), angleStep(angleStep), densityFallOff(densityFallOff)
+ParticleSystem::ParticleSystem(float gValue, glm::vec3 nucleus, FloorHeightsCallback getFloorHeights)
+	: mode(planet), gVec(0,0,0), nucleus(nucleus), g(gValue), getFloorHeights(getFloorHeights), outData(nullptr), outStride(0), outCount(std::numeric_limits<size_t>::max()), outBuffer(nullptr) { }
+
+size_t ParticleSystem::add(glm::vec3 position, glm::vec3 speed)
 {
-	// Compute useful variables	
-	heightSteps = std::ceil(1 + (atmosphereRadius - planetRadius) / heightStep);	// <<<
-	angleSteps = std::ceil(1 + 3.141592653589793238462 / angleStep);
-	bytes = 4 * heightSteps * angleSteps;	// sizeof(float) = 4
+	posX.push_back(position.x);
+	posY.push_back(position.y);
+	posZ.push_back(position.z);
+	speedX.push_back(speed.x);
+	speedY.push_back(speed.y);
+	speedZ.push_back(speed.z);
+	onFloor.push_back(0);
+
+	return posX.size() - 1;
+}
 
-	// Get table
-	table.resize(bytes);
+void ParticleSystem::remove(size_t index)
+{
+	if (index >= size()) throw std::runtime_error("Particle index out of range!");
 
-	float rayLength, angle;
-	glm::vec3 point, rayDir;
-	float* optDepth = (float*)table.data();
+	size_t last = size() - 1;
+	for (std::vector<float>* array : { &posX, &posY, &posZ, &speedX, &speedY, &speedZ })
+	{
+		(*array)[index] = (*array)[last];
+		array->pop_back();
+	}
+	onFloor[index] = onFloor[last];
+	onFloor.pop_back();
+}
 
-	for (size_t i = 0; i < heightSteps; i++)
+void ParticleSystem::clear()
+{
+	for (std::vector<float>* array : { &posX, &posY, &posZ, &speedX, &speedY, &speedZ })
+		array->clear();
+	onFloor.clear();
+}
+
+void ParticleSystem::reserve(size_t count)
+{
+	for (std::vector<float>* array : { &posX, &posY, &posZ, &speedX, &speedY, &speedZ })
+		array->reserve(count);
+	onFloor.reserve(count);
+}
+
+size_t ParticleSystem::size() const { return posX.size(); }
+
+glm::vec3 ParticleSystem::getPos(size_t index) const { return glm::vec3(posX[index], posY[index], posZ[index]); }
+
+glm::vec3 ParticleSystem::getSpeed(size_t index) const { return glm::vec3(speedX[index], speedY[index], speedZ[index]); }
+
+bool ParticleSystem::isOnFloor(size_t index) const { return onFloor[index]; }
+
+void ParticleSystem::setPos(size_t index, glm::vec3 position)
+{
+	posX[index] = position.x;
+	posY[index] = position.y;
+	posZ[index] = position.z;
+}
+
+void ParticleSystem::setSpeed(size_t index, glm::vec3 speed)
+{
+	speedX[index] = speed.x;
+	speedY[index] = speed.y;
+	speedZ[index] = speed.z;
+}
+
+void ParticleSystem::setCallback(FloorHeightsCallback getFloorHeights) { this->getFloorHeights = getFloorHeights; }
+
+void ParticleSystem::setOutput(uint8_t* data, size_t stride)
+{
+	if (data && stride < 3 * sizeof(float)) throw std::runtime_error("Output stride too small for a position!");
+
+	outData = data;
+	outStride = stride;
+	outCount = std::numeric_limits<size_t>::max();
+	outBuffer = nullptr;
+}
+
+void ParticleSystem::setOutput(BindingBuffer* buffer, size_t offset)
+{
+	if (!buffer) { setOutput(static_cast<uint8_t*>(nullptr), 0); return; }
+
+	size_t stride = buffer->descriptorSize / buffer->numSubDescriptors;   // Sub-descriptor size
+	if (offset + 3 * sizeof(float) > stride) throw std::runtime_error("Position doesn't fit in the buffer's sub-descriptors!");
+
+	outData = buffer->binding.data() + offset;
+	outStride = stride;
+	outCount = buffer->numSubDescriptors;
+	outBuffer = buffer;
+}
+
+void ParticleSystem::updateState(float deltaTime, JobPool* pool)
+{
+	size_t count = size();
+
+	if (pool && count > batchSize)
+		pool->parallelFor(count, batchSize * 16, [this, deltaTime](size_t begin, size_t end)
+		{
+			for (size_t i = begin; i < end; i += batchSize)
+				updateBatch(i, std::min(i + batchSize, end), deltaTime);
+		});
+	else
+		for (size_t i = 0; i < count; i += batchSize)
+			updateBatch(i, std::min(i + batchSize, count), deltaTime);
+
+	if (outBuffer)
 	{
-		point = { 0, planetRadius + i * heightStep, 0 };	// rayOrigin
+		size_t written = std::min(count, outCount);   // Particles beyond the buffer's capacity are not written
+		outBuffer->setSize_subs(written);
+		outBuffer->setDirty(0, written * outStride);
+	}
+}
 
-		for (size_t j = 0; j < angleSteps; j++)
+/*
+	Particles are integrated with the widest SIMD type available (see simd.hpp), and narrower ones process the remaining particles of each batch.
+	Two passes per batch: predict the new positions (UARM), and (after querying their floor heights) place them on the floor if they're below it.
+*/
+namespace
+{
+	/// Pointers to a batch of particles and the parameters of ParticleSystem::updateState().
+	struct ParticleBatch
+	{
+		float* x, * y, * z;
+		float* speedX, * speedY, * speedZ;
+		uint8_t* onFloor;
+		float* newX, * newY, * newZ;   //!< Predicted positions
+		float* heights;   //!< Floor heights of the predicted positions
+
+		bool planet;
+		glm::vec3 gVec;   //!< Flat mode
+		glm::vec3 nucleus;   //!< Planet mode
+		float g;
+		float deltaTime;
+	};
+
+	/// UARM: Uniformly Accelerated Rectilinear Motion ( s = 0.5 g t^2 + v t + s0 ). Predict positions [i, count) in groups of S::width. Updates "i".
+	template<typename S>
+	void predictParticles(const ParticleBatch& b, size_t& i, size_t count)
+	{
+		typedef typename S::F F;
+		const F dt = S::set(b.deltaTime);
+
+		if (!b.planet)   // Like Particle::updateState()
+		{
+			const float halfDt2 = 0.5f * b.deltaTime * b.deltaTime;
+			const F accX = S::set(b.gVec.x * halfDt2), accY = S::set(b.gVec.y * halfDt2), accZ = S::set(b.gVec.z * halfDt2);
+
+			for (; i + S::width <= count; i += S::width)
+			{
+				S::store(b.newX + i, S::add(S::add(S::load(b.x + i), S::mul(S::load(b.speedX + i), dt)), accX));
+				S::store(b.newY + i, S::add(S::add(S::load(b.y + i), S::mul(S::load(b.speedY + i), dt)), accY));
+				S::store(b.newZ + i, S::add(S::add(S::load(b.z + i), S::mul(S::load(b.speedZ + i), dt)), accZ));
+			}
+		}
+		else   // Like PlanetParticle::updateState(): g points towards the nucleus
 		{
-			angle = j * angleStep;
-			rayDir = glm::vec3(sin(angle), cos(angle), 0);
-			rayLength = raySphere(point, rayDir).y;
+			const F nx = S::set(b.nucleus.x), ny = S::set(b.nucleus.y), nz = S::set(b.nucleus.z);
+			const F gHalfDt2 = S::set(0.5f * b.g * b.deltaTime * b.deltaTime);
+
+			for (; i + S::width <= count; i += S::width)
+			{
+				F x = S::load(b.x + i), y = S::load(b.y + i), z = S::load(b.z + i);
+				F dx = S::sub(nx, x), dy = S::sub(ny, y), dz = S::sub(nz, z);
+				F gScale = S::div(gHalfDt2, S::sqrt(S::add(S::add(S::mul(dx, dx), S::mul(dy, dy)), S::mul(dz, dz))));   // g * 0.5 t^2 / |d|
+
+				S::store(b.newX + i, S::add(S::add(x, S::mul(S::load(b.speedX + i), dt)), S::mul(dx, gScale)));
+				S::store(b.newY + i, S::add(S::add(y, S::mul(S::load(b.speedY + i), dt)), S::mul(dy, gScale)));
+				S::store(b.newZ + i, S::add(S::add(z, S::mul(S::load(b.speedZ + i), dt)), S::mul(dz, gScale)));
+			}
+		}
+	}
 
-			optDepth[i * angleSteps + j] = opticalDepth(point, rayDir, rayLength);
+	/// Adjust predicted positions [i, count) to the ground and update speeds, in groups of S::width. Updates "i".
+	template<typename S>
+	void resolveParticles(const ParticleBatch& b, size_t& i, size_t count)
+	{
+		typedef typename S::F F;
+		typedef typename S::M M;
+		const F zero = S::set(0.f);
+		unsigned onFloor;
 
-			//if (point.y > 2399 && point.y < 2401 && angle > 1.84 && angle < 1.86)
-			//	std::cout << "(" << i << ", " << j << ") / " << point.y << " / " << optDepth[i * angleSteps + j] << " / " << rayLength << " / " << angle << " / (" << rayDir.x << ", " << rayDir.y << ", " << rayDir.z << ")" << std::endl;
+		if (!b.planet)
+		{
+			const F gx = S::set(b.gVec.x * b.deltaTime), gy = S::set(b.gVec.y * b.deltaTime), gz = S::set(b.gVec.z * b.deltaTime);
+			const F jumpMargin = S::set(0.15f);   // Allows to jump before touching ground
+
+			for (; i + S::width <= count; i += S::width)
+			{
+				F newZ = S::load(b.newZ + i), height = S::load(b.heights + i);
+				M below = S::lessMask(newZ, height);
+
+				S::store(b.x + i, S::load(b.newX + i));
+				S::store(b.y + i, S::load(b.newY + i));
+				S::store(b.z + i, S::select(below, newZ, height));
+				S::store(b.speedX + i, S::select(below, S::add(S::load(b.speedX + i), gx), zero));
+				S::store(b.speedY + i, S::select(below, S::add(S::load(b.speedY + i), gy), zero));
+				S::store(b.speedZ + i, S::select(below, S::add(S::load(b.speedZ + i), gz), zero));
+
+				onFloor = S::less(newZ, S::add(height, jumpMargin));
+				for (size_t j = 0; j < S::width; j++)
+					b.onFloor[i + j] = (onFloor >> j) & 1;
+			}
+		}
+		else
+		{
+			const F nx = S::set(b.nucleus.x), ny = S::set(b.nucleus.y), nz = S::set(b.nucleus.z);
+			const F gDt = S::set(b.g * b.deltaTime);
+			const F one = S::set(1.f);
+
+			for (; i + S::width <= count; i += S::width)
+			{
+				F newX = S::load(b.newX + i), newY = S::load(b.newY + i), newZ = S::load(b.newZ + i), height = S::load(b.heights + i);
+				F dx = S::sub(nx, newX), dy = S::sub(ny, newY), dz = S::sub(nz, newZ);
+				F newHeight = S::sqrt(S::add(S::add(S::mul(dx, dx), S::mul(dy, dy)), S::mul(dz, dz)));
+				F invHeight = S::div(one, newHeight);   // gDir = d / |d|
+				M below = S::lessMask(newHeight, height);
+
+				F floorScale = S::mul(invHeight, height);   // Floor position = nucleus - gDir * floorHeight
+				S::store(b.x + i, S::select(below, newX, S::sub(nx, S::mul(dx, floorScale))));
+				S::store(b.y + i, S::select(below, newY, S::sub(ny, S::mul(dy, floorScale))));
+				S::store(b.z + i, S::select(below, newZ, S::sub(nz, S::mul(dz, floorScale))));
+
+				F gScale = S::mul(invHeight, gDt);   // speed += gDir * g * t (g at the new position)
+				S::store(b.speedX + i, S::select(below, S::add(S::load(b.speedX + i), S::mul(dx, gScale)), zero));
+				S::store(b.speedY + i, S::select(below, S::add(S::load(b.speedY + i), S::mul(dy, gScale)), zero));
+				S::store(b.speedZ + i, S::select(below, S::add(S::load(b.speedZ + i), S::mul(dz, gScale)), zero));
+
+				onFloor = S::less(newHeight, height);
+				for (size_t j = 0; j < S::width; j++)
+					b.onFloor[i + j] = (onFloor >> j) & 1;
+			}
 		}
 	}
+}
 
-	// Compute
-	float angleRange = 3.141592653589793238462;
-	point = glm::vec3(2400, 0, 0);
-	angle = angleRange / 1.7;
-	rayDir = glm::vec3(cos(angle), 0, sin(angle));
-	rayLength = raySphere(point, rayDir).y;
-
-	// Look up
-	float heightRatio = (2400.f - planetRadius) / (atmosphereRadius - planetRadius);
-	float angleRatio = angle / angleRange;
-	unsigned i = (heightSteps - 1) * heightRatio;
-	unsigned j = (angleSteps - 1) * angleRatio;
+void ParticleSystem::updateBatch(size_t begin, size_t end, float deltaTime)
+{
+	size_t count = end - begin;
+	float newX[batchSize], newY[batchSize], newZ[batchSize], heights[batchSize];
+
+	ParticleBatch batch{
+		posX.data() + begin, posY.data() + begin, posZ.data() + begin,
+		speedX.data() + begin, speedY.data() + begin, speedZ.data() + begin,
+		onFloor.data() + begin,
+		newX, newY, newZ, heights,
+		mode == planet, gVec, nucleus, g, deltaTime };
+
+	size_t i = 0;
+#ifdef __AVX512F__
+	predictParticles<SimdAVX512>(batch, i, count);
+#endif
+#ifdef __AVX__
+	predictParticles<SimdAVX>(batch, i, count);
+#endif
+#if defined(__AVX__) || defined(POLYGONUM_SSE)
+	predictParticles<SimdSSE>(batch, i, count);
+#endif
+	predictParticles<SimdScalar>(batch, i, count);
+
+	if (getFloorHeights) getFloorHeights(newX, newY, newZ, heights, count);
+	else std::fill(heights, heights + count, mode == planet ? 0.f : std::numeric_limits<float>::lowest());   // No floor
+
+	i = 0;
+#ifdef __AVX512F__
+	resolveParticles<SimdAVX512>(batch, i, count);
+#endif
+#ifdef __AVX__
+	resolveParticles<SimdAVX>(batch, i, count);
+#endif
+#if defined(__AVX__) || defined(POLYGONUM_SSE)
+	resolveParticles<SimdSSE>(batch, i, count);
+#endif
+	resolveParticles<SimdScalar>(batch, i, count);
+
+	if (outData && begin < outCount)   // Instance data (particles beyond outCount are not written)
+		for (i = 0; i < std::min(count, outCount - begin); i++)
+		{
+			float* out = reinterpret_cast<float*>(outData + (begin + i) * outStride);
+			out[0] = batch.x[i];
+			out[1] = batch.y[i];
+			out[2] = batch.z[i];
+		}
 }
 
-float OpticalDepthTable::opticalDepth(glm::vec3 rayOrigin, glm::vec3 rayDir, float rayLength) const
+// OpticalDepthTable ----------------------------------------------------------
+
+/*
+	Tables are computed with the widest SIMD type available (see simd.hpp), and narrower ones process the remaining elements:
+		- OpticalDepthTable: Each row (ray origin height) is a job. In a row, S::width angles (ray directions) are ray-marched at once.
+		- DensityVector: S::width heights at once.
+	Then they're cached on disk: <cacheDirectory>/<key>.bin = { key, bytes, table }. The key is a FNV-1a hash of the table type and its constructor parameters.
+*/
+namespace
 {
-	glm::vec3 point = rayOrigin;
-	float stepSize = rayLength / (numOptDepthPoints - 1);
-	float opticalDepth = 0;
+	/// Parameters of OpticalDepthTable for the ray-marching kernel.
+	struct OptDepthParams
+	{
+		float planetRadius;
+		float atmosphereRadius;
+		unsigned numOptDepthPoints;
+		float densityFallOff;
+	};
+
+	/// Density at some normalized height (0: surface, 1: atmosphere's limit).
+	template<typename S>
+	typename S::F densityAtHeight(typename S::F height01, typename S::F densityFallOff)
+	{
+		//return simdExp<S>(S::mul(S::sub(S::set(0.f), height01), densityFallOff));   // There is always some density
+		return S::mul(simdExp<S>(S::mul(S::sub(S::set(0.f), height01), densityFallOff)), S::sub(S::set(1.f), height01));   // Density ends at some distance
+	}
 
-	for (unsigned i = 0; i < numOptDepthPoints; i++)
+	/**
+		Optical depths of rays [i, count) (directions dirX/dirY) starting at (0, height, 0), in groups of S::width. Updates "i".
+		Ray length: Distance through the atmosphere (ray-sphere intersection with the planet at the origin; 0 if missed). Then, numOptDepthPoints densities are sampled along it.
+	*/
+	template<typename S>
+	void opticalDepths(const OptDepthParams& p, float height, const float* dirX, const float* dirY, float* optDepth, size_t& i, size_t count)
 	{
-		opticalDepth += densityAtPoint(point) * stepSize;
-		point += rayDir * stepSize;
+		typedef typename S::F F;
+		const F zero = S::set(0.f), half = S::set(0.5f);
+		const F originY = S::set(height);
+		const F c = S::set(height * height - p.atmosphereRadius * p.atmosphereRadius);   // dot(offset, offset) - r^2
+		const F planetRadius = S::set(p.planetRadius);
+		const F invAtmosphereHeight = S::set(1.f / (p.atmosphereRadius - p.planetRadius));
+		const F densityFallOff = S::set(p.densityFallOff);
+		const F invSteps = S::set(1.f / (p.numOptDepthPoints - 1));
+
+		for (; i + S::width <= count; i += S::width)
+		{
+			F dx = S::load(dirX + i), dy = S::load(dirY + i);
+
+			// Ray-sphere intersection (a = 1, b = 2 dot(offset, rayDir), discriminant = b^2 - 4ac). Length is 0 if there are less than 2 intersections or both are behind the ray.
+			F b = S::mul(S::set(2.f), S::mul(originY, dy));
+			F s = S::sqrt(S::max(S::sub(S::mul(b, b), S::mul(S::set(4.f), c)), zero));
+			F distNear = S::max(zero, S::mul(S::sub(S::sub(zero, b), s), half));
+			F distFar = S::mul(S::add(S::sub(zero, b), s), half);
+			F stepSize = S::mul(S::max(zero, S::sub(distFar, distNear)), invSteps);
+
+			// Ray marching
+			F optDepthSum = zero;
+			for (unsigned k = 0; k < p.numOptDepthPoints; k++)
+			{
+				F t = S::mul(stepSize, S::set((float)k));
+				F px = S::mul(dx, t), py = S::add(originY, S::mul(dy, t));
+				F height01 = S::mul(S::sub(S::sqrt(S::add(S::mul(px, px), S::mul(py, py))), planetRadius), invAtmosphereHeight);
+				optDepthSum = S::add(optDepthSum, densityAtHeight<S>(height01, densityFallOff));
+			}
+
+			S::store(optDepth + i, S::mul(optDepthSum, stepSize));
+		}
 	}
 
-	return opticalDepth;
-}
+	/// Replace normalized heights [i, count) with their densities, in groups of S::width. Updates "i".
+	template<typename S>
+	void densities(float* data, float densityFallOff, size_t& i, size_t count)
+	{
+		const typename S::F fallOff = S::set(densityFallOff);
 
-float OpticalDepthTable::densityAtPoint(glm::vec3 point) const
-{
-	float heightAboveSurface = glm::length(point - planetCenter) - planetRadius;
-	float height01 = heightAboveSurface / (atmosphereRadius - planetRadius);
+		for (; i + S::width <= count; i += S::width)
+			S::store(data + i, densityAtHeight<S>(S::load(data + i), fallOff));
+	}
+
+	uint64_t getTableKey(const std::string& type, std::initializer_list<double> params)
+	{
+		uint64_t hash = 14695981039346656037ull;   // FNV-1a (offset basis)
+
+		auto addBytes = [&hash](const void* data, size_t size)
+		{
+			for (size_t i = 0; i < size; i++)
+			{
+				hash ^= static_cast<const unsigned char*>(data)[i];
+				hash *= 1099511628211ull;   // FNV prime
+			}
+		};
+
+		addBytes(type.data(), type.size());
+		for (double param : params)
+			addBytes(&param, sizeof(param));
+
+		return hash;
+	}
+
+	std::string getTableFileName(uint64_t key)
+	{
+		std::ostringstream fileName;
+		fileName << OpticalDepthTable::cacheDirectory << '/' << std::hex << key << ".bin";
+		return fileName.str();
+	}
+
+	/// Load a table from the cache. "table" must have the expected size. Returns false if not found or not valid.
+	bool readTableCache(uint64_t key, std::vector<unsigned char>& table)
+	{
+		if (OpticalDepthTable::cacheDirectory.empty()) return false;
+
+		std::ifstream file(getTableFileName(key), std::ios::binary);
+		if (!file.is_open()) return false;
+
+		uint64_t header[2];   // key, bytes
+		file.read(reinterpret_cast<char*>(header), sizeof(header));
+		if (!file || header[0] != key || header[1] != table.size()) return false;
+
+		file.read(reinterpret_cast<char*>(table.data()), table.size());
+		if (!file) return false;
+
+#ifdef DEBUG_RESOURCES
+		std::cout << "   Table taken from cache: " << getTableFileName(key) << std::endl;
+#endif
+
+		return true;
+	}
+
+	void writeTableCache(uint64_t key, const std::vector<unsigned char>& table)
+	{
+		if (OpticalDepthTable::cacheDirectory.empty()) return;
 
-	//return exp(-height01 * densityFallOff);					// There is always some density
-	return exp(-height01 * densityFallOff) * (1 - height01);	// Density ends at some distance
+		std::string fileName = getTableFileName(key);
+		std::ostringstream tempName;
+		tempName << fileName << '.' << std::this_thread::get_id() << ".tmp";   // Different threads/processes may compute the same table simultaneously.
+
+		std::error_code error;
+		std::filesystem::create_directories(OpticalDepthTable::cacheDirectory, error);
+
+		{
+			std::ofstream file(tempName.str(), std::ios::binary | std::ios::trunc);
+			if (!file.is_open()) return;   // The cache is optional: Don't fail if it cannot be written.
+
+			uint64_t header[2] = { key, table.size() };
+			file.write(reinterpret_cast<const char*>(header), sizeof(header));
+			file.write(reinterpret_cast<const char*>(table.data()), table.size());
+			if (!file) { file.close(); std::filesystem::remove(tempName.str(), error); return; }
+		}
+
+		std::filesystem::rename(tempName.str(), fileName, error);   // Readers never see partially written files.
+		if (error) std::filesystem::remove(tempName.str(), error);
+	}
 }
 
-// Returns distance to sphere surface. If it's not, return maximum floating point.
-// Returns vector(distToSphere, distThroughSphere). 
-//		If rayOrigin is inside sphere, distToSphere = 0. 
-//		If ray misses sphere, distToSphere = maxValue; distThroughSphere = 0.
-glm::vec2 OpticalDepthTable::raySphere(glm::vec3 rayOrigin, glm::vec3 rayDir) const
+std::string OpticalDepthTable::cacheDirectory = "atmosphereCache";
+
+void OpticalDepthTable::setCacheDirectory(const std::string& directory) { cacheDirectory = directory; }
+
+OpticalDepthTable::OpticalDepthTable(unsigned numOptDepthPoints, unsigned planetRadius, unsigned atmosphereRadius, float heightStep, float angleStep, float densityFallOff, JobPool* pool)
+	: planetCenter(0, 0, 0), planetRadius(planetRadius), atmosphereRadius(atmosphereRadius), numOptDepthPoints(numOptDepthPoints), heightStep(heightStep), angleStep(angleStep), densityFallOff(densityFallOff)
 {
-	// Number of intersections
-	glm::vec3 offset = rayOrigin - planetCenter;
-	float a = 1;						// Set to dot(rayDir, rayDir) if rayDir might not be normalized
-	float b = 2 * dot(offset, rayDir);
-	float c = glm::dot(offset, offset) - atmosphereRadius * atmosphereRadius;
-	float d = b * b - 4 * a * c;		// Discriminant of quadratic formula (sqrt has 2 solutions/intersections when positive)
-
-	// Two intersections (d > 0)
-	if (d > 0)
-	{
-		float s = sqrt(d);
-		float distToSphereNear = std::max(0.f, (-b - s) / (2 * a));
-		float distToSphereFar = (-b + s) / (2 * a);
+	// Compute useful variables	
+	heightSteps = std::ceil(1 + (atmosphereRadius - planetRadius) / heightStep);	// <<<
+	angleSteps = std::ceil(1 + 3.141592653589793238462 / angleStep);
+	bytes = 4 * heightSteps * angleSteps;	// sizeof(float) = 4
 
-		if (distToSphereFar >= 0)		// Ignore intersections that occur behind the ray
-			return glm::vec2(distToSphereNear, distToSphereFar - distToSphereNear);
+	// Get table
+	table.resize(bytes);
+
+	uint64_t key = getTableKey("OpticalDepthTable", { (double)numOptDepthPoints, (double)planetRadius, (double)atmosphereRadius, heightStep, angleStep, densityFallOff });
+	if (readTableCache(key, table)) return;
+
+	std::vector<float> dirX(angleSteps), dirY(angleSteps);   // Ray directions
+	for (size_t j = 0; j < angleSteps; j++)
+	{
+		dirX[j] = sin(j * angleStep);
+		dirY[j] = cos(j * angleStep);
 	}
 
-	// No intersection (d < 0) or one (d = 0)
-	return glm::vec2(FLT_MAX, 0);			// https://stackoverflow.com/questions/16069959/glsl-how-to-ensure-largest-possible-float-value-without-overflow
+	std::unique_ptr<JobPool> tempPool;
+	if (!pool)
+	{
+		tempPool = std::make_unique<JobPool>();
+		pool = tempPool.get();
+	}
 
-	/*
-		/ Line:     y = mx + b
-		\ Circle:   r^2 = x^2 + y^2;	y = sqrt(r^2 - x^2)
-					r^2 = (x - h)^2 + (y - k)^2;	r^2 = X^2 + x^2 + 2Xx + Y^2 + y^2 + 2Yy
+	pool->parallelFor(heightSteps, 1, [this, &dirX, &dirY](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+			computeRow(i, dirX.data(), dirY.data());
+	});
 
-		mx + b = sqrt(r^2 - x^2)
-		mmx^2 + b^2 + 2mbx = r^2 - x^2
-		mmx^2 + b^2 + 2mbx - r^2 + x^2  = 0
-		(mm + 1)x^2 + 2mbx + (b^2 - r^2) = 0
-	*/
+	writeTableCache(key, table);
+}
 
-	//float m = rayDir.y / rayDir.x;	// line's slope
-	//float B = rayOrigin.y;			// line's Y-intercept 
-	//float a = m * m + 1;
-	//float b = 2 * m * B;
-	//float c = B * B - atmosphereRadius * atmosphereRadius;
-	//float d = b * b - 4 * a * c;
+void OpticalDepthTable::computeRow(size_t row, const float* dirX, const float* dirY)
+{
+	OptDepthParams params{ (float)planetRadius, (float)atmosphereRadius, numOptDepthPoints, densityFallOff };
+	float height = planetRadius + row * heightStep;   // Ray origin: (0, height, 0)
+	float* optDepth = (float*)table.data() + row * angleSteps;
+	size_t i = 0;
+
+#ifdef __AVX512F__
+	opticalDepths<SimdAVX512>(params, height, dirX, dirY, optDepth, i, angleSteps);
+#endif
+#ifdef __AVX__
+	opticalDepths<SimdAVX>(params, height, dirX, dirY, optDepth, i, angleSteps);
+#endif
+#if defined(__AVX__) || defined(POLYGONUM_SSE)
+	opticalDepths<SimdSSE>(params, height, dirX, dirY, optDepth, i, angleSteps);
+#endif
+	opticalDepths<SimdScalar>(params, height, dirX, dirY, optDepth, i, angleSteps);
 }
 
 DensityVector::DensityVector(float planetRadius, float atmosphereRadius, float stepSize, float densityFallOff)
@@ -301,20 +686,24 @@ DensityVector::DensityVector(float planetRadius, float atmosphereRadius, float s
 	bytes = 4 * heightSteps;
 	table.resize(bytes);
 
-	glm::vec2 point = { 0.f, planetRadius };
-	glm::vec2 planetCenter = { 0.f, 0.f };
-	float heightAboveSurface;
-	float height01;
-	float* density = (float*)table.data();
+	uint64_t key = getTableKey("DensityVector", { planetRadius, atmosphereRadius, stepSize, densityFallOff });
+	if (readTableCache(key, table)) return;
 
+	float* density = (float*)table.data();
 	for (size_t i = 0; i < heightSteps; i++)
-	{
-		heightAboveSurface = glm::length(point - planetCenter) - planetRadius;
-		height01 = heightAboveSurface / (atmosphereRadius - planetRadius);
-
-		//density[i] = std::exp(-height01 * densityFallOff);					// There is always some density
-		density[i] = std::exp(-height01 * densityFallOff) * (1 - height01);	// Density ends at some distance
-
-		point.y += stepSize;
-	}
-}
\ No newline at end of file
+		density[i] = (i * stepSize) / (atmosphereRadius - planetRadius);   // Normalized height
+
+	size_t i = 0;
+#ifdef __AVX512F__
+	densities<SimdAVX512>(density, densityFallOff, i, heightSteps);
+#endif
+#ifdef __AVX__
+	densities<SimdAVX>(density, densityFallOff, i, heightSteps);
+#endif
+#if defined(__AVX__) || defined(POLYGONUM_SSE)
+	densities<SimdSSE>(density, densityFallOff, i, heightSteps);
+#endif
+	densities<SimdScalar>(density, densityFallOff, i, heightSteps);
+
+	writeTableCache(key, table);
+}
@@ -0,0 +1,169 @@
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <cstring>
+
+#include "polygonum/pipelines.hpp"
+
+
+PipelineManager::PipelineManager(VulkanCore& core)
+	: c(core), pipelineCache(VK_NULL_HANDLE)
+{
+	createPipelineCache();
+}
+
+void PipelineManager::createPipelineCache()
+{
+	std::vector<char> cacheData;
+
+	std::ifstream file(cacheFile, std::ios::ate | std::ios::binary);
+	if (file.is_open())
+	{
+		cacheData.resize((size_t)file.tellg());
+		file.seekg(0);
+		file.read(cacheData.data(), cacheData.size());
+
+		if (!file || !isCompatible(cacheData))   // Some drivers don't validate the data properly.
+			cacheData.clear();
+	}
+
+	VkPipelineCacheCreateInfo cacheInfo{};
+	cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	cacheInfo.initialDataSize = cacheData.size();
+	cacheInfo.pInitialData = cacheData.size() ? cacheData.data() : nullptr;
+
+	if (vkCreatePipelineCache(c.device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS)
+		throw std::runtime_error("Failed to create pipeline cache!");
+
+#ifdef DEBUG_RESOURCES
+	std::cout << "Pipeline cache loaded (" << cacheData.size() << " bytes)" << std::endl;
+#endif
+}
+
+bool PipelineManager::isCompatible(const std::vector<char>& cacheData)
+{
+	// Header (VkPipelineCacheHeaderVersionOne): headerSize, headerVersion, vendorID, deviceID (4 bytes each), pipelineCacheUUID (VK_UUID_SIZE bytes).
+	const size_t headerSize = 4 * sizeof(uint32_t) + VK_UUID_SIZE;
+	if (cacheData.size() < headerSize) return false;
+
+	uint32_t header[4];
+	std::memcpy(header, cacheData.data(), sizeof(header));
+
+	const VkPhysicalDeviceProperties& properties = c.deviceData.deviceProperties;
+
+	return
+		header[0] >= headerSize &&
+		header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+		header[2] == properties.vendorID &&
+		header[3] == properties.deviceID &&
+		std::memcmp(cacheData.data() + sizeof(header), properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void PipelineManager::get(const std::string& key, VkPipeline& pipeline, VkPipelineLayout& layout, const std::function<void(VkPipelineCache, VkPipeline&, VkPipelineLayout&)>& create)
+{
+	std::unique_lock<std::mutex> lock(mutPipelines);
+
+	// Another thread may be creating it. Don't count this user until it's ready: if creation fails, the entry is erased (and may be created again).
+	auto it = pipelines.find(key);
+	condReady.wait(lock, [&] { it = pipelines.find(key); return it == pipelines.end() || it->second.ready; });
+
+	if (it != pipelines.end())
+	{
+		it->second.users++;
+		pipeline = it->second.pipeline;
+		layout = it->second.layout;
+		return;
+	}
+
+	// Create it without holding the lock (other pipelines can be created in parallel).
+	it = pipelines.emplace(key, Entry{ VK_NULL_HANDLE, VK_NULL_HANDLE, 1, false }).first;   // unordered_map iterators stay valid after insertions.
+	lock.unlock();
+
+	try { create(pipelineCache, pipeline, layout); }
+	catch (...)
+	{
+		lock.lock();
+		pipelines.erase(it);
+		condReady.notify_all();
+		throw;
+	}
+
+	lock.lock();
+	it->second.pipeline = pipeline;
+	it->second.layout = layout;
+	it->second.ready = true;
+	condReady.notify_all();
+
+#ifdef DEBUG_RESOURCES
+	std::cout << "   New pipeline (" << pipelines.size() << " in total)" << std::endl;
+#endif
+}
+
+void PipelineManager::release(const std::string& key)
+{
+	const std::lock_guard<std::mutex> lock(mutPipelines);
+
+	auto it = pipelines.find(key);
+	if (it == pipelines.end() || --it->second.users) return;
+
+	vkDestroyPipeline(c.device, it->second.pipeline, nullptr);
+	vkDestroyPipelineLayout(c.device, it->second.layout, nullptr);
+	pipelines.erase(it);
+}
+
+size_t PipelineManager::size()
+{
+	const std::lock_guard<std::mutex> lock(mutPipelines);
+	return pipelines.size();
+}
+
+void PipelineManager::saveCache()
+{
+	if (!pipelineCache) return;
+
+	size_t dataSize = 0;
+	if (vkGetPipelineCacheData(c.device, pipelineCache, &dataSize, nullptr) != VK_SUCCESS || !dataSize)
+		return;
+
+	std::vector<char> cacheData(dataSize);
+	if (vkGetPipelineCacheData(c.device, pipelineCache, &dataSize, cacheData.data()) != VK_SUCCESS)
+		return;
+
+	// Write a temporary file and replace the old one (a crash while writing doesn't leave a corrupted cache).
+	std::string tempFile = cacheFile + ".tmp";
+	{
+		std::ofstream file(tempFile, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) return;   // The cache is optional: Don't fail if it cannot be written.
+
+		file.write(cacheData.data(), dataSize);
+		if (!file) return;
+	}
+
+	std::error_code error;
+	std::filesystem::rename(tempFile, cacheFile, error);
+	if (error) std::filesystem::remove(tempFile, error);
+
+#ifdef DEBUG_RESOURCES
+	std::cout << "Pipeline cache saved (" << dataSize << " bytes)" << std::endl;
+#endif
+}
+
+void PipelineManager::destroy()
+{
+	saveCache();
+
+	const std::lock_guard<std::mutex> lock(mutPipelines);
+
+	for (auto& entry : pipelines)
+	{
+		vkDestroyPipeline(c.device, entry.second.pipeline, nullptr);
+		vkDestroyPipelineLayout(c.device, entry.second.layout, nullptr);
+	}
+	pipelines.clear();
+
+	if (pipelineCache)
+	{
+		vkDestroyPipelineCache(c.device, pipelineCache, nullptr);
+		pipelineCache = VK_NULL_HANDLE;
+	}
+}
@@ -0,0 +1,281 @@
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+
+#include "polygonum/profiler.hpp"
+
+
+// Profiler ----------------------------------------------------------
+
+namespace
+{
+	std::atomic<uint32_t> tracksCount(Profiler::gpuTrack + 1);
+
+	/// Write a string as a JSON string (quoted and escaped).
+	void writeJsonString(std::ostream& out, const char* str)
+	{
+		out << '"';
+		for (; *str; str++)
+		{
+			if (*str == '"' || *str == '\\') out << '\\' << *str;
+			else if ((unsigned char)*str < 0x20) out << ' ';
+			else out << *str;
+		}
+		out << '"';
+	}
+}
+
+Profiler::Profiler(size_t capacity)
+	: events(new Event[capacity]), capacity(capacity), writeIndex(0), frame(0), frameBegin(0), enabled(true), startTime(std::chrono::steady_clock::now())
+{
+	if (!capacity) throw std::runtime_error("Profiler capacity cannot be 0!");
+
+	for (size_t i = 0; i < capacity; i++)
+		events[i].sequence.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Profiler::now() const
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+uint32_t Profiler::getThreadTrack()
+{
+	thread_local uint32_t track = tracksCount++;
+	return track;
+}
+
+void Profiler::record(const char* name, uint64_t begin, uint64_t end) { record(name, begin, end, getThreadTrack()); }
+
+void Profiler::record(const char* name, uint64_t begin, uint64_t end, uint32_t track)
+{
+	if (!enabled.load(std::memory_order_relaxed)) return;
+
+	uint64_t index = writeIndex.fetch_add(1, std::memory_order_relaxed);
+	Event& event = events[index % capacity];
+
+	event.sequence.store(2 * index + 1, std::memory_order_relaxed);   // Being written
+	std::atomic_thread_fence(std::memory_order_release);
+
+	event.name.store(name, std::memory_order_relaxed);
+	event.begin.store(begin, std::memory_order_relaxed);
+	event.end.store(end, std::memory_order_relaxed);
+	event.frame.store(frame.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	event.track.store(track, std::memory_order_relaxed);
+
+	event.sequence.store(2 * index + 2, std::memory_order_release);   // Published
+}
+
+void Profiler::newFrame()
+{
+	uint64_t time = now();
+	uint64_t begin = frameBegin.exchange(time);
+
+	if (begin) record("Frame", begin, time);
+	frame++;
+}
+
+template<typename F>
+void Profiler::forEachEvent(F&& function) const
+{
+	uint64_t last = writeIndex.load(std::memory_order_acquire);
+	uint64_t first = last > capacity ? last - capacity : 0;
+
+	for (uint64_t index = first; index < last; index++)
+	{
+		const Event& event = events[index % capacity];
+
+		uint64_t sequence = event.sequence.load(std::memory_order_acquire);
+		if (sequence != 2 * index + 2) continue;   // Being written, or overwritten by a newer event
+
+		const char* name = event.name.load(std::memory_order_relaxed);
+		uint64_t begin = event.begin.load(std::memory_order_relaxed);
+		uint64_t end = event.end.load(std::memory_order_relaxed);
+		uint64_t eventFrame = event.frame.load(std::memory_order_relaxed);
+		uint32_t track = event.track.load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (event.sequence.load(std::memory_order_relaxed) != sequence) continue;   // Overwritten while reading
+
+		function(name, begin, end, eventFrame, track);
+	}
+}
+
+uint64_t Profiler::getFrame() const { return frame; }
+
+void Profiler::setEnabled(bool enabled) { this->enabled = enabled; }
+
+bool Profiler::isEnabled() const { return enabled; }
+
+ProfileStats Profiler::getStats(const char* name, size_t frames) const
+{
+	uint64_t currentFrame = frame;
+	uint64_t firstFrame = currentFrame >= frames ? currentFrame - frames + 1 : 0;   // Current frame included
+	std::vector<double> durations;
+
+	forEachEvent([&](const char* eventName, uint64_t begin, uint64_t end, uint64_t eventFrame, uint32_t track)
+	{
+		if (eventFrame >= firstFrame && std::strcmp(eventName, name) == 0)
+			durations.push_back((end - begin) / 1000000.);
+	});
+
+	ProfileStats stats;
+	if (durations.empty()) return stats;
+
+	std::sort(durations.begin(), durations.end());
+	stats.count = durations.size();
+	stats.min = durations.front();
+	stats.max = durations.back();
+	stats.p99 = durations[(durations.size() * 99 + 99) / 100 - 1];   // ceil(0.99 n) - 1
+	for (double duration : durations) stats.avg += duration;
+	stats.avg /= durations.size();
+
+	return stats;
+}
+
+bool Profiler::exportChromeTrace(const std::string& fileName) const
+{
+	std::ofstream file(fileName, std::ios::trunc);
+	if (!file.is_open()) return false;
+
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << gpuTrack << ",\"args\":{\"name\":\"GPU\"}}";
+
+	file.precision(3);
+	file << std::fixed;
+
+	forEachEvent([&file](const char* name, uint64_t begin, uint64_t end, uint64_t frame, uint32_t track)
+	{
+		file << ",\n{\"name\":";
+		writeJsonString(file, name);
+		file << ",\"ph\":\"X\",\"pid\":0,\"tid\":" << track
+			<< ",\"ts\":" << begin / 1000. << ",\"dur\":" << (end - begin) / 1000.   // Microseconds
+			<< ",\"args\":{\"frame\":" << frame << "}}";
+	});
+
+	file << "\n]}\n";
+
+	return file.good();
+}
+
+ProfileZone::ProfileZone(Profiler& profiler, const char* name)
+	: profiler(profiler), name(name), begin(profiler.now()), active(true) { }
+
+ProfileZone::~ProfileZone() { end(); }
+
+void ProfileZone::end()
+{
+	if (!active) return;
+
+	profiler.record(name, begin, profiler.now());
+	active = false;
+}
+
+// GpuTimestamps ----------------------------------------------------------
+
+GpuTimestamps::GpuTimestamps()
+	: device(VK_NULL_HANDLE), period(0), validMask(0)
+{
+	names.push_back("GPU culling");
+	for (uint32_t i = 1; i < maxZones; i++)
+		names.push_back("GPU render pass " + std::to_string(i - 1));
+}
+
+void GpuTimestamps::create(VkPhysicalDevice physicalDevice, VkDevice device, uint32_t queueFamily, size_t numFrames)
+{
+	this->device = device;
+
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+	uint32_t familiesCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familiesCount, nullptr);
+	std::vector<VkQueueFamilyProperties> families(familiesCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &familiesCount, families.data());
+
+	uint32_t validBits = queueFamily < familiesCount ? families[queueFamily].timestampValidBits : 0;
+	if (!validBits || properties.limits.timestampPeriod <= 0)
+	{
+		std::cout << "GPU timestamps not supported by the graphics queue" << std::endl;
+		return;
+	}
+
+	period = properties.limits.timestampPeriod;
+	validMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+	VkQueryPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	poolInfo.queryCount = 2 * maxZones;
+
+	queryPools.resize(numFrames, VK_NULL_HANDLE);
+	numZones.resize(numFrames, 0);
+	submitTimes.resize(numFrames, 0);
+
+	for (VkQueryPool& pool : queryPools)
+		if (vkCreateQueryPool(device, &poolInfo, nullptr, &pool) != VK_SUCCESS)
+			throw std::runtime_error("Failed to create timestamp query pool!");
+}
+
+void GpuTimestamps::destroy()
+{
+	for (VkQueryPool& pool : queryPools)
+		vkDestroyQueryPool(device, pool, nullptr);
+
+	queryPools.clear();
+	numZones.clear();
+	submitTimes.clear();
+}
+
+bool GpuTimestamps::isSupported() const { return queryPools.size(); }
+
+void GpuTimestamps::reset(VkCommandBuffer commandBuffer, size_t frameIndex, uint32_t numZones)
+{
+	if (!isSupported()) return;
+
+	vkCmdResetQueryPool(commandBuffer, queryPools[frameIndex], 0, 2 * maxZones);
+	this->numZones[frameIndex] = std::min(numZones, maxZones);
+}
+
+void GpuTimestamps::begin(VkCommandBuffer commandBuffer, size_t frameIndex, uint32_t zone)
+{
+	if (isSupported() && zone < numZones[frameIndex])
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPools[frameIndex], 2 * zone);
+}
+
+void GpuTimestamps::end(VkCommandBuffer commandBuffer, size_t frameIndex, uint32_t zone)
+{
+	if (isSupported() && zone < numZones[frameIndex])
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPools[frameIndex], 2 * zone + 1);
+}
+
+void GpuTimestamps::setSubmitTime(size_t frameIndex, uint64_t time)
+{
+	if (isSupported()) submitTimes[frameIndex] = time;
+}
+
+void GpuTimestamps::collect(size_t frameIndex, Profiler& profiler)
+{
+	if (!isSupported() || !submitTimes[frameIndex] || !numZones[frameIndex]) return;
+
+	uint64_t submitTime = submitTimes[frameIndex];
+	submitTimes[frameIndex] = 0;
+	if (!profiler.isEnabled()) return;
+
+	uint64_t timestamps[2 * maxZones];
+	uint32_t count = 2 * numZones[frameIndex];
+	if (vkGetQueryPoolResults(device, queryPools[frameIndex], 0, count, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+		return;   // Not available
+
+	uint64_t first = timestamps[0] & validMask;   // Culling's begin is the first timestamp of the command buffer.
+
+	for (uint32_t zone = 0; zone < numZones[frameIndex]; zone++)
+	{
+		uint64_t begin = timestamps[2 * zone] & validMask;
+		uint64_t end = timestamps[2 * zone + 1] & validMask;
+		if (begin < first || end < begin) continue;   // Counter wrapped around
+
+		profiler.record(names[zone].c_str(), submitTime + uint64_t((begin - first) * period), submitTime + uint64_t((end - first) * period), Profiler::gpuTrack);
+	}
+}
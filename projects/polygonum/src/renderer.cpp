@@ -1,4 +1,7 @@
 #include <iostream>
+#include <limits>
+#include <cstring>
+#include <thread>
 
 #include "polygonum/renderer.hpp"
 
@@ -9,36 +12,59 @@ void Renderer::recreateSwapChain()
 	std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 #endif
 	
-	// 1. Get window size.
+	// 1. Get window size (wait while it's minimized).
 	int width = 0, height = 0;
-	do {
-		c.io.waitEvents(); // Wait for an event (resize, focus change, etc.)
+	c.io.getFramebufferSize(&width, &height);
+	while (width == 0 || height == 0)
+	{
+		if (pipelined)   // Render thread: The main thread processes events.
+		{
+			if (pipeline.isStopped()) return;
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		else
+			c.io.waitEvents(); // Wait for an event (resize, focus change, etc.)
+
 		c.io.getFramebufferSize(&width, &height);
-	} while (width == 0 || height == 0);
+	}
 
 	std::cout << "New window size: " << width << ", " << height << std::endl;
 
-	// 2. Wait for device, graphics queue, and worker to be idle (so we don't touch resources that are in use).
+	// 2. Wait for device, graphics queue, and worker to be idle (so we don't touch resources that are in use). The worker stays paused until the end, since user updates can add tasks meanwhile (pipelined mode).
 	vkDeviceWaitIdle(c.device);
 	c.queueWaitIdle(c.graphicsQueue, &commander.mutQueue);
-	worker.waitIdle();
+	worker.pause();
+	worker.releaseRetired(true);   // Device is idle and command buffers are recreated below.
+	arena.releasePending(true);
 
 	// 3. Destroy swapchain and related resources.
+	size_t oldNumImages = swapChain.numImages();
+	VkFormat oldFormat = swapChain.imageFormat;
+
 	commander.freeCommandBuffers();
-	models.cleanup_pipelines_and_descriptors(&worker.mutModels);
 	rp->destroyRenderPipeline();
 	swapChain.destroy();
 	
 	// 4. Create swapchain and related resources.
+	swapChain.latencyTarget = latencyTarget;	// Set here, by the render thread (setLatencyTarget() may be called from the main thread).
 	swapChain.createSwapChain();				// Recreate the swap chain.
 
 	rp->createRenderPipeline();
 
-	models.create_pipelines_and_descriptors(&worker.mutModels);
+	// Pipelines use dynamic viewport/scissor and stay compatible with the new render passes, and descriptor sets only have to point to the new input attachments. Everything is recreated only if the number of swapchain images (descriptor sets are per image) or their format (render pass compatibility) changed.
+	if (swapChain.numImages() == oldNumImages && swapChain.imageFormat == oldFormat)
+		models.updateInputAttachments(&worker.mutModels);
+	else
+	{
+		models.cleanup_pipelines_and_descriptors(&worker.mutModels);
+		models.create_pipelines_and_descriptors(&worker.mutModels);
+	}
 	
 	uint32_t frameIndex = commander.getNextFrame();
 	commander.createCommandBuffers(swapChain.numImages(), commander.numFrames());   // Command buffers directly depend on the swap chain images.
 	commander.imagesInFlight.resize(swapChain.numImages(), { VK_NULL_HANDLE, 0 });
+
+	worker.resume();
 }
 
 Renderer::~Renderer()
@@ -57,45 +83,68 @@ void Renderer::addGlobalUbo(const BindingBuffer& bindBuffer)
 void Renderer::drawFrame()
 {
 	/*
+		0. Frame pacing: Sleep until this frame's deadline (maxFPS), before taking any lock or acquiring an image.
+		   Pipelined mode: Wait for the next frame packet and apply it (the user update runs in the main thread).
 		1. Wait for vkQueueSubmit(graphicsQueue) finish commands execution (framesInFlight).
 		2. Acquire a swapchain image (vkAcquireNextImageKHR) and signal semaphore (imageAvailable) once it's acquired.
 		3. Wait if image is used (imagesInFlight), and mark it as used by this frame (imagesInFlight = framesInFlight).
 		4. Update states:
-		  4.1. Wait for FPS
-		  4.2. User updates
+		  4.1. Update time (not pipelined)
+		  4.2. User updates (not pipelined)
 		  4.3. Update UBOs
-		  4.4. Update command buffer.
+		  4.4. Update command buffer (only if outdated).
 		5. Submit command buffer (vkQueueSubmit(graphicsQueue)) for execution. Synchronizers: fence (framesInFlight), waitSemaphore (imageAvailable), signalSemaphore (renderFinished).
 		6. Present image for display on screen (vkQueuePresentKHR(presentQueue)). Synchronizers: waitSemaphore (renderFinished).
+
+		Headless mode: Offscreen images are used in turns (no acquire), and the frame is not presented (no semaphores). Read the last one with readImage().
 	*/
 
 #if defined(DEBUG_RENDERER) || defined(DEBUG_RENDERLOOP)
 	std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 #endif
 
-#if defined(DEBUG_REND_PROFILER)
-	PRINT("----------\nBegin drawFrame: ", profiler.updateTime() * 1000.f);
-#endif
+	profiler.newFrame();
+
+	// 0. Frame pacing (sleeping here, instead of after acquiring the image, keeps the acquired image and the user update as recent as possible, and doesn't block other threads waiting for mutFrame).
+	ProfileZone zoneFPS(profiler, "waitFPS");
+	pacer.wait();
+	zoneFPS.end();
+
+	if (pipelined)   // Applied now, so early returns (swap chain recreation) don't lose it.
+	{
+		ProfileZone zonePacket(profiler, "waitPacket");
+		FramePacket* packet = pipeline.acquire();
+		zonePacket.end();
+		if (!packet) return;   // Stopped
+
+		applyFrame(*packet);
+		pipeline.release();
+	}
 
-	// 0. Wait until this frame is available to work with.
+	// Wait until this frame is available to work with.
 	size_t frameIndex = commander.getNextFrame();
 
+	ProfileZone zoneWait(profiler, "waitFrame");
 	const std::lock_guard<std::mutex> lock(commander.mutFrame[frameIndex]);
 
-#if defined(DEBUG_REND_PROFILER)
-	PRINT("lock_guard(mutFrame): ", profiler.updateTime() * 1000.f);
-#endif
-
 	// 1. Wait for a previous command buffer execution (i.e., the frame to be finished). If VK_TRUE, wait for all fences; otherwise, wait for any.
 	vkWaitForFences(c.device, 1, &commander.framesInFlight[frameIndex], VK_TRUE, UINT64_MAX);
+	zoneWait.end();
 
-#if defined(DEBUG_REND_PROFILER)
-	PRINT("vkWaitForFences: ", profiler.updateTime() * 1000.f);
-#endif
+	commander.timestamps.collect(frameIndex, profiler);   // GPU zones of the previous use of this frame
+
+	worker.releaseRetired();   // Deleted models that no frame uses anymore
+	arena.releasePending();   // Freed geometry that no frame uses anymore
 
 	// 2. Acquire the next available swapchain image. Semaphore will be signaled once it's acquired.
 	uint32_t imageIndex;		// Swap chain image index (0, 1, 2)
-	VkResult result = vkAcquireNextImageKHR(c.device, swapChain.swapChain, UINT64_MAX, commander.imageAvailableSemaphores[frameIndex], VK_NULL_HANDLE, &imageIndex);		// Swap chain is an extension feature. imageIndex: index to the VkImage in our swapChainImages.
+	VkResult result = VK_SUCCESS;
+	ProfileZone zoneAcquire(profiler, "acquire");
+	if (c.headless)
+		imageIndex = static_cast<uint32_t>(renderedFramesCount % swapChain.numImages());
+	else
+		result = vkAcquireNextImageKHR(c.device, swapChain.swapChain, UINT64_MAX, commander.imageAvailableSemaphores[frameIndex], VK_NULL_HANDLE, &imageIndex);		// Swap chain is an extension feature. imageIndex: index to the VkImage in our swapChainImages.
+	zoneAcquire.end();
 	if (result == VK_ERROR_OUT_OF_DATE_KHR) 					// VK_ERROR_OUT_OF_DATE_KHR: The swap chain became incompatible with the surface and can no longer be used for rendering. Usually happens after window resize.
 	{
 		std::cout << "VK_ERROR_OUT_OF_DATE_KHR" << std::endl;
@@ -105,12 +154,8 @@ void Renderer::drawFrame()
 	else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR)	// VK_SUBOPTIMAL_KHR: The swap chain can still be used to successfully present to the surface, but the surface properties are no longer matched exactly.
 		throw std::runtime_error("Failed to acquire swap chain image!");
 
-#if defined(DEBUG_REND_PROFILER)
-	PRINT("vkAcquireNextImageKHR: ", profiler.updateTime() * 1000.f);
-#endif
-
-
 	// 3. Check if this image is being used. If used, wait. Then, mark it as used by this frame.
+	ProfileZone zoneImage(profiler, "waitImage");
 	VkFence& imageInFlight = commander.imagesInFlight[imageIndex].first;
 	size_t associatedFrameIndex = commander.imagesInFlight[imageIndex].second;
 	if (imageInFlight != VK_NULL_HANDLE)   // Check if a previous frame is using this image (i.e. there is its fence to wait on)
@@ -121,46 +166,36 @@ void Renderer::drawFrame()
 	}
 	
 	commander.imagesInFlight[imageIndex] = { commander.framesInFlight[frameIndex], frameIndex };   // Mark the image as now being in use by this frame
-	
-#if defined(DEBUG_REND_PROFILER)
-	PRINT("vkWaitForFences: ", profiler.updateTime() * 1000.f);
-	PRINT("Update states:");
-#endif
-
-	// 4.1. Wait for FPS
-	timer.updateTime();
-	waitForFPS(timer, maxFPS);
-	timer.reUpdateTime();
+	zoneImage.end();
 
-#if defined(DEBUG_REND_PROFILER)
-	PRINT("  waitForFPS: ", profiler.updateTime() * 1000.f);
-#endif
-
-	// 4.2. User updates
-	userUpdate(*((Renderer*)this));   // Update model matrices and other things (user defined)
+	if (!pipelined)
+	{
+		// 4.1. Update time
+		timer.updateTime();
 
-#if defined(DEBUG_REND_PROFILER)
-	PRINT("  userUpdate: ", profiler.updateTime() * 1000.f);
-#endif
+		// 4.2. User updates
+		ProfileZone zoneUser(profiler, "userUpdate");
+		userUpdate(*((Renderer*)this));   // Update model matrices and other things (user defined)
+		zoneUser.end();
+	}
 
 	// 4.3. Update UBOs
+	ProfileZone zoneUBOs(profiler, "updateUBOs");
 	updateUBOs(imageIndex);
+	zoneUBOs.end();
 
-#if defined(DEBUG_REND_PROFILER)
-	PRINT("  Copy UBOs: ", profiler.updateTime() * 1000.f);
-#endif
+	// 4.4. Update command buffer (only if models, instances, or swapchain changed since last recording; otherwise, resubmit the recorded one).
+	vkResetFences(c.device, 1, &commander.framesInFlight[frameIndex]);	// Reset the fence to the unsignaled state.
 
-	// 4.4. Update command buffer.
-	if (true)//if (updateCommandBuffer)
 	{
-		vkResetFences(c.device, 1, &commander.framesInFlight[frameIndex]);	// Reset the fence to the unsignaled state.
-		commander.updateCommandBuffers(models, rp, swapChain.numImages(), frameIndex);
+		const std::lock_guard<std::mutex> lock(worker.mutModels);   // Checked while locked: deleted models are extracted (under this lock) after flagging the update.
+		if (commander.isOutdated(frameIndex))
+		{
+			ProfileZone zoneRecord(profiler, "recordCommands");
+			commander.updateCommandBuffers(models, rp, swapChain.numImages(), frameIndex);
+		}
 	}
 
-#if defined(DEBUG_REND_PROFILER)
-	PRINT("  Update command buffer: ", profiler.updateTime() * 1000.f);
-#endif
-
 	// 5. Submit command buffer to the graphics queue for commands execution (rendering).
 	VkSemaphore waitSemaphores[] = { commander.imageAvailableSemaphores[frameIndex] };   // Which semaphores to wait on before command buffers execution begins.
 	VkSemaphore signalSemaphores[] = { commander.renderFinishedSemaphores[frameIndex] };   // Which semaphores to signal once the command buffers have finished execution.
@@ -168,10 +203,10 @@ void Renderer::drawFrame()
 
 	VkSubmitInfo submitInfo{};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.waitSemaphoreCount = 1;
+	submitInfo.waitSemaphoreCount = c.headless ? 0 : 1;			// Headless: nothing acquired nor presented.
 	submitInfo.pWaitSemaphores = waitSemaphores;					// Semaphores upon which to wait before the CB/s begin execution.
 	submitInfo.pWaitDstStageMask = waitStages;
-	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.signalSemaphoreCount = c.headless ? 0 : 1;
 	submitInfo.pSignalSemaphores = signalSemaphores;				// Semaphores to be signaled once the CB/s have completed execution.
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &commander.commandBuffers[frameIndex][imageIndex];   // Command buffers to submit for execution (here, the one that binds the swap chain image we just acquired as color attachment).
@@ -179,21 +214,26 @@ void Renderer::drawFrame()
 	//vkResetFences(e.c.device, 1, &framesInFlight[currentFrame]);	// Reset the fence to the unsignaled state.
 
 	{
+		ProfileZone zoneSubmit(profiler, "submit");
 		const std::lock_guard<std::mutex> lock(commander.mutQueue);
+		commander.timestamps.setSubmitTime(frameIndex, profiler.now());
 		if (vkQueueSubmit(c.graphicsQueue, 1, &submitInfo, commander.framesInFlight[frameIndex]) != VK_SUCCESS)	// Submit the command buffer to the graphics queue. An array of VkSubmitInfo structs can be taken as argument when workload is much larger, for efficiency.
 			throw std::runtime_error("Failed to submit draw command buffer!");
 	}
 
-#if defined(DEBUG_REND_PROFILER)
-	PRINT("vkQueueSubmit: ", profiler.updateTime() * 1000.f);
-#endif
-
 	// Note:
 	// Subpass dependencies: Subpasses in a render pass automatically take care of image layout transitions. These transitions are controlled by subpass dependencies (specify memory and execution dependencies between subpasses).
 	// There are two built-in dependencies that take care of the transition at the start and at the end of the render pass, but the former does not occur at the right time. It assumes that the transition occurs at the start of the pipeline, but we haven't acquired the image yet at that point. Two ways to deal with this problem:
 	//		- waitStages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT (ensures that the render passes don't begin until the image is available).
 	//		- waitStages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT (makes the render pass wait for this stage).
 
+	if (c.headless)
+	{
+		lastImageIndex = imageIndex;
+		renderedFramesCount++;
+		return;
+	}
+
 	// 6. Presentation: Submit the result back to the swap chain to have it eventually show up on the screen.
 	VkPresentInfoKHR presentInfo{};
 	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -206,25 +246,23 @@ void Renderer::drawFrame()
 	presentInfo.pResults = nullptr;			// Optional
 
 	{
+		ProfileZone zonePresent(profiler, "present");
 		const std::lock_guard<std::mutex> lock(commander.mutQueue);
 		result = vkQueuePresentKHR(c.presentQueue, &presentInfo);		// Submit request to present an image to the swap chain. Our triangle may look a bit different because the shader interpolates in linear color space and then converts to sRGB color space.
 		renderedFramesCount++;
 	}
 
-	if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || c.io.framebufferResized)
+	if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || c.io.framebufferResized || swapChainOutdated)
 	{
-		std::cout << "Out-of-date/Suboptimal KHR or window resized" << std::endl;
+		std::cout << "Out-of-date/Suboptimal KHR, window resized, or latency target changed" << std::endl;
 		c.io.framebufferResized = false;
+		swapChainOutdated = false;
 		recreateSwapChain();
 	}
 	else if (result != VK_SUCCESS)
 		throw std::runtime_error("Failed to present swap chain image!");
 
 	//vkQueueWaitIdle(e.presentQueue);   // Make the whole graphics pipeline to be used only one frame at a time (instead of using this, we use multiple semaphores for processing frames concurrently).
-
-#if defined(DEBUG_REND_PROFILER)
-	PRINT("vkQueuePresentKHR: ", profiler.updateTime() * 1000.f);
-#endif
 }
 
 void Renderer::renderLoop()
@@ -237,9 +275,10 @@ void Renderer::renderLoop()
 	worker.start();
 
 	timer.startTimer();
-	profiler.startTimer();
 
-	while (!c.io.getWindowShouldClose())
+	if (pipelined)
+		renderLoopPipelined();
+	else while (!c.io.getWindowShouldClose())
 	{
 		#ifdef DEBUG_RENDERLOOP
 				std::cout << "Render loop 1/2 ----------" << std::endl;
@@ -258,6 +297,8 @@ void Renderer::renderLoop()
 
 	worker.stop();
 
+	if (renderException) std::rethrow_exception(renderException);
+
 	vkDeviceWaitIdle(c.device);	// Waits for the logical device to finish operations. Needed for cleaning up once drawing and presentation operations (drawFrame) have finished. Use vkQueueWaitIdle for waiting for operations in a specific command queue to be finished.
 
 	cleanup();
@@ -267,6 +308,114 @@ void Renderer::renderLoop()
 	#endif
 }
 
+void Renderer::renderLoopPipelined()
+{
+	pipeline.reset();
+	renderException = nullptr;
+
+	std::thread renderThread([this]()
+	{
+		try
+		{
+			while (!pipeline.isStopped())
+				drawFrame();
+		}
+		catch (...)
+		{
+			renderException = std::current_exception();
+			pipeline.stop();
+		}
+	});
+
+	try
+	{
+		while (!c.io.getWindowShouldClose())
+		{
+			// Wait for a free packet (the render thread is at most one frame behind). Events are processed meanwhile (resizing, minimized window...).
+			FramePacket* packet = nullptr;
+			while (!packet && !pipeline.isStopped())
+			{
+				c.io.pollEvents();
+				packet = pipeline.beginPacket(std::chrono::milliseconds(10));
+			}
+			if (!packet) break;
+
+			timer.updateTime();
+
+			ProfileZone zoneUser(profiler, "userUpdate");
+			userUpdate(*((Renderer*)this));
+			zoneUser.end();
+
+			captureFrame(*packet);
+			pipeline.publish();
+
+			if (c.io.isKeyPressed(GLFW_KEY_ESCAPE))
+				c.io.setWindowShouldClose(true);
+		}
+	}
+	catch (...)
+	{
+		pipeline.stop();   // The render thread must be joined before leaving (a joinable std::thread calls std::terminate when destroyed).
+		renderThread.join();
+		throw;
+	}
+
+	pipeline.stop();
+	renderThread.join();
+}
+
+void Renderer::captureFrame(FramePacket& packet)
+{
+	for (auto& buffer : globalBuffers)
+		packet.addBuffer(0, buffer);
+
+	{
+		const std::lock_guard<std::mutex> lock(worker.mutModels);
+
+		for (auto it = models.data.begin(); it != models.data.end(); it++)
+			if (it->second.ready)   // Buffers of models not ready keep their modified range until they are.
+			{
+				for (auto& set : it->second.bindSets)
+				{
+					for (auto& buffer : set.vsLocal)
+						packet.addBuffer(it->first, buffer);
+
+					for (auto& buffer : set.fsLocal)
+						packet.addBuffer(it->first, buffer);
+				}
+
+				if (it->second.culling)
+					packet.addBuffer(it->first, it->second.culling->getBounds());
+			}
+	}
+
+	{
+		const std::lock_guard<std::mutex> lock(mutInstances);
+		packet.instances.swap(pendingInstances);   // pendingInstances gets the cleared vector of the packet (keeps its capacity).
+	}
+
+	packet.frustum = culling.getFrustum();
+}
+
+void Renderer::applyFrame(const FramePacket& packet)
+{
+	const std::lock_guard<std::mutex> lock(worker.mutModels);
+
+	for (const auto& instances : packet.instances)
+		if (models.data.find(instances.first) != models.data.end())
+			if (models.data[instances.first].setNumInstances(instances.second))
+				commander.flagUpdate();
+
+	for (const auto& update : packet.buffers)
+	{
+		if (update.model && models.data.find(update.model) == models.data.end()) continue;   // Model deleted after the capture.
+
+		update.buffer->setFrameData(update.offset, packet.data.data() + update.dataOffset, update.bytes);
+		update.buffer->setFrameSize(update.size);
+	}
+
+	culling.setFrameFrustum(packet.frustum);
+}
 
 void Renderer::cleanup()
 {
@@ -276,8 +425,17 @@ void Renderer::cleanup()
 
 	c.queueWaitIdle(c.graphicsQueue, &commander.mutQueue);
 
+	uploader.destroy();
+
+	worker.releaseRetired(true);
 	models.data.clear();   // lock_guard (worker.mutModels) not necessary before this because worker stopped the loading thread.
 
+	pipelines.destroy();   // Saves the pipeline cache
+
+	arena.destroy();
+
+	culling.destroy();
+
 	//for(auto& gUbo : globalBuffers)
 	//	if (gUbo.getCapacity()) gUbo.destroyBuffer();
 	globalBuffers.clear();
@@ -305,14 +463,20 @@ key64 Renderer::newModel(ModelDataInfo& modelInfo)
 	
 	if (modelInfo.renderPassIndex < models.keys.size() && modelInfo.subpassIndex < models.keys[modelInfo.renderPassIndex].size())
 	{
-		std::pair<std::unordered_map<key64, ModelData>::iterator, bool> result = models.data.emplace(
-			std::piecewise_construct,
-			std::forward_as_tuple(models.getNewKey()),
-			std::forward_as_tuple(this, modelInfo));   // Save model object into model list
+		key64 key = models.getNewKey();
 
-		worker.newTask(result.first->first, LoadingWorker::construct);   // Schedule task: Construct model
+		{
+			const std::lock_guard<std::mutex> lock(worker.mutModels);   // Loading threads access models.data concurrently.
 
-		return result.first->first;
+			models.data.emplace(
+				std::piecewise_construct,
+				std::forward_as_tuple(key),
+				std::forward_as_tuple(this, modelInfo));   // Save model object into model list
+		}
+
+		worker.newTask(key, LoadingWorker::construct, modelInfo.loadPriority);   // Schedule task: Construct model
+
+		return key;
 	}
 
 	std::cout << "The renderpass/subpass specified for this model (" << modelInfo.name << ": " << modelInfo.renderPassIndex << '/' << modelInfo.subpassIndex << ") doesn't fit the render pipeline" << std::endl;
@@ -342,11 +506,18 @@ void Renderer::setInstances(key64 key, size_t numberOfRenders)
 	std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 #endif
 
+	if (pipelined)   // Applied by the render thread with the next frame packet.
+	{
+		const std::lock_guard<std::mutex> lock(mutInstances);
+		pendingInstances.push_back({ key, static_cast<uint32_t>(numberOfRenders) });
+		return;
+	}
+
 	const std::lock_guard<std::mutex> lock(worker.mutModels);
 
 	if (models.data.find(key) != models.data.end())
 		if (models.data[key].setNumInstances(numberOfRenders))
-			commander.updateCommandBuffer = true;		// We flag commandBuffer for update assuming that our model is in list "model"
+			commander.flagUpdate();		// We flag commandBuffer for update assuming that our model is in list "model"
 }
 
 void Renderer::setInstances(std::vector<key64>& keys, size_t numberOfRenders)
@@ -355,72 +526,85 @@ void Renderer::setInstances(std::vector<key64>& keys, size_t numberOfRenders)
 	std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 #endif
 
+	if (pipelined)
+	{
+		const std::lock_guard<std::mutex> lock(mutInstances);
+		for (key64 key : keys)
+			pendingInstances.push_back({ key, static_cast<uint32_t>(numberOfRenders) });
+		return;
+	}
+
 	const std::lock_guard<std::mutex> lock(worker.mutModels);
 
 	for (key64 key : keys)
 		if (models.data.find(key) != models.data.end())
 			if (models.data[key].setNumInstances(numberOfRenders))
-				commander.updateCommandBuffer = true;		// We flag commandBuffer for update assuming that our model is in list "model"
+				commander.flagUpdate();		// We flag commandBuffer for update assuming that our model is in list "model"
 }
 
-void Renderer::setMaxFPS(int maxFPS)
+void Renderer::setPipelined(bool pipelined) { this->pipelined = pipelined; }
+
+bool Renderer::isPipelined() const { return pipelined; }
+
+void Renderer::setMaxFPS(int maxFPS) { pacer.setMaxFPS(maxFPS); }
+
+void Renderer::setLatencyTarget(LatencyTarget target)
 {
-	if (maxFPS > 0)
-		this->maxFPS = maxFPS;
-	else
-		this->maxFPS = 0;
+	if (latencyTarget.exchange(target) == target) return;
+
+	if (!c.headless) swapChainOutdated = true;   // Recreated (with the new present mode) after the next present
 }
 
+void Renderer::setRecordingThreads(unsigned numThreads) { commander.setRecordingThreads(numThreads); }
+
+void Renderer::setLoadingThreads(unsigned numThreads) { worker.setThreads(numThreads); }
+
+void Renderer::setLoadPriority(key64 key, float priority) { worker.setPriority(key, priority); }
+
 void Renderer::updateUBOs(uint32_t imageIndex)
 {
 	#ifdef DEBUG_RENDERLOOP
 		std::cout << "Copy UBOs" << std::endl;
 	#endif
 
-	void* data;
-	uint32_t bytes;
-	ModelData* model;
+	// Buffer memories are persistently mapped, so only the modified bytes of each binding are copied (no vkMapMemory/vkUnmapMemory calls).
+	// GPU memory is updated from the frame data of each buffer. Not pipelined: the user data is published here. Pipelined: applyFrame() set it.
 
 	// Global buffers
 	for (auto& buffer : globalBuffers)
 	{
-		bytes = buffer.getSize();
-		if (!bytes) continue;
-		vkMapMemory(c.device, buffer.bindingMemories[imageIndex], 0, bytes, 0, &data);
-		memcpy(data, buffer.binding.data(), bytes);
-		vkUnmapMemory(c.device, buffer.bindingMemories[imageIndex]);
+		if (!pipelined) buffer.publish();
+		buffer.updateMemory(imageIndex);
 	}
 
 	// Local buffers
 	const std::lock_guard<std::mutex> lock(worker.mutModels);
 
-	models.distributeKeys();
-
 	for (auto it = models.data.begin(); it != models.data.end(); it++)
 		if (it->second.ready)
-		{
-			model = &it->second;
-
-			for (const auto& set : model->bindSets)
+			for (auto& set : it->second.bindSets)
 			{
-				for (const auto& buffer : set.vsLocal)
+				for (auto& buffer : set.vsLocal)
 				{
-					bytes = buffer.getSize();
-					if (!bytes) continue;
-					vkMapMemory(c.device, buffer.bindingMemories[imageIndex], 0, bytes, 0, &data);   // Get a pointer to some Vulkan/GPU memory of size X. vkMapMemory retrieves a host virtual address pointer (data) to a region of a mappable memory object (uniformBuffersMemory[]). We have to provide the logical device that owns the memory (e.device).
-					memcpy(data, buffer.binding.data(), bytes);   // Copy some data in that memory. Copies a number of bytes (sizeof(ubo)) from a source (ubo) to a destination (data).
-					vkUnmapMemory(c.device, buffer.bindingMemories[imageIndex]);   // "Get rid" of the pointer. Unmap a previously mapped memory object (uniformBuffersMemory[]).
+					if (!pipelined) buffer.publish();
+					buffer.updateMemory(imageIndex);
 				}
 
-				for (const auto& buffer : set.fsLocal)
+				for (auto& buffer : set.fsLocal)
 				{
-					bytes = buffer.getSize();
-					if (!bytes) continue;
-					vkMapMemory(c.device, buffer.bindingMemories[imageIndex], 0, bytes, 0, &data);
-					memcpy(data, buffer.binding.data(), bytes);
-					vkUnmapMemory(c.device, buffer.bindingMemories[imageIndex]);
+					if (!pipelined) buffer.publish();
+					buffer.updateMemory(imageIndex);
 				}
 			}
+
+	// GPU culling (frustum and bounds)
+	if (!pipelined) culling.setFrameFrustum(culling.getFrustum());
+
+	for (auto it = models.data.begin(); it != models.data.end(); it++)
+		if (it->second.ready && it->second.culling)
+		{
+			if (!pipelined) it->second.culling->getBounds().publish();
+			it->second.culling->updateMemory(imageIndex);
 		}
 }
 
@@ -438,14 +622,58 @@ size_t Renderer::loadedShaders() { return shaders.size(); }
 
 size_t Renderer::loadedTextures() { return textures.size(); }
 
+size_t Renderer::loadedPipelines() { return pipelines.size(); }
+
 IOmanager& Renderer::getIO() { return c.io; }
 
 int Renderer::getMaxMemoryAllocationCount() { return c.deviceData.maxMemoryAllocationCount; }
 
 int Renderer::getMemAllocObjects() { return c.memAllocObjects; }
 
+MemoryStats Renderer::getMemoryStats() { return c.allocator.getStats(); }
+
+Profiler& Renderer::getProfiler() { return profiler; }
+
+size_t Renderer::getLoadingTasks() { return worker.numTasks(); }
+
+bool Renderer::isHeadless() const { return c.headless; }
+
+VkExtent2D Renderer::getImageExtent() const { return swapChain.extent; }
+
+void Renderer::readImage(std::vector<uint8_t>& pixels)
+{
+	if (!c.headless)
+		throw std::runtime_error("Images can only be read in headless mode!");
+	if (!renderedFramesCount)
+		throw std::runtime_error("No image rendered yet!");
+
+	// Wait for the frame that rendered the image
+	VkFence imageInFlight = commander.imagesInFlight[lastImageIndex].first;
+	if (imageInFlight != VK_NULL_HANDLE)
+		vkWaitForFences(c.device, 1, &imageInFlight, VK_TRUE, UINT64_MAX);
+
+	// Copy it into a staging buffer, and then into pixels
+	VkDeviceSize size = VkDeviceSize(swapChain.extent.width) * swapChain.extent.height * 4;
+	VkBuffer stagingBuffer;
+	Allocation stagingMemory;
+	c.createBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingMemory);
+
+	commander.copyImageToBuffer(swapChain.images[lastImageIndex], swapChain.finalLayout, stagingBuffer, swapChain.extent.width, swapChain.extent.height);
+
+	pixels.resize(size);
+	std::memcpy(pixels.data(), stagingMemory.mapped, size);
+
+	c.destroyBuffer(c.device, stagingBuffer, stagingMemory);
+}
+
+PacingStats Renderer::getPacingStats(size_t frames) { return pacer.getStats(frames); }
+
+ProfileStats Renderer::getProfileStats(const char* zone, size_t frames) { return profiler.getStats(zone, frames); }
+
+bool Renderer::exportProfile(const std::string& fileName) { return profiler.exportChromeTrace(fileName); }
+
 LoadingWorker::LoadingWorker(Renderer* renderer)
-	: r(*renderer), stopThread(false) { }
+	: r(*renderer), tasksCount(0), stopThread(false), paused(false), numThreads(1) { }
 
 LoadingWorker::~LoadingWorker()
 {
@@ -454,11 +682,19 @@ LoadingWorker::~LoadingWorker()
 #endif
 }
 
+bool LoadingWorker::TaskInfo::operator<(const TaskInfo& other) const
+{
+	if (priority != other.priority) return priority < other.priority;
+	return order < other.order;
+}
+
 void LoadingWorker::start()
 {
 	stopThread = false;
-	cond.notify_one();
-	thread_loadModels = std::thread(&LoadingWorker::thread_loadData, this, std::ref(r), std::ref(r.models), std::ref(r.commander));
+	cond.notify_all();
+
+	for (unsigned i = 0; i < numThreads; i++)
+		threads_loadModels.push_back(std::thread(&LoadingWorker::thread_loadData, this, std::ref(r), std::ref(r.models), std::ref(r.commander)));
 }
 
 void LoadingWorker::stop()
@@ -467,50 +703,130 @@ void LoadingWorker::stop()
 	std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 #endif
 
-	stopThread = true;
-	cond.notify_one();
+	{
+		std::lock_guard lock(mutTasks);
+		stopThread = true;
+	}
+	cond.notify_all();
 
-	if (thread_loadModels.joinable())
-		thread_loadModels.join();
+	for (std::thread& thread : threads_loadModels)
+		if (thread.joinable())
+			thread.join();
+
+	threads_loadModels.clear();
 }
 
-void LoadingWorker::newTask(key64 key, Task task)
+void LoadingWorker::newTask(key64 key, Task task, float priority)
+{
+	{
+		std::lock_guard lock(mutTasks);
+
+		if (task == delet)
+		{
+			auto pending = pendingConstructs.find(key);
+			if (pending != pendingConstructs.end())   // Cancel construction (the model still has to be deleted)
+			{
+				tasks.erase(pending->second);
+				pendingConstructs.erase(pending);
+			}
+
+			priority = std::numeric_limits<float>::lowest();   // Deletions go first (they are cheap and free memory)
+		}
+
+		auto result = tasks.insert(TaskInfo{ key, task, priority, tasksCount++ });
+
+		if (task == construct)
+			pendingConstructs[key] = result.first;
+	}
+
+	cond.notify_one();   // Wake up a loading thread
+}
+
+void LoadingWorker::setPriority(key64 key, float priority)
 {
 	std::lock_guard lock(mutTasks);
-	tasks.push(std::pair(key, task));
-	cond.notify_one();   // Wake up the loading thread
+
+	auto pending = pendingConstructs.find(key);
+	if (pending == pendingConstructs.end()) return;   // Not waiting (already constructed, being constructed, or deleted)
+
+	TaskInfo info = *pending->second;
+	info.priority = priority;
+
+	tasks.erase(pending->second);
+	pending->second = tasks.insert(info).first;
+}
+
+void LoadingWorker::setThreads(unsigned numThreads)
+{
+	this->numThreads = numThreads ? numThreads : 1;
 }
 
 void LoadingWorker::waitIdle()
 {
-	std::mutex mutWait;
-	std::unique_lock lock(mutWait);
-	cond.wait(lock, [this] { return tasks.empty(); });
+	std::unique_lock lock(mutTasks);
+	condIdle.wait(lock, [this] { return tasks.empty() && busyKeys.empty(); });
 }
 
-size_t LoadingWorker::numTasks() { return tasks.size(); }
+void LoadingWorker::pause()
+{
+	std::unique_lock lock(mutTasks);
+	paused = true;
+	condIdle.wait(lock, [this] { return busyKeys.empty(); });
+}
 
-void LoadingWorker::extractModel(ModelsManager& models, key64 key)
+void LoadingWorker::resume()
 {
-	const std::lock_guard<std::mutex> lock(mutModels);
+	{
+		std::lock_guard lock(mutTasks);
+		paused = false;
+	}
+	cond.notify_all();
+}
 
-	models.data[key].ready = false;
+size_t LoadingWorker::numTasks()
+{
+	std::lock_guard lock(mutTasks);
+	return tasks.size() + busyKeys.size();
+}
 
+std::unordered_map<key64, ModelData>::node_type LoadingWorker::extractModel(ModelsManager& models, key64 key, size_t& update)
+{
+	const std::lock_guard<std::mutex> lock(mutModels);
+
+	update = r.commander.flagUpdate();   // Before extracting it, so the render loop doesn't record it again once it's gone.
 	auto node = models.data.extract(key);   // auto = std::unordered_map<key64, ModelData>::node_type
 	if (node.empty() == false)
-		modelTP.insert(std::move(node));
+		node.mapped().ready = false;
+
+	return node;
 }
 
-void LoadingWorker::returnModel(ModelsManager& models, key64 key)
+void LoadingWorker::releaseRetired(bool all)
 {
-	const std::lock_guard<std::mutex> lock(mutModels);
+	std::vector<std::unordered_map<key64, ModelData>::node_type> released;
 
-	auto node = modelTP.extract(key);   // auto = std::unordered_map<key64, ModelData>::node_type
-	if (node.empty() == false)
-		models.data.insert(std::move(node));
+	{
+		const std::lock_guard<std::mutex> lock(mutRetired);
+
+		for (auto it = retiredModels.begin(); it != retiredModels.end(); )
+			if (all || r.commander.isRetired(it->first))
+			{
+				released.push_back(std::move(it->second));
+				it = retiredModels.erase(it);
+			}
+			else it++;
+	}
 
-	if (models.data[key].fullyConstructed)
-		models.data[key].ready = true;
+	// Models are destroyed here, without holding the lock.
+}
+
+std::set<LoadingWorker::TaskInfo>::iterator LoadingWorker::nextTask()
+{
+	for (auto it = tasks.begin(); it != tasks.end(); it++)
+		if (busyKeys.find(it->key) == busyKeys.end())
+			return it;
+
+	return tasks.end();
 }
 
 void LoadingWorker::thread_loadData(Renderer& renderer, ModelsManager& models, Commander& commander)
@@ -520,8 +836,7 @@ void LoadingWorker::thread_loadData(Renderer& renderer, ModelsManager& models, C
 	std::cout << "- Loading thread ID: " << std::this_thread::get_id() << std::endl;
 #endif
 
-	key64 key;
-	Task task;
+	TaskInfo info;
 
 	for(;;)
 	{
@@ -529,35 +844,72 @@ void LoadingWorker::thread_loadData(Renderer& renderer, ModelsManager& models, C
 		std::cout << "- New iteration -----" << std::endl;
 #endif
 
-		std::unique_lock lock(mutTasks);
-		cond.wait(lock, [this] { return (!tasks.empty() || stopThread); });   // Wait for new tasks or a stop order.
-		
-		if (tasks.empty() && stopThread) return;   // Stop order executed here
+		{
+			std::unique_lock lock(mutTasks);
+
+			std::set<TaskInfo>::iterator next;
+			cond.wait(lock, [this, &next] { next = paused ? tasks.end() : nextTask(); return (next != tasks.end() || ((tasks.empty() || paused) && stopThread)); });   // Wait for new tasks (while not paused) or a stop order.
 
-		key = tasks.front().first;   // Get task info
-		task = tasks.front().second;
-		tasks.pop();
+			if (next == tasks.end()) return;   // Stop order executed here
+
+			info = *next;   // Get task info
+			if (info.task == construct) pendingConstructs.erase(info.key);
+			tasks.erase(next);
+			busyKeys.insert(info.key);
+		}
 
-		lock.unlock();
-		
 		// Complete task
-		switch (task)
+		switch (info.task)
 		{
 		case construct:
-			models.data[key].fullConstruction(renderer);
-			models.data[key].ready = true;
-			commander.updateCommandBuffer = true;
+		{
+			ModelData* model = nullptr;
+			{
+				const std::lock_guard<std::mutex> lock(mutModels);
+				auto it = models.data.find(info.key);
+				if (it != models.data.end()) model = &it->second;   // Elements of unordered_map keep their address while other elements are inserted. This one cannot be deleted while its key is busy.
+			}
+
+			if (!model) break;
+			ProfileZone zone(renderer.profiler, "loadModel");
+			model->fullConstruction(renderer);
+			zone.end();
+
+			{
+				const std::lock_guard<std::mutex> lock(mutModels);
+				model->ready = true;
+			}
+
+			commander.flagUpdate();
 			break;
+		}
 
 		case delet:
-			extractModel(models, key);
-			modelTP.clear();
-			commander.updateCommandBuffer = true;
+		{
+			ProfileZone zone(renderer.profiler, "deleteModel");
+			size_t update;
+			auto node = extractModel(models, info.key, update);
+			zone.end();
+
+			if (!node.empty())   // Frames in flight and cached command buffers may still use it: destroyed later by releaseRetired().
+			{
+				const std::lock_guard<std::mutex> lock(mutRetired);
+				retiredModels.emplace_back(update, std::move(node));
+			}
 			break;
+		}
 
 		default:
 			break;
 		}
+
+		{
+			std::lock_guard lock(mutTasks);
+			busyKeys.erase(info.key);
+		}
+
+		cond.notify_all();   // Tasks waiting for this model can be executed now.
+		condIdle.notify_all();
 	}
 
 #ifdef DEBUG_WORKER
@@ -3,6 +3,9 @@
 
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <thread>
 
 Shader::Shader(VulkanCore& c, const std::string id, VkShaderModule shaderModule)
 	: c(c), id(id), shaderModule(shaderModule) {
@@ -184,8 +187,8 @@ std::shared_ptr<Shader> ShaderLoader::loadShader(PointersManager<std::string, Sh
 #endif
 
 	// Look for it in loadedShaders
-	if (loadedShaders.contains(id))
-		return loadedShaders.get(id);
+	if (std::shared_ptr<Shader> loaded = loadedShaders.find(id))
+		return loaded;
 
 	// Load shader (if not loaded yet)
 	std::string glslData;
@@ -198,7 +201,11 @@ std::shared_ptr<Shader> ShaderLoader::loadShader(PointersManager<std::string, Sh
 	shaderc::CompileOptions options;
 	options.SetIncluder(std::make_unique<ShaderIncluder>());
 	options.SetGenerateDebugInfo();
+	options.SetTargetEnvironment(shaderc_target_env_vulkan, shaderc_env_version_vulkan_1_0);
 	//if (optimize) options.SetOptimizationLevel(shaderc_optimization_level_performance);	// This option makes shaderc::CompileGlslToSpv fail when Assimp::Importer is present in code, even if an Importer object is not created (odd) (Importer is in DataFromFile2::loadVertex).
+	unsigned spvVersion = 0, spvRevision = 0;
+	shaderc_get_spv_version(&spvVersion, &spvRevision);
+	const std::string optionsKey = "debugInfo vulkan_1_0 spv" + std::to_string(spvVersion) + '.' + std::to_string(spvRevision);   // Compiler version, target environment and compile options that change the SPIR-V (part of the cache key). Update it when changing the options.
 
 	shaderc::Compiler compiler;
 
@@ -207,12 +214,23 @@ std::shared_ptr<Shader> ShaderLoader::loadShader(PointersManager<std::string, Sh
 		std::cerr << "Shader module preprocessing failed - " << preProcessed.GetErrorMessage() << std::endl;
 
 	std::string ppData(preProcessed.begin());
-	shaderc::SpvCompilationResult module = compiler.CompileGlslToSpv(ppData.data(), ppData.size(), shaderc_glsl_infer_from_source, id.c_str(), options);
+	std::vector<uint32_t> spirv;
 
-	if (module.GetCompilationStatus() != shaderc_compilation_status_success)
-		std::cerr << "Shader module compilation failed - " << module.GetErrorMessage() << std::endl;
+	// Take the SPIR-V from the cache (preprocessing is cheap, compilation is not), or compile it and save it in the cache.
+	uint64_t cacheKey = getCacheKey(id, optionsKey, ppData);
 
-	std::vector<uint32_t> spirv = { module.cbegin(), module.cend() };
+	if (!readCache(cacheKey, spirv))
+	{
+		shaderc::SpvCompilationResult module = compiler.CompileGlslToSpv(ppData.data(), ppData.size(), shaderc_glsl_infer_from_source, id.c_str(), options);
+
+		if (module.GetCompilationStatus() != shaderc_compilation_status_success)
+			std::cerr << "Shader module compilation failed - " << module.GetErrorMessage() << std::endl;
+
+		spirv.assign(module.cbegin(), module.cend());
+
+		if (module.GetCompilationStatus() == shaderc_compilation_status_success)
+			writeCache(cacheKey, spirv);
+	}
 
 	//Create shader module:
 
@@ -235,6 +253,88 @@ void ShaderLoader::applyModifications(std::string& shader)
 		mod.applyModification(shader);
 }
 
+std::string ShaderLoader::cacheDirectory = "shaderCache";
+
+void ShaderLoader::setCacheDirectory(const std::string& directory) { cacheDirectory = directory; }
+
+uint64_t ShaderLoader::getCacheKey(const std::string& id, const std::string& options, const std::string& preprocessedGlsl)
+{
+	uint64_t hash = 14695981039346656037ull;   // FNV-1a (offset basis)
+
+	for (const std::string* str : { &id, &options, &preprocessedGlsl })
+	{
+		for (char ch : *str)
+		{
+			hash ^= (unsigned char)ch;
+			hash *= 1099511628211ull;   // FNV prime
+		}
+
+		hash ^= 0xff;   // Separator (so "ab" + "c" != "a" + "bc")
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+bool ShaderLoader::readCache(uint64_t key, std::vector<uint32_t>& spirv)
+{
+	if (cacheDirectory.empty()) return false;
+
+	std::ostringstream fileName;
+	fileName << cacheDirectory << '/' << std::hex << key << ".spv";
+
+	std::ifstream file(fileName.str(), std::ios::ate | std::ios::binary);
+	if (!file.is_open()) return false;
+
+	uint64_t header[2];   // key, bytes
+	size_t fileSize = (size_t)file.tellg();
+	if (fileSize < sizeof(header) + sizeof(uint32_t)) return false;
+
+	file.seekg(0);
+	file.read(reinterpret_cast<char*>(header), sizeof(header));
+	if (!file || header[0] != key || header[1] != fileSize - sizeof(header) || header[1] % sizeof(uint32_t)) return false;
+
+	spirv.resize(header[1] / sizeof(uint32_t));
+	file.read(reinterpret_cast<char*>(spirv.data()), header[1]);
+
+	if (!file || spirv[0] != 0x07230203)   // SPIR-V magic number
+	{
+		spirv.clear();
+		return false;
+	}
+
+#ifdef DEBUG_RESOURCES
+	std::cout << "   Shader taken from cache: " << fileName.str() << std::endl;
+#endif
+
+	return true;
+}
+
+void ShaderLoader::writeCache(uint64_t key, const std::vector<uint32_t>& spirv)
+{
+	if (cacheDirectory.empty() || spirv.empty()) return;
+
+	std::ostringstream fileName, tempName;
+	fileName << cacheDirectory << '/' << std::hex << key << ".spv";
+	tempName << fileName.str() << '.' << std::this_thread::get_id() << ".tmp";   // Loading threads may compile the same shader simultaneously.
+
+	std::error_code error;
+	std::filesystem::create_directories(cacheDirectory, error);
+
+	{
+		std::ofstream file(tempName.str(), std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) return;   // The cache is optional: Don't fail if it cannot be written.
+
+		uint64_t header[2] = { key, spirv.size() * sizeof(uint32_t) };
+		file.write(reinterpret_cast<const char*>(header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(spirv.data()), spirv.size() * sizeof(uint32_t));
+		if (!file) { file.close(); std::filesystem::remove(tempName.str(), error); return; }
+	}
+
+	std::filesystem::rename(tempName.str(), fileName.str(), error);   // Readers never see partially written files.
+	if (error) std::filesystem::remove(tempName.str(), error);
+}
+
 SL_fromBuffer::SL_fromBuffer(const std::string& id, const std::string& glslText, const std::initializer_list<SMod>& modifications)
 	: ShaderLoader(id, modifications), data(glslText) {
 }
@@ -4,7 +4,7 @@
 #define STB_IMAGE_IMPLEMENTATION		// Import textures
 #include "stb_image.h"
 
-Texture::Texture(const std::string& id, TexType type, VulkanCore& c, VkImage textureImage, VkDeviceMemory textureImageMemory, VkImageView textureImageView, VkSampler textureSampler, VkFormat imageFormat, VkSamplerAddressMode addressMode)
+Texture::Texture(const std::string& id, TexType type, VulkanCore& c, VkImage textureImage, Allocation textureImageMemory, VkImageView textureImageView, VkSampler textureSampler, VkFormat imageFormat, VkSamplerAddressMode addressMode)
 	: id(id), type(type), imageFormat(imageFormat), addressMode(addressMode), texture(&c, textureImage, textureImageMemory, textureImageView, textureSampler) { }
 
 Texture::Texture(const std::string& id, TexType type, VkFormat imageFormat, VkSamplerAddressMode addressMode)
@@ -28,8 +28,8 @@ std::shared_ptr<Texture> Texture::loadTexture(Renderer& r)
 	//this->c = &core;
 
 	// Look for it in Renderer::textures.
-	if (r.textures.contains(id))
-		return r.textures.get(id);
+	if (std::shared_ptr<Texture> loaded = r.textures.find(id))
+		return loaded;
 
 	// Load an image
 	unsigned char* pixels;
@@ -38,17 +38,17 @@ std::shared_ptr<Texture> Texture::loadTexture(Renderer& r)
 
 	// Get arguments for creating the texture object
 	uint32_t mipLevels;		//!< Number of levels (mipmaps)
-	std::pair<VkImage, VkDeviceMemory> image = createTextureImage(pixels, texWidth, texHeight, mipLevels, r);
+	std::pair<VkImage, Allocation> image = createTextureImage(pixels, texWidth, texHeight, mipLevels, r);
 	VkImageView textureImageView = createTextureImageView(std::get<VkImage>(image), mipLevels, r.c);
 	VkSampler textureSampler = createTextureSampler(mipLevels, r.c);
 
 	// Create and save texture object
-	return r.textures.emplace(id, std::ref(id), type, std::ref(r.c), std::get<VkImage>(image), std::get<VkDeviceMemory>(image), textureImageView, textureSampler, imageFormat, addressMode);
+	return r.textures.emplace(id, std::ref(id), type, std::ref(r.c), std::get<VkImage>(image), std::get<Allocation>(image), textureImageView, textureSampler, imageFormat, addressMode);
 }
 
 void Texture::getRawData(unsigned char*& pixels, int32_t& texWidth, int32_t& texHeight) { }
 
-std::pair<VkImage, VkDeviceMemory> Texture::createTextureImage(unsigned char* pixels, int32_t texWidth, int32_t texHeight, uint32_t& mipLevels, Renderer& r)
+std::pair<VkImage, Allocation> Texture::createTextureImage(unsigned char* pixels, int32_t texWidth, int32_t texHeight, uint32_t& mipLevels, Renderer& r)
 {
 #ifdef DEBUG_RESOURCES
 	std::cout << "   " << __func__ << std::endl;
@@ -57,27 +57,9 @@ std::pair<VkImage, VkDeviceMemory> Texture::createTextureImage(unsigned char* pi
 	VkDeviceSize imageSize = texWidth * texHeight * 4;												// 4 bytes per rgba pixel
 	mipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(texWidth, texHeight)))) + 1;	// Calculate the number levels (mipmaps)
 
-	// Create a staging buffer (temporary buffer in host visible memory so that we can use vkMapMemory and copy the pixels to it)
-	VkBuffer	   stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
-
-	r.c.createBuffer(
-		imageSize,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		stagingBuffer,
-		stagingBufferMemory);
-
-	// Copy directly the pixel values from the image we loaded to the staging-buffer.
-	void* data;
-	vkMapMemory(r.c.device, stagingBufferMemory, 0, imageSize, 0, &data);	// vkMapMemory retrieves a host virtual address pointer (data) to a region of a mappable memory object (stagingBufferMemory). We have to provide the logical device that owns the memory (e.device).
-	memcpy(data, pixels, static_cast<size_t>(imageSize));					// Copies a number of bytes (imageSize) from a source (pixels) to a destination (data).
-	vkUnmapMemory(r.c.device, stagingBufferMemory);						// Unmap a previously mapped memory object (stagingBufferMemory).
-	stbi_image_free(pixels);	// Clean up the original pixel array
-
 	// Create the texture image
 	VkImage			textureImage;
-	VkDeviceMemory	textureImageMemory;
+	Allocation		textureImageMemory;
 
 	r.c.createImage(
 		textureImage,
@@ -91,15 +73,9 @@ std::pair<VkImage, VkDeviceMemory> Texture::createTextureImage(unsigned char* pi
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
 	);
 
-	// Copy the staging buffer to the texture image
-	r.commander.transitionImageLayout(textureImage, imageFormat, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);					// Transition the texture image to VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
-	r.commander.copyBufferToImage(stagingBuffer, textureImage, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight));											// Execute the buffer to image copy operation
-	// Transitioned to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL while generating mipmaps
-	// transitionImageLayout(textureImage, imageFormat, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, mipLevels);	// To be able to start sampling from the texture image in the shader, we need one last transition to prepare it for shader access
-	r.commander.generateMipmaps(textureImage, imageFormat, texWidth, texHeight, mipLevels);
-
-	// Cleanup the staging buffer and its memory
-	r.c.destroyBuffer(r.c.device, stagingBuffer, stagingBufferMemory);
+	// Copy the pixels to the staging ring and record the transfer: transition to VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, buffer to image copy, and mipmaps generation (which transitions the image to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL).
+	r.uploader.uploadImage(textureImage, imageFormat, pixels, imageSize, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight), mipLevels);
+	stbi_image_free(pixels);	// Clean up the original pixel array (already copied to staging memory)
 
 	return std::pair(textureImage, textureImageMemory);
 }
@@ -2,7 +2,12 @@
 #include <chrono>
 #include <thread>
 
+#ifdef _MSC_VER
+	#include <intrin.h>   // _BitScanForward
+#endif
+
 #include "polygonum/toolkit.hpp"
+#include "polygonum/simd.hpp"
 
 
 double pi = 3.141592653589793238462;
@@ -304,6 +309,201 @@ bool Frustum::isInFrustum(const Sphere& sphere) const
 	return true;   // Sphere is inside or intersects the frustum
 }
 
+/*
+	Batch culling: cullSpheresBatch() and cullAABBsBatch() are run with the widest SIMD type available (see simd.hpp), and narrower ones process the remaining objects.
+*/
+namespace
+{
+	inline unsigned countTrailingZeros(unsigned mask)
+	{
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, mask);
+		return index;
+#else
+		return __builtin_ctz(mask);
+#endif
+	}
+
+	/// Cull spheres [i, count) in groups of S::width (the remaining ones are left for a narrower type). Updates "i" and returns the new number of visible objects.
+	template<typename S>
+	size_t cullSpheresBatch(const std::array<Plane, 6>& planes, const float* x, const float* y, const float* z, const float* radius, size_t& i, size_t count, uint32_t* visible, size_t numVisible)
+	{
+		typename S::F nx[6], ny[6], nz[6], d[6];
+		for (size_t p = 0; p < 6; p++)
+		{
+			nx[p] = S::set(planes[p].normal.x);
+			ny[p] = S::set(planes[p].normal.y);
+			nz[p] = S::set(planes[p].normal.z);
+			d[p] = S::set(planes[p].dist);
+		}
+
+		const typename S::F minusOne = S::set(-1.f);
+
+		for (; i + S::width <= count; i += S::width)
+		{
+			typename S::F cx = S::load(x + i), cy = S::load(y + i), cz = S::load(z + i);
+			typename S::F negRadius = S::mul(S::load(radius + i), minusOne);
+			unsigned outside = 0;
+
+			for (size_t p = 0; p < 6 && outside != S::fullMask; p++)   // Sphere is outside if it's completely behind any plane.
+			{
+				typename S::F dist = S::add(S::add(S::mul(cx, nx[p]), S::mul(cy, ny[p])), S::add(S::mul(cz, nz[p]), d[p]));
+				outside |= S::less(dist, negRadius);
+			}
+
+			for (unsigned inside = ~outside & S::fullMask; inside; inside &= inside - 1)   // Compact indices of visible spheres
+				visible[numVisible++] = static_cast<uint32_t>(i + countTrailingZeros(inside));
+		}
+
+		return numVisible;
+	}
+
+	/// Cull AABBs [i, count) in groups of S::width. For each plane, the corner most aligned with its normal is taken with max() per axis (no branches).
+	template<typename S>
+	size_t cullAABBsBatch(const std::array<Plane, 6>& planes, const float* minX, const float* minY, const float* minZ, const float* maxX, const float* maxY, const float* maxZ, size_t& i, size_t count, uint32_t* visible, size_t numVisible)
+	{
+		typename S::F nx[6], ny[6], nz[6], d[6];
+		for (size_t p = 0; p < 6; p++)
+		{
+			nx[p] = S::set(planes[p].normal.x);
+			ny[p] = S::set(planes[p].normal.y);
+			nz[p] = S::set(planes[p].normal.z);
+			d[p] = S::set(planes[p].dist);
+		}
+
+		const typename S::F zero = S::set(0.f);
+
+		for (; i + S::width <= count; i += S::width)
+		{
+			typename S::F x0 = S::load(minX + i), y0 = S::load(minY + i), z0 = S::load(minZ + i);
+			typename S::F x1 = S::load(maxX + i), y1 = S::load(maxY + i), z1 = S::load(maxZ + i);
+			unsigned outside = 0;
+
+			for (size_t p = 0; p < 6 && outside != S::fullMask; p++)   // AABB is outside if its most aligned corner is behind any plane.
+			{
+				typename S::F dist = S::add(
+					S::add(S::max(S::mul(x0, nx[p]), S::mul(x1, nx[p])), S::max(S::mul(y0, ny[p]), S::mul(y1, ny[p]))),
+					S::add(S::max(S::mul(z0, nz[p]), S::mul(z1, nz[p])), d[p]));
+				outside |= S::less(dist, zero);
+			}
+
+			for (unsigned inside = ~outside & S::fullMask; inside; inside &= inside - 1)
+				visible[numVisible++] = static_cast<uint32_t>(i + countTrailingZeros(inside));
+		}
+
+		return numVisible;
+	}
+}
+
+size_t Frustum::cullSpheres(const SpheresSoA& spheres, std::vector<uint32_t>& visible) const
+{
+	visible.resize(spheres.size());
+	visible.resize(cullSpheres(spheres.x.data(), spheres.y.data(), spheres.z.data(), spheres.radius.data(), spheres.size(), visible.data()));
+	return visible.size();
+}
+
+size_t Frustum::cullSpheres(const float* x, const float* y, const float* z, const float* radius, size_t count, uint32_t* visible) const
+{
+	size_t i = 0, numVisible = 0;
+
+#ifdef __AVX512F__
+	numVisible = cullSpheresBatch<SimdAVX512>(planes, x, y, z, radius, i, count, visible, numVisible);
+#endif
+#ifdef __AVX__
+	numVisible = cullSpheresBatch<SimdAVX>(planes, x, y, z, radius, i, count, visible, numVisible);
+#endif
+#if defined(__AVX__) || defined(POLYGONUM_SSE)
+	numVisible = cullSpheresBatch<SimdSSE>(planes, x, y, z, radius, i, count, visible, numVisible);
+#endif
+	return cullSpheresBatch<SimdScalar>(planes, x, y, z, radius, i, count, visible, numVisible);
+}
+
+size_t Frustum::cullAABBs(const AABBsSoA& aabbs, std::vector<uint32_t>& visible) const
+{
+	visible.resize(aabbs.size());
+	visible.resize(cullAABBs(aabbs.minX.data(), aabbs.minY.data(), aabbs.minZ.data(), aabbs.maxX.data(), aabbs.maxY.data(), aabbs.maxZ.data(), aabbs.size(), visible.data()));
+	return visible.size();
+}
+
+size_t Frustum::cullAABBs(const float* minX, const float* minY, const float* minZ, const float* maxX, const float* maxY, const float* maxZ, size_t count, uint32_t* visible) const
+{
+	size_t i = 0, numVisible = 0;
+
+#ifdef __AVX512F__
+	numVisible = cullAABBsBatch<SimdAVX512>(planes, minX, minY, minZ, maxX, maxY, maxZ, i, count, visible, numVisible);
+#endif
+#ifdef __AVX__
+	numVisible = cullAABBsBatch<SimdAVX>(planes, minX, minY, minZ, maxX, maxY, maxZ, i, count, visible, numVisible);
+#endif
+#if defined(__AVX__) || defined(POLYGONUM_SSE)
+	numVisible = cullAABBsBatch<SimdSSE>(planes, minX, minY, minZ, maxX, maxY, maxZ, i, count, visible, numVisible);
+#endif
+	return cullAABBsBatch<SimdScalar>(planes, minX, minY, minZ, maxX, maxY, maxZ, i, count, visible, numVisible);
+}
+
+void SpheresSoA::push_back(const Sphere& sphere)
+{
+	x.push_back(sphere.center.x);
+	y.push_back(sphere.center.y);
+	z.push_back(sphere.center.z);
+	radius.push_back(sphere.radius);
+}
+
+void SpheresSoA::set(size_t index, const Sphere& sphere)
+{
+	x[index] = sphere.center.x;
+	y[index] = sphere.center.y;
+	z[index] = sphere.center.z;
+	radius[index] = sphere.radius;
+}
+
+void SpheresSoA::resize(size_t size)
+{
+	x.resize(size);
+	y.resize(size);
+	z.resize(size);
+	radius.resize(size);
+}
+
+void SpheresSoA::clear() { resize(0); }
+
+size_t SpheresSoA::size() const { return x.size(); }
+
+void AABBsSoA::push_back(const AABB& aabb)
+{
+	minX.push_back(aabb.min.x);
+	minY.push_back(aabb.min.y);
+	minZ.push_back(aabb.min.z);
+	maxX.push_back(aabb.max.x);
+	maxY.push_back(aabb.max.y);
+	maxZ.push_back(aabb.max.z);
+}
+
+void AABBsSoA::set(size_t index, const AABB& aabb)
+{
+	minX[index] = aabb.min.x;
+	minY[index] = aabb.min.y;
+	minZ[index] = aabb.min.z;
+	maxX[index] = aabb.max.x;
+	maxY[index] = aabb.max.y;
+	maxZ[index] = aabb.max.z;
+}
+
+void AABBsSoA::resize(size_t size)
+{
+	minX.resize(size);
+	minY.resize(size);
+	minZ.resize(size);
+	maxX.resize(size);
+	maxY.resize(size);
+	maxZ.resize(size);
+}
+
+void AABBsSoA::clear() { resize(0); }
+
+size_t AABBsSoA::size() const { return minX.size(); }
+
 SqrMesh::SqrMesh(size_t sideCount, float sideLength) 
 	: sideCount(sideCount), sideLength(sideLength), vertexCount(sideCount * sideCount)
 {
@@ -873,19 +1073,6 @@ float getSlope(const glm::vec3& groundNormal, const glm::vec3& upNormal)
 
 void sleep(int milliseconds) { std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds)); }
 
-// Add some time to deltaTime to adjust the FPS (if FPS control is enabled)
-void waitForFPS(Timer& timer, int maxFPS)
-{
-	if (maxFPS == 0) return;
-
-	int waitTime = static_cast<int>((1.l / maxFPS - timer.getDeltaTime()) * 1000000);    // microseconds (for the sleep)
-	if (waitTime > 0)
-	{
-		std::this_thread::sleep_for(std::chrono::microseconds(waitTime));
-		timer.reUpdateTime();
-	}
-}
-
 Timer::Timer()
 	: deltaTime(0), totalDeltaTime(0)
 {
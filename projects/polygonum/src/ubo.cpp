@@ -1,4 +1,5 @@
 #include <iostream>
+#include <algorithm>
 
 #include "polygonum/ubo.hpp"
 #include "polygonum/renderer.hpp"
@@ -19,6 +20,8 @@ namespace sizes {
 
 BindingBuffer::BindingBuffer(BindingBufferType descType, uint32_t numDescs, uint32_t numSubDescs, VkDeviceSize descSize, const std::vector<std::string>& glslLines)
 	: c(nullptr), swapChain(nullptr),
+	modifiedRange(0, 0),
+	resized(false),
 	numDescriptors(numDescs),
 	numSubDescriptors(numSubDescs),
 	descriptorSize(alignedDescriptorSize(numDescs, descType, descSize)),
@@ -28,6 +31,8 @@ BindingBuffer::BindingBuffer(BindingBufferType descType, uint32_t numDescs, uint
 
 	binding.resize(numDescriptors * descriptorSize);
 	size = binding.size();
+	frameBinding = binding;
+	frameSize = size;
 
 	switch (descType)
 	{
@@ -47,7 +52,7 @@ BindingBuffer::BindingBuffer(BindingBufferType descType, uint32_t numDescs, uint
 }
 
 BindingBuffer::BindingBuffer(const BindingBuffer& obj)
-	: c(obj.c), swapChain(obj.swapChain), size(obj.size), type(obj.type), usage(obj.usage), numDescriptors(obj.numDescriptors), descriptorSize(obj.descriptorSize), numSubDescriptors(obj.numSubDescriptors), binding(obj.binding), glslLines(obj.glslLines)
+	: c(obj.c), swapChain(obj.swapChain), size(obj.size), frameSize(obj.frameSize), modifiedRange(obj.modifiedRange), resized(obj.resized), frameBinding(obj.frameBinding), type(obj.type), usage(obj.usage), numDescriptors(obj.numDescriptors), descriptorSize(obj.descriptorSize), numSubDescriptors(obj.numSubDescriptors), binding(obj.binding), glslLines(obj.glslLines)
 {
 	// Members "bindingBuffers" and "bindingMemories" are not copied because they're destroyed by the destructor.
 }
@@ -58,6 +63,11 @@ BindingBuffer::BindingBuffer(BindingBuffer&& other) noexcept
 	: c(std::move(other.c)),
 	swapChain(std::move(other.swapChain)),
 	size(std::move(other.size)),
+	frameSize(other.frameSize),
+	modifiedRange(other.modifiedRange),
+	resized(other.resized),
+	frameBinding(std::move(other.frameBinding)),
+	dirtyRanges(std::move(other.dirtyRanges)),
 	type(std::move(other.type)),
 	usage(std::move(other.usage)),
 	numDescriptors(other.numDescriptors),   // Cannot use std::move on const variables.
@@ -76,6 +86,10 @@ BindingBuffer& BindingBuffer::operator=(const BindingBuffer& obj)
 	c = obj.c;
 	swapChain = obj.swapChain;
 	size = obj.size;
+	frameSize = obj.frameSize;
+	modifiedRange = obj.modifiedRange;
+	resized = obj.resized;
+	frameBinding = obj.frameBinding;
 
 	type = obj.type;
 	usage = obj.usage;
@@ -145,9 +159,84 @@ BindingBuffer& BindingBuffer::operator=(BindingBuffer&& other) noexcept
 uint8_t* BindingBuffer::getDescriptor(size_t index)
 {
 	uint8_t* ptr = binding.data() + index * descriptorSize;
+	setDirty(index * descriptorSize, descriptorSize);
 	return ptr;
 }
 
+void BindingBuffer::setDirty(uint32_t offset, uint32_t bytes)
+{
+	uint32_t end = std::min<uint64_t>((uint64_t)offset + bytes, getCapacity());
+
+	if (modifiedRange.first >= modifiedRange.second) modifiedRange = { offset, end };
+	else modifiedRange = { std::min(modifiedRange.first, offset), std::max(modifiedRange.second, end) };
+}
+
+void BindingBuffer::setFrameDirty(uint32_t offset, uint32_t bytes)
+{
+	uint32_t end = std::min<uint64_t>((uint64_t)offset + bytes, getCapacity());
+
+	for (auto& range : dirtyRanges)
+	{
+		if (range.first >= range.second) range = { offset, end };
+		else range = { std::min(range.first, offset), std::max(range.second, end) };
+	}
+}
+
+void BindingBuffer::updateMemory(uint32_t imageIndex)
+{
+	if (!isFullyConstructed()) return;
+
+	std::pair<uint32_t, uint32_t>& range = dirtyRanges[imageIndex];
+	uint32_t end = std::min(range.second, frameSize);
+
+	if (range.first < end)
+		memcpy(bindingMemories[imageIndex].mapped + range.first, frameBinding.data() + range.first, end - range.first);   // Memory is host coherent, so no flush is required.
+
+	range = { 0, 0 };
+}
+
+void BindingBuffer::publish()
+{
+	uint32_t offset, bytes;
+	if (!takeModified(offset, bytes)) return;
+
+	setFrameData(offset, binding.data() + offset, bytes);
+	setFrameSize(size);
+}
+
+bool BindingBuffer::takeModified(uint32_t& offset, uint32_t& bytes)
+{
+	bool modified = modifiedRange.first < modifiedRange.second;
+	offset = modified ? modifiedRange.first : 0;
+	bytes = modified ? modifiedRange.second - modifiedRange.first : 0;
+
+	modified |= resized;
+	modifiedRange = { 0, 0 };
+	resized = false;
+
+	return modified;
+}
+
+void BindingBuffer::setFrameData(uint32_t offset, const void* data, uint32_t bytes)
+{
+	if ((uint64_t)offset + bytes > frameBinding.size())
+		throw std::runtime_error("Frame data out of range!");
+
+	if (!bytes) return;
+	memcpy(frameBinding.data() + offset, data, bytes);
+	setFrameDirty(offset, bytes);
+}
+
+void BindingBuffer::setFrameSize(uint32_t newSize)
+{
+	uint32_t oldSize = frameSize;
+	frameSize = std::min(newSize, getCapacity());
+
+	if (frameSize > oldSize) setFrameDirty(oldSize, frameSize - oldSize);   // Bytes beyond the old size may not have been copied yet.
+}
+
+const uint8_t* BindingBuffer::getFrameData() const { return frameBinding.data(); }
+
 // (21)
 void BindingBuffer::createBuffer(Renderer* rend)
 {
@@ -164,6 +253,7 @@ void BindingBuffer::createBuffer(Renderer* rend)
 
 	bindingBuffers.resize(swapChain->images.size());
 	bindingMemories.resize(swapChain->images.size());
+	dirtyRanges.resize(swapChain->images.size(), { 0, getCapacity() });   // Whole binding is copied in the first update.
 	
 	//destroyUniformBuffers();		// Not required since Renderer calls this first
 
@@ -173,14 +263,20 @@ void BindingBuffer::createBuffer(Renderer* rend)
 			usage,
 			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 			bindingBuffers[i],
-			bindingMemories[i]);
+			bindingMemories[i]);   // Host-visible memory is persistently mapped by the allocator. Avoids mapping/unmapping each frame.
 }
 
 void BindingBuffer::destroyBuffer()
 {
 	if (isFullyConstructed())
+	{
 		for (size_t i = 0; i < swapChain->images.size(); i++)
 			c->destroyBuffer(c->device, bindingBuffers[i], bindingMemories[i]);
+
+		bindingBuffers.clear();   // Avoids destroying them twice (destroyBuffer and destructor).
+		bindingMemories.clear();
+		dirtyRanges.clear();
+	}
 }
 
 bool BindingBuffer::isFullyConstructed() { return bindingBuffers.size(); }
@@ -191,18 +287,28 @@ uint32_t BindingBuffer::getCapacity() const  { return binding.size(); }
 
 void BindingBuffer::setSize(uint32_t newSize)
 {
+	uint32_t oldSize = size;
+
 	if (newSize > getCapacity())
 		size = getCapacity();
 	else
 		size = newSize;
+
+	if (size > oldSize) setDirty(oldSize, size - oldSize);   // Bytes beyond the old size may not have been copied yet.
+	if (size != oldSize) resized = true;
 }
 
 void BindingBuffer::setSize_subs(uint32_t numActiveSubDescriptors)
 {
+	uint32_t oldSize = size;
+
 	if (numActiveSubDescriptors > numSubDescriptors)
 		size = getCapacity();
 	else
 		size = (getCapacity() / numSubDescriptors) * numActiveSubDescriptors;
+
+	if (size > oldSize) setDirty(oldSize, size - oldSize);
+	if (size != oldSize) resized = true;
 }
 
 Material::Material(glm::vec3& diffuse, glm::vec3& specular, float shininess)
@@ -0,0 +1,422 @@
+#include <iostream>
+#include <cstring>
+
+#include "polygonum/uploader.hpp"
+
+
+Uploader::Uploader(VulkanCore& core, Commander& commander) :
+	c(core),
+	commander(commander),
+	stagingBuffer(VK_NULL_HANDLE),
+	head(0),
+	tail(0),
+	dedicatedTransfer(core.transferQueue != VK_NULL_HANDLE),
+	queue(dedicatedTransfer ? core.transferQueue : core.graphicsQueue),
+	commandPool(VK_NULL_HANDLE),
+	acquirePool(VK_NULL_HANDLE),
+	oldest(0),
+	pending(0),
+	submittedBatches(0),
+	retiredBatches(0)
+{
+#if defined(DEBUG_RENDERER) || defined(DEBUG_RESOURCES)
+	std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
+#endif
+
+	// Staging ring (persistently mapped)
+	c.createBuffer(
+		ringSize,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		stagingBuffer,
+		stagingMemory);
+
+	// Command pools (command buffers are short-lived and re-recorded individually)
+	QueueFamilyIndices queueFamilyIndices = c.findQueueFamilies(c.physicalDevice);
+	graphicsFamily = queueFamilyIndices.graphicsFamily.value();
+	transferFamily = dedicatedTransfer ? queueFamilyIndices.transferFamily.value() : graphicsFamily;
+
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.queueFamilyIndex = transferFamily;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+
+	if (vkCreateCommandPool(c.device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS)
+		throw std::runtime_error("Failed to create upload command pool!");
+
+	if (dedicatedTransfer)
+	{
+		poolInfo.queueFamilyIndex = graphicsFamily;
+
+		if (vkCreateCommandPool(c.device, &poolInfo, nullptr, &acquirePool) != VK_SUCCESS)
+			throw std::runtime_error("Failed to create upload command pool!");
+	}
+
+#if defined(DEBUG_RENDERER) || defined(DEBUG_RESOURCES)
+	std::cout << "   Uploads queue family: " << transferFamily << (dedicatedTransfer ? " (dedicated transfer)" : " (graphics)") << std::endl;
+#endif
+
+	// Batches (one command buffer and fence each)
+	batches.resize(maxBatches);
+
+	VkCommandBufferAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.commandPool = commandPool;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandBufferCount = 1;
+
+	VkFenceCreateInfo fenceInfo{};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+	VkSemaphoreCreateInfo semaphoreInfo{};
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+	for (Batch& batch : batches)
+	{
+		batch.acquireCommandBuffer = VK_NULL_HANDLE;
+		batch.transferFinished = VK_NULL_HANDLE;
+		batch.acquiring = false;
+		batch.ringEnd = 0;
+		batch.transfers = 0;
+
+		allocInfo.commandPool = commandPool;
+
+		if (vkAllocateCommandBuffers(c.device, &allocInfo, &batch.commandBuffer) != VK_SUCCESS ||
+			vkCreateFence(c.device, &fenceInfo, nullptr, &batch.fence) != VK_SUCCESS)
+			throw std::runtime_error("Failed to create upload batches!");
+
+		if (dedicatedTransfer)
+		{
+			allocInfo.commandPool = acquirePool;
+
+			if (vkAllocateCommandBuffers(c.device, &allocInfo, &batch.acquireCommandBuffer) != VK_SUCCESS ||
+				vkCreateSemaphore(c.device, &semaphoreInfo, nullptr, &batch.transferFinished) != VK_SUCCESS)
+				throw std::runtime_error("Failed to create upload batches!");
+		}
+	}
+}
+
+Uploader::Batch& Uploader::current() { return batches[(oldest + pending) % batches.size()]; }
+
+void Uploader::beginBatch()
+{
+	Batch& batch = current();
+	if (batch.transfers) return;   // Already recording
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+	if (vkBeginCommandBuffer(batch.commandBuffer, &beginInfo) != VK_SUCCESS)   // Implicitly resets the command buffer.
+		throw std::runtime_error("Failed to begin recording upload command buffer!");
+}
+
+VkCommandBuffer Uploader::beginAcquire()
+{
+	Batch& batch = current();
+	if (batch.acquiring) return batch.acquireCommandBuffer;
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+	if (vkBeginCommandBuffer(batch.acquireCommandBuffer, &beginInfo) != VK_SUCCESS)
+		throw std::runtime_error("Failed to begin recording upload command buffer!");
+
+	batch.acquiring = true;
+	return batch.acquireCommandBuffer;
+}
+
+/**
+	Resources are created with VK_SHARING_MODE_EXCLUSIVE, so they are owned by a single queue family at a time. The transfer family releases them and the graphics family acquires them with the same barrier (same queue families, same resource range, same layouts).
+	The release barrier only needs its source scope (transfer writes). The acquire barrier only needs its destination scope (reads by later commands submitted to the graphics queue). The semaphore between both submissions provides the dependency.
+*/
+void Uploader::transferOwnership(VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size)
+{
+	VkBufferMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcQueueFamilyIndex = transferFamily;
+	barrier.dstQueueFamilyIndex = graphicsFamily;
+	barrier.buffer = buffer;
+	barrier.offset = offset;
+	barrier.size = size;
+
+	// Release (transfer queue)
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = 0;
+
+	vkCmdPipelineBarrier(current().commandBuffer,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+		0, nullptr,
+		1, &barrier,
+		0, nullptr);
+
+	// Acquire (graphics queue)
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+
+	vkCmdPipelineBarrier(beginAcquire(),
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+		0, nullptr,
+		1, &barrier,
+		0, nullptr);
+}
+
+void Uploader::transferOwnership(VkImage image, uint32_t mipLevels)
+{
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;		// No layout transition (generateMipmaps() expects all levels in TRANSFER_DST_OPTIMAL)
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcQueueFamilyIndex = transferFamily;
+	barrier.dstQueueFamilyIndex = graphicsFamily;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = mipLevels;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+
+	// Release (transfer queue)
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = 0;
+
+	vkCmdPipelineBarrier(current().commandBuffer,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+		0, nullptr,
+		0, nullptr,
+		1, &barrier);
+
+	// Acquire (graphics queue)
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;	// Mipmaps generation (blits)
+
+	vkCmdPipelineBarrier(beginAcquire(),
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+		0, nullptr,
+		0, nullptr,
+		1, &barrier);
+}
+
+VkDeviceSize Uploader::stage(const void* data, VkDeviceSize size, VkBuffer& srcBuffer)
+{
+	if (size > ringSize)   // Too big for the ring: Use a temporary staging buffer.
+	{
+		std::pair<VkBuffer, Allocation> temp;
+		c.createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, temp.first, temp.second);
+		memcpy(temp.second.mapped, data, (size_t)size);
+
+		current().oversized.push_back(temp);
+		srcBuffer = temp.first;
+		return 0;
+	}
+
+	while (true)
+	{
+		VkDeviceSize start = stagingAlignment * ((head + stagingAlignment - 1) / stagingAlignment);
+		if (start % ringSize + size > ringSize)   // Doesn't fit before the end of the ring: Skip to its beginning.
+			start = ringSize * ((start + ringSize - 1) / ringSize);
+
+		if (start + size - tail <= ringSize)
+		{
+			head = start + size;
+			memcpy(stagingMemory.mapped + start % ringSize, data, (size_t)size);   // Coherent memory: visible to the GPU on the next vkQueueSubmit.
+			srcBuffer = stagingBuffer;
+			return start % ringSize;
+		}
+
+		// Ring full: Wait for the oldest batch. If the current batch uses the whole ring, submit it first.
+		if (!retireOldest(true))
+			submitBatch();
+	}
+}
+
+void Uploader::submitBatch()
+{
+	Batch& batch = current();
+	if (!batch.transfers) return;
+
+	if (!dedicatedTransfer)
+	{
+		// Make transfer writes available to the commands submitted later (vertex/index/uniform reads). Images got their own barriers when transitioned to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
+		VkMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+
+		vkCmdPipelineBarrier(batch.commandBuffer,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+			1, &barrier,
+			0, nullptr,
+			0, nullptr);
+	}
+
+	if (vkEndCommandBuffer(batch.commandBuffer) != VK_SUCCESS ||
+		(batch.acquiring && vkEndCommandBuffer(batch.acquireCommandBuffer) != VK_SUCCESS))
+		throw std::runtime_error("Failed to record upload command buffer!");
+
+	batch.ringEnd = head;
+	vkResetFences(c.device, 1, &batch.fence);
+
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &batch.commandBuffer;
+
+	if (!dedicatedTransfer)
+	{
+		const std::lock_guard<std::mutex> lock(commander.mutQueue);
+		if (vkQueueSubmit(queue, 1, &submitInfo, batch.fence) != VK_SUCCESS)
+			throw std::runtime_error("Failed to submit upload command buffer!");
+	}
+	else
+	{
+		// Copies (transfer queue). Only Uploader uses this queue, and always under mutUpload, so mutQueue is not needed.
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &batch.transferFinished;
+
+		if (vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+			throw std::runtime_error("Failed to submit upload command buffer!");
+
+		// Acquire barriers and mipmaps (graphics queue). Waits for the copies.
+		VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;   // Same stage as the source scope of the acquire barriers.
+
+		VkSubmitInfo acquireInfo{};
+		acquireInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		acquireInfo.waitSemaphoreCount = 1;
+		acquireInfo.pWaitSemaphores = &batch.transferFinished;
+		acquireInfo.pWaitDstStageMask = &waitStage;
+		acquireInfo.commandBufferCount = 1;
+		acquireInfo.pCommandBuffers = &batch.acquireCommandBuffer;
+
+		const std::lock_guard<std::mutex> lock(commander.mutQueue);
+		if (vkQueueSubmit(c.graphicsQueue, 1, &acquireInfo, batch.fence) != VK_SUCCESS)
+			throw std::runtime_error("Failed to submit upload command buffer!");
+	}
+
+#ifdef DEBUG_RESOURCES
+	std::cout << typeid(*this).name() << "::" << __func__ << ": " << batch.transfers << " transfers" << std::endl;
+#endif
+
+	pending++;
+	submittedBatches++;
+	if (pending == batches.size()) retireOldest(true);   // Keep a batch free for recording.
+}
+
+bool Uploader::retireOldest(bool wait)
+{
+	if (!pending) return false;
+
+	Batch& batch = batches[oldest];
+
+	if (wait)
+		vkWaitForFences(c.device, 1, &batch.fence, VK_TRUE, UINT64_MAX);
+	else if (vkGetFenceStatus(c.device, batch.fence) != VK_SUCCESS)
+		return false;
+
+	for (auto& buffer : batch.oversized)
+		c.destroyBuffer(c.device, buffer.first, buffer.second);
+
+	batch.oversized.clear();
+	batch.transfers = 0;
+	batch.acquiring = false;
+	tail = batch.ringEnd;
+	oldest = (oldest + 1) % batches.size();
+	pending--;
+	retiredBatches++;
+
+	if (tail == head)   // Ring empty: Restart from its beginning, so the next range doesn't need to wrap.
+		head = tail = ringSize * ((head + ringSize - 1) / ringSize);
+
+	return true;
+}
+
+void Uploader::uploadBuffer(VkBuffer dstBuffer, const void* data, VkDeviceSize size)
+{
+	uploadBuffer(dstBuffer, 0, data, size);
+}
+
+void Uploader::uploadBuffer(VkBuffer dstBuffer, VkDeviceSize dstOffset, const void* data, VkDeviceSize size)
+{
+	if (!size) return;
+
+	const std::lock_guard<std::mutex> lock(mutUpload);
+
+	while (retireOldest(false));   // Reclaim ring space of completed batches.
+
+	VkBuffer srcBuffer;
+	VkDeviceSize srcOffset = stage(data, size, srcBuffer);
+
+	beginBatch();
+	commander.copyBuffer(current().commandBuffer, srcBuffer, srcOffset, dstBuffer, dstOffset, size);
+	if (dedicatedTransfer) transferOwnership(dstBuffer, dstOffset, size);
+	current().transfers++;
+}
+
+void Uploader::uploadImage(VkImage image, VkFormat format, const void* pixels, VkDeviceSize size, uint32_t width, uint32_t height, uint32_t mipLevels)
+{
+	const std::lock_guard<std::mutex> lock(mutUpload);
+
+	while (retireOldest(false));
+
+	VkBuffer srcBuffer;
+	VkDeviceSize srcOffset = stage(pixels, size, srcBuffer);
+
+	beginBatch();
+	VkCommandBuffer commandBuffer = current().commandBuffer;
+	commander.transitionImageLayout(commandBuffer, image, format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);
+	commander.copyBufferToImage(commandBuffer, srcBuffer, srcOffset, image, width, height);
+
+	if (dedicatedTransfer)
+	{
+		transferOwnership(image, mipLevels);
+		commandBuffer = current().acquireCommandBuffer;   // Blits require a graphics queue.
+	}
+
+	commander.generateMipmaps(commandBuffer, image, format, width, height, mipLevels);   // Transitions all levels to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+	current().transfers++;
+}
+
+uint64_t Uploader::submit()
+{
+	const std::lock_guard<std::mutex> lock(mutUpload);
+
+	submitBatch();
+	return submittedBatches;
+}
+
+void Uploader::wait(uint64_t batch)
+{
+	const std::lock_guard<std::mutex> lock(mutUpload);
+
+	if (batch > submittedBatches) submitBatch();   // Not submitted yet (its transfers are in the current batch).
+
+	while (retiredBatches < batch && retireOldest(true));
+}
+
+void Uploader::flush()
+{
+	const std::lock_guard<std::mutex> lock(mutUpload);
+
+	submitBatch();
+	while (retireOldest(true));
+}
+
+void Uploader::destroy()
+{
+	if (commandPool == VK_NULL_HANDLE) return;
+
+	flush();
+
+	for (Batch& batch : batches)
+	{
+		vkDestroyFence(c.device, batch.fence, nullptr);
+		if (batch.transferFinished) vkDestroySemaphore(c.device, batch.transferFinished, nullptr);
+	}
+
+	vkDestroyCommandPool(c.device, commandPool, nullptr);   // Command buffers are freed with their pool.
+	if (acquirePool) vkDestroyCommandPool(c.device, acquirePool, nullptr);
+	commandPool = acquirePool = VK_NULL_HANDLE;
+
+	c.destroyBuffer(c.device, stagingBuffer, stagingMemory);
+}
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <array>
+#include <algorithm>
 
 #include "polygonum/vertex.hpp"
 #include "polygonum/renderer.hpp"
@@ -257,7 +258,7 @@ void VertexSet::reset(uint32_t vertexSize)
 }
 
 VertexesLoader::VertexesLoader(size_t vertexSize, std::initializer_list<VerticesModifier*> modifiers)
-	: vertexSize(vertexSize), modifiers(modifiers) {
+	: vertexSize(vertexSize), modifiers(modifiers), maxMeshletVertices(0) {
 }
 
 VertexesLoader::~VertexesLoader() {}
@@ -265,14 +266,106 @@ VertexesLoader::~VertexesLoader() {}
 void VertexesLoader::loadVertexes(Renderer& r, ModelData& model)
 {
 	VertexSet rawVertices;
-	std::vector<uint16_t> rawIndices;
+	std::vector<uint32_t> rawIndices;
 
 	getRawData(rawVertices, rawIndices, model);   // Get raw data from source
 	applyModifiers(rawVertices);
-	createBuffers(model.vert, rawVertices, rawIndices, r);   // Upload data to Vulkan
+
+	if (maxMeshletVertices && rawIndices.size())
+	{
+		uint32_t primitiveSize = 0;
+		switch (model.getTopology())
+		{
+		case VK_PRIMITIVE_TOPOLOGY_POINT_LIST:		primitiveSize = 1; break;
+		case VK_PRIMITIVE_TOPOLOGY_LINE_LIST:		primitiveSize = 2; break;
+		case VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST:	primitiveSize = 3; break;
+		default: std::cerr << "Meshlets require a list topology (points, lines or triangles): " << model.name << std::endl;
+		}
+
+		if (primitiveSize)
+			splitIntoMeshlets(rawVertices, rawIndices, model.vert.meshlets, maxMeshletVertices, primitiveSize);
+	}
+
+	if (model.useGeometryArena)
+		r.arena.allocate(rawVertices, rawIndices, model.vert);   // Upload data to the shared buffers of the arena
+	else
+		createBuffers(model.vert, rawVertices, rawIndices, r);   // Upload data to Vulkan
+}
+
+VertexesLoader* VertexesLoader::useMeshlets(uint32_t maxVertices)
+{
+	maxMeshletVertices = maxVertices;
+	return this;
+}
+
+void VertexesLoader::splitIntoMeshlets(VertexSet& vertices, std::vector<uint32_t>& indices, std::vector<Meshlet>& meshlets, uint32_t maxVertices, uint32_t primitiveSize)
+{
+	meshlets.clear();
+	if (indices.empty() || primitiveSize == 0 || maxVertices < primitiveSize) return;
+
+	VertexSet newVertices(vertices.vertexSize);
+	newVertices.reserve(static_cast<unsigned>(std::max<size_t>(vertices.size(), 8)));
+	std::vector<uint32_t> newIndices;
+	newIndices.reserve(indices.size());
+
+	std::vector<uint32_t> localIndex(vertices.size(), UINT32_MAX);   // [vertex] Index of the vertex in the current meshlet (UINT32_MAX if it's not there).
+	std::vector<uint32_t> meshletVertices;   // Vertices (original indices) of the current meshlet.
+	Meshlet meshlet{ 0, 0, 0, 0 };
+
+	auto closeMeshlet = [&]()
+	{
+		meshlet.indexCount = static_cast<uint32_t>(newIndices.size()) - meshlet.firstIndex;
+		meshlet.vertexCount = static_cast<uint32_t>(meshletVertices.size());
+		meshlets.push_back(meshlet);
+
+		for (uint32_t vertex : meshletVertices)
+		{
+			newVertices.push_back(vertices.getElement(vertex));
+			localIndex[vertex] = UINT32_MAX;
+		}
+
+		meshlet.firstIndex = static_cast<uint32_t>(newIndices.size());
+		meshlet.vertexOffset = static_cast<int32_t>(newVertices.size());
+		meshletVertices.clear();
+	};
+
+	for (size_t p = 0; p + primitiveSize <= indices.size(); p += primitiveSize)   // each primitive (incomplete primitives at the end are discarded)
+	{
+		// Start a new meshlet if this primitive's vertices don't fit in the current one.
+		uint32_t newVertexCount = 0;
+		for (uint32_t i = 0; i < primitiveSize; i++)
+		{
+			if (indices[p + i] >= vertices.size())
+				throw std::runtime_error("Index out of range while splitting meshlets!");
+
+			if (localIndex[indices[p + i]] == UINT32_MAX) newVertexCount++;
+		}
+
+		if (meshletVertices.size() + newVertexCount > maxVertices)
+			closeMeshlet();
+
+		// Add the primitive
+		for (uint32_t i = 0; i < primitiveSize; i++)
+		{
+			uint32_t vertex = indices[p + i];
+
+			if (localIndex[vertex] == UINT32_MAX)
+			{
+				localIndex[vertex] = static_cast<uint32_t>(meshletVertices.size());
+				meshletVertices.push_back(vertex);
+			}
+
+			newIndices.push_back(localIndex[vertex]);
+		}
+	}
+
+	if (meshletVertices.size()) closeMeshlet();
+
+	vertices = newVertices;
+	indices.swap(newIndices);
 }
 
-void VertexesLoader::createBuffers(VertexData& result, const VertexSet& rawVertices, const std::vector<uint16_t>& rawIndices, Renderer& r)
+void VertexesLoader::createBuffers(VertexData& result, const VertexSet& rawVertices, const std::vector<uint32_t>& rawIndices, Renderer& r)
 {
 	createVertexBuffer(rawVertices, result, r);
 	createIndexBuffer(rawIndices, result, r);
@@ -290,23 +383,9 @@ void VertexesLoader::createVertexBuffer(const VertexSet& rawVertices, VertexData
 	std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 #endif
 
-	// Create a staging buffer (host visible buffer used as temporary buffer for mapping and copying the vertex data) (https://vkguide.dev/docs/chapter-5/memory_transfers/)
-	VkDeviceSize   bufferSize = rawVertices.totalBytes();	// sizeof(vertices[0])* vertices.size();
-	VkBuffer	   stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
+	VkDeviceSize bufferSize = rawVertices.totalBytes();	// sizeof(vertices[0])* vertices.size();
 
-	r.c.createBuffer(
-		bufferSize,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 											// VK_BUFFER_USAGE_ ... TRANSFER_SRC_BIT / TRANSFER_DST_BIT (buffer can be used as source/destination in a memory transfer operation).
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		stagingBuffer,
-		stagingBufferMemory);
-
-	// Fill the staging buffer (by mapping the buffer memory into CPU accessible memory: https://en.wikipedia.org/wiki/Memory-mapped_I/O)
-	void* data;
-	vkMapMemory(r.c.device, stagingBufferMemory, 0, bufferSize, 0, &data);	// Access a memory region. Use VK_WHOLE_SIZE to map all of the memory.
-	memcpy(data, rawVertices.data(), (size_t)bufferSize);					// Copy the vertex data to the mapped memory.
-	vkUnmapMemory(r.c.device, stagingBufferMemory);						// Unmap memory.
+	// Vertex data is copied to the staging ring buffer of Uploader (host visible buffer used as temporary buffer for copying data to device local buffers: https://vkguide.dev/docs/chapter-5/memory_transfers/). Its memory is persistently mapped into CPU accessible memory (https://en.wikipedia.org/wiki/Memory-mapped_I/O).
 
 	/*
 		Note:
@@ -329,42 +408,36 @@ void VertexesLoader::createVertexBuffer(const VertexSet& rawVertices, VertexData
 
 	result.vertexCount = rawVertices.getNumVertex();
 
-	// Move the vertex data to the device local buffer
-	r.commander.copyBuffer(stagingBuffer, result.vertexBuffer, bufferSize);
-
-	// Clean up
-	r.c.destroyBuffer(r.c.device, stagingBuffer, stagingBufferMemory);
+	// Move the vertex data to the device local buffer (recorded in the current upload batch, submitted later)
+	r.uploader.uploadBuffer(result.vertexBuffer, rawVertices.data(), bufferSize);
 }
 
-void VertexesLoader::createIndexBuffer(const std::vector<uint16_t>& rawIndices, VertexData& result, Renderer& r)
+void VertexesLoader::createIndexBuffer(const std::vector<uint32_t>& rawIndices, VertexData& result, Renderer& r)
 {
 #ifdef DEBUG_RESOURCES
 	std::cout << typeid(*this).name() << "::" << __func__ << std::endl;
 #endif
 
 	result.indexCount = static_cast<uint32_t>(rawIndices.size());
+	result.indexType = VK_INDEX_TYPE_UINT16;
 
 	if (rawIndices.size() == 0) return;
 
-	// Create a staging buffer
-	VkDeviceSize   bufferSize = sizeof(rawIndices[0]) * rawIndices.size();
-	VkBuffer	   stagingBuffer;
-	VkDeviceMemory stagingBufferMemory;
+	// Use 16-bit indices if possible (half the memory and bandwidth). Meshlets keep indices small (they are relative to the meshlet's first vertex).
+	std::vector<uint16_t> indices16;
+	const void* indexData = rawIndices.data();
+	VkDeviceSize bufferSize = sizeof(uint32_t) * rawIndices.size();
 
-	r.c.createBuffer(
-		bufferSize,
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		stagingBuffer,
-		stagingBufferMemory);
-
-	// Fill the staging buffer
-	void* data;
-	vkMapMemory(r.c.device, stagingBufferMemory, 0, bufferSize, 0, &data);
-	memcpy(data, rawIndices.data(), (size_t)bufferSize);
-	vkUnmapMemory(r.c.device, stagingBufferMemory);
-
-	// Create the vertex buffer
+	if (*std::max_element(rawIndices.begin(), rawIndices.end()) > UINT16_MAX)
+		result.indexType = VK_INDEX_TYPE_UINT32;
+	else
+	{
+		indices16.assign(rawIndices.begin(), rawIndices.end());
+		indexData = indices16.data();
+		bufferSize = sizeof(uint16_t) * indices16.size();
+	}
+
+	// Create the index buffer
 	r.c.createBuffer(
 		bufferSize,
 		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
@@ -372,11 +445,8 @@ void VertexesLoader::createIndexBuffer(const std::vector<uint16_t>& rawIndices,
 		result.indexBuffer,
 		result.indexBufferMemory);
 
-	// Move the vertex data to the device local buffer
-	r.commander.copyBuffer(stagingBuffer, result.indexBuffer, bufferSize);
-
-	// Clean up
-	r.c.destroyBuffer(r.c.device, stagingBuffer, stagingBufferMemory);
+	// Move the index data to the device local buffer
+	r.uploader.uploadBuffer(result.indexBuffer, indexData, bufferSize);
 }
 
 glm::vec3 VertexesLoader::getVertexTangent(const glm::vec3& v1, const glm::vec3& v2, const glm::vec3& v3, const glm::vec2 uv1, const glm::vec2 uv2, const glm::vec2 uv3)
@@ -397,7 +467,7 @@ glm::vec3 VertexesLoader::getVertexTangent(const glm::vec3& v1, const glm::vec3&
 	return glm::normalize((uvDiff2 * edge1 - uvDiff1 * edge2) / denominator);
 }
 
-VL_fromBuffer::VL_fromBuffer(const void* verticesData, uint32_t vertexSize, uint32_t vertexCount, const std::vector<uint16_t>& indices, std::initializer_list<VerticesModifier*> modifiers)
+VL_fromBuffer::VL_fromBuffer(const void* verticesData, uint32_t vertexSize, uint32_t vertexCount, const std::vector<uint32_t>& indices, std::initializer_list<VerticesModifier*> modifiers)
 	: VertexesLoader(vertexSize, modifiers)
 {
 	rawVertices.reset(vertexSize, vertexCount, verticesData);
@@ -405,13 +475,18 @@ VL_fromBuffer::VL_fromBuffer(const void* verticesData, uint32_t vertexSize, uint
 }
 
 VL_fromBuffer* VL_fromBuffer::factory(const void* verticesData, size_t vertexSize, size_t vertexCount, const std::vector<uint16_t>& indices, std::initializer_list<VerticesModifier*> modifiers)
+{
+	return new VL_fromBuffer(verticesData, vertexSize, vertexCount, std::vector<uint32_t>(indices.begin(), indices.end()), modifiers);
+}
+
+VL_fromBuffer* VL_fromBuffer::factory(const void* verticesData, size_t vertexSize, size_t vertexCount, const std::vector<uint32_t>& indices, std::initializer_list<VerticesModifier*> modifiers)
 {
 	return new VL_fromBuffer(verticesData, vertexSize, vertexCount, indices, modifiers);
 }
 
 VertexesLoader* VL_fromBuffer::clone() { return new VL_fromBuffer(*this); }
 
-void VL_fromBuffer::getRawData(VertexSet& destVertices, std::vector<uint16_t>& destIndices, ModelData& model)
+void VL_fromBuffer::getRawData(VertexSet& destVertices, std::vector<uint32_t>& destIndices, ModelData& model)
 {
 	destVertices = rawVertices;
 	destIndices = rawIndices;
@@ -428,7 +503,7 @@ VL_fromFile* VL_fromFile::factory(std::string filePath, std::initializer_list<Ve
 
 VertexesLoader* VL_fromFile::clone() { return new VL_fromFile(*this); }
 
-void VL_fromFile::getRawData(VertexSet& destVertices, std::vector<uint16_t>& destIndices, ModelData& model)
+void VL_fromFile::getRawData(VertexSet& destVertices, std::vector<uint32_t>& destIndices, ModelData& model)
 {
 	/*
 		Data is imported as a Scene (aiScene), which contains:
@@ -464,11 +539,9 @@ void VL_fromFile::processNode(const aiScene* scene, aiNode* node)
 	std::vector<aiMesh*> meshes;
 
 	for (unsigned i = 0; i < node->mNumMeshes; i++)
-	{
-		//mesh = scene->mMeshes[node->mMeshes[i]];
 		meshes.push_back(scene->mMeshes[node->mMeshes[i]]);
-		processMeshes(scene, meshes);
-	}
+
+	processMeshes(scene, meshes);
 
 	// Repeat process in children
 	for (unsigned i = 0; i < node->mNumChildren; i++)
@@ -484,6 +557,8 @@ void VL_fromFile::processMeshes(const aiScene* scene, std::vector<aiMesh*>& mesh
 	// Go through each mesh contained in this node
 	for (k = 0; k < meshes.size(); k++)
 	{
+		uint32_t firstVertex = vertices->getNumVertex();   // Indices of each mesh start at 0, so they are rebased to the mesh's first vertex.
+
 		// Get VERTEX data (positions, normals, UVs)
 		for (i = 0; i < meshes[k]->mNumVertices; i++)
 		{
@@ -517,7 +592,7 @@ void VL_fromFile::processMeshes(const aiScene* scene, std::vector<aiMesh*>& mesh
 		{
 			face = meshes[k]->mFaces[i];
 			for (j = 0; j < face.mNumIndices; j++)
-				indices->push_back(face.mIndices[j]);	// Get INDICES
+				indices->push_back(firstVertex + face.mIndices[j]);	// Get INDICES
 		}
 
 		// Process MATERIAL